@@ -2,9 +2,9 @@ mkdir -p lib
 mkdir -p build
 mkdir -p data
 
-RBLIB="./lib/rb.o ./lib/compressor.o"
+RBLIB="./lib/rb.o ./lib/compressor.o ./lib/zonemap.o ./lib/roaring.o ./lib/bitmap.o ./lib/agg.o ./lib/arena.o ./lib/group.o ./lib/sort.o ./lib/join.o ./lib/stats.o ./lib/plan.o ./lib/filter.o ./lib/project.o ./lib/bloom.o ./lib/lsm.o ./lib/keyfilter.o ./lib/art.o ./lib/fts.o ./lib/mvcc.o ./lib/lock.o ./lib/latch.o ./lib/dirty.o ./lib/hotbackup.o ./lib/commitlog.o ./lib/sha256.o ./lib/chunkstore.o ./lib/pagestore.o ./lib/columns.o"
 ZLIB="-L./external/zlib -l:libz.a"
-LIBS="$RBLIB $ZLIB"
+LIBS="$RBLIB $ZLIB -lm -pthread"
 INCLUDE="-I./external/zlib -I ./include"
 
 DEBUG="-ggdb -Wno-incompatible-pointer-types -Wno-int-conversion -Wno-discarded-qualifiers"
@@ -17,6 +17,80 @@ gcc -c ${SRC}rb.c -o ./lib/rb.o $INCLUDE $DEBUG
 echo [COMPILE] ${SRC}compressor.c
 gcc -c ${SRC}compressor.c -o ./lib/compressor.o $INCLUDE $DEBUG
 
+echo [COMPILE] ${SRC}zonemap.c
+gcc -c ${SRC}zonemap.c -o ./lib/zonemap.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}roaring.c
+gcc -c ${SRC}roaring.c -o ./lib/roaring.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}bitmap.c
+gcc -c ${SRC}bitmap.c -o ./lib/bitmap.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}agg.c
+gcc -c ${SRC}agg.c -o ./lib/agg.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}arena.c
+gcc -c ${SRC}arena.c -o ./lib/arena.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}group.c
+gcc -c ${SRC}group.c -o ./lib/group.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}sort.c
+gcc -c ${SRC}sort.c -o ./lib/sort.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}join.c
+gcc -c ${SRC}join.c -o ./lib/join.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}stats.c
+gcc -c ${SRC}stats.c -o ./lib/stats.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}plan.c
+gcc -c ${SRC}plan.c -o ./lib/plan.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}filter.c
+gcc -c ${SRC}filter.c -o ./lib/filter.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}project.c
+gcc -c ${SRC}project.c -o ./lib/project.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}bloom.c
+gcc -c ${SRC}bloom.c -o ./lib/bloom.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}lsm.c
+gcc -c ${SRC}lsm.c -o ./lib/lsm.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}keyfilter.c
+gcc -c ${SRC}keyfilter.c -o ./lib/keyfilter.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}art.c
+gcc -c ${SRC}art.c -o ./lib/art.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}fts.c
+gcc -c ${SRC}fts.c -o ./lib/fts.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}mvcc.c
+gcc -c ${SRC}mvcc.c -o ./lib/mvcc.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}lock.c
+gcc -c ${SRC}lock.c -o ./lib/lock.o $INCLUDE $DEBUG
+
+echo [COMPILE] ${SRC}latch.c
+gcc -c ${SRC}latch.c -o ./lib/latch.o $INCLUDE $DEBUG
+echo [COMPILE] ${SRC}dirty.c
+gcc -c ${SRC}dirty.c -o ./lib/dirty.o $INCLUDE $DEBUG
+echo [COMPILE] ${SRC}hotbackup.c
+gcc -c ${SRC}hotbackup.c -o ./lib/hotbackup.o $INCLUDE $DEBUG
+echo [COMPILE] ${SRC}commitlog.c
+gcc -c ${SRC}commitlog.c -o ./lib/commitlog.o $INCLUDE $DEBUG
+echo [COMPILE] ${SRC}sha256.c
+gcc -c ${SRC}sha256.c -o ./lib/sha256.o $INCLUDE $DEBUG
+echo [COMPILE] ${SRC}chunkstore.c
+gcc -c ${SRC}chunkstore.c -o ./lib/chunkstore.o $INCLUDE $DEBUG
+echo [COMPILE] ${SRC}pagestore.c
+gcc -c ${SRC}pagestore.c -o ./lib/pagestore.o $INCLUDE $DEBUG
+echo [COMPILE] ${SRC}columns.c
+gcc -c ${SRC}columns.c -o ./lib/columns.o $INCLUDE $DEBUG
+
 # Table functions
 
 TARGET=create_table
@@ -61,6 +135,78 @@ TARGET=edit_many
   echo [BUILD] ${src}${TARGET}.c
   gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
 
+TARGET=create_bitmap
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=aggregate
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=group_by
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=order_by
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=join_tables
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=explain
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=select
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=lsm_table
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=bitmap_filter
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=prefix_search
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=full_text
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=snapshot
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=stress
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=threads
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
 TARGET=backup
   echo [BUILD] ${src}${TARGET}.c
   gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=pitr
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=dedup
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=compressed
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
+
+TARGET=columnar
+  echo [BUILD] ${src}${TARGET}.c
+  gcc -o ${BUILD}${TARGET} ${SRC}${TARGET}.c $INCLUDE $LIBS $DEBUG
@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <rb.h>
 
 #define INFO_HEADER_LEN 64
@@ -32,8 +33,13 @@
 #define MAKE_TYPE(number, size) (0xffff & (((number<<1)&0xe) + (size << 4)))
 #define KEY_FIELD 1
 
+// Layout of the rows and key tree nodes, 1 since nodes keep the size of
+// their subtree. Tables of another format are not opened
+#define TABLE_FORMAT 1
+#define TABLE_VERSION (TABLE_FORMAT << 4 | sizeof(size_t))
+
 // Header view
-// [0]                                  [char] = sizeof(size_t) on the moment of table creation
+// [0]                                  [char] = TABLE_FORMAT << 4 | sizeof(size_t) on the moment of table creation
 // [1]                                  [size_t] next_empty_space
 // [1+DATA_OFFSET]                      [char] number of columns
 // [2+DATA_OFFSET]                      [char] max length of the field names
@@ -62,6 +68,488 @@ typedef struct {
   void* next;
 } stack;
 
+// Zone maps: per block of ZMAP_BLOCK_ROWS rows keep min/max of every
+// INT/FLOAT/DATATIME column plus live/deleted row counters, so that scans
+// can skip blocks that cannot contain the value. Stored in <table>.zmap
+#define ZMAP_BLOCK_ROWS 4096
+#define ZMAP_VALUE_SIZE 8
+#define ZMAP_TRACKED(t) (TYPE_NUMBER(t) != TABLE_TYPE_VARCHAR)
+
+typedef struct {
+  unsigned char min[ZMAP_VALUE_SIZE];
+  unsigned char max[ZMAP_VALUE_SIZE];
+  size_t init;
+} ZONE;
+
+typedef struct {
+  size_t block_rows;
+  size_t ncols;
+  size_t nblocks, capacity;
+  size_t* live;
+  size_t* deleted;
+  ZONE* zones; // nblocks * ncols
+  size_t dirty;
+} ZONE_MAP;
+
+// Columnar segments: column_seal encodes the rows of the table into
+// <table>.cols, a segment per column and block of ZMAP_BLOCK_ROWS rows.
+// INT and DATATIME take frame of reference, delta or run length encoding,
+// VARCHAR a dictionary and FLOAT the xor of neighbouring values.
+// Aggregates fold sealed blocks without decoding them into rows, a block
+// a commit changed after sealing is read from the rows again
+typedef struct {
+  size_t rows;           // sealed, the blocks cover rows 0 to rows
+  size_t nblocks;
+  size_t* blocks;        // offset of each block in data
+  unsigned char* stale;  // a bit per block changed since sealing
+  unsigned char* data;   // <table>.cols
+  size_t size;
+  size_t saved_rows;     // row count of the table in the file
+  size_t dirty;
+} COLUMNS;
+
+// Part of an aggregate folded from column segments
+typedef struct {
+  size_t count;
+  long long isum;
+  double fsum;
+  int imin, imax;
+  float fmin, fmax;
+  size_t tmin, tmax;     // datatime_key
+} COLUMN_FOLD;
+
+// Roaring bitmap of row ids: containers by the high 16 bits of the id,
+// each one is a sorted array of the low bits or a 65536-bit bitmap
+#define ROARING_ARRAY_MAX 4096
+#define ROARING_BITMAP_WORDS (65536 / 64)
+
+typedef struct {
+  unsigned int key;
+  unsigned int card;
+  unsigned short* array;
+  unsigned long long* bits;
+} RCONTAINER;
+
+typedef struct {
+  size_t count, capacity;
+  RCONTAINER* items;
+} ROARING;
+
+// Bitmap index: one roaring bitmap of row ids per distinct value of
+// a column. All indexes of the table are stored in <table>.bmi
+#define BITMAP_INDEX_MAX_VALUES 1024
+
+typedef struct {
+  size_t col;
+  size_t count, capacity;
+  unsigned char* values; // sorted, TYPE_SIZE(col) bytes each
+  ROARING* bitmaps;
+} BITMAP_INDEX;
+
+typedef struct {
+  size_t count;
+  BITMAP_INDEX* items;
+  size_t dirty;
+} BITMAP_INDEXES;
+
+// Adaptive radix tree over a VARCHAR key column: inner nodes hold 4, 16,
+// 48 or 256 children as their fan-out grows, single-child paths are
+// compressed into the prefix of the node below. Lookups cost the length of
+// the key, a prefix is one subtree. All trees are stored in <table>.art
+#define ART_LEAF    0
+#define ART_NODE4   1
+#define ART_NODE16  2
+#define ART_NODE48  3
+#define ART_NODE256 4
+
+typedef struct art_node {
+  unsigned char kind;
+  size_t count;            // children
+  size_t leaves;           // rows below, 1 for a leaf
+  size_t prefix_len;
+  unsigned char* prefix;   // compressed path, the whole key for a leaf
+  unsigned char* keys;     // NODE4/16: sorted bytes, NODE48: slot + 1 by byte
+  struct art_node** children;
+  size_t row;              // leaf
+} ART_NODE;
+
+typedef struct {
+  size_t col;
+  ART_NODE* root;
+} ART_INDEX;
+
+typedef struct {
+  size_t count;
+  ART_INDEX* items;
+  size_t dirty;
+} ART_INDEXES;
+
+// Inverted index over a VARCHAR column: every lowercased word of the
+// column points to the rows it occurs in and its positions there. A
+// posting list is varint coded, rows and positions as deltas from the
+// previous one. All indexes are stored in <table>.fts
+typedef struct {
+  size_t count, capacity;
+  unsigned char* items;
+} FTS_POSTINGS;
+
+typedef struct {
+  char* term;
+  size_t rows;           // rows holding the term
+  size_t last_row;       // rows above it are appended to the list
+  FTS_POSTINGS postings;
+} FTS_TERM;
+
+typedef struct {
+  size_t col;
+  size_t count, capacity;
+  FTS_TERM* terms;       // sorted
+} FTS_INDEX;
+
+typedef struct {
+  size_t count;
+  FTS_INDEX* items;
+  size_t dirty;
+} FTS_INDEXES;
+
+// Locking between processes through <table>.lock: readers share the
+// commit byte, a commit takes it alone, writers of disjoint key ranges
+// hold byte ranges that stand for them. Threads latching the table shared
+// share the byte too, the first takes it and the last lets it go. A
+// process that finds the generation moved on reads the table again.
+// Sidecars derived from the rows hold the generation of the commit that
+// saved them after their magic and are built again if it is not the one
+// of the table
+#define TABLE_LOCK_NONE  0
+#define TABLE_LOCK_READ  1
+#define TABLE_LOCK_WRITE 2
+#define SIDECAR_GENERATION_OFFSET 4
+
+typedef struct {
+  int fd;
+  size_t mode;
+  size_t readers;        // sharing the commit byte
+  pthread_mutex_t mutex; // the first reader takes the byte alone
+  size_t generation;     // of the table as this process last read it
+  size_t keys;           // key ranges are held
+} TABLE_LOCK;
+
+// Latching between the threads of one process sharing a TABLE_STATE:
+// lookups, scans and cursors share the latch, a commit and index changes
+// take it alone. Rows are read and written at their offsets, never through
+// the position of the FILE, and the key trees compare against per-thread
+// row buffers. Changes are staged under a mutex of their own, so a thread
+// stages while others read. Tables with an LSM index or a snapshot keep
+// read buffers of their own and are latched alone by readers too, without
+// the commit byte: LSM tables are left to one process and a snapshot reads
+// the versions of its own commit
+typedef struct {
+  pthread_rwlock_t latch;
+  pthread_mutex_t stage;
+  void* owner;           // thread holding the latch alone
+} TABLE_LATCH;
+
+// Pages of the table file a commit wrote, for incremental backups. They
+// are added to <table>.dirty while the table has a backup chain, which is
+// flagged before the commit writes the table
+#define DIRTY_PAGE_SIZE (1 << 16)
+
+typedef struct {
+  size_t npages;
+  unsigned char* bits;   // a bit per page
+  size_t dirty;
+} DIRTY_PAGES;
+
+// Point in time recovery: commits append their stage events to log
+// segments <table>.log.<n>, a full backup notes the last commit it holds
+// and a restore replays the log after it
+#define LOG_SEGMENT_SIZE (1 << 22)
+
+typedef struct {
+  int fd;                // <table>.log
+} COMMIT_LOG;
+
+// Compressed tables: the table file is a container of zlib compressed
+// pages and a map of where each lies. Pages read stay decompressed in a
+// cache, pages written are compressed again when the commit is done
+#define PAGE_STORE_PAGE (1 << 14)
+#define PAGE_CACHE_PAGES 2048
+
+typedef struct {
+  int fd;
+  size_t length;         // of the table the pages hold
+  size_t npages;
+  size_t* map;           // per page slot offset, compressed length, slot size
+  size_t map_offset;
+  size_t capacity;       // pages the map in the file has room for
+  unsigned char** cache; // decompressed pages, NULL if not read
+  unsigned char* dirty;  // written since the last flush
+  unsigned char* used;   // read since the clock hand passed
+  size_t cached;
+  size_t hand;
+  size_t pos;            // of the FILE for the header
+  pthread_mutex_t mutex;
+} PAGE_STORE;
+
+// What a backup into a deduplicating chunk store took
+typedef struct {
+  size_t chunks;
+  size_t new_chunks;     // not in the store before
+  size_t bytes;          // of the table
+  size_t new_bytes;      // compressed bytes written to the store
+} CHUNK_STATS;
+
+#define SHA256_SIZE 32
+
+// Multi-version reads: before a commit first changes a row it saves the
+// committed image of the row into <table>.mvcc.<commit>. A snapshot of
+// commit S reads the live row and takes the image of the first commit
+// after S that saved one instead, so it never sees later or half done
+// commits. <table>.mvcc holds the last commit and the open snapshots
+#define MVCC_SNAPSHOTS 64
+
+typedef struct {
+  int fd;                // <table>.mvcc
+  size_t seq;            // last commit
+  size_t rows;           // row count of the last commit
+  int version_fd;        // file of the commit in progress, -1 if none
+  unsigned char* saved;  // rows it holds an image of
+} MVCC;
+
+typedef struct {
+  size_t seq;
+  int fd;                // -1 if the commit changed no row
+  size_t parsed;         // bytes of the file read so far
+  size_t done;           // the commit had ended on the last read
+  size_t count, capacity;
+  size_t* rows;          // open addressing, row + 1 or 0
+  size_t* offsets;       // of the image of the row
+} MVCC_VERSION;
+
+typedef struct {
+  int fd;                // own handle on <table>.mvcc holding the slot lock
+  size_t slot;
+  size_t seq;
+  size_t rows;
+  size_t count;
+  MVCC_VERSION* versions; // of the commits after seq, in order
+  char* cache;           // the last row read
+  size_t cached;
+} SNAPSHOT;
+
+// Aggregates over INT/FLOAT/DATATIME columns
+#define AGG_COUNT 0
+#define AGG_SUM   1
+#define AGG_MIN   2
+#define AGG_MAX   3
+#define AGG_AVG   4
+
+typedef struct {
+  size_t count;                       // rows that took part
+  double value;                       // COUNT/SUM/AVG, MIN/MAX as a number
+  unsigned char raw[ZMAP_VALUE_SIZE]; // MIN/MAX column value
+} AGG_RESULT;
+
+// Bump allocator, everything is released at once by arena_free
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+typedef struct arena_block {
+  struct arena_block* next;
+  size_t used, size;
+  unsigned char data[];
+} ARENA_BLOCK;
+
+typedef struct {
+  ARENA_BLOCK* head;
+  size_t allocated;
+} ARENA;
+
+// GROUP BY: groups are kept in an open addressing hash table while they
+// fit into memory_limit, rows of new groups are spilled afterwards into
+// GROUP_PARTITIONS temporary files which are grouped one by one
+#define GROUP_MEMORY_LIMIT (64 << 20)
+#define GROUP_PARTITIONS 16
+#define GROUP_MAX_DEPTH 8
+
+typedef struct {
+  size_t nkeys;
+  size_t* key_cols;
+  size_t naggs;
+  size_t* agg_ops;   // AGG_*
+  size_t* agg_cols;
+  size_t pred_col;   // optional equality filter, used if pred_value != NULL
+  void* pred_value;
+  size_t memory_limit;
+} GROUP_BY;
+
+// Group row: key columns one after another, then naggs AGG_RESULT
+typedef struct {
+  size_t count;
+  size_t key_size;
+  size_t row_size;
+  unsigned char* rows;
+} GROUP_RESULT;
+
+// ORDER BY: a key column is streamed from its tree, starting at offset
+// without walking the skipped rows, small limits are kept in a top-K
+// heap, everything else is sorted in memory_limit sized runs that are
+// spilled to temporary files and merged SORT_MERGE_FANIN at a time
+#define SORT_MEMORY_LIMIT (64 << 20)
+#define SORT_MERGE_FANIN 64
+
+typedef struct {
+  size_t col;
+  size_t desc;
+  size_t limit;      // 0 for all rows
+  size_t offset;     // rows skipped before the first one passed on
+  size_t pred_col;   // optional equality filter, used if pred_value != NULL
+  void* pred_value;
+  size_t memory_limit;
+} ORDER_BY;
+
+// JOIN: a key column on either side is looked up through its tree for every
+// row of the other side. Otherwise a hash table is built on the smaller
+// side; if it does not fit into memory_limit both sides are split into
+// JOIN_PARTITIONS temporary files by hash and joined partition by partition
+#define JOIN_MEMORY_LIMIT (64 << 20)
+#define JOIN_PARTITIONS 16
+#define JOIN_MAX_DEPTH 8
+
+typedef struct {
+  size_t left_col;
+  size_t right_col;
+  size_t memory_limit;
+} JOIN;
+
+// Comparison of a column with a value
+#define PRED_EQ 0
+#define PRED_NE 1
+#define PRED_LT 2
+#define PRED_LE 3
+#define PRED_GT 4
+#define PRED_GE 5
+#define PRED_PREFIX 6 // VARCHAR starts with the value
+#define PRED_AND 7
+#define PRED_OR 8
+#define PRED_NOT 9
+
+// Predicate tree, comparison leaves own a copy of their value
+typedef struct pred {
+  size_t op;
+  size_t col;
+  size_t size;
+  unsigned char* value;
+  struct pred* left;
+  struct pred* right;
+} PRED;
+
+typedef struct filter FILTER;
+
+// Bloom filter over 64-bit hashes, nhashes probes by double hashing
+typedef struct {
+  size_t nbits;
+  size_t nhashes;
+  unsigned char* bits;
+} BLOOM;
+
+// Counting bloom filter: 4-bit counters instead of bits, so keys can be
+// removed. A counter that reached 15 stays there, it may count more keys
+typedef struct {
+  size_t ncounters;
+  size_t nhashes;
+  unsigned char* counters; // two per byte
+} COUNTING_BLOOM;
+
+// Key filters: a counting bloom filter of the values of every key column,
+// kept up to date by inserts, edits and deletes, so lookups of missing keys
+// return without reading the tree. Sized for twice the live rows and
+// rebuilt on save once more keys than that were added. Stored in <table>.kbf
+#define KEYFILTER_BITS 10 // counters per key
+#define KEYFILTER_MIN_KEYS 1024
+
+typedef struct {
+  size_t nkeys;     // key columns
+  size_t capacity;  // keys the filters were sized for
+  size_t count;     // keys in every filter
+  COUNTING_BLOOM* filters;
+  size_t dirty;
+} KEY_FILTERS;
+
+// LSM key index, an alternative to the row trees for insert heavy tables
+// switched on by lsm_create. Key values go to a skip list memtable which is
+// flushed as an immutable sorted run file <table>.lsm.<key>.<id> when full
+// and on close. Runs keep the first key of every LSM_BLOCK_RECORDS records
+// (fence pointers) and a bloom filter in memory, so a lookup reads at most
+// one block per run; the memtable is asked first, then the runs newest
+// first. Once a level has LSM_FANOUT runs a background thread merges them
+// into one run of the next level. The run list is kept in <table>.lsm
+#define LSM_MEMTABLE_RECORDS 65536
+#define LSM_BLOCK_RECORDS 64
+#define LSM_FANOUT 4
+#define LSM_BLOOM_BITS 10 // per key
+#define LSM_SKIP_LEVELS 16
+
+typedef struct lsm LSM;
+
+// Projection: the columns a query delivers, in this order. Results are
+// packed tuples of only these columns. Scans collect row numbers, the
+// columns are read once all matches are known, in row order, up to
+// PROJECT_BATCH_ROWS rows per read with gaps of up to PROJECT_MAX_GAP rows
+// read through
+#define PROJECT_BATCH_ROWS 256
+#define PROJECT_MAX_GAP 16
+
+typedef struct {
+  size_t ncols;
+  size_t* cols;
+} PROJECTION;
+
+// Column statistics: distinct count estimate (HyperLogLog with
+// 2^STATS_HLL_BITS registers), min/max and an equi-depth histogram of
+// STATS_BUCKETS buckets built from up to STATS_SAMPLE values. Inserts update
+// them in place, everything is rebuilt once the table changed by more than
+// 1/STATS_REBUILD_RATIO of its rows
+#define STATS_HLL_BITS 10
+#define STATS_HLL_REGISTERS (1 << STATS_HLL_BITS)
+#define STATS_BUCKETS 32
+#define STATS_SAMPLE 65536
+#define STATS_REBUILD_RATIO 5
+
+typedef struct {
+  size_t init;
+  unsigned char min[ZMAP_VALUE_SIZE];
+  unsigned char max[ZMAP_VALUE_SIZE];
+  size_t nbounds; // 0 if there is no histogram
+  double bounds[STATS_BUCKETS + 1];
+  unsigned char hll[STATS_HLL_REGISTERS];
+} COL_STATS;
+
+typedef struct {
+  size_t nrows;   // live rows
+  size_t changes; // since the last rebuild
+  size_t ncols;
+  COL_STATS* cols;
+  size_t dirty;
+} TABLE_STATS;
+
+// Access paths the planner chooses from, costs are in sequential row reads
+#define ACCESS_INDEX_LOOKUP 0
+#define ACCESS_RANGE_CURSOR 1
+#define ACCESS_ZONE_MAP_SCAN 2
+#define ACCESS_PARALLEL_SCAN 3
+
+#define PLAN_RANDOM_COST 4.0
+#define PLAN_THREAD_COST 1024.0
+#define SCAN_MAX_THREADS 8
+
+typedef struct {
+  size_t access;
+  double selectivity;
+  double rows;
+  double cost;
+  size_t threads;
+} QUERY_PLAN;
+
 typedef struct {
   char version;
   size_t init;
@@ -84,7 +572,23 @@ typedef struct {
   // size_t stage_next_free;
   size_t stage_append_offset;
   FILE* file;
+  char* file_name;
   size_t last_inserted;
+  ZONE_MAP* zone_map;
+  COLUMNS* columns;
+  BITMAP_INDEXES* bitmap_indexes;
+  ART_INDEXES* art_indexes;
+  FTS_INDEXES* fts_indexes;
+  MVCC* mvcc;
+  TABLE_LOCK* lock;
+  TABLE_LATCH* latch;
+  DIRTY_PAGES* dirty_pages;
+  COMMIT_LOG* commit_log;
+  PAGE_STORE* page_store;
+  SNAPSHOT* snapshot;    // read only view of one commit
+  LSM* lsm;
+  KEY_FILTERS* key_filters;
+  TABLE_STATS* stats;
 } TABLE_STATE;
 
 typedef struct {
@@ -92,12 +596,15 @@ typedef struct {
   char* data;
 } STAGE_EVENT;
 
-#define RB_DATA_LEN 4
+#define RB_DATA_LEN 5
 #define RB_DATA_SIZE (RB_DATA_LEN * sizeof(size_t))
 #define RB_INDEX_PARENT 0
 #define RB_INDEX_LEFT   1
 #define RB_INDEX_RIGHT  2
 #define RB_INDEX_COLOR  3
+#define RB_INDEX_SIZE   4 // nodes in the subtree, for rank and OFFSET
+
+#define ENTRY_DELETED(entry) (((size_t*)(entry))[RB_INDEX_COLOR] == (size_t)-1)
 
 #define TABLE_TYPE_INT 0
 #define TABLE_TYPE_FLOAT 1
@@ -110,13 +617,19 @@ typedef struct {
 #define SE_DELETE        1
 #define SE_EDIT          2
 #define SE_EDIT_SELECTED 3
+#define SE_DELETE_WHERE  4
+#define SE_EDIT_WHERE    5
 
 void header_write(size_t ncols, size_t name_len, size_t* col_types, const char** col_names, FILE* file);
-void header_read(FILE* file, TABLE_STATE* table_state);
+size_t header_read(FILE* file, TABLE_STATE* table_state);
 
 void tset(size_t offset, TABLE_STATE* table_state);
 size_t tappend(void* entry, TABLE_STATE* table_state);
 void tedit(void* data, TABLE_STATE* table_state);
+void tedit_row(size_t row, size_t col, const void* old_value, char* new_data, TABLE_STATE* table_state);
+void tedit_where(void* data, TABLE_STATE* table_state);
+void tdelete_row(size_t row, TABLE_STATE* table_state);
+size_t tdelete_where(void* data, TABLE_STATE* table_state);
 
 size_t entry_offset(size_t index, TABLE_STATE* table_state);
 void create_entry(TABLE_STATE* table_state, size_t nargs, ...);
@@ -124,7 +637,14 @@ size_t edit_entry(size_t col, void* old_val, void* new_val, TABLE_STATE* table_s
 
 void commit_changes(TABLE_STATE* table_state);
 
+size_t table_pread(TABLE_STATE* table_state, void* buf, size_t size, size_t offset);
+size_t table_pwrite(TABLE_STATE* table_state, const void* buf, size_t size, size_t offset);
+size_t table_pread_some(TABLE_STATE* table_state, void* buf, size_t size, size_t offset);
+void table_truncate(TABLE_STATE* table_state, size_t length);
 void* get_by_tindex(size_t index, TABLE_STATE* table_state);
+size_t read_rows(size_t first, size_t count, void* buf, TABLE_STATE* table_state);
+size_t row_count(TABLE_STATE* table_state);
+char* sidecar_name(const char* file_name, const char* ext);
 
 size_t create_table(size_t ncols, size_t name_len, size_t* col_types, const char** col_names, const char* file_name);
 size_t open_table(const char* file_name, TABLE_STATE* table_state);
@@ -138,8 +658,8 @@ void rb_table_update(rbtree* rbt, rbnode* node);
 void rb_from_raw_table(rbtree* tree, TABLE_STATE* table_state);
 
 unsigned char table_version(FILE* file);
-size_t next_empty_read(FILE* file);
-size_t next_empty_write(FILE* file, size_t node_ptr);
+size_t next_empty_read(TABLE_STATE* ts);
+size_t next_empty_write(TABLE_STATE* ts, size_t node_ptr);
 size_t next_empty_withdraw(TABLE_STATE* ts);
 unsigned char read_ncols(FILE* file);
 unsigned char read_name_len(FILE* file);
@@ -157,17 +677,246 @@ int cmp_float   (const void* rb, const void* a, const void* b);
 int cmp_str     (const void* rb, const void* a, const void* b);
 int cmp_datatime(const void* rb, const void* a, const void* b);
 int (*pick_cmp(size_t type))(const void*, const void*, const void*);
+int value_cmp(size_t type, const void* a, const void* b);
+size_t value_hash(size_t type, const void* value);
 void _destroy(void* a);
 
+size_t key_find(size_t col, void* entry, TABLE_STATE* table_state);
+int key_tree(size_t col, TABLE_STATE* table_state);
 size_t find_entry(size_t col, void* value, TABLE_STATE* table_state, void** result, size_t** indices);
 size_t beautiful_find_entry(size_t col, void* value, TABLE_STATE* table_state, void** result, size_t** indices);
+size_t table_scan(size_t col, void* value, TABLE_STATE* table_state, int (*func)(void*, size_t, void*), void* cookie);
 size_t delete_entry(size_t col, void* value, TABLE_STATE* table_state);
+size_t delete_where(const PRED* where, TABLE_STATE* table_state);
+size_t edit_where(const PRED* where, size_t col, void* new_value, TABLE_STATE* table_state);
 
 int archive(int type, const char* table_name, const char* backup_name);
 size_t restore_from_backup(const char* file_name, const char* backup_name);
 size_t create_backup(const char* file_name, const char* backup_name);
+size_t backup_pread(const char* backup_name, void* buf, size_t size, size_t offset);
+size_t backup_read_rows(const char* backup_name, size_t first, size_t count, void* buf, TABLE_STATE* table_state);
+size_t restore_rows_from_backup(const char* backup_name, size_t first, size_t count, TABLE_STATE* table_state);
+size_t create_online_backup(const char* file_name, const char* backup_name, size_t rate, size_t* seq);
+int archive_fill(const char* backup_name, size_t size, int (*fill)(void* cookie, void* buf, size_t len, size_t offset), void* cookie);
+size_t log_enable(TABLE_STATE* ts);
+void log_open(TABLE_STATE* ts);
+void log_commit(TABLE_STATE* ts, const struct darray* stage);
+void log_close(TABLE_STATE* ts);
+void log_remove(const char* file_name);
+size_t log_seq(const char* file_name);
+void log_backup_point(const char* file_name, const char* backup_name);
+size_t restore_to_point(const char* file_name, const char* backup_name, const char* log_name, size_t seq, size_t time);
+size_t chunk_backup(const char* file_name, const char* store, const char* backup_name, CHUNK_STATS* stats);
+size_t chunk_restore(const char* file_name, const char* store, const char* backup_name);
+size_t chunk_backup_delete(const char* store, const char* backup_name);
+void sha256(const void* p, size_t n, unsigned char* out);
+size_t create_incremental_backup(const char* file_name, const char* backup_name);
+size_t restore_backup_chain(const char* file_name, const char* backup_name);
+int archive_ranges(const char* table_name, const char* delta_name, const size_t* offsets, const size_t* lens, size_t count);
+int restore_ranges(const char* table_name, const char* delta_name);
+void dirty_begin(TABLE_STATE* ts);
+void dirty_mark(TABLE_STATE* ts, size_t offset, size_t size);
+void dirty_save(TABLE_STATE* ts);
+void dirty_close(TABLE_STATE* ts);
+void dirty_chain_start(const char* file_name, const char* backup_name);
+FILE* table_fopen(const char* file_name, const char* mode, TABLE_STATE* ts);
+size_t page_store_read(PAGE_STORE* ps, void* buf, size_t size, size_t offset);
+size_t page_store_write(PAGE_STORE* ps, const void* buf, size_t size, size_t offset);
+void page_store_truncate(PAGE_STORE* ps, size_t length);
+void page_store_flush(TABLE_STATE* ts);
+void page_store_reload(TABLE_STATE* ts);
+void page_store_close(TABLE_STATE* ts);
+size_t table_compress(const char* file_name);
+size_t table_decompress(const char* file_name);
+size_t backup_table_pread(const char* backup_name, void* buf, size_t size, size_t offset);
 
 size_t encode_datatime(size_t Y, size_t M, size_t D, size_t h, size_t m, size_t s, size_t ms);
+size_t datatime_key(const unsigned char* datatime);
+
+void zmap_open(TABLE_STATE* ts);
+void zmap_rebuild(TABLE_STATE* ts);
+void zmap_save(TABLE_STATE* ts);
+void zmap_close(TABLE_STATE* ts);
+void zmap_row_written(TABLE_STATE* ts, size_t row, const void* entry, size_t reused);
+void zmap_value_written(TABLE_STATE* ts, size_t row, size_t col, const void* entry);
+void zmap_row_deleted(TABLE_STATE* ts, size_t row);
+int zmap_block_may_match(TABLE_STATE* ts, size_t block, size_t col, const void* entry);
+int zmap_block_may_satisfy(TABLE_STATE* ts, size_t block, size_t col, size_t op, const void* value);
+
+size_t column_seal(TABLE_STATE* ts);
+size_t column_drop(TABLE_STATE* ts);
+void columns_open(TABLE_STATE* ts);
+void columns_save(TABLE_STATE* ts);
+void columns_close(TABLE_STATE* ts);
+void column_row_changed(TABLE_STATE* ts, size_t row);
+size_t column_fold(TABLE_STATE* ts, size_t block, size_t col, size_t pred_col, size_t op, const void* value, COLUMN_FOLD* fold);
+size_t column_size(TABLE_STATE* ts, size_t col);
+const char* column_encoding(TABLE_STATE* ts, size_t block, size_t col);
+
+void roaring_add(ROARING* r, size_t x);
+void roaring_remove(ROARING* r, size_t x);
+int roaring_contains(const ROARING* r, size_t x);
+size_t roaring_count(const ROARING* r);
+ROARING roaring_and(const ROARING* a, const ROARING* b);
+ROARING roaring_or(const ROARING* a, const ROARING* b);
+size_t roaring_to_array(const ROARING* r, size_t** result);
+void roaring_free(ROARING* r);
+size_t roaring_write(const ROARING* r, FILE* file);
+size_t roaring_read(ROARING* r, FILE* file);
+
+size_t bitmap_index_create(size_t col, TABLE_STATE* ts);
+size_t bitmap_index_drop(size_t col, TABLE_STATE* ts);
+BITMAP_INDEX* bitmap_index_get(size_t col, TABLE_STATE* ts);
+const ROARING* bitmap_index_lookup(size_t col, const void* entry, TABLE_STATE* ts);
+size_t bitmap_index_count(size_t col, const void* entry, TABLE_STATE* ts);
+void bitmap_indexes_open(TABLE_STATE* ts);
+void bitmap_indexes_save(TABLE_STATE* ts);
+void bitmap_indexes_close(TABLE_STATE* ts);
+void bitmap_row_written(TABLE_STATE* ts, size_t row, const void* entry);
+void bitmap_value_written(TABLE_STATE* ts, size_t row, size_t col, const void* old_entry, const void* entry);
+void bitmap_row_deleted(TABLE_STATE* ts, size_t row);
+
+size_t art_index_create(size_t col, TABLE_STATE* ts);
+size_t art_index_drop(size_t col, TABLE_STATE* ts);
+ART_INDEX* art_index_get(size_t col, TABLE_STATE* ts);
+size_t art_find(size_t col, const void* value, TABLE_STATE* ts);
+size_t art_prefix_count(size_t col, const char* prefix, TABLE_STATE* ts);
+size_t art_prefix_rows(size_t col, const char* prefix, TABLE_STATE* ts, size_t** rows);
+void art_indexes_open(TABLE_STATE* ts);
+void art_indexes_save(TABLE_STATE* ts);
+void art_indexes_close(TABLE_STATE* ts);
+void art_row_written(TABLE_STATE* ts, size_t row, const void* entry);
+void art_value_written(TABLE_STATE* ts, size_t row, size_t col, const void* old_value, const void* entry);
+void art_row_deleted(TABLE_STATE* ts, size_t row);
+
+size_t fts_index_create(size_t col, TABLE_STATE* ts);
+size_t fts_index_drop(size_t col, TABLE_STATE* ts);
+FTS_INDEX* fts_index_get(size_t col, TABLE_STATE* ts);
+size_t fts_term_count(size_t col, const char* word, TABLE_STATE* ts);
+size_t fts_search(size_t col, const char* query, TABLE_STATE* ts, size_t** rows);
+size_t fts_select(size_t col, const char* query, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie);
+void fts_indexes_open(TABLE_STATE* ts);
+void fts_indexes_save(TABLE_STATE* ts);
+void fts_indexes_close(TABLE_STATE* ts);
+void fts_row_written(TABLE_STATE* ts, size_t row, const void* entry);
+void fts_value_written(TABLE_STATE* ts, size_t row, size_t col, const void* old_value, const void* entry);
+void fts_row_deleted(TABLE_STATE* ts, size_t row);
+
+size_t mvcc_enable(TABLE_STATE* ts);
+void mvcc_open(TABLE_STATE* ts);
+void mvcc_before_write(TABLE_STATE* ts, size_t row);
+void mvcc_commit(TABLE_STATE* ts);
+void mvcc_close(TABLE_STATE* ts);
+void mvcc_remove(const char* file_name);
+size_t snapshot_open(const char* file_name, TABLE_STATE* ts);
+size_t snapshot_rows(TABLE_STATE* ts, size_t first, size_t count, void* buf);
+const void* snapshot_row(TABLE_STATE* ts, size_t row);
+size_t snapshot_seq(TABLE_STATE* ts);
+void snapshot_close(TABLE_STATE* ts);
+
+void lock_open(TABLE_STATE* ts);
+void lock_close(TABLE_STATE* ts);
+size_t table_lock(TABLE_STATE* ts, size_t mode);
+size_t table_lock_shared(TABLE_STATE* ts);
+void table_unlock(TABLE_STATE* ts);
+size_t key_range_lock(TABLE_STATE* ts, size_t col, const void* lo, const void* hi);
+void key_range_unlock(TABLE_STATE* ts);
+void table_reload(TABLE_STATE* ts);
+size_t table_generation(TABLE_STATE* ts);
+void table_generation_next(TABLE_STATE* ts);
+void sidecar_restamp(TABLE_STATE* ts, const char* ext);
+void table_replaced(const char* file_name);
+
+void latch_open(TABLE_STATE* ts);
+void latch_close(TABLE_STATE* ts);
+size_t table_latch(TABLE_STATE* ts, size_t mode);
+void table_unlatch(TABLE_STATE* ts, size_t held);
+void stage_push(TABLE_STATE* ts, STAGE_EVENT* se);
+struct darray stage_take(TABLE_STATE* ts);
+
+size_t aggregate(size_t op, size_t col, size_t pred_col, void* pred_value, TABLE_STATE* ts, AGG_RESULT* result);
+
+void* arena_alloc(ARENA* arena, size_t size);
+void arena_free(ARENA* arena);
+
+size_t group_by(GROUP_BY* query, TABLE_STATE* ts, GROUP_RESULT* result);
+unsigned char* group_key(GROUP_RESULT* result, size_t group);
+AGG_RESULT* group_agg(GROUP_RESULT* result, size_t group, size_t agg);
+void group_result_free(GROUP_RESULT* result);
+
+size_t order_by(ORDER_BY* query, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie);
+
+size_t hash_join(JOIN* query, TABLE_STATE* left, TABLE_STATE* right, int (*func)(void*, size_t, void*, size_t, void*), void* cookie);
+
+void stats_open(TABLE_STATE* ts);
+void stats_rebuild(TABLE_STATE* ts);
+void stats_save(TABLE_STATE* ts);
+void stats_close(TABLE_STATE* ts);
+void stats_row_written(TABLE_STATE* ts, size_t row, const void* entry);
+void stats_value_written(TABLE_STATE* ts, size_t row, size_t col, const void* entry);
+void stats_row_deleted(TABLE_STATE* ts, size_t row);
+size_t stats_rows(TABLE_STATE* ts);
+size_t stats_distinct(size_t col, TABLE_STATE* ts);
+double stats_selectivity(size_t col, size_t op, const void* value, TABLE_STATE* ts);
+
+int pred_match(size_t type, size_t op, const void* value, const void* operand);
+void plan_predicate(size_t col, size_t op, const void* value, TABLE_STATE* ts, QUERY_PLAN* plan);
+size_t key_count(size_t col, size_t op, const void* value, TABLE_STATE* ts);
+size_t key_nth(size_t col, size_t n, size_t desc, TABLE_STATE* ts);
+size_t table_select(size_t col, size_t op, const void* value, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie);
+size_t table_select_where(size_t col, size_t op, const void* value, const FILTER* filter, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie);
+size_t table_select_rows(const size_t* rows, size_t n, const FILTER* filter, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie);
+
+PRED* pred_cmp(size_t col, size_t op, const void* value, TABLE_STATE* ts);
+PRED* pred_and(PRED* left, PRED* right);
+PRED* pred_or(PRED* left, PRED* right);
+PRED* pred_not(PRED* operand);
+void pred_free(PRED* p);
+size_t pred_serialize(const PRED* p, char** buf);
+PRED* pred_deserialize(const char** buf);
+FILTER* filter_compile(const PRED* where, TABLE_STATE* ts);
+void filter_free(FILTER* f);
+int filter_match(const FILTER* f, const void* entry);
+int filter_block_may_match(const FILTER* f, TABLE_STATE* ts, size_t block);
+size_t filter_bitmap(const PRED* where, TABLE_STATE* ts, ROARING* rows);
+size_t table_filter(const PRED* where, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie);
+size_t find_where(const PRED* where, TABLE_STATE* ts, void** result, size_t** indices);
+
+void bloom_init(BLOOM* bloom, size_t nkeys, size_t bits_per_key);
+void bloom_add(BLOOM* bloom, size_t hash);
+int bloom_may_contain(const BLOOM* bloom, size_t hash);
+void bloom_free(BLOOM* bloom);
+void cbloom_init(COUNTING_BLOOM* bloom, size_t nkeys, size_t counters_per_key);
+void cbloom_add(COUNTING_BLOOM* bloom, size_t hash);
+void cbloom_remove(COUNTING_BLOOM* bloom, size_t hash);
+int cbloom_may_contain(const COUNTING_BLOOM* bloom, size_t hash);
+void cbloom_free(COUNTING_BLOOM* bloom);
+
+void keyfilter_open(TABLE_STATE* ts);
+void keyfilter_rebuild(TABLE_STATE* ts);
+void keyfilter_save(TABLE_STATE* ts);
+void keyfilter_close(TABLE_STATE* ts);
+void keyfilter_row_written(TABLE_STATE* ts, size_t row, const void* entry);
+void keyfilter_value_written(TABLE_STATE* ts, size_t row, size_t col, const void* old_value, const void* entry);
+void keyfilter_row_deleted(TABLE_STATE* ts, size_t row);
+int keyfilter_may_contain(size_t col, const void* value, TABLE_STATE* ts);
+
+size_t lsm_create(TABLE_STATE* ts);
+void lsm_open(TABLE_STATE* ts);
+void lsm_save(TABLE_STATE* ts);
+void lsm_close(TABLE_STATE* ts);
+void lsm_remove(const char* file_name);
+size_t lsm_find(size_t col, const void* value, TABLE_STATE* ts);
+int lsm_key_exists(TABLE_STATE* ts, const void* entry);
+void lsm_row_written(TABLE_STATE* ts, size_t row, const void* entry);
+void lsm_value_written(TABLE_STATE* ts, size_t row, size_t col, const void* old_value, const void* entry);
+void lsm_row_deleted(TABLE_STATE* ts, size_t row);
+size_t lsm_run_count(size_t col, TABLE_STATE* ts);
+
+size_t projection_size(const PROJECTION* proj, TABLE_STATE* ts);
+void* projection_value(void* tuple, const PROJECTION* proj, size_t i, TABLE_STATE* ts);
+size_t project_rows(const size_t* rows, size_t count, const PROJECTION* proj, TABLE_STATE* ts, void* result);
+size_t find_project(const PRED* where, const PROJECTION* proj, TABLE_STATE* ts, void** result, size_t** indices);
 
 #endif // TABLE_FILE_H
 
@@ -193,6 +942,18 @@ size_t encode_datatime(size_t Y, size_t M, size_t D, size_t h, size_t m, size_t
   return res;
 }
 
+// Maps encoded datatime to a number that preserves chronological order
+size_t datatime_key(const unsigned char* d) {
+  size_t Y  =  d[0]           + ((size_t)(d[1]&0xf0)<<4);
+  size_t M  = ((d[1]&0x0f)<<4) + ((d[2]&0xf0)>>4);
+  size_t D  = ((d[2]&0x0f)<<4) + ((d[3]&0xf0)>>4);
+  size_t h  = ((d[3]&0x0f)<<4) + ((d[4]&0xf0)>>4);
+  size_t m  = ((d[4]&0x0f)<<4) + ((d[5]&0xf0)>>4);
+  size_t s  = ((d[5]&0x0f)<<4) + ((d[6]&0xf0)>>4);
+  size_t ms = ((size_t)(d[6]&0x0f)<<8) + d[7];
+  return (Y<<52) | (M<<44) | (D<<36) | (h<<28) | (m<<20) | (s<<12) | ms;
+}
+
 int (*pick_cmp(size_t type_))(const void*, const void*, const void*) {
   if (TYPE_NUMBER(type_) == TABLE_TYPE_INT)
     return cmp_int;
@@ -206,6 +967,55 @@ int (*pick_cmp(size_t type_))(const void*, const void*, const void*) {
   return NULL;
 }
 
+// Compares two bare column values of the given type
+int value_cmp(size_t type, const void* a, const void* b) {
+  if (TYPE_NUMBER(type) == TABLE_TYPE_INT) {
+    int l = *(int*)a, r = *(int*)b;
+    return l == r ? 0 : (l < r ? -1 : 1);
+  }
+  if (TYPE_NUMBER(type) == TABLE_TYPE_FLOAT) {
+    float l = *(float*)a, r = *(float*)b;
+    return l == r ? 0 : (l < r ? -1 : 1);
+  }
+  if (TYPE_NUMBER(type) == TABLE_TYPE_VARCHAR)
+    return strcmp(a, b);
+  if (TYPE_NUMBER(type) == TABLE_TYPE_DATATIME) {
+    size_t l = datatime_key(a), r = datatime_key(b);
+    return l == r ? 0 : (l < r ? -1 : 1);
+  }
+  assert(0 && "should never happen");
+  return 0;
+}
+
+// 64-bit hash, equal for values value_cmp finds equal
+size_t value_hash(size_t type, const void* value) {
+  const unsigned char* bytes = value;
+  size_t size = TYPE_SIZE(type);
+  size_t key;
+  if (TYPE_NUMBER(type) == TABLE_TYPE_VARCHAR) {
+    size = strlen(value);
+  } else if (TYPE_NUMBER(type) == TABLE_TYPE_DATATIME) {
+    key = datatime_key(value);
+    bytes = (const unsigned char*)&key;
+    size = sizeof(size_t);
+  } else if (TYPE_NUMBER(type) == TABLE_TYPE_FLOAT && *(float*)value == 0) {
+    key = 0; // -0.0 is equal to 0.0
+    bytes = (const unsigned char*)&key;
+  }
+  size_t h = 14695981039346656037UL;
+  for (size_t i = 0; i < size; i++) {
+    h ^= bytes[i];
+    h *= 1099511628211UL;
+  }
+  // FNV leaves the high bits poorly mixed
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdUL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53UL;
+  h ^= h >> 33;
+  return h;
+}
+
 void _destroy(void* a) {
   free(a);
 }
@@ -242,13 +1052,11 @@ int cmp_datatime(const void* rb, const void* a, const void* b) {
   const rbtree* rbt = rb;
   TABLE_STATE* ts = rbt->table_state;
   size_t offset = ts->col_offsets[rbt->col];
-  char* l = &((char*)a)[offset];
-  char* r = &((char*)b)[offset];
-  for (size_t i = 0; i < DATATIME_SIZE; i++) {
-    if (l[i] < r[i]) return -1;
-    if (r[i] > l[i]) return 1;
-  }
-  return 0;
+  size_t l = datatime_key(&((unsigned char*)a)[offset]);
+  size_t r = datatime_key(&((unsigned char*)b)[offset]);
+  if (l == r) return 0;
+  if (l < r) return -1;
+  return 1;
 }
 
 /*
@@ -289,7 +1097,7 @@ void header_write(size_t ncols, size_t name_len, size_t* col_types, const char**
   char* info_header = (char*)malloc(sizeof(char) * NAMES_OFFSET);
   memset(info_header, 0, NAMES_OFFSET);
   
-  info_header[0] = sizeof(size_t);
+  info_header[0] = TABLE_VERSION;
   
   size_t next_empty_place = 0;
   memcpy(&info_header[1], &next_empty_place, sizeof(size_t)); // TODO:
@@ -320,7 +1128,8 @@ void header_write(size_t ncols, size_t name_len, size_t* col_types, const char**
     strcpy(&(result[NAMES_OFFSET + i * (name_len + 1)]), col_names[i]);
   }
 
-  size_t rb_nil[4] = {-1,-1,-1,-1};
+  size_t rb_nil[RB_DATA_LEN];
+  memset(rb_nil, 0xff, RB_DATA_SIZE);
 
   size_t rb_offset = NAMES_OFFSET + ncols*(name_len+1);
   for (size_t t = 0; t < nkey_fields; t++) {
@@ -355,8 +1164,40 @@ size_t entry_offset(size_t index, TABLE_STATE* table_state) {
   return table_state->header_offset + index * (table_state->entry_size + table_state->entry_metadata_size);
 }
 
+// Reads and writes at an offset of the table file, the position of the
+// FILE is left alone so threads do not move it under each other.
+// 1 if all size bytes were transferred. Compressed tables go through
+// their pages
+size_t table_pread(TABLE_STATE* table_state, void* buf, size_t size, size_t offset) {
+  return table_pread_some(table_state, buf, size, offset) == size;
+}
+
+size_t table_pwrite(TABLE_STATE* table_state, const void* buf, size_t size, size_t offset) {
+  if (table_state->page_store)
+    return page_store_write(table_state->page_store, buf, size, offset) == size;
+  dirty_mark(table_state, offset, size);
+  return pwrite(fileno(table_state->file), buf, size, offset) == (ssize_t)size;
+}
+
+// Bytes read at offset, fewer at the end of the table
+size_t table_pread_some(TABLE_STATE* table_state, void* buf, size_t size, size_t offset) {
+  if (table_state->page_store)
+    return page_store_read(table_state->page_store, buf, size, offset);
+  ssize_t r = pread(fileno(table_state->file), buf, size, offset);
+  return r > 0 ? r : 0;
+}
+
+void table_truncate(TABLE_STATE* table_state, size_t length) {
+  if (table_state->page_store)
+    page_store_truncate(table_state->page_store, length);
+  else
+    ftruncate(fileno(table_state->file), length);
+}
+
 size_t tappend(void* entry, TABLE_STATE* table_state) { // TODO: add check if there is a free place in table
-  size_t next_empty = next_empty_read(table_state->file);
+  if (table_state->lsm && lsm_key_exists(table_state, entry))
+    return 1;
+  size_t next_empty = next_empty_read(table_state);
   size_t offset = table_state->append_offset;
   size_t was_empty = 0;
   if (next_empty) {
@@ -365,22 +1206,57 @@ size_t tappend(void* entry, TABLE_STATE* table_state) { // TODO: add check if th
     next_empty_withdraw(table_state);
   }
   table_state->last_inserted = (offset - table_state->header_offset) / table_state->entry_raw_size;
-  fseek(table_state->file, offset + table_state->entry_metadata_size, SEEK_SET);
-  size_t r = fwrite(&((char*)entry)[table_state->entry_metadata_size], table_state->entry_size, 1, table_state->file);
-  table_state->append_offset = ftell(table_state->file);
+  mvcc_before_write(table_state, table_state->last_inserted);
+  // 1 if all of the entry was written
+  size_t written = table_pwrite(table_state, &((char*)entry)[table_state->entry_metadata_size], table_state->entry_size, offset + table_state->entry_metadata_size);
+  assert(written);
+  if (!was_empty)
+    table_state->append_offset = offset + table_state->entry_raw_size;
   size_t ret = 0;
-  for (size_t i = 0; i < table_state->nkey_cols; i++) {
+  for (size_t i = 0; !table_state->lsm && i < table_state->nkey_cols; i++) {
     ret = !rb_insert(table_state->rb_trees[i], entry);
     if (ret && !was_empty) {
       table_state->append_offset = offset;
-      ftruncate(fileno(table_state->file), offset);
+      table_truncate(table_state, offset);
       break;
     }
   }
+  if (!ret) {
+    lsm_row_written(table_state, table_state->last_inserted, entry);
+    keyfilter_row_written(table_state, table_state->last_inserted, entry);
+    art_row_written(table_state, table_state->last_inserted, entry);
+    fts_row_written(table_state, table_state->last_inserted, entry);
+    zmap_row_written(table_state, table_state->last_inserted, entry, was_empty);
+    column_row_changed(table_state, table_state->last_inserted);
+    bitmap_row_written(table_state, table_state->last_inserted, entry);
+    stats_row_written(table_state, table_state->last_inserted, entry);
+  }
   return ret;
   // Update next free
 }
 
+// Writes col of new_data into a row, old_value is the bare value it replaces
+void tedit_row(size_t row, size_t col, const void* old_value, char* new_data, TABLE_STATE* table_state) {
+  table_state->last_inserted = row;
+  if (key_tree(col, table_state)) {
+    rbtree* rbt = table_state->rb_trees[table_state->key_col_relpos[col]];
+    rb_delete(rbt, row, 1);
+    rb_insert(rbt, new_data);
+  } else {
+    size_t offset = entry_offset(row, table_state);
+    mvcc_before_write(table_state, row);
+    table_pwrite(table_state, &((char*)new_data)[table_state->col_offsets[col]], TYPE_SIZE(table_state->col_types[col]), offset + table_state->col_offsets[col]);
+  }
+  lsm_value_written(table_state, row, col, old_value, new_data);
+  keyfilter_value_written(table_state, row, col, old_value, new_data);
+  art_value_written(table_state, row, col, old_value, new_data);
+  fts_value_written(table_state, row, col, old_value, new_data);
+  zmap_value_written(table_state, row, col, new_data);
+  column_row_changed(table_state, row);
+  bitmap_value_written(table_state, row, col, old_value, &new_data[table_state->col_offsets[col]]);
+  stats_value_written(table_state, row, col, new_data);
+}
+
 void tedit(void* data, TABLE_STATE* table_state) {
   size_t col = *((size_t*)data);
   size_t size = TYPE_SIZE(table_state->col_types[col]);
@@ -400,58 +1276,97 @@ void tedit(void* data, TABLE_STATE* table_state) {
     }
   }
 
+  for (size_t i = 0; i < count; i++)
+    tedit_row(indices[i], col, old_value, new_data, table_state);
+  if (count) free(indices);
+  free(new_data);
+}
+
+// Edits col of the rows matching a serialized predicate,
+// data is [size_t] col, new value, predicate
+void tedit_where(void* data, TABLE_STATE* table_state) {
+  size_t col = *((size_t*)data);
+  size_t size = TYPE_SIZE(table_state->col_types[col]);
+  const char* it = &((char*)data)[sizeof(size_t) + size];
+  PRED* where = pred_deserialize(&it);
+  size_t* indices;
+  size_t count = find_where(where, table_state, NULL, &indices);
+  pred_free(where);
+  char* new_data = get_by_tindex(0, table_state);
+  memcpy(&new_data[table_state->col_offsets[col]], &((char*)data)[sizeof(size_t)], size);
+  char* row = malloc(table_state->entry_raw_size);
   for (size_t i = 0; i < count; i++) {
-    table_state->last_inserted = indices[i];
-    if (IS_KEY(table_state->col_types[col])) {
-      rbtree* rbt = table_state->rb_trees[table_state->key_col_relpos[col]];
-      rb_delete(rbt, indices[i], 1);
-      rb_insert(rbt, new_data);
-    } else {
-      size_t offset = entry_offset(indices[i], table_state);
-      fseek(table_state->file, offset + table_state->col_offsets[col], SEEK_SET);
-      fwrite(&((char*)new_data)[table_state->col_offsets[col]], TYPE_SIZE(table_state->col_types[col]), 1, table_state->file);
-    }
+    // a key value can be given to one row only
+    if (IS_KEY(table_state->col_types[col]) && find_entry(col, new_data, table_state, NULL, NULL) != 0)
+      break;
+    read_rows(indices[i], 1, row, table_state);
+    tedit_row(indices[i], col, &row[table_state->col_offsets[col]], new_data, table_state);
   }
+  free(row);
   if (count) free(indices);
   free(new_data);
 }
 
+// Unlinks a row from the key trees and puts it on the free list
+void tdelete_row(size_t row, TABLE_STATE* table_state) {
+  lsm_row_deleted(table_state, row);
+  keyfilter_row_deleted(table_state, row);
+  art_row_deleted(table_state, row);
+  fts_row_deleted(table_state, row);
+  for (size_t j = 0; !table_state->lsm && j < table_state->nkey_cols; j++) {
+    rb_delete(table_state->rb_trees[j], row, 1);
+  }
+  // set_free(row)
+  size_t next_empty = next_empty_read(table_state);
+  next_empty_write(table_state, row);
+
+  mvcc_before_write(table_state, row);
+  size_t offset_parent = entry_offset(row, table_state) + 0 + sizeof(size_t) * RB_INDEX_PARENT;
+  table_pwrite(table_state, &next_empty, sizeof(size_t), offset_parent);
+
+  size_t offset_color = entry_offset(row, table_state) + 0 + sizeof(size_t) * RB_INDEX_COLOR;
+  size_t minusone = -1;
+  table_pwrite(table_state, &minusone, sizeof(size_t), offset_color);
+  zmap_row_deleted(table_state, row);
+  column_row_changed(table_state, row);
+  bitmap_row_deleted(table_state, row);
+  stats_row_deleted(table_state, row);
+}
+
+// Deletes the rows matching a serialized predicate
+size_t tdelete_where(void* data, TABLE_STATE* table_state) {
+  const char* it = data;
+  PRED* where = pred_deserialize(&it);
+  size_t* indices;
+  size_t count = find_where(where, table_state, NULL, &indices);
+  pred_free(where);
+  for (size_t i = 0; i < count; i++)
+    tdelete_row(indices[i], table_state);
+  if (count) free(indices);
+  return count;
+}
+
 size_t tdelete(void *data, TABLE_STATE* table_state) {
   size_t col = *(size_t*)data;
   void* value = &((char*)data)[sizeof(size_t)];
   char* query = get_by_tindex(0, table_state);
   memcpy(&query[table_state->col_offsets[col]], value, TYPE_SIZE(table_state->col_types[col]));
-  size_t is_key = IS_KEY(table_state->col_types[col]);
-  if (is_key) {
+  if (key_tree(col, table_state)) {
     size_t *index;
     size_t count = find_entry(col, query, table_state, NULL, &index); // TODO :
-    for (size_t i = 0; *index && i < table_state->nkey_cols; i++) {
-      rb_delete(table_state->rb_trees[i], *index, 0);
-    }
     if (query) free(query);
+    if (count == 0)
+      return 0;
+    // the row is unlinked from every key tree, but freed once
+    tdelete_row(*index, table_state);
     size_t val = *index;
     free(index);
     return val;
   } else {
     size_t *indices = NULL;
     size_t count = find_entry(col, query, table_state, NULL, &indices);
-    for (size_t i = 0; i < count; i++) {
-      for (size_t j = 0; j < table_state->nkey_cols; j++) {
-        rb_delete(table_state->rb_trees[j], indices[i], 1);
-      }
-      // set_free(indices[i])
-      size_t next_empty = next_empty_read(table_state->file);
-      next_empty_write(table_state->file, indices[i]);
-      
-      size_t offset_parent = entry_offset(indices[i], table_state) + 0 + sizeof(size_t) * RB_INDEX_PARENT;
-      fseek(table_state->file, offset_parent, SEEK_SET);
-      fwrite(&next_empty, sizeof(size_t), 1, table_state->file);
-      
-      size_t offset_color = entry_offset(indices[i], table_state) + 0 + sizeof(size_t) * RB_INDEX_COLOR;
-      fseek(table_state->file, offset_color, SEEK_SET);
-      size_t minusone = -1;
-      fwrite(&minusone, sizeof(size_t), 1, table_state->file);
-    }
+    for (size_t i = 0; i < count; i++)
+      tdelete_row(indices[i], table_state);
     if (query) free(query);
     if (indices) free(indices);
   }
@@ -464,23 +1379,21 @@ unsigned char table_version(FILE* file) {
   return version;
 }
 
-size_t next_empty_read(FILE* file) {
-  fseek(file, 1, SEEK_SET);
-  size_t pos;
-  fread(&pos, sizeof(size_t), 1, file);
+size_t next_empty_read(TABLE_STATE* ts) {
+  size_t pos = 0;
+  table_pread(ts, &pos, sizeof(size_t), 1);
   return pos;
 }
 
-size_t next_empty_write(FILE* file, size_t node_ptr) {
-  fseek(file, 1, SEEK_SET);
-  return fwrite(&node_ptr, sizeof(size_t), 1, file);
+size_t next_empty_write(TABLE_STATE* ts, size_t node_ptr) {
+  return table_pwrite(ts, &node_ptr, sizeof(size_t), 1);
 }
 
 size_t next_empty_withdraw(TABLE_STATE* ts) {
-  size_t curr_empty = next_empty_read(ts->file);
+  size_t curr_empty = next_empty_read(ts);
   if (curr_empty != 0) {
     size_t* next_empty_entry = get_by_tindex(curr_empty, ts);
-    next_empty_write(ts->file, next_empty_entry[RB_INDEX_PARENT]);
+    next_empty_write(ts, next_empty_entry[RB_INDEX_PARENT]);
     free(next_empty_entry);
   }
 }
@@ -547,9 +1460,8 @@ size_t *read_rb_head(size_t col, TABLE_STATE* ts) {
     NAMES_OFFSET + 
     ts->ncols*(ts->name_len+1) +
     ts->key_col_relpos[col] * RB_DATA_SIZE;
-  fseek(ts->file, offset, SEEK_SET);
   size_t rb_head[RB_DATA_LEN];
-  fread(&rb_head, RB_DATA_SIZE, 1, ts->file);
+  table_pread(ts, &rb_head, RB_DATA_SIZE, offset);
   return NULL;
 }
 
@@ -558,17 +1470,18 @@ size_t write_rb_head(size_t col, size_t rb_head, TABLE_STATE* ts) {
     return 0;
   }
   size_t offset = ts->key_col_relpos[col] * sizeof(size_t) + NAMES_OFFSET + ts->ncols*(ts->name_len+1);
-  fseek(ts->file, offset, SEEK_SET);
-  return fwrite(&rb_head, sizeof(size_t), 1, ts->file);
+  return table_pwrite(ts, &rb_head, sizeof(size_t), offset);
 }
 
-void header_read(FILE* file, TABLE_STATE* table_state) {
+// 1 if the table was written in another format or with another size_t
+size_t header_read(FILE* file, TABLE_STATE* table_state) {
   rewind(file);
 
   table_state->file      = file;
   table_state->version   = table_version(file);
   // table_state->stage_next_free = next_empty_read(file);
-  assert(table_state->version == sizeof(size_t));
+  if ((unsigned char)table_state->version != TABLE_VERSION)
+    return 1;
   table_state->ncols     = read_ncols(file);
   table_state->name_len  = read_name_len(file);
 
@@ -604,6 +1517,7 @@ void header_read(FILE* file, TABLE_STATE* table_state) {
       table_state->rb_trees[table_state->key_col_relpos[i]] = rb_restore_from_table(table_state->key_col_relpos[i], table_state, cmp);
     }
   }
+  return 0;
 }
 
 void create_entry(TABLE_STATE* table_state, size_t nargs, ...) {
@@ -650,15 +1564,33 @@ void create_entry(TABLE_STATE* table_state, size_t nargs, ...) {
   STAGE_EVENT *se = malloc(sizeof(STAGE_EVENT));
   se->type = SE_CREATE;
   se->data = data;
-  da_append(&table_state->stage, se);
+  stage_push(table_state, se);
   va_end(args);
   // printf("WRITING\n");
   // display_entry(data, table_state->entry_raw_size);
 }
 
 void commit_changes(TABLE_STATE* table_state) {
-  for (size_t i = 0; i < table_state->stage.count; i++) {
-    STAGE_EVENT* se = table_state->stage.items[i];
+  assert(table_state->snapshot == NULL);
+  // one thread commits at a time, the process lock is its own
+  size_t latched = table_latch(table_state, TABLE_LOCK_WRITE);
+  // LSM runs are merged in the background and are not read again, such
+  // tables are left to one process
+  TABLE_LOCK* lock = table_state->lock;
+  size_t locked = lock && lock->mode == TABLE_LOCK_NONE && table_state->lsm == NULL;
+  assert(lock == NULL || lock->mode != TABLE_LOCK_READ);
+  if (locked)
+    table_lock(table_state, TABLE_LOCK_WRITE);
+  // threads go on staging into a new stage meanwhile
+  struct darray stage = stage_take(table_state);
+  if (stage.count)
+    table_generation_next(table_state);
+  log_commit(table_state, &stage);
+  // the backup chain learns of the commit before the table is written
+  if (stage.count)
+    dirty_begin(table_state);
+  for (size_t i = 0; i < stage.count; i++) {
+    STAGE_EVENT* se = stage.items[i];
     if (se->type == SE_CREATE) {
       tappend(se->data, table_state);
       free(se->data);
@@ -670,19 +1602,71 @@ void commit_changes(TABLE_STATE* table_state) {
     if (se->type == SE_EDIT) {
       tedit(se->data, table_state);
     }
+    if (se->type == SE_DELETE_WHERE) {
+      tdelete_where(se->data, table_state);
+      free(se->data);
+    }
+    if (se->type == SE_EDIT_WHERE) {
+      tedit_where(se->data, table_state);
+      free(se->data);
+    }
     free(se);
   }
-  table_state->stage.count = 0;
-  fflush(table_state->file);
+  free(stage.items);
+  // the rows are in the file before the sidecars say so
+  page_store_flush(table_state);
+  zmap_save(table_state);
+  columns_save(table_state);
+  bitmap_indexes_save(table_state);
+  stats_save(table_state);
+  lsm_save(table_state);
+  keyfilter_save(table_state);
+  art_indexes_save(table_state);
+  fts_indexes_save(table_state);
+  mvcc_commit(table_state);
+  dirty_save(table_state);
+  if (locked)
+    table_unlock(table_state);
+  key_range_unlock(table_state);
+  table_unlatch(table_state, latched);
 }
 
 void* get_by_tindex(size_t index, TABLE_STATE* table_state) {
-  fseek(table_state->file, entry_offset(index, table_state), SEEK_SET);
   void* buf = malloc(table_state->entry_raw_size);
-  fread(buf, table_state->entry_raw_size, 1, table_state->file);
+  size_t latched = table_latch(table_state, TABLE_LOCK_READ);
+  if (table_state->snapshot)
+    memcpy(buf, snapshot_row(table_state, index), table_state->entry_raw_size);
+  else
+    table_pread(table_state, buf, table_state->entry_raw_size, entry_offset(index, table_state));
+  table_unlatch(table_state, latched);
   return buf;
 }
 
+// Reads count consecutive rows starting from first into buf
+size_t read_rows(size_t first, size_t count, void* buf, TABLE_STATE* table_state) {
+  size_t latched = table_latch(table_state, TABLE_LOCK_READ);
+  size_t n = 0;
+  if (table_state->snapshot) {
+    n = snapshot_rows(table_state, first, count, buf);
+  } else {
+    n = table_pread_some(table_state, buf, count * table_state->entry_raw_size, entry_offset(first, table_state)) / table_state->entry_raw_size;
+  }
+  table_unlatch(table_state, latched);
+  return n;
+}
+
+// Number of row slots including the sentinel row 0
+size_t row_count(TABLE_STATE* table_state) {
+  return (table_state->append_offset - table_state->header_offset) / table_state->entry_raw_size;
+}
+
+// Name of a file stored next to the table: <file_name>.<ext>
+char* sidecar_name(const char* file_name, const char* ext) {
+  char* name = malloc(strlen(file_name) + strlen(ext) + 2);
+  sprintf(name, "%s.%s", file_name, ext);
+  return name;
+}
+
 size_t create_table(size_t ncols, size_t name_len, size_t* col_types, const char** col_names, const char* file_name) {
   if (access(file_name, F_OK) == 0) {// Check if the file doesn't exist
     return 1;
@@ -694,20 +1678,71 @@ size_t create_table(size_t ncols, size_t name_len, size_t* col_types, const char
   return 0;
 }
 
+// Returns 1 if the table does not exist or is of another format
 size_t open_table(const char* file_name, TABLE_STATE* table_state) {
   if (access(file_name, F_OK) != 0) { // Check if the file does exist
     return 1;
   }
-  FILE* file = fopen(file_name, "rb+");
-  header_read(file, table_state);
+  table_state->file_name = strdup(file_name);
+  latch_open(table_state);
+  // nothing is read while a commit of another process is applied
+  lock_open(table_state);
+  table_lock(table_state, TABLE_LOCK_READ);
+  FILE* file = table_fopen(file_name, "rb+", table_state);
+  if (header_read(file, table_state) != 0) {
+    table_unlock(table_state);
+    close_table(table_state);
+    return 1;
+  }
+  zmap_open(table_state);
+  columns_open(table_state);
+  bitmap_indexes_open(table_state);
+  stats_open(table_state);
+  lsm_open(table_state);
+  keyfilter_open(table_state);
+  art_indexes_open(table_state);
+  fts_indexes_open(table_state);
+  mvcc_open(table_state);
+  log_open(table_state);
+  table_unlock(table_state);
   return 0;
 }
 
+// Drops what is kept of the table in memory and reads it again, after
+// another process committed to it
+void table_reload(TABLE_STATE* table_state) {
+  mvcc_close(table_state);
+  zmap_close(table_state);
+  columns_close(table_state);
+  bitmap_indexes_close(table_state);
+  stats_close(table_state);
+  keyfilter_close(table_state);
+  art_indexes_close(table_state);
+  fts_indexes_close(table_state);
+  // rows are read at their offsets, only the end of the file moved
+  page_store_reload(table_state);
+  fseek(table_state->file, 0L, SEEK_END);
+  table_state->stage_append_offset = table_state->append_offset = ftell(table_state->file);
+  for (size_t i = 0; i < table_state->nkey_cols; i++)
+    table_state->rb_trees[i]->min_ptr = rb_min(table_state->rb_trees[i]);
+  zmap_open(table_state);
+  columns_open(table_state);
+  bitmap_indexes_open(table_state);
+  stats_open(table_state);
+  keyfilter_open(table_state);
+  art_indexes_open(table_state);
+  fts_indexes_open(table_state);
+  mvcc_open(table_state);
+}
+
 size_t close_table(TABLE_STATE *table_state) {
+  lsm_close(table_state);
   if (table_state->file) {
     fclose(table_state->file);
     table_state->file = NULL;
   }
+  mvcc_close(table_state);
+  snapshot_close(table_state);
   free(table_state->col_offsets);
   free(table_state->col_types);
   for (size_t i = 0; i < table_state->ncols; i++) {
@@ -716,15 +1751,36 @@ size_t close_table(TABLE_STATE *table_state) {
   free(table_state->col_names);
   free(table_state->key_col_relpos);
   for (size_t i = 0; i < table_state->nkey_cols; i++) {
-    free(table_state->rb_trees[i]->copy_data);
     free(table_state->rb_trees[i]);
   }
   free(table_state->rb_trees);
   free(table_state->stage.items);
+  zmap_close(table_state);
+  columns_close(table_state);
+  bitmap_indexes_close(table_state);
+  stats_close(table_state);
+  keyfilter_close(table_state);
+  art_indexes_close(table_state);
+  fts_indexes_close(table_state);
+  lock_close(table_state);
+  latch_close(table_state);
+  dirty_close(table_state);
+  log_close(table_state);
+  free(table_state->file_name);
 }
 
+static const char* sidecar_exts[] = { "zmap", "cols", "bmi", "stats", "kbf", "art", "fts", "mvcc", "lock", "dirty", NULL };
+
 size_t delete_table(const char* file_name) {
   assert(access(file_name, F_OK) == 0); // Check if the file does exist
+  lsm_remove(file_name);
+  mvcc_remove(file_name);
+  log_remove(file_name);
+  for (size_t i = 0; sidecar_exts[i]; i++) {
+    char* name = sidecar_name(file_name, sidecar_exts[i]);
+    unlink(name);
+    free(name);
+  }
   return unlink(file_name); 
 }
 
@@ -732,11 +1788,19 @@ size_t erase_table(const char* file_name) {
   assert(access(file_name, F_OK) == 0); // Check if the file does exist
   TABLE_STATE table_state = { 0 };
   open_table(file_name, &table_state);
+  size_t lsm = table_state.lsm != NULL;
+  lsm_close(&table_state);
   fclose(table_state.file);
   table_state.file = NULL;
   delete_table(file_name);
   create_table(table_state.ncols, table_state.name_len, table_state.col_types, table_state.col_names, file_name);
   close_table(&table_state);
+  if (lsm) {
+    table_state = (TABLE_STATE){ 0 };
+    open_table(file_name, &table_state);
+    lsm_create(&table_state);
+    close_table(&table_state);
+  }
 }
 
 size_t save_table(TABLE_STATE* table_state) {
@@ -808,20 +1872,17 @@ void rb_table_update(rbtree* rbt, rbnode* node) {
     metadata[2] = 1 + ((size_t*)node->right->data)[0];
   }
   size_t offset = entry_offset(((size_t*)node->data)[0], table_state);
-  fseek(table_state->file, offset, SEEK_SET);
   assert(sizeof(metadata) == table_state->entry_metadata_size);
-  fwrite(metadata, 1, sizeof(metadata), table_state->file);
+  table_pwrite(table_state, metadata, sizeof(metadata), offset);
 }
 
 void rb_from_raw_table(rbtree* rbt, TABLE_STATE* table_state) {
-  fseek(table_state->file, 0L, SEEK_END);
-  size_t fend = ftell(table_state->file);
-  size_t count = (fend - table_state->header_offset) / (table_state->entry_raw_size);
+  size_t count = row_count(table_state);
   for (size_t i = 0; i < count; i++) {
     size_t offset = entry_offset(i, table_state);
-    fseek(table_state->file, offset, SEEK_SET);
     char* entry = malloc(table_state->entry_raw_size);
-    size_t r = fread(entry, sizeof(char), table_state->entry_raw_size, table_state->file);
+    size_t whole = table_pread(table_state, entry, table_state->entry_raw_size, offset);
+    assert(whole);
 
     // char *val = malloc(sizeof(size_t) + TYPE_SIZE(table_state->col_types[0]));
     // memcpy(val, &i, sizeof(size_t));
@@ -830,58 +1891,86 @@ void rb_from_raw_table(rbtree* rbt, TABLE_STATE* table_state) {
   }
 }
 
+// Row holding the key col of entry, 0 if there is none
+size_t key_find(size_t col, void* entry, TABLE_STATE* table_state) {
+  const void* value = &((char*)entry)[table_state->col_offsets[col]];
+  size_t latched = table_latch(table_state, TABLE_LOCK_READ);
+  size_t row = 0;
+  if (!keyfilter_may_contain(col, value, table_state))
+    row = 0;
+  else if (art_index_get(col, table_state))
+    row = art_find(col, value, table_state);
+  else if (table_state->lsm)
+    row = lsm_find(col, value, table_state);
+  else
+    row = rb_find(table_state->rb_trees[table_state->key_col_relpos[col]], entry);
+  table_unlatch(table_state, latched);
+  return row;
+}
+
+// 1 if col is kept in a row tree, which can be walked in key order
+int key_tree(size_t col, TABLE_STATE* table_state) {
+  return IS_KEY(table_state->col_types[col]) && table_state->lsm == NULL;
+}
+
 // must free all entries
+typedef struct {
+  TABLE_STATE* table_state;
+  size_t result, indices;
+  struct darray entr, indx;
+} FIND_RESULT;
+
+static int find_collect(void* entry, size_t row, void* cookie) {
+  FIND_RESULT* found = cookie;
+  if (found->result) {
+    void* copy = malloc(found->table_state->entry_raw_size);
+    memcpy(copy, entry, found->table_state->entry_raw_size);
+    da_append(&found->entr, copy);
+  }
+  if (found->indices)
+    da_append(&found->indx, row);
+  return 0;
+}
+
 size_t find_entry(size_t col, void* value, TABLE_STATE* table_state, void** result, size_t** indices) {
   size_t is_key = IS_KEY(table_state->col_types[col]);
   if (is_key) {
-    size_t index = rb_find(table_state->rb_trees[table_state->key_col_relpos[col]], value);
+    // the row is read before a commit can move it
+    size_t latched = table_latch(table_state, TABLE_LOCK_READ);
+    size_t index = key_find(col, value, table_state);
     if (result && index) {
       void** a = malloc(sizeof(void*));
       a[0] = get_by_tindex(index, table_state);
       *result = a;
     }
+    table_unlatch(table_state, latched);
     if (indices && index) {
       *indices = malloc(sizeof(size_t));
       (*indices)[0] = index;
     }
     return (index ? 1 : 0);
   } else {
-    rbtree rbt = { 0 };
-    rbt.col = col;
-    rbt.table_state = table_state;
-    int (*cmp)(const void*, const void*, const void*) = pick_cmp(table_state->col_types[col]);
-    rbt.compare = cmp;
-    struct darray entr = { 0 }, indx = { 0 };
-    size_t diff = (table_state->append_offset - table_state->header_offset); 
-    size_t len = diff / table_state->entry_raw_size;
-    // fprintf(stderr, "DIFF: %ld Len: %ld\n", diff, len);
-    size_t count = 0;
-    for (size_t i = 1; i < len; i++) {
-      void* entry = get_by_tindex(i, table_state);  
-      size_t used = 0;
-      if (((size_t*)entry)[RB_INDEX_COLOR] != -1) { // deleted row
-        if (rbt.compare(&rbt, value, entry) == 0) {
-          count++;
-          if (result) {
-            da_append(&entr, entry);
-            used = 1;
-          }
-          if (indices)
-            da_append(&indx, i);
-        }
-      }
-      if (!used) {
-        free(entry);
-      }
-    }
+    FIND_RESULT found = { 0 };
+    found.table_state = table_state;
+    found.result = result != NULL;
+    found.indices = indices != NULL;
+    size_t count = table_select(col, PRED_EQ, &((char*)value)[table_state->col_offsets[col]], table_state, find_collect, &found);
     if (result)
-      *result = entr.items;
+      *result = found.entr.items;
     if (indices)
-      *indices = indx.items;
+      *indices = found.indx.items;
     return count;
   }
 }
 
+// Calls func(entry, row, cookie) for every live row whose col is equal to
+// col of value, or for every live row if value is NULL. entry is only
+// valid during the call. Stops when func returns non-zero.
+// Returns number of rows passed to func
+size_t table_scan(size_t col, void* value, TABLE_STATE* table_state, int (*func)(void*, size_t, void*), void* cookie) {
+  return table_select(col, PRED_EQ, value ? &((char*)value)[table_state->col_offsets[col]] : NULL, table_state, func, cookie);
+}
+
 size_t beautiful_find_entry(size_t col, void* value, TABLE_STATE* table_state, void** result, size_t** indices) {
   char* query = get_by_tindex(0, table_state);
   memcpy(&query[table_state->col_offsets[col]], value, TYPE_SIZE(table_state->col_types[col]));
@@ -897,7 +1986,7 @@ size_t delete_entry(size_t col, void* value, TABLE_STATE* table_state) {
   se->data = malloc(sizeof(size_t) + size);
   memcpy(se->data, &col, sizeof(size_t));
   memcpy(&se->data[sizeof(size_t)], value, size);
-  da_append(&table_state->stage, se);
+  stage_push(table_state, se);
   return 0;
 }
 
@@ -909,16 +1998,97 @@ size_t edit_entry(size_t col, void* old_value, void* new_value, TABLE_STATE* tab
   memcpy(se->data, &col, sizeof(size_t));
   memcpy(&se->data[sizeof(size_t)], old_value, size);
   memcpy(&se->data[sizeof(size_t) + size], new_value, size);
-  da_append(&table_state->stage, se);
+  stage_push(table_state, se);
   return 0;
 }
 
+size_t delete_where(const PRED* where, TABLE_STATE* table_state) {
+  STAGE_EVENT *se = malloc(sizeof(STAGE_EVENT));
+  se->type = SE_DELETE_WHERE;
+  pred_serialize(where, &se->data);
+  stage_push(table_state, se);
+  return 0;
+}
+
+size_t edit_where(const PRED* where, size_t col, void* new_value, TABLE_STATE* table_state) {
+  size_t size = TYPE_SIZE(table_state->col_types[col]);
+  char* pred;
+  size_t pred_size = pred_serialize(where, &pred);
+  STAGE_EVENT *se = malloc(sizeof(STAGE_EVENT));
+  se->type = SE_EDIT_WHERE;
+  se->data = malloc(sizeof(size_t) + size + pred_size);
+  memcpy(se->data, &col, sizeof(size_t));
+  memcpy(&se->data[sizeof(size_t)], new_value, size);
+  memcpy(&se->data[sizeof(size_t) + size], pred, pred_size);
+  free(pred);
+  stage_push(table_state, se);
+  return 0;
+}
+
+// A full backup starts a chain of incremental backups of the table
 size_t create_backup(const char* file_name, const char* backup_name) {
-  archive(0, file_name, backup_name);
+  // the commit byte, taken through a description of its own: no commit
+  // lands between the copy, its log seq and the start of its chain
+  TABLE_STATE pin = { 0 };
+  pin.file_name = strdup(file_name);
+  lock_open(&pin);
+  table_lock(&pin, TABLE_LOCK_READ);
+  log_backup_point(file_name, backup_name);
+  size_t ret = archive(0, file_name, backup_name) != 0;
+  if (ret == 0)
+    dirty_chain_start(file_name, backup_name);
+  table_unlock(&pin);
+  lock_close(&pin);
+  free(pin.file_name);
+  return ret;
 }
 
 size_t restore_from_backup(const char* file_name, const char* backup_name) {
-  archive(1, file_name, backup_name);
+  return restore_backup_chain(file_name, backup_name);
+}
+
+// Reads count rows starting from first out of a full backup of the table
+// into buf, inflating only the blocks and pages that hold them. Returns
+// the number of rows read, the table may have had less rows then
+size_t backup_read_rows(const char* backup_name, size_t first, size_t count, void* buf, TABLE_STATE* table_state) {
+  size_t size = table_state->entry_raw_size;
+  return backup_table_pread(backup_name, buf, count * size, entry_offset(first, table_state)) / size;
+}
+
+// Stages the rows first to first + count of a full backup back into the
+// table: a row that was live then replaces the rows holding any of its
+// keys. Rows that were free in the backup are left alone. A table without
+// a key column has nothing to tell its rows apart by and is not restored
+// into. Returns the number of rows staged, to be committed by the caller
+size_t restore_rows_from_backup(const char* backup_name, size_t first, size_t count, TABLE_STATE* table_state) {
+  if (table_state->nkey_cols == 0)
+    return 0;
+  size_t size = table_state->entry_raw_size;
+  if (first == 0) { // the sentinel row
+    first++;
+    count = count ? count - 1 : 0;
+  }
+  char* rows = malloc(count * size);
+  count = backup_read_rows(backup_name, first, count, rows, table_state);
+  size_t staged = 0;
+  for (size_t i = 0; i < count; i++) {
+    char* row = &rows[i * size];
+    if (ENTRY_DELETED(row))
+      continue;
+    // the new row would break the uniqueness of every key it shares
+    for (size_t col = 0; col < table_state->ncols; col++)
+      if (IS_KEY(table_state->col_types[col]))
+        delete_entry(col, &row[table_state->col_offsets[col]], table_state);
+    STAGE_EVENT *se = malloc(sizeof(STAGE_EVENT));
+    se->type = SE_CREATE;
+    se->data = malloc(size);
+    memcpy(se->data, row, size);
+    memset(se->data, 0, table_state->entry_metadata_size);
+    stage_push(table_state, se);
+    staged++;
+  }
+  free(rows);
+  return staged;
 }
 
 #endif // TABLE_FILE_H_IMPLEMENTATION
@@ -9,6 +9,9 @@
 #define RB_DUP 1
 #define RB_MIN 1
 
+#define RB_ROOT_PTR 0
+#define RB_NIL_PTR ((size_t)-1)
+
 #define RED 0
 #define BLACK 1
 
@@ -40,7 +43,6 @@ typedef struct {
 
   size_t col;
   void* table_state;
-  void* copy_data;
 } rbtree;
 
 #define RB_ROOT(rbt) (&(rbt)->root)
@@ -55,7 +57,14 @@ rbtree *rb_create(int (*compare_func)(const void*, const void *, const void *),
 void rb_destroy(rbtree *rbt);
 
 size_t rb_find(rbtree *rbt, void *data);
+size_t rb_lower_bound(rbtree *rbt, void *data);
 size_t rb_successor(rbtree *rbt, size_t node_ptr);
+size_t rb_predecessor(rbtree *rbt, size_t node_ptr);
+size_t rb_min(rbtree *rbt);
+size_t rb_max(rbtree *rbt);
+size_t rb_count(rbtree *rbt);
+size_t rb_rank(rbtree *rbt, void *data);
+size_t rb_select(rbtree *rbt, size_t rank);
 
 int rb_apply_node(rbtree *rbt, size_t node_ptr, int (*func)(void *, void *), void *cookie, enum rbtraversal order);
 void rb_print(rbtree *rbt, void (*print_func)(void *));
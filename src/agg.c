@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <float.h>
+#include "file.h"
+
+// Values of a column are gathered from a block of rows into a dense array
+// and folded AGG_LANES at a time with GCC vector extensions
+
+#define AGG_LANES 8
+
+typedef int                v8i __attribute__((vector_size(AGG_LANES * sizeof(int))));
+typedef long long          v8l __attribute__((vector_size(AGG_LANES * sizeof(long long))));
+typedef float              v8f __attribute__((vector_size(AGG_LANES * sizeof(float))));
+typedef double             v8d __attribute__((vector_size(AGG_LANES * sizeof(double))));
+typedef unsigned long long v8u __attribute__((vector_size(AGG_LANES * sizeof(unsigned long long))));
+
+typedef struct {
+  size_t type;
+  size_t count;
+  long long isum;
+  double fsum;
+  int imin, imax;
+  float fmin, fmax;
+  size_t tmin, tmax; // datatime_key
+  size_t offset;     // of the column in a row
+  void* batch;       // gathered values of the current block
+  size_t nbatch;
+} AGG_STATE;
+
+static void kernel_int(const int* v, size_t n, AGG_STATE* st) {
+  v8l acc = { 0 };
+  v8i mn, mx;
+  for (size_t l = 0; l < AGG_LANES; l++) { mn[l] = st->imin; mx[l] = st->imax; }
+  size_t i = 0;
+  for (; i + AGG_LANES <= n; i += AGG_LANES) {
+    v8i x;
+    memcpy(&x, &v[i], sizeof(x));
+    acc += __builtin_convertvector(x, v8l);
+    v8i lt = x < mn, gt = x > mx;
+    mn = (x & lt) | (mn & ~lt);
+    mx = (x & gt) | (mx & ~gt);
+  }
+  for (size_t l = 0; l < AGG_LANES; l++) {
+    st->isum += acc[l];
+    if (mn[l] < st->imin) st->imin = mn[l];
+    if (mx[l] > st->imax) st->imax = mx[l];
+  }
+  for (; i < n; i++) {
+    st->isum += v[i];
+    if (v[i] < st->imin) st->imin = v[i];
+    if (v[i] > st->imax) st->imax = v[i];
+  }
+}
+
+static void kernel_float(const float* v, size_t n, AGG_STATE* st) {
+  v8d acc = { 0 };
+  v8f mn, mx;
+  for (size_t l = 0; l < AGG_LANES; l++) { mn[l] = st->fmin; mx[l] = st->fmax; }
+  size_t i = 0;
+  for (; i + AGG_LANES <= n; i += AGG_LANES) {
+    v8f x;
+    memcpy(&x, &v[i], sizeof(x));
+    acc += __builtin_convertvector(x, v8d);
+    v8i lt = x < mn, gt = x > mx;
+    mn = (v8f)(((v8i)x & lt) | ((v8i)mn & ~lt));
+    mx = (v8f)(((v8i)x & gt) | ((v8i)mx & ~gt));
+  }
+  for (size_t l = 0; l < AGG_LANES; l++) {
+    st->fsum += acc[l];
+    if (mn[l] < st->fmin) st->fmin = mn[l];
+    if (mx[l] > st->fmax) st->fmax = mx[l];
+  }
+  for (; i < n; i++) {
+    st->fsum += v[i];
+    if (v[i] < st->fmin) st->fmin = v[i];
+    if (v[i] > st->fmax) st->fmax = v[i];
+  }
+}
+
+static void kernel_datatime(const size_t* v, size_t n, AGG_STATE* st) {
+  v8u mn, mx;
+  for (size_t l = 0; l < AGG_LANES; l++) { mn[l] = st->tmin; mx[l] = st->tmax; }
+  size_t i = 0;
+  for (; i + AGG_LANES <= n; i += AGG_LANES) {
+    v8u x;
+    memcpy(&x, &v[i], sizeof(x));
+    v8u lt = (v8u)(x < mn), gt = (v8u)(x > mx);
+    mn = (x & lt) | (mn & ~lt);
+    mx = (x & gt) | (mx & ~gt);
+  }
+  for (size_t l = 0; l < AGG_LANES; l++) {
+    if (mn[l] < st->tmin) st->tmin = mn[l];
+    if (mx[l] > st->tmax) st->tmax = mx[l];
+  }
+  for (; i < n; i++) {
+    if (v[i] < st->tmin) st->tmin = v[i];
+    if (v[i] > st->tmax) st->tmax = v[i];
+  }
+}
+
+static void agg_flush(AGG_STATE* st) {
+  if (st->nbatch == 0)
+    return;
+  if (TYPE_NUMBER(st->type) == TABLE_TYPE_INT)
+    kernel_int(st->batch, st->nbatch, st);
+  if (TYPE_NUMBER(st->type) == TABLE_TYPE_FLOAT)
+    kernel_float(st->batch, st->nbatch, st);
+  if (TYPE_NUMBER(st->type) == TABLE_TYPE_DATATIME)
+    kernel_datatime(st->batch, st->nbatch, st);
+  st->count += st->nbatch;
+  st->nbatch = 0;
+}
+
+static void agg_gather(AGG_STATE* st, const unsigned char* value) {
+  if (TYPE_NUMBER(st->type) == TABLE_TYPE_INT)
+    ((int*)st->batch)[st->nbatch++] = *(int*)value;
+  if (TYPE_NUMBER(st->type) == TABLE_TYPE_FLOAT)
+    ((float*)st->batch)[st->nbatch++] = *(float*)value;
+  if (TYPE_NUMBER(st->type) == TABLE_TYPE_DATATIME)
+    ((size_t*)st->batch)[st->nbatch++] = datatime_key(value);
+  if (st->nbatch == ZMAP_BLOCK_ROWS)
+    agg_flush(st);
+}
+
+static int agg_row(void* entry, size_t row, void* cookie) {
+  AGG_STATE* st = cookie;
+  agg_gather(st, &((unsigned char*)entry)[st->offset]);
+  return 0;
+}
+
+static void datatime_from_key(size_t key, unsigned char* raw) {
+  size_t datatime = encode_datatime(key >> 52, (key >> 44) & 0xff, (key >> 36) & 0xff,
+                                    (key >> 28) & 0xff, (key >> 20) & 0xff, (key >> 12) & 0xff, key & 0xfff);
+  memcpy(raw, &datatime, DATATIME_SIZE);
+}
+
+static void agg_result(size_t op, AGG_STATE* st, AGG_RESULT* result) {
+  memset(result, 0, sizeof(AGG_RESULT));
+  result->count = st->count;
+  size_t number = TYPE_NUMBER(st->type);
+  double sum = number == TABLE_TYPE_INT ? (double)st->isum : st->fsum;
+  if (op == AGG_COUNT) result->value = st->count;
+  if (op == AGG_SUM)   result->value = sum;
+  if (op == AGG_AVG)   result->value = st->count ? sum / st->count : 0;
+  if (st->count == 0 || (op != AGG_MIN && op != AGG_MAX))
+    return;
+  if (number == TABLE_TYPE_INT) {
+    int v = op == AGG_MIN ? st->imin : st->imax;
+    memcpy(result->raw, &v, sizeof(int));
+    result->value = v;
+  }
+  if (number == TABLE_TYPE_FLOAT) {
+    float v = op == AGG_MIN ? st->fmin : st->fmax;
+    memcpy(result->raw, &v, sizeof(float));
+    result->value = v;
+  }
+  if (number == TABLE_TYPE_DATATIME) {
+    size_t v = op == AGG_MIN ? st->tmin : st->tmax;
+    datatime_from_key(v, result->raw);
+    result->value = v;
+  }
+}
+
+// MIN/MAX of a key column are the ends of its tree, COUNT is its size
+static size_t agg_from_index(size_t op, size_t col, TABLE_STATE* ts, AGG_RESULT* result) {
+  rbtree* rbt = ts->rb_trees[ts->key_col_relpos[col]];
+  AGG_STATE st = { 0 };
+  st.type = ts->col_types[col];
+  if (op == AGG_COUNT) {
+    st.count = rb_count(rbt);
+    agg_result(op, &st, result);
+    return 0;
+  }
+  size_t node_ptr = RB_NIL_PTR;
+  if (op == AGG_MIN)
+    node_ptr = rbt->min_ptr != RB_NIL_PTR ? rbt->min_ptr : rb_min(rbt);
+  else
+    node_ptr = rb_max(rbt);
+  if (node_ptr != RB_NIL_PTR) {
+    unsigned char* entry = get_by_tindex(node_ptr, ts);
+    st.imin = st.imax = *(int*)&entry[ts->col_offsets[col]];
+    st.fmin = st.fmax = *(float*)&entry[ts->col_offsets[col]];
+    st.tmin = st.tmax = datatime_key(&entry[ts->col_offsets[col]]);
+    st.count = 1;
+    free(entry);
+  }
+  agg_result(op, &st, result);
+  return 0;
+}
+
+// Sealed blocks are folded from their column segments, the blocks a
+// commit changed since and the rows after the last one from the rows
+static void aggregate_columns(size_t col, size_t pred_col, void* pred_value, TABLE_STATE* ts, AGG_STATE* st) {
+  size_t size = ts->entry_raw_size, pred_type = pred_value ? ts->col_types[pred_col] : 0;
+  size_t rows = row_count(ts);
+  char* buf = malloc(ZMAP_BLOCK_ROWS * size);
+  for (size_t first = 0; first < rows; first += ZMAP_BLOCK_ROWS) {
+    size_t end = first + ZMAP_BLOCK_ROWS < rows ? first + ZMAP_BLOCK_ROWS : rows;
+    agg_flush(st);
+    COLUMN_FOLD fold = { st->count, st->isum, st->fsum, st->imin, st->imax, st->fmin, st->fmax, st->tmin, st->tmax };
+    size_t from = first;
+    if (column_fold(ts, first / ZMAP_BLOCK_ROWS, col, pred_col, PRED_EQ, pred_value, &fold) == 0) {
+      st->count = fold.count; st->isum = fold.isum; st->fsum = fold.fsum;
+      st->imin = fold.imin; st->imax = fold.imax;
+      st->fmin = fold.fmin; st->fmax = fold.fmax;
+      st->tmin = fold.tmin; st->tmax = fold.tmax;
+      // rows appended to the last block after sealing
+      from = ts->columns->rows < end ? ts->columns->rows : end;
+    }
+    size_t n = end > from ? read_rows(from, end - from, buf, ts) : 0;
+    for (size_t i = from == 0; i < n; i++) {
+      char* entry = &buf[i * size];
+      if (!ENTRY_DELETED(entry) && (pred_value == NULL || pred_match(pred_type, PRED_EQ, &entry[ts->col_offsets[pred_col]], pred_value)))
+        agg_gather(st, (unsigned char*)&entry[st->offset]);
+    }
+  }
+  free(buf);
+}
+
+static size_t aggregate_table(size_t op, size_t col, size_t pred_col, void* pred_value, TABLE_STATE* ts, AGG_RESULT* result) {
+  size_t type = ts->col_types[col];
+  if (TYPE_NUMBER(type) == TABLE_TYPE_VARCHAR)
+    return 1;
+  if (TYPE_NUMBER(type) == TABLE_TYPE_DATATIME && (op == AGG_SUM || op == AGG_AVG))
+    return 1;
+  if (pred_value == NULL && key_tree(col, ts) && (op == AGG_MIN || op == AGG_MAX || op == AGG_COUNT))
+    return agg_from_index(op, col, ts, result);
+
+  AGG_STATE st = { 0 };
+  st.type = type;
+  st.imin = INT_MAX; st.imax = INT_MIN;
+  st.fmin = FLT_MAX; st.fmax = -FLT_MAX;
+  st.tmin = (size_t)-1; st.tmax = 0;
+  st.batch = malloc(ZMAP_BLOCK_ROWS * sizeof(size_t));
+  st.offset = ts->col_offsets[col];
+
+  if (ts->columns && !ts->snapshot && (pred_value == NULL || !key_tree(pred_col, ts))) {
+    aggregate_columns(col, pred_col, pred_value, ts, &st);
+    agg_flush(&st);
+    agg_result(op, &st, result);
+    free(st.batch);
+    return 0;
+  }
+  char* query = NULL;
+  if (pred_value) {
+    query = get_by_tindex(0, ts);
+    memcpy(&query[ts->col_offsets[pred_col]], pred_value, TYPE_SIZE(ts->col_types[pred_col]));
+  }
+  table_scan(pred_col, query, ts, agg_row, &st);
+  agg_flush(&st);
+  agg_result(op, &st, result);
+  free(st.batch);
+  if (query) free(query);
+  return 0;
+}
+
+// Computes op over col for the rows whose pred_col is equal to pred_value,
+// or over all rows if pred_value is NULL.
+// Returns 1 if op is not defined for the column type
+size_t aggregate(size_t op, size_t col, size_t pred_col, void* pred_value, TABLE_STATE* ts, AGG_RESULT* result) {
+  size_t latched = table_latch(ts, TABLE_LOCK_READ);
+  size_t ret = aggregate_table(op, col, pred_col, pred_value, ts, result);
+  table_unlatch(ts, latched);
+  return ret;
+}
@@ -0,0 +1,21 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+
+int main () {
+  TABLE_STATE table_state = { 0 };
+  open_table("data/table.bin", &table_state);
+  const char* names[] = { "COUNT", "SUM", "MIN", "MAX", "AVG" };
+  AGG_RESULT result;
+  for (size_t op = AGG_COUNT; op <= AGG_AVG; op++) {
+    aggregate(op, 1, 0, NULL, &table_state, &result);
+    printf("%s(height) = %f\n", names[op], result.value);
+  }
+  aggregate(AGG_MIN, 0, 0, NULL, &table_state, &result);
+  printf("MIN(id) = %d\n", *(int*)result.raw);
+  aggregate(AGG_MAX, 0, 0, NULL, &table_state, &result);
+  printf("MAX(id) = %d\n", *(int*)result.raw);
+  printf("\n");
+  close_table(&table_state);
+  
+  return 0;
+}
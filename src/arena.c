@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "file.h"
+
+void* arena_alloc(ARENA* arena, size_t size) {
+  size = (size + 7) & ~(size_t)7;
+  ARENA_BLOCK* block = arena->head;
+  if (block == NULL || block->used + size > block->size) {
+    size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block = malloc(sizeof(ARENA_BLOCK) + block_size);
+    block->next = arena->head;
+    block->used = 0;
+    block->size = block_size;
+    arena->head = block;
+    arena->allocated += sizeof(ARENA_BLOCK) + block_size;
+  }
+  void* ptr = &block->data[block->used];
+  block->used += size;
+  return ptr;
+}
+
+void arena_free(ARENA* arena) {
+  while (arena->head) {
+    ARENA_BLOCK* next = arena->head->next;
+    free(arena->head);
+    arena->head = next;
+  }
+  arena->allocated = 0;
+}
@@ -0,0 +1,637 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "file.h"
+
+// Sidecar view
+// [0]   "ARTX"
+// [4]   [size_t] generation of the commit on the moment of saving
+// [..]  [size_t] row count of the table on the moment of saving
+// [..]  [size_t] number of indexes
+// ...   per index: [size_t] col, [unsigned char] 1 if there is a root, nodes
+//
+// Node, children follow their parent (pre-order)
+// [unsigned char] kind, [size_t] leaves, [size_t] prefix_len, prefix
+// leaf:  [size_t] row
+// inner: [size_t] count, count * ([unsigned char] byte, child)
+
+#define ART_MAGIC "ARTX"
+
+typedef struct {
+  size_t count, capacity;
+  size_t* items;
+} ART_ROWS;
+
+// Keys are the string with its terminating 0, so no key is a prefix of
+// another one and every inner node has a byte to branch on
+static unsigned char* art_key(const void* value, size_t size, size_t* len) {
+  size_t n = strnlen(value, size);
+  unsigned char* key = malloc(n + 1);
+  memcpy(key, value, n);
+  key[n] = 0;
+  *len = n + 1;
+  return key;
+}
+
+static size_t node_capacity(unsigned char kind) {
+  if (kind == ART_NODE4) return 4;
+  if (kind == ART_NODE16) return 16;
+  if (kind == ART_NODE48) return 48;
+  return 256;
+}
+
+static ART_NODE* node_new(unsigned char kind) {
+  ART_NODE* n = calloc(1, sizeof(ART_NODE));
+  n->kind = kind;
+  if (kind == ART_LEAF)
+    return n;
+  n->children = calloc(node_capacity(kind), sizeof(ART_NODE*));
+  if (kind == ART_NODE48)
+    n->keys = calloc(256, 1);
+  else if (kind != ART_NODE256)
+    n->keys = calloc(node_capacity(kind), 1);
+  return n;
+}
+
+static ART_NODE* leaf_new(const unsigned char* key, size_t len, size_t row) {
+  ART_NODE* leaf = node_new(ART_LEAF);
+  leaf->prefix = malloc(len);
+  memcpy(leaf->prefix, key, len);
+  leaf->prefix_len = len;
+  leaf->leaves = 1;
+  leaf->row = row;
+  return leaf;
+}
+
+static void node_free(ART_NODE* n) {
+  if (n == NULL)
+    return;
+  if (n->kind != ART_LEAF) {
+    for (size_t i = 0; i < node_capacity(n->kind); i++)
+      node_free(n->children[i]);
+  }
+  free(n->children);
+  free(n->keys);
+  free(n->prefix);
+  free(n);
+}
+
+static void node_free_shallow(ART_NODE* n) {
+  free(n->children);
+  free(n->keys);
+  free(n->prefix);
+  free(n);
+}
+
+// Slot of the child for byte, NULL if there is none
+static ART_NODE** find_child(ART_NODE* n, unsigned char byte) {
+  switch (n->kind) {
+  case ART_NODE4:
+  case ART_NODE16:
+    for (size_t i = 0; i < n->count; i++) {
+      if (n->keys[i] == byte)
+        return &n->children[i];
+      if (n->keys[i] > byte)
+        break;
+    }
+    return NULL;
+  case ART_NODE48:
+    return n->keys[byte] ? &n->children[n->keys[byte] - 1] : NULL;
+  case ART_NODE256:
+    return n->children[byte] ? &n->children[byte] : NULL;
+  }
+  return NULL;
+}
+
+// Moves the children of n into a node of another kind, in byte order
+static ART_NODE* node_resize(ART_NODE* n, unsigned char kind) {
+  ART_NODE* m = node_new(kind);
+  m->leaves = n->leaves;
+  m->prefix = n->prefix;
+  m->prefix_len = n->prefix_len;
+  n->prefix = NULL;
+  for (size_t b = 0; b < 256; b++) {
+    ART_NODE** child = find_child(n, b);
+    if (child == NULL)
+      continue;
+    if (kind == ART_NODE256) {
+      m->children[b] = *child;
+    } else if (kind == ART_NODE48) {
+      m->children[m->count] = *child;
+      m->keys[b] = m->count + 1;
+    } else {
+      m->keys[m->count] = b;
+      m->children[m->count] = *child;
+    }
+    m->count++;
+  }
+  node_free_shallow(n);
+  return m;
+}
+
+static void add_child(ART_NODE** ref, unsigned char byte, ART_NODE* child) {
+  ART_NODE* n = *ref;
+  if (n->count == node_capacity(n->kind))
+    n = *ref = node_resize(n, n->kind == ART_NODE4 ? ART_NODE16 : n->kind == ART_NODE16 ? ART_NODE48 : ART_NODE256);
+  if (n->kind == ART_NODE256) {
+    n->children[byte] = child;
+  } else if (n->kind == ART_NODE48) {
+    size_t slot = 0;
+    while (n->children[slot]) slot++;
+    n->children[slot] = child;
+    n->keys[byte] = slot + 1;
+  } else {
+    size_t i = 0;
+    while (i < n->count && n->keys[i] < byte) i++;
+    memmove(&n->keys[i + 1], &n->keys[i], n->count - i);
+    memmove(&n->children[i + 1], &n->children[i], (n->count - i) * sizeof(ART_NODE*));
+    n->keys[i] = byte;
+    n->children[i] = child;
+  }
+  n->count++;
+}
+
+// Unlinks the child for byte, shrinks the node or merges a single child
+// into it. The child itself is not freed
+static void remove_child(ART_NODE** ref, unsigned char byte) {
+  ART_NODE* n = *ref;
+  if (n->kind == ART_NODE256) {
+    n->children[byte] = NULL;
+  } else if (n->kind == ART_NODE48) {
+    n->children[n->keys[byte] - 1] = NULL;
+    n->keys[byte] = 0;
+  } else {
+    size_t i = find_child(n, byte) - n->children;
+    memmove(&n->keys[i], &n->keys[i + 1], n->count - i - 1);
+    memmove(&n->children[i], &n->children[i + 1], (n->count - i - 1) * sizeof(ART_NODE*));
+    n->children[n->count - 1] = NULL;
+  }
+  n->count--;
+
+  // fewer children than the smaller kind holds, with some slack against flapping
+  if (n->kind == ART_NODE256 && n->count <= 40)
+    *ref = node_resize(n, ART_NODE48);
+  else if (n->kind == ART_NODE48 && n->count <= 12)
+    *ref = node_resize(n, ART_NODE16);
+  else if (n->kind == ART_NODE16 && n->count <= 3)
+    *ref = node_resize(n, ART_NODE4);
+  else if (n->kind == ART_NODE4 && n->count == 1) {
+    // path compression: the only child takes over the prefix and its byte
+    ART_NODE* child = n->children[0];
+    if (child->kind != ART_LEAF) {
+      unsigned char* prefix = malloc(n->prefix_len + 1 + child->prefix_len);
+      memcpy(prefix, n->prefix, n->prefix_len);
+      prefix[n->prefix_len] = n->keys[0];
+      memcpy(&prefix[n->prefix_len + 1], child->prefix, child->prefix_len);
+      free(child->prefix);
+      child->prefix = prefix;
+      child->prefix_len += n->prefix_len + 1;
+    }
+    node_free_shallow(n);
+    *ref = child;
+  }
+}
+
+static size_t prefix_mismatch(const ART_NODE* n, const unsigned char* key, size_t len, size_t depth) {
+  size_t i = 0;
+  while (i < n->prefix_len && depth + i < len && n->prefix[i] == key[depth + i]) i++;
+  return i;
+}
+
+// 1 if a leaf was added, 0 if the key was there and got the new row
+static size_t insert(ART_NODE** ref, const unsigned char* key, size_t len, size_t depth, size_t row) {
+  ART_NODE* n = *ref;
+  if (n == NULL) {
+    *ref = leaf_new(key, len, row);
+    return 1;
+  }
+  if (n->kind == ART_LEAF) {
+    if (n->prefix_len == len && memcmp(n->prefix, key, len) == 0) {
+      n->row = row;
+      return 0;
+    }
+    // both keys end with their own 0, they differ before either runs out
+    size_t lcp = 0;
+    while (n->prefix[depth + lcp] == key[depth + lcp]) lcp++;
+    ART_NODE* inner = node_new(ART_NODE4);
+    inner->prefix_len = lcp;
+    inner->prefix = malloc(lcp ? lcp : 1);
+    memcpy(inner->prefix, &key[depth], lcp);
+    inner->leaves = 2;
+    *ref = inner;
+    add_child(ref, n->prefix[depth + lcp], n);
+    add_child(ref, key[depth + lcp], leaf_new(key, len, row));
+    return 1;
+  }
+  if (n->prefix_len) {
+    size_t p = prefix_mismatch(n, key, len, depth);
+    if (p < n->prefix_len) {
+      // the key leaves the compressed path, split it at the mismatch
+      ART_NODE* inner = node_new(ART_NODE4);
+      inner->prefix_len = p;
+      inner->prefix = malloc(p ? p : 1);
+      memcpy(inner->prefix, n->prefix, p);
+      inner->leaves = n->leaves + 1;
+      unsigned char byte = n->prefix[p];
+      memmove(n->prefix, &n->prefix[p + 1], n->prefix_len - p - 1);
+      n->prefix_len -= p + 1;
+      *ref = inner;
+      add_child(ref, byte, n);
+      add_child(ref, key[depth + p], leaf_new(key, len, row));
+      return 1;
+    }
+    depth += n->prefix_len;
+  }
+  ART_NODE** child = find_child(n, key[depth]);
+  if (child) {
+    size_t added = insert(child, key, len, depth + 1, row);
+    n->leaves += added;
+    return added;
+  }
+  n->leaves++;
+  add_child(ref, key[depth], leaf_new(key, len, row));
+  return 1;
+}
+
+// 1 if the key was removed
+static size_t delete(ART_NODE** ref, const unsigned char* key, size_t len, size_t depth) {
+  ART_NODE* n = *ref;
+  if (n == NULL)
+    return 0;
+  if (n->kind == ART_LEAF) {
+    if (n->prefix_len != len || memcmp(n->prefix, key, len) != 0)
+      return 0;
+    node_free(n);
+    *ref = NULL;
+    return 1;
+  }
+  if (prefix_mismatch(n, key, len, depth) != n->prefix_len)
+    return 0;
+  depth += n->prefix_len;
+  if (depth >= len)
+    return 0;
+  unsigned char byte = key[depth];
+  ART_NODE** child = find_child(n, byte);
+  if (child == NULL || !delete(child, key, len, depth + 1))
+    return 0;
+  n->leaves--;
+  if (*child == NULL)
+    remove_child(ref, byte);
+  return 1;
+}
+
+static ART_NODE* search(ART_NODE* n, const unsigned char* key, size_t len) {
+  size_t depth = 0;
+  while (n && n->kind != ART_LEAF) {
+    if (prefix_mismatch(n, key, len, depth) != n->prefix_len)
+      return NULL;
+    depth += n->prefix_len;
+    if (depth >= len)
+      return NULL;
+    ART_NODE** child = find_child(n, key[depth]);
+    n = child ? *child : NULL;
+    depth++;
+  }
+  if (n && n->prefix_len == len && memcmp(n->prefix, key, len) == 0)
+    return n;
+  return NULL;
+}
+
+// Topmost node whose keys all start with prefix, NULL if no key does
+static ART_NODE* search_prefix(ART_NODE* n, const unsigned char* prefix, size_t len) {
+  size_t depth = 0;
+  while (n && depth < len) {
+    if (n->kind == ART_LEAF)
+      return n->prefix_len >= len && memcmp(n->prefix, prefix, len) == 0 ? n : NULL;
+    size_t p = prefix_mismatch(n, prefix, len, depth);
+    if (depth + p == len)
+      return n;
+    if (p < n->prefix_len)
+      return NULL;
+    depth += n->prefix_len;
+    ART_NODE** child = find_child(n, prefix[depth]);
+    n = child ? *child : NULL;
+    depth++;
+  }
+  return n;
+}
+
+// Rows of the leaves below n in key order
+static void collect(ART_NODE* n, ART_ROWS* rows) {
+  if (n->kind == ART_LEAF) {
+    da_append(rows, n->row);
+    return;
+  }
+  for (size_t b = 0; b < 256; b++) {
+    ART_NODE** child = find_child(n, b);
+    if (child) collect(*child, rows);
+  }
+}
+
+static void node_write(const ART_NODE* n, FILE* file) {
+  fwrite(&n->kind, 1, 1, file);
+  fwrite(&n->leaves, sizeof(size_t), 1, file);
+  fwrite(&n->prefix_len, sizeof(size_t), 1, file);
+  fwrite(n->prefix, 1, n->prefix_len, file);
+  if (n->kind == ART_LEAF) {
+    fwrite(&n->row, sizeof(size_t), 1, file);
+    return;
+  }
+  size_t count = n->count;
+  fwrite(&count, sizeof(size_t), 1, file);
+  for (size_t b = 0; b < 256; b++) {
+    ART_NODE** child = find_child((ART_NODE*)n, b);
+    if (child == NULL)
+      continue;
+    unsigned char byte = b;
+    fwrite(&byte, 1, 1, file);
+    node_write(*child, file);
+  }
+}
+
+static ART_NODE* node_read(FILE* file) {
+  unsigned char kind;
+  size_t leaves, prefix_len;
+  if (fread(&kind, 1, 1, file) != 1 || kind > ART_NODE256)
+    return NULL;
+  if (!fread(&leaves, sizeof(size_t), 1, file) || !fread(&prefix_len, sizeof(size_t), 1, file))
+    return NULL;
+  ART_NODE* n = node_new(kind);
+  n->leaves = leaves;
+  n->prefix_len = prefix_len;
+  n->prefix = malloc(prefix_len ? prefix_len : 1);
+  if (fread(n->prefix, 1, prefix_len, file) != prefix_len) {
+    node_free(n);
+    return NULL;
+  }
+  if (kind == ART_LEAF) {
+    if (!fread(&n->row, sizeof(size_t), 1, file)) {
+      node_free(n);
+      return NULL;
+    }
+    return n;
+  }
+  size_t count;
+  if (!fread(&count, sizeof(size_t), 1, file) || count > node_capacity(kind)) {
+    node_free(n);
+    return NULL;
+  }
+  for (size_t i = 0; i < count; i++) {
+    unsigned char byte;
+    ART_NODE* child = fread(&byte, 1, 1, file) == 1 ? node_read(file) : NULL;
+    if (child == NULL || find_child(n, byte)) {
+      node_free(child);
+      node_free(n);
+      return NULL;
+    }
+    add_child(&n, byte, child);
+  }
+  return n;
+}
+
+static void index_build(ART_INDEX* ai, TABLE_STATE* ts) {
+  size_t len = row_count(ts);
+  size_t offset = ts->col_offsets[ai->col];
+  size_t size = TYPE_SIZE(ts->col_types[ai->col]);
+  char* block = malloc(ZMAP_BLOCK_ROWS * ts->entry_raw_size);
+  for (size_t first = 1, last; first < len; first = last) {
+    last = first + ZMAP_BLOCK_ROWS;
+    if (last > len) last = len;
+    read_rows(first, last - first, block, ts);
+    for (size_t i = first; i < last; i++) {
+      char* entry = &block[(i - first) * ts->entry_raw_size];
+      if (ENTRY_DELETED(entry))
+        continue;
+      size_t klen;
+      unsigned char* key = art_key(&entry[offset], size, &klen);
+      insert(&ai->root, key, klen, 0, i);
+      free(key);
+    }
+  }
+  free(block);
+}
+
+static ART_INDEXES* indexes(TABLE_STATE* ts) {
+  if (ts->art_indexes == NULL) {
+    ts->art_indexes = malloc(sizeof(ART_INDEXES));
+    memset(ts->art_indexes, 0, sizeof(ART_INDEXES));
+  }
+  return ts->art_indexes;
+}
+
+ART_INDEX* art_index_get(size_t col, TABLE_STATE* ts) {
+  ART_INDEXES* ais = ts->art_indexes;
+  if (ais == NULL)
+    return NULL;
+  for (size_t i = 0; i < ais->count; i++) {
+    if (ais->items[i].col == col)
+      return &ais->items[i];
+  }
+  return NULL;
+}
+
+// 0 on success, 1 if col is not a VARCHAR key or already indexed
+size_t art_index_create(size_t col, TABLE_STATE* ts) {
+  assert(col < ts->ncols);
+  size_t type = ts->col_types[col];
+  if (!IS_KEY(type) || TYPE_NUMBER(type) != TABLE_TYPE_VARCHAR || art_index_get(col, ts))
+    return 1;
+  ART_INDEX ai = { 0 };
+  ai.col = col;
+  index_build(&ai, ts);
+  size_t latched = table_latch(ts, TABLE_LOCK_WRITE);
+  ART_INDEXES* ais = indexes(ts);
+  ais->items = realloc(ais->items, (ais->count + 1) * sizeof(ART_INDEX));
+  ais->items[ais->count++] = ai;
+  ais->dirty = 1;
+  art_indexes_save(ts);
+  table_unlatch(ts, latched);
+  return 0;
+}
+
+size_t art_index_drop(size_t col, TABLE_STATE* ts) {
+  size_t latched = table_latch(ts, TABLE_LOCK_WRITE);
+  ART_INDEX* ai = art_index_get(col, ts);
+  if (ai == NULL) {
+    table_unlatch(ts, latched);
+    return 1;
+  }
+  ART_INDEXES* ais = ts->art_indexes;
+  node_free(ai->root);
+  size_t i = ai - ais->items;
+  memmove(&ais->items[i], &ais->items[i + 1], (ais->count - i - 1) * sizeof(ART_INDEX));
+  ais->count--;
+  ais->dirty = 1;
+  art_indexes_save(ts);
+  table_unlatch(ts, latched);
+  return 0;
+}
+
+// Row holding the bare value in col, 0 if there is none
+size_t art_find(size_t col, const void* value, TABLE_STATE* ts) {
+  size_t latched = table_latch(ts, TABLE_LOCK_READ);
+  ART_INDEX* ai = art_index_get(col, ts);
+  assert(ai);
+  size_t len;
+  unsigned char* key = art_key(value, TYPE_SIZE(ts->col_types[col]), &len);
+  ART_NODE* leaf = search(ai->root, key, len);
+  size_t row = leaf ? leaf->row : 0;
+  table_unlatch(ts, latched);
+  free(key);
+  return row;
+}
+
+// Number of rows whose col starts with prefix, read off one node
+size_t art_prefix_count(size_t col, const char* prefix, TABLE_STATE* ts) {
+  size_t latched = table_latch(ts, TABLE_LOCK_READ);
+  ART_INDEX* ai = art_index_get(col, ts);
+  assert(ai);
+  ART_NODE* n = search_prefix(ai->root, (const unsigned char*)prefix, strlen(prefix));
+  size_t count = n ? n->leaves : 0;
+  table_unlatch(ts, latched);
+  return count;
+}
+
+// Rows whose col starts with prefix in key order, *rows has to be freed
+// if the count is not 0
+size_t art_prefix_rows(size_t col, const char* prefix, TABLE_STATE* ts, size_t** rows) {
+  size_t latched = table_latch(ts, TABLE_LOCK_READ);
+  ART_INDEX* ai = art_index_get(col, ts);
+  assert(ai);
+  ART_ROWS found = { 0 };
+  ART_NODE* n = search_prefix(ai->root, (const unsigned char*)prefix, strlen(prefix));
+  if (n)
+    collect(n, &found);
+  table_unlatch(ts, latched);
+  *rows = found.items;
+  return found.count;
+}
+
+void art_indexes_open(TABLE_STATE* ts) {
+  char* name = sidecar_name(ts->file_name, "art");
+  FILE* file = fopen(name, "rb");
+  free(name);
+  if (file == NULL)
+    return;
+  ART_INDEXES* ais = indexes(ts);
+  char magic[4];
+  size_t gen, nrows, count;
+  size_t ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, ART_MAGIC, 4) == 0;
+  ok = ok && fread(&gen, sizeof(size_t), 1, file);
+  ok = ok && fread(&nrows, sizeof(size_t), 1, file);
+  ok = ok && fread(&count, sizeof(size_t), 1, file);
+  size_t stale = ok && (gen != table_generation(ts) || nrows != row_count(ts));
+  if (ok) {
+    ais->items = calloc(count ? count : 1, sizeof(ART_INDEX));
+    for (size_t i = 0; ok && i < count; i++) {
+      ART_INDEX* ai = &ais->items[ais->count++];
+      unsigned char has_root;
+      ok = ok && fread(&ai->col, sizeof(size_t), 1, file) && ai->col < ts->ncols;
+      ok = ok && fread(&has_root, 1, 1, file) == 1;
+      if (ok && has_root && !stale)
+        ok = (ai->root = node_read(file)) != NULL;
+    }
+  }
+  fclose(file);
+  // table was changed without the indexes, build them again
+  if (!ok || stale) {
+    for (size_t i = 0; i < ais->count; i++) {
+      node_free(ais->items[i].root);
+      ais->items[i].root = NULL;
+      if (ok) index_build(&ais->items[i], ts);
+    }
+    if (!ok) ais->count = 0;
+    ais->dirty = 1;
+  }
+}
+
+void art_indexes_save(TABLE_STATE* ts) {
+  ART_INDEXES* ais = ts->art_indexes;
+  if (ais == NULL)
+    return;
+  if (!ais->dirty) {
+    sidecar_restamp(ts, "art");
+    return;
+  }
+  char* name = sidecar_name(ts->file_name, "art");
+  if (ais->count == 0) {
+    unlink(name);
+    free(name);
+    ais->dirty = 0;
+    return;
+  }
+  FILE* file = fopen(name, "wb");
+  free(name);
+  if (file == NULL)
+    return;
+  size_t gen = table_generation(ts), nrows = row_count(ts);
+  fwrite(ART_MAGIC, 1, 4, file);
+  fwrite(&gen, sizeof(size_t), 1, file);
+  fwrite(&nrows, sizeof(size_t), 1, file);
+  fwrite(&ais->count, sizeof(size_t), 1, file);
+  for (size_t i = 0; i < ais->count; i++) {
+    ART_INDEX* ai = &ais->items[i];
+    unsigned char has_root = ai->root != NULL;
+    fwrite(&ai->col, sizeof(size_t), 1, file);
+    fwrite(&has_root, 1, 1, file);
+    if (has_root)
+      node_write(ai->root, file);
+  }
+  fclose(file);
+  ais->dirty = 0;
+}
+
+void art_indexes_close(TABLE_STATE* ts) {
+  ART_INDEXES* ais = ts->art_indexes;
+  if (ais == NULL)
+    return;
+  for (size_t i = 0; i < ais->count; i++)
+    node_free(ais->items[i].root);
+  free(ais->items);
+  free(ais);
+  ts->art_indexes = NULL;
+}
+
+void art_row_written(TABLE_STATE* ts, size_t row, const void* entry) {
+  ART_INDEXES* ais = ts->art_indexes;
+  if (ais == NULL)
+    return;
+  for (size_t i = 0; i < ais->count; i++) {
+    ART_INDEX* ai = &ais->items[i];
+    size_t len;
+    unsigned char* key = art_key(&((const char*)entry)[ts->col_offsets[ai->col]], TYPE_SIZE(ts->col_types[ai->col]), &len);
+    insert(&ai->root, key, len, 0, row);
+    free(key);
+    ais->dirty = 1;
+  }
+}
+
+// old_value is the bare value col had before
+void art_value_written(TABLE_STATE* ts, size_t row, size_t col, const void* old_value, const void* entry) {
+  ART_INDEX* ai = art_index_get(col, ts);
+  if (ai == NULL)
+    return;
+  size_t size = TYPE_SIZE(ts->col_types[col]), len;
+  unsigned char* key = art_key(old_value, size, &len);
+  delete(&ai->root, key, len, 0);
+  free(key);
+  key = art_key(&((const char*)entry)[ts->col_offsets[col]], size, &len);
+  insert(&ai->root, key, len, 0, row);
+  free(key);
+  ts->art_indexes->dirty = 1;
+}
+
+void art_row_deleted(TABLE_STATE* ts, size_t row) {
+  ART_INDEXES* ais = ts->art_indexes;
+  if (ais == NULL || ais->count == 0)
+    return;
+  char* entry = get_by_tindex(row, ts);
+  for (size_t i = 0; i < ais->count; i++) {
+    ART_INDEX* ai = &ais->items[i];
+    size_t len;
+    unsigned char* key = art_key(&entry[ts->col_offsets[ai->col]], TYPE_SIZE(ts->col_types[ai->col]), &len);
+    delete(&ai->root, key, len, 0);
+    free(key);
+    ais->dirty = 1;
+  }
+  free(entry);
+}
@@ -1,9 +1,212 @@
 #define TABLE_FILE_H_IMPLEMENTATION
 #include "file.h"
+#include <pthread.h>
+
+#define ROWS 12000
+
+// 1 if both files hold the same bytes
+static int same_file(const char* a, const char* b) {
+  FILE* fa = fopen(a, "rb");
+  FILE* fb = fopen(b, "rb");
+  int same = fa && fb;
+  char ba[4096], bb[4096];
+  while (same) {
+    size_t na = fread(ba, 1, sizeof(ba), fa);
+    size_t nb = fread(bb, 1, sizeof(bb), fb);
+    same = na == nb && memcmp(ba, bb, na) == 0;
+    if (na == 0)
+      break;
+  }
+  if (fa) fclose(fa);
+  if (fb) fclose(fb);
+  return same;
+}
+
+static long file_size(const char* name) {
+  FILE* file = fopen(name, "rb");
+  fseek(file, 0L, SEEK_END);
+  long size = ftell(file);
+  fclose(file);
+  return size;
+}
+
+// Writes pairs of notes, ids i and PAIRS + i, in one commit each until
+// the backup is done. A backup of one commit holds both notes of a pair
+#define PAIRS 100
+
+typedef struct {
+  TABLE_STATE* ts;
+  volatile int stop;
+  size_t commits;
+} PAIR_WRITER;
+
+static void* pair_writer(void* arg) {
+  PAIR_WRITER* pw = arg;
+  char note[200];
+  while (!pw->stop) {
+    int id = pw->commits % PAIRS, pair = PAIRS + id;
+    snprintf(note, sizeof(note), "pair note of commit %ld", pw->commits);
+    PRED* where = pred_or(pred_cmp(0, PRED_EQ, &id, pw->ts), pred_cmp(0, PRED_EQ, &pair, pw->ts));
+    edit_where(where, 1, note, pw->ts);
+    pred_free(where);
+    commit_changes(pw->ts);
+    pw->commits++;
+  }
+  return NULL;
+}
 
 int main () {
   create_backup("data/table.bin", "data/table.backup");
   restore_from_backup("data/table.restore", "data/table.backup");
-  
+  printf("table.bin restored %s\n", same_file("data/table.bin", "data/table.restore") ? "identical" : "different");
+
+  // a table of several blocks, compressed and restored in parallel
+  const char* file_name = "data/notes.bin";
+  size_t col_types[2] = {
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int)) | KEY_FIELD,
+    MAKE_TYPE(TABLE_TYPE_VARCHAR, 200)
+  };
+  const char* col_names[] = { "id", "note" };
+  if (access(file_name, F_OK) == 0)
+    delete_table(file_name);
+  create_table(2, 32, col_types, col_names, file_name);
+  TABLE_STATE ts = { 0 };
+  open_table(file_name, &ts);
+  char note[200];
+  for (int i = 0; i < ROWS; i++) {
+    snprintf(note, sizeof(note), "note %d of customer %d, follow up in %d days", i, (i * 7919) % 1000, i % 30);
+    create_entry(&ts, 2, i, note);
+  }
+  commit_changes(&ts);
+  create_backup(file_name, "data/notes.backup");
+  restore_from_backup("data/notes.restore", "data/notes.backup");
+  long size = file_size(file_name);
+  printf("notes.bin: %ld blocks, %ld%% of %ld bytes, restored %s\n",
+    (size + (1 << 20) - 1) >> 20, file_size("data/notes.backup") * 100 / size, size,
+    same_file(file_name, "data/notes.restore") ? "identical" : "different");
+
+  // rows are read and recovered out of the backup without inflating it all
+  char* row = malloc(ts.entry_raw_size);
+  backup_read_rows("data/notes.backup", 5000, 1, row, &ts);
+  printf("row 5000 of the backup: %d, \"%s\"\n", *(int*)&row[ts.col_offsets[0]], &row[ts.col_offsets[1]]);
+  free(row);
+  for (int id = 100; id < 110; id++)
+    delete_entry(0, &id, &ts);
+  commit_changes(&ts);
+  restore_rows_from_backup("data/notes.backup", 101, 10, &ts);
+  commit_changes(&ts);
+  size_t recovered = 0;
+  for (int id = 100; id < 110; id++) {
+    void* entries;
+    if (!beautiful_find_entry(0, &id, &ts, &entries, NULL))
+      continue;
+    char* entry = ((void**)entries)[0];
+    snprintf(note, sizeof(note), "note %d of customer %d, follow up in %d days", id, (id * 7919) % 1000, id % 30);
+    recovered += strcmp(&entry[ts.col_offsets[1]], note) == 0;
+    free(entry);
+    free(entries);
+  }
+  printf("rows 101 to 110 recovered from the backup: %ld of 10\n", recovered);
+
+  // incremental backups hold the pages commits wrote since the last backup
+  for (int round = 1; round <= 2; round++) {
+    for (int i = 0; i < 10; i++) {
+      int id = (i * 1231 + round * 7) % ROWS;
+      snprintf(note, sizeof(note), "note %d edited in round %d", id, round);
+      PRED* where = pred_cmp(0, PRED_EQ, &id, &ts);
+      edit_where(where, 1, note, &ts);
+      pred_free(where);
+    }
+    int id = ROWS + round;
+    create_entry(&ts, 2, id, "a new note");
+    commit_changes(&ts);
+    char delta[64];
+    snprintf(delta, sizeof(delta), "data/notes.backup.%d", round);
+    create_incremental_backup(file_name, "data/notes.backup");
+    printf("incremental backup %d: %ld bytes\n", round, file_size(delta));
+  }
+  close_table(&ts);
+  restore_from_backup("data/notes.restore", "data/notes.backup");
+  printf("notes.bin restored from the chain %s\n", same_file(file_name, "data/notes.restore") ? "identical" : "different");
+  unlink("data/notes.restore");
+
+  // an online backup holds one commit while a writer goes on committing
+  ts = (TABLE_STATE){ 0 };
+  open_table(file_name, &ts);
+  mvcc_enable(&ts);
+  PAIR_WRITER pw = { .ts = &ts };
+  pthread_t thread;
+  pthread_create(&thread, NULL, pair_writer, &pw);
+  while (pw.commits < PAIRS)
+    usleep(1000);
+  size_t seq, before = pw.commits;
+  create_online_backup(file_name, "data/notes.online", 8 << 20, &seq);
+  size_t during = pw.commits - before;
+  pw.stop = 1;
+  pthread_join(thread, NULL);
+  close_table(&ts);
+  restore_from_backup("data/notes.restore", "data/notes.online");
+  TABLE_STATE restored = { 0 };
+  open_table("data/notes.restore", &restored);
+  size_t pairs = 0;
+  for (int id = 0; id < PAIRS; id++) {
+    int pair = PAIRS + id;
+    void *a, *b;
+    if (beautiful_find_entry(0, &id, &restored, &a, NULL) && beautiful_find_entry(0, &pair, &restored, &b, NULL)) {
+      char* ea = ((void**)a)[0];
+      char* eb = ((void**)b)[0];
+      pairs += strcmp(&ea[restored.col_offsets[1]], &eb[restored.col_offsets[1]]) == 0;
+      free(ea); free(eb); free(a); free(b);
+    }
+  }
+  printf("online backup with commits going on: %s, %ld of %d pairs match, %s\n",
+    during ? "writer not stopped" : "writer stopped", pairs, PAIRS,
+    rb_check_black_height(restored.rb_trees[0]) ? "tree ok" : "tree broken");
+  close_table(&restored);
+  delete_table("data/notes.restore");
+  unlink("data/notes.online");
+
+  // a table restored over itself builds its bitmap index again
+  const char* groups = "data/groups.bin";
+  size_t group_types[2] = {
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int)) | KEY_FIELD,
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int))
+  };
+  const char* group_names[] = { "id", "grp" };
+  if (access(groups, F_OK) == 0)
+    delete_table(groups);
+  create_table(2, 32, group_types, group_names, groups);
+  ts = (TABLE_STATE){ 0 };
+  open_table(groups, &ts);
+  bitmap_index_create(1, &ts);
+  for (int i = 0; i < 100; i++)
+    create_entry(&ts, 2, i, 5);
+  commit_changes(&ts);
+  create_backup(groups, "data/groups.backup");
+  int five = 5, seven = 7;
+  PRED* where = pred_cmp(1, PRED_EQ, &five, &ts);
+  edit_where(where, 1, &seven, &ts);
+  pred_free(where);
+  commit_changes(&ts);
+  close_table(&ts);
+  restore_from_backup(groups, "data/groups.backup");
+  ts = (TABLE_STATE){ 0 };
+  open_table(groups, &ts);
+  size_t found[2];
+  int values[2] = { five, seven };
+  for (int v = 0; v < 2; v++) {
+    where = pred_cmp(1, PRED_EQ, &values[v], &ts);
+    found[v] = find_where(where, &ts, NULL, NULL);
+    pred_free(where);
+  }
+  printf("restored over a table with a bitmap index: %ld rows of group 5, %ld of group 7\n", found[0], found[1]);
+  close_table(&ts);
+  delete_table(groups);
+  unlink("data/groups.backup");
+  delete_table(file_name);
+  unlink("data/notes.backup");
+  unlink("data/notes.backup.1");
+  unlink("data/notes.backup.2");
+
   return 0;
 }
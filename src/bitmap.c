@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "file.h"
+
+// Sidecar view
+// [0]   "BMIX"
+// [4]   [size_t] generation of the commit on the moment of saving
+// [..]  [size_t] row count of the table on the moment of saving
+// [..]  [size_t] number of indexes
+// ...   per index: [size_t] col, [size_t] nvalues, nvalues * TYPE_SIZE(col)
+//       values, nvalues roaring bitmaps
+
+#define BMI_MAGIC "BMIX"
+
+static size_t value_size(BITMAP_INDEX* bi, TABLE_STATE* ts) {
+  return TYPE_SIZE(ts->col_types[bi->col]);
+}
+
+static unsigned char* value_at(BITMAP_INDEX* bi, size_t i, TABLE_STATE* ts) {
+  return &bi->values[i * value_size(bi, ts)];
+}
+
+static size_t value_index(BITMAP_INDEX* bi, const void* value, TABLE_STATE* ts, size_t* found) {
+  size_t type = ts->col_types[bi->col];
+  size_t lo = 0, hi = bi->count;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (value_cmp(type, value_at(bi, mid, ts), value) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  *found = lo < bi->count && value_cmp(type, value_at(bi, lo, ts), value) == 0;
+  return lo;
+}
+
+static ROARING* value_bitmap(BITMAP_INDEX* bi, const void* value, TABLE_STATE* ts, size_t create) {
+  size_t found;
+  size_t i = value_index(bi, value, ts, &found);
+  if (found)
+    return &bi->bitmaps[i];
+  if (!create)
+    return NULL;
+  size_t size = value_size(bi, ts);
+  if (bi->count >= bi->capacity) {
+    bi->capacity = bi->capacity ? bi->capacity * 2 : 16;
+    bi->values = realloc(bi->values, bi->capacity * size);
+    bi->bitmaps = realloc(bi->bitmaps, bi->capacity * sizeof(ROARING));
+  }
+  memmove(value_at(bi, i + 1, ts), value_at(bi, i, ts), (bi->count - i) * size);
+  memmove(&bi->bitmaps[i + 1], &bi->bitmaps[i], (bi->count - i) * sizeof(ROARING));
+  memset(value_at(bi, i, ts), 0, size);
+  if (TYPE_NUMBER(ts->col_types[bi->col]) == TABLE_TYPE_VARCHAR)
+    strncpy((char*)value_at(bi, i, ts), value, size - 1);
+  else
+    memcpy(value_at(bi, i, ts), value, size);
+  bi->bitmaps[i] = (ROARING){ 0 };
+  bi->count++;
+  return &bi->bitmaps[i];
+}
+
+static void value_drop_if_empty(BITMAP_INDEX* bi, size_t i, TABLE_STATE* ts) {
+  if (bi->bitmaps[i].count)
+    return;
+  size_t size = value_size(bi, ts);
+  roaring_free(&bi->bitmaps[i]);
+  memmove(value_at(bi, i, ts), value_at(bi, i + 1, ts), (bi->count - i - 1) * size);
+  memmove(&bi->bitmaps[i], &bi->bitmaps[i + 1], (bi->count - i - 1) * sizeof(ROARING));
+  bi->count--;
+}
+
+static void index_free(BITMAP_INDEX* bi) {
+  for (size_t i = 0; i < bi->count; i++)
+    roaring_free(&bi->bitmaps[i]);
+  free(bi->bitmaps);
+  free(bi->values);
+  *bi = (BITMAP_INDEX){ 0 };
+}
+
+// Fills the index from the table, 1 if there are too many distinct values
+static size_t index_build(BITMAP_INDEX* bi, TABLE_STATE* ts) {
+  size_t len = row_count(ts);
+  size_t offset = ts->col_offsets[bi->col];
+  char* block = malloc(ZMAP_BLOCK_ROWS * ts->entry_raw_size);
+  size_t ret = 0;
+  for (size_t first = 1, last; !ret && first < len; first = last) {
+    last = first + ZMAP_BLOCK_ROWS;
+    if (last > len) last = len;
+    read_rows(first, last - first, block, ts);
+    for (size_t i = first; i < last; i++) {
+      char* entry = &block[(i - first) * ts->entry_raw_size];
+      if (ENTRY_DELETED(entry))
+        continue;
+      roaring_add(value_bitmap(bi, &entry[offset], ts, 1), i);
+      if (bi->count > BITMAP_INDEX_MAX_VALUES) {
+        ret = 1;
+        break;
+      }
+    }
+  }
+  free(block);
+  return ret;
+}
+
+static BITMAP_INDEXES* indexes(TABLE_STATE* ts) {
+  if (ts->bitmap_indexes == NULL) {
+    ts->bitmap_indexes = malloc(sizeof(BITMAP_INDEXES));
+    memset(ts->bitmap_indexes, 0, sizeof(BITMAP_INDEXES));
+  }
+  return ts->bitmap_indexes;
+}
+
+BITMAP_INDEX* bitmap_index_get(size_t col, TABLE_STATE* ts) {
+  BITMAP_INDEXES* bis = ts->bitmap_indexes;
+  if (bis == NULL)
+    return NULL;
+  for (size_t i = 0; i < bis->count; i++) {
+    if (bis->items[i].col == col)
+      return &bis->items[i];
+  }
+  return NULL;
+}
+
+// 0 on success, 1 if col is a key or already indexed,
+// 2 if col has more than BITMAP_INDEX_MAX_VALUES distinct values
+size_t bitmap_index_create(size_t col, TABLE_STATE* ts) {
+  assert(col < ts->ncols);
+  if (IS_KEY(ts->col_types[col]) || bitmap_index_get(col, ts))
+    return 1;
+  BITMAP_INDEX bi = { 0 };
+  bi.col = col;
+  if (index_build(&bi, ts) != 0) {
+    index_free(&bi);
+    return 2;
+  }
+  size_t latched = table_latch(ts, TABLE_LOCK_WRITE);
+  BITMAP_INDEXES* bis = indexes(ts);
+  bis->items = realloc(bis->items, (bis->count + 1) * sizeof(BITMAP_INDEX));
+  bis->items[bis->count++] = bi;
+  bis->dirty = 1;
+  bitmap_indexes_save(ts);
+  table_unlatch(ts, latched);
+  return 0;
+}
+
+size_t bitmap_index_drop(size_t col, TABLE_STATE* ts) {
+  size_t latched = table_latch(ts, TABLE_LOCK_WRITE);
+  BITMAP_INDEX* bi = bitmap_index_get(col, ts);
+  if (bi == NULL) {
+    table_unlatch(ts, latched);
+    return 1;
+  }
+  BITMAP_INDEXES* bis = ts->bitmap_indexes;
+  index_free(bi);
+  size_t i = bi - bis->items;
+  memmove(&bis->items[i], &bis->items[i + 1], (bis->count - i - 1) * sizeof(BITMAP_INDEX));
+  bis->count--;
+  bis->dirty = 1;
+  bitmap_indexes_save(ts);
+  table_unlatch(ts, latched);
+  return 0;
+}
+
+// Rows whose col is equal to col of entry, NULL if col has no bitmap index
+const ROARING* bitmap_index_lookup(size_t col, const void* entry, TABLE_STATE* ts) {
+  static const ROARING empty = { 0 };
+  BITMAP_INDEX* bi = bitmap_index_get(col, ts);
+  if (bi == NULL)
+    return NULL;
+  ROARING* r = value_bitmap(bi, &((char*)entry)[ts->col_offsets[col]], ts, 0);
+  return r ? r : &empty;
+}
+
+size_t bitmap_index_count(size_t col, const void* entry, TABLE_STATE* ts) {
+  size_t latched = table_latch(ts, TABLE_LOCK_READ);
+  const ROARING* r = bitmap_index_lookup(col, entry, ts);
+  size_t count = r ? roaring_count(r) : 0;
+  table_unlatch(ts, latched);
+  return count;
+}
+
+void bitmap_indexes_open(TABLE_STATE* ts) {
+  char* name = sidecar_name(ts->file_name, "bmi");
+  FILE* file = fopen(name, "rb");
+  free(name);
+  if (file == NULL)
+    return;
+  BITMAP_INDEXES* bis = indexes(ts);
+  char magic[4];
+  size_t gen, nrows, count;
+  size_t ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, BMI_MAGIC, 4) == 0;
+  ok = ok && fread(&gen, sizeof(size_t), 1, file);
+  ok = ok && fread(&nrows, sizeof(size_t), 1, file);
+  ok = ok && fread(&count, sizeof(size_t), 1, file);
+  size_t stale = ok && (gen != table_generation(ts) || nrows != row_count(ts));
+  if (ok) {
+    bis->items = calloc(count ? count : 1, sizeof(BITMAP_INDEX));
+    for (size_t i = 0; ok && i < count; i++) {
+      BITMAP_INDEX* bi = &bis->items[bis->count++];
+      size_t nvalues;
+      ok = ok && fread(&bi->col, sizeof(size_t), 1, file) && bi->col < ts->ncols;
+      ok = ok && fread(&nvalues, sizeof(size_t), 1, file);
+      if (!ok) break;
+      size_t size = value_size(bi, ts);
+      bi->count = bi->capacity = nvalues;
+      bi->values = malloc((nvalues ? nvalues : 1) * size);
+      bi->bitmaps = calloc(nvalues ? nvalues : 1, sizeof(ROARING));
+      ok = ok && fread(bi->values, size, nvalues, file) == nvalues;
+      for (size_t v = 0; ok && v < nvalues; v++)
+        ok = ok && roaring_read(&bi->bitmaps[v], file);
+    }
+  }
+  fclose(file);
+  // table was changed without the indexes, build them again
+  if (!ok || stale) {
+    for (size_t i = 0; i < bis->count; i++) {
+      size_t col = bis->items[i].col;
+      index_free(&bis->items[i]);
+      bis->items[i].col = col;
+      if (ok) index_build(&bis->items[i], ts);
+    }
+    if (!ok) bis->count = 0;
+    bis->dirty = 1;
+  }
+}
+
+void bitmap_indexes_save(TABLE_STATE* ts) {
+  BITMAP_INDEXES* bis = ts->bitmap_indexes;
+  if (bis == NULL)
+    return;
+  if (!bis->dirty) {
+    sidecar_restamp(ts, "bmi");
+    return;
+  }
+  char* name = sidecar_name(ts->file_name, "bmi");
+  if (bis->count == 0) {
+    unlink(name);
+    free(name);
+    bis->dirty = 0;
+    return;
+  }
+  FILE* file = fopen(name, "wb");
+  free(name);
+  if (file == NULL)
+    return;
+  size_t gen = table_generation(ts), nrows = row_count(ts);
+  fwrite(BMI_MAGIC, 1, 4, file);
+  fwrite(&gen, sizeof(size_t), 1, file);
+  fwrite(&nrows, sizeof(size_t), 1, file);
+  fwrite(&bis->count, sizeof(size_t), 1, file);
+  for (size_t i = 0; i < bis->count; i++) {
+    BITMAP_INDEX* bi = &bis->items[i];
+    fwrite(&bi->col, sizeof(size_t), 1, file);
+    fwrite(&bi->count, sizeof(size_t), 1, file);
+    fwrite(bi->values, value_size(bi, ts), bi->count, file);
+    for (size_t v = 0; v < bi->count; v++)
+      roaring_write(&bi->bitmaps[v], file);
+  }
+  fclose(file);
+  bis->dirty = 0;
+}
+
+void bitmap_indexes_close(TABLE_STATE* ts) {
+  BITMAP_INDEXES* bis = ts->bitmap_indexes;
+  if (bis == NULL)
+    return;
+  for (size_t i = 0; i < bis->count; i++)
+    index_free(&bis->items[i]);
+  free(bis->items);
+  free(bis);
+  ts->bitmap_indexes = NULL;
+}
+
+void bitmap_row_written(TABLE_STATE* ts, size_t row, const void* entry) {
+  BITMAP_INDEXES* bis = ts->bitmap_indexes;
+  if (bis == NULL)
+    return;
+  for (size_t i = 0; i < bis->count; i++) {
+    BITMAP_INDEX* bi = &bis->items[i];
+    roaring_add(value_bitmap(bi, &((char*)entry)[ts->col_offsets[bi->col]], ts, 1), row);
+    bis->dirty = 1;
+  }
+}
+
+// old_value and value are bare column values
+void bitmap_value_written(TABLE_STATE* ts, size_t row, size_t col, const void* old_value, const void* value) {
+  BITMAP_INDEX* bi = bitmap_index_get(col, ts);
+  if (bi == NULL)
+    return;
+  size_t found;
+  size_t i = value_index(bi, old_value, ts, &found);
+  if (found) {
+    roaring_remove(&bi->bitmaps[i], row);
+    value_drop_if_empty(bi, i, ts);
+  }
+  roaring_add(value_bitmap(bi, value, ts, 1), row);
+  ts->bitmap_indexes->dirty = 1;
+}
+
+void bitmap_row_deleted(TABLE_STATE* ts, size_t row) {
+  BITMAP_INDEXES* bis = ts->bitmap_indexes;
+  if (bis == NULL)
+    return;
+  for (size_t i = 0; i < bis->count; i++) {
+    BITMAP_INDEX* bi = &bis->items[i];
+    for (size_t v = 0; v < bi->count; v++) {
+      if (roaring_contains(&bi->bitmaps[v], row)) {
+        roaring_remove(&bi->bitmaps[v], row);
+        value_drop_if_empty(bi, v, ts);
+        break;
+      }
+    }
+    bis->dirty = 1;
+  }
+}
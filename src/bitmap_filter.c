@@ -0,0 +1,92 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+
+// Predicates over columns with bitmap indexes are answered by intersecting
+// and uniting the bitmaps, the rows found are the ones a full scan finds
+#define ROWS 20000
+
+typedef struct {
+  const FILTER* filter;
+  size_t count, sum;
+} SCAN;
+
+static int scan_row(void* entry, size_t row, void* cookie) {
+  SCAN* scan = cookie;
+  if (filter_match(scan->filter, entry)) {
+    scan->count++;
+    scan->sum += row;
+  }
+  return 0;
+}
+
+static int found_row(void* entry, size_t row, void* cookie) {
+  SCAN* found = cookie;
+  found->count++;
+  found->sum += row;
+  return 0;
+}
+
+static void query(const char* text, PRED* where, TABLE_STATE* ts) {
+  ROARING bitmap;
+  size_t from_bitmaps = filter_bitmap(where, ts, &bitmap) ? roaring_count(&bitmap) : row_count(ts) - 1;
+  roaring_free(&bitmap);
+  SCAN found = { 0 }, scan = { 0 };
+  table_filter(where, ts, found_row, &found);
+  scan.filter = filter_compile(where, ts);
+  table_scan(0, NULL, ts, scan_row, &scan);
+  filter_free((FILTER*)scan.filter);
+  printf("%s: %ld rows of %ld from the bitmaps, %s\n", text, found.count, from_bitmaps,
+    found.count == scan.count && found.sum == scan.sum ? "same as a full scan" : "different from a full scan");
+  pred_free(where);
+}
+
+int main () {
+  const char* file_name = "data/cars.bin";
+  size_t col_types[4] = {
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int)) | KEY_FIELD,
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int)),
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int)),
+    MAKE_TYPE(TABLE_TYPE_VARCHAR, 16)
+  };
+  const char* col_names[] = { "id", "color", "doors", "region" };
+  const char* regions[] = { "north", "south", "east", "west" };
+  if (access(file_name, F_OK) == 0)
+    delete_table(file_name);
+  create_table(4, 16, col_types, col_names, file_name);
+  TABLE_STATE ts = { 0 };
+  open_table(file_name, &ts);
+  for (int i = 0; i < ROWS; i++)
+    create_entry(&ts, 4, i, i * 7 % 10, 2 + i % 3, regions[i / 4 % 4]);
+  commit_changes(&ts);
+  bitmap_index_create(1, &ts);
+  bitmap_index_create(2, &ts);
+  bitmap_index_create(3, &ts);
+
+  int red = 3, blue = 7, two = 2, four = 4, id = 10000;
+  query("color = 3 AND doors = 2",
+    pred_and(pred_cmp(1, PRED_EQ, &red, &ts), pred_cmp(2, PRED_EQ, &two, &ts)), &ts);
+  query("color = 3 OR color = 7",
+    pred_or(pred_cmp(1, PRED_EQ, &red, &ts), pred_cmp(1, PRED_EQ, &blue, &ts)), &ts);
+  query("(color = 3 OR color = 7) AND doors = 4 AND region = 'west'",
+    pred_and(pred_and(pred_or(pred_cmp(1, PRED_EQ, &red, &ts), pred_cmp(1, PRED_EQ, &blue, &ts)),
+      pred_cmp(2, PRED_EQ, &four, &ts)), pred_cmp(3, PRED_EQ, "west", &ts)), &ts);
+  query("color = 3 AND doors = 2 AND id < 10000",
+    pred_and(pred_and(pred_cmp(1, PRED_EQ, &red, &ts), pred_cmp(2, PRED_EQ, &two, &ts)),
+      pred_cmp(0, PRED_LT, &id, &ts)), &ts);
+  query("(color = 3 AND doors = 4) OR region = 'north'",
+    pred_or(pred_and(pred_cmp(1, PRED_EQ, &red, &ts), pred_cmp(2, PRED_EQ, &four, &ts)),
+      pred_cmp(3, PRED_EQ, "north", &ts)), &ts);
+
+  // the bitmaps follow the commits
+  PRED* where = pred_cmp(1, PRED_EQ, &red, &ts);
+  edit_where(where, 1, &blue, &ts);
+  pred_free(where);
+  commit_changes(&ts);
+  query("after recoloring 3 to 7, color = 3 OR color = 7",
+    pred_or(pred_cmp(1, PRED_EQ, &red, &ts), pred_cmp(1, PRED_EQ, &blue, &ts)), &ts);
+  close_table(&ts);
+  delete_table(file_name);
+  printf("\n");
+
+  return 0;
+}
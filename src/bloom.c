@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "file.h"
+
+// Probe i is h1 + i * h2 of the two halves of the hash (Kirsch-Mitzenmacher)
+
+void bloom_init(BLOOM* bloom, size_t nkeys, size_t bits_per_key) {
+  bloom->nbits = (nkeys * bits_per_key + 63) & ~(size_t)63;
+  if (bloom->nbits < 64) bloom->nbits = 64;
+  // ln 2 * bits per key minimizes the false positive rate
+  bloom->nhashes = bits_per_key * 69 / 100;
+  if (bloom->nhashes < 1) bloom->nhashes = 1;
+  if (bloom->nhashes > 30) bloom->nhashes = 30;
+  bloom->bits = calloc(bloom->nbits / 8, 1);
+}
+
+void bloom_add(BLOOM* bloom, size_t hash) {
+  size_t h1 = hash & 0xffffffff, h2 = (hash >> 32) | 1;
+  for (size_t i = 0; i < bloom->nhashes; i++) {
+    size_t bit = (h1 + i * h2) % bloom->nbits;
+    bloom->bits[bit / 8] |= 1 << (bit % 8);
+  }
+}
+
+// 0 if hash was never added, 1 if it may have been
+int bloom_may_contain(const BLOOM* bloom, size_t hash) {
+  size_t h1 = hash & 0xffffffff, h2 = (hash >> 32) | 1;
+  for (size_t i = 0; i < bloom->nhashes; i++) {
+    size_t bit = (h1 + i * h2) % bloom->nbits;
+    if (!(bloom->bits[bit / 8] & (1 << (bit % 8))))
+      return 0;
+  }
+  return 1;
+}
+
+void bloom_free(BLOOM* bloom) {
+  free(bloom->bits);
+  bloom->bits = NULL;
+  bloom->nbits = 0;
+}
+
+static size_t counter_get(const COUNTING_BLOOM* bloom, size_t i) {
+  return (bloom->counters[i / 2] >> (i % 2 * 4)) & 0xf;
+}
+
+static void counter_set(COUNTING_BLOOM* bloom, size_t i, size_t value) {
+  unsigned char shift = i % 2 * 4;
+  bloom->counters[i / 2] = (bloom->counters[i / 2] & ~(0xf << shift)) | (value << shift);
+}
+
+void cbloom_init(COUNTING_BLOOM* bloom, size_t nkeys, size_t counters_per_key) {
+  bloom->ncounters = (nkeys * counters_per_key + 1) & ~(size_t)1;
+  if (bloom->ncounters < 64) bloom->ncounters = 64;
+  bloom->nhashes = counters_per_key * 69 / 100;
+  if (bloom->nhashes < 1) bloom->nhashes = 1;
+  if (bloom->nhashes > 30) bloom->nhashes = 30;
+  bloom->counters = calloc(bloom->ncounters / 2, 1);
+}
+
+void cbloom_add(COUNTING_BLOOM* bloom, size_t hash) {
+  size_t h1 = hash & 0xffffffff, h2 = (hash >> 32) | 1;
+  for (size_t i = 0; i < bloom->nhashes; i++) {
+    size_t c = (h1 + i * h2) % bloom->ncounters;
+    size_t value = counter_get(bloom, c);
+    if (value < 15)
+      counter_set(bloom, c, value + 1);
+  }
+}
+
+// hash has to be added before, saturated counters are not decremented
+void cbloom_remove(COUNTING_BLOOM* bloom, size_t hash) {
+  size_t h1 = hash & 0xffffffff, h2 = (hash >> 32) | 1;
+  for (size_t i = 0; i < bloom->nhashes; i++) {
+    size_t c = (h1 + i * h2) % bloom->ncounters;
+    size_t value = counter_get(bloom, c);
+    if (value > 0 && value < 15)
+      counter_set(bloom, c, value - 1);
+  }
+}
+
+int cbloom_may_contain(const COUNTING_BLOOM* bloom, size_t hash) {
+  size_t h1 = hash & 0xffffffff, h2 = (hash >> 32) | 1;
+  for (size_t i = 0; i < bloom->nhashes; i++)
+    if (counter_get(bloom, (h1 + i * h2) % bloom->ncounters) == 0)
+      return 0;
+  return 1;
+}
+
+void cbloom_free(COUNTING_BLOOM* bloom) {
+  free(bloom->counters);
+  bloom->counters = NULL;
+  bloom->ncounters = 0;
+}
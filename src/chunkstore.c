@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "zlib.h"
+#include "file.h"
+
+// Deduplicating backup store, a directory
+// <store>/<backup>.manifest  "TCM2", [size_t] length of the table,
+//                            [size_t] chunks, per chunk its SHA-256
+//                            and [size_t] length
+// <store>/chunks/<xx>/<hash> a chunk compressed by zlib, xx the first
+//                            byte of its hash
+//
+// Tables are cut where a gear rolling hash of the last bytes has its low
+// bits clear, so a chunk boundary depends on the bytes around it only and
+// unchanged parts of a table give the chunks they gave before. A chunk
+// already in the store is not compressed or written again. A chunk is
+// named by its SHA-256, two chunks of one name are taken to be the same
+
+#define MANIFEST_MAGIC "TCM2"
+#define CHUNK_MIN (1 << 14)
+#define CHUNK_MAX (1 << 18)
+#define CHUNK_MASK ((1 << 16) - 1)   // chunks of 64KB on average
+#define CHUNK_HASH_SIZE SHA256_SIZE
+#define RESTORE_MAX_THREADS 16
+
+typedef struct {
+  unsigned char hash[CHUNK_HASH_SIZE];
+  size_t len;
+} CHUNK_REF;
+
+static uint64_t splitmix(uint64_t* state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// Length of the chunk that starts at p
+static size_t chunk_cut(const uint64_t* gear, const unsigned char* p, size_t n) {
+  if (n <= CHUNK_MIN)
+    return n;
+  size_t max = n < CHUNK_MAX ? n : CHUNK_MAX;
+  uint64_t h = 0;
+  for (size_t i = CHUNK_MIN - 64; i < max; i++) {
+    h = (h << 1) + gear[p[i]];
+    if (i >= CHUNK_MIN && (h >> 40 & CHUNK_MASK) == 0)
+      return i + 1;
+  }
+  return max;
+}
+
+static char* chunk_name(const char* store, const unsigned char* hash, size_t dir_only) {
+  char* name = malloc(strlen(store) + 2 * CHUNK_HASH_SIZE + 16);
+  char* it = name + sprintf(name, "%s/chunks/%02x", store, hash[0]);
+  if (!dir_only) {
+    *it++ = '/';
+    for (size_t i = 0; i < CHUNK_HASH_SIZE; i++)
+      it += sprintf(it, "%02x", hash[i]);
+  }
+  return name;
+}
+
+static char* manifest_name(const char* store, const char* backup_name) {
+  char* name = malloc(strlen(store) + strlen(backup_name) + 16);
+  sprintf(name, "%s/%s.manifest", store, backup_name);
+  return name;
+}
+
+// Writes a file whole under a temporary name and renames it, a file of
+// the store is there complete or not at all
+static size_t write_whole(const char* name, const void* buf, size_t size) {
+  char* tmp = malloc(strlen(name) + 32);
+  sprintf(tmp, "%s.tmp.%d", name, getpid());
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  size_t ok = fd >= 0 && write(fd, buf, size) == (ssize_t)size;
+  if (fd >= 0)
+    close(fd);
+  ok = ok && rename(tmp, name) == 0;
+  if (!ok)
+    unlink(tmp);
+  free(tmp);
+  return ok;
+}
+
+// Backs the table file_name up as backup_name into the store, which is
+// made if it does not exist. stats may be NULL.
+// Returns 1 if the table could not be read or the store written
+size_t chunk_backup(const char* file_name, const char* store, const char* backup_name, CHUNK_STATS* stats) {
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0)
+    return 1;
+  struct stat st;
+  fstat(fd, &st);
+  size_t size = st.st_size;
+  const unsigned char* table = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (size && table == MAP_FAILED)
+    return 1;
+  char* dir = malloc(strlen(store) + 16);
+  mkdir(store, 0755);
+  sprintf(dir, "%s/chunks", store);
+  mkdir(dir, 0755);
+  free(dir);
+
+  uint64_t gear[256], seed = 0x5eed;
+  for (size_t i = 0; i < 256; i++)
+    gear[i] = splitmix(&seed);
+  CHUNK_STATS s = { .bytes = size };
+  size_t capacity = 64, ret = 0;
+  CHUNK_REF* refs = malloc(capacity * sizeof(CHUNK_REF));
+  unsigned char* comp = malloc(compressBound(CHUNK_MAX));
+  for (size_t at = 0; at < size && ret == 0;) {
+    size_t len = chunk_cut(gear, &table[at], size - at);
+    if (s.chunks == capacity)
+      refs = realloc(refs, (capacity *= 2) * sizeof(CHUNK_REF));
+    CHUNK_REF* ref = &refs[s.chunks++];
+    ref->len = len;
+    sha256(&table[at], len, ref->hash);
+    char* name = chunk_name(store, ref->hash, 0);
+    if (access(name, F_OK) != 0) {
+      char* sub = chunk_name(store, ref->hash, 1);
+      mkdir(sub, 0755);
+      free(sub);
+      uLongf comp_len = compressBound(CHUNK_MAX);
+      if (compress2(comp, &comp_len, &table[at], len, Z_DEFAULT_COMPRESSION) != Z_OK || !write_whole(name, comp, comp_len))
+        ret = 1;
+      s.new_chunks++;
+      s.new_bytes += comp_len;
+    }
+    free(name);
+    at += len;
+  }
+  if (size)
+    munmap((void*)table, size);
+  if (ret == 0) {
+    size_t head = 4 + 2 * sizeof(size_t);
+    char* manifest = malloc(head + s.chunks * (CHUNK_HASH_SIZE + sizeof(size_t)));
+    memcpy(manifest, MANIFEST_MAGIC, 4);
+    memcpy(&manifest[4], &size, sizeof(size_t));
+    memcpy(&manifest[4 + sizeof(size_t)], &s.chunks, sizeof(size_t));
+    char* it = &manifest[head];
+    for (size_t i = 0; i < s.chunks; i++) {
+      memcpy(it, refs[i].hash, CHUNK_HASH_SIZE);
+      memcpy(&it[CHUNK_HASH_SIZE], &refs[i].len, sizeof(size_t));
+      it += CHUNK_HASH_SIZE + sizeof(size_t);
+    }
+    char* name = manifest_name(store, backup_name);
+    ret = !write_whole(name, manifest, it - manifest);
+    free(name);
+    free(manifest);
+  }
+  free(comp);
+  free(refs);
+  if (stats)
+    *stats = s;
+  return ret;
+}
+
+// 1 if the manifest was read, its chunks go to refs
+static size_t manifest_read(const char* name, size_t* size, CHUNK_REF** refs, size_t* count) {
+  FILE* file = fopen(name, "rb");
+  if (file == NULL)
+    return 0;
+  char magic[4];
+  size_t ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, MANIFEST_MAGIC, 4) == 0
+    && fread(size, sizeof(size_t), 1, file) == 1 && fread(count, sizeof(size_t), 1, file) == 1;
+  *refs = NULL;
+  if (ok) {
+    *refs = malloc((*count + 1) * sizeof(CHUNK_REF));
+    for (size_t i = 0; ok && i < *count; i++)
+      ok = fread((*refs)[i].hash, 1, CHUNK_HASH_SIZE, file) == CHUNK_HASH_SIZE
+        && fread(&(*refs)[i].len, sizeof(size_t), 1, file) == 1;
+  }
+  fclose(file);
+  if (!ok) {
+    free(*refs);
+    *refs = NULL;
+    *count = 0;
+  }
+  return ok;
+}
+
+typedef struct {
+  const char* store;
+  const CHUNK_REF* refs;
+  const size_t* offsets;
+  size_t count;
+  size_t first;
+  size_t step;
+  int fd;
+  size_t ret;
+  int started;
+  pthread_t thread;
+} CHUNK_WORKER;
+
+// Restores every step-th chunk, from first on
+static void* restore_chunks(void* arg) {
+  CHUNK_WORKER* w = arg;
+  unsigned char* comp = malloc(compressBound(CHUNK_MAX));
+  unsigned char* raw = malloc(CHUNK_MAX);
+  for (size_t i = w->first; i < w->count && w->ret == 0; i += w->step) {
+    const CHUNK_REF* ref = &w->refs[i];
+    char* name = chunk_name(w->store, ref->hash, 0);
+    int fd = open(name, O_RDONLY);
+    free(name);
+    ssize_t comp_len = fd >= 0 ? read(fd, comp, compressBound(CHUNK_MAX)) : -1;
+    if (fd >= 0)
+      close(fd);
+    uLongf len = CHUNK_MAX;
+    unsigned char hash[CHUNK_HASH_SIZE];
+    if (comp_len <= 0 || uncompress(raw, &len, comp, comp_len) != Z_OK || len != ref->len) {
+      w->ret = 1;
+      break;
+    }
+    sha256(raw, len, hash);
+    if (memcmp(hash, ref->hash, CHUNK_HASH_SIZE) != 0 || pwrite(w->fd, raw, len, w->offsets[i]) != (ssize_t)len)
+      w->ret = 1;
+  }
+  free(comp);
+  free(raw);
+  return NULL;
+}
+
+// Restores backup_name of the store to file_name, threads restore chunks
+// of their own at their offsets. Returns 1 if the backup is missing or a
+// chunk is missing or damaged
+size_t chunk_restore(const char* file_name, const char* store, const char* backup_name) {
+  char* name = manifest_name(store, backup_name);
+  size_t size, count;
+  CHUNK_REF* refs;
+  size_t ok = manifest_read(name, &size, &refs, &count);
+  free(name);
+  if (!ok)
+    return 1;
+  int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    free(refs);
+    return 1;
+  }
+  size_t* offsets = malloc((count + 1) * sizeof(size_t));
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    offsets[i] = total;
+    total += refs[i].len;
+  }
+  size_t ret = total != size || ftruncate(fd, size) != 0;
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threads = cores < 1 ? 1 : cores < RESTORE_MAX_THREADS ? cores : RESTORE_MAX_THREADS;
+  if (threads > count)
+    threads = count ? count : 1;
+  CHUNK_WORKER* workers = calloc(threads, sizeof(CHUNK_WORKER));
+  for (size_t t = 0; ret == 0 && t < threads; t++) {
+    workers[t] = (CHUNK_WORKER){ store, refs, offsets, count, t, threads, fd, 0 };
+    // without a thread the chunks of the worker are restored here
+    workers[t].started = pthread_create(&workers[t].thread, NULL, restore_chunks, &workers[t]) == 0;
+    if (!workers[t].started)
+      restore_chunks(&workers[t]);
+  }
+  for (size_t t = 0; t < threads; t++) {
+    if (workers[t].started)
+      pthread_join(workers[t].thread, NULL);
+    ret |= workers[t].ret;
+  }
+  free(workers);
+  free(offsets);
+  free(refs);
+  close(fd);
+  // the sidecars of the table restored over are built again, its backup
+  // chain is no longer its chain
+  name = sidecar_name(file_name, "dirty");
+  unlink(name);
+  free(name);
+  table_replaced(file_name);
+  return ret;
+}
+
+static int hash_cmp(const void* a, const void* b) {
+  return memcmp(a, b, CHUNK_HASH_SIZE);
+}
+
+static size_t hex_byte(const char* s) {
+  unsigned int b = 0;
+  sscanf(s, "%2x", &b);
+  return b;
+}
+
+// Drops backup_name from the store and the chunks no other backup uses.
+// The store goes when its last backup does
+size_t chunk_backup_delete(const char* store, const char* backup_name) {
+  char* name = manifest_name(store, backup_name);
+  size_t gone = unlink(name) == 0;
+  free(name);
+  if (!gone)
+    return 1;
+  // hashes of the chunks the backups left use, sorted
+  DIR* dir = opendir(store);
+  if (dir == NULL)
+    return 1;
+  size_t used = 0, capacity = 0;
+  unsigned char* hashes = NULL;
+  struct dirent* e;
+  while ((e = readdir(dir)) != NULL) {
+    size_t n = strlen(e->d_name);
+    if (n < 9 || strcmp(&e->d_name[n - 9], ".manifest") != 0)
+      continue;
+    char* path = malloc(strlen(store) + n + 2);
+    sprintf(path, "%s/%s", store, e->d_name);
+    size_t size, count;
+    CHUNK_REF* refs;
+    manifest_read(path, &size, &refs, &count);
+    free(path);
+    if (used + count > capacity) {
+      capacity = (used + count) * 2;
+      hashes = realloc(hashes, capacity * CHUNK_HASH_SIZE);
+    }
+    for (size_t i = 0; i < count; i++)
+      memcpy(&hashes[used++ * CHUNK_HASH_SIZE], refs[i].hash, CHUNK_HASH_SIZE);
+    free(refs);
+  }
+  closedir(dir);
+  qsort(hashes, used, CHUNK_HASH_SIZE, hash_cmp);
+
+  char* chunks = malloc(strlen(store) + 16);
+  sprintf(chunks, "%s/chunks", store);
+  for (size_t x = 0; x < 256; x++) {
+    unsigned char first = x;
+    char* sub = chunk_name(store, &first, 1);
+    DIR* d = opendir(sub);
+    if (d != NULL) {
+      while ((e = readdir(d)) != NULL) {
+        if (strlen(e->d_name) != 2 * CHUNK_HASH_SIZE)
+          continue;
+        unsigned char hash[CHUNK_HASH_SIZE];
+        for (size_t i = 0; i < CHUNK_HASH_SIZE; i++)
+          hash[i] = hex_byte(&e->d_name[2 * i]);
+        if (used && bsearch(hash, hashes, used, CHUNK_HASH_SIZE, hash_cmp))
+          continue;
+        char* path = malloc(strlen(sub) + strlen(e->d_name) + 2);
+        sprintf(path, "%s/%s", sub, e->d_name);
+        unlink(path);
+        free(path);
+      }
+      closedir(d);
+      rmdir(sub);  // if it is empty
+    }
+    free(sub);
+  }
+  rmdir(chunks);
+  rmdir(store);
+  free(chunks);
+  free(hashes);
+  return 0;
+}
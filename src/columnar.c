@@ -0,0 +1,98 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+#include <math.h>
+
+// Readings of weather stations are sealed into column segments. The
+// aggregates over them come out the same as over the rows, before and
+// after later commits change some of the sealed blocks
+#define ROWS 50000
+#define STATIONS 40
+
+typedef struct {
+  AGG_RESULT sum, min_time, max_time, count;
+} REPORT;
+
+static REPORT report(TABLE_STATE* ts) {
+  REPORT r;
+  char station[32] = "station 7";
+  int status = 2;
+  aggregate(AGG_SUM, 3, 1, station, ts, &r.sum);
+  aggregate(AGG_MIN, 2, 0, NULL, ts, &r.min_time);
+  aggregate(AGG_MAX, 2, 0, NULL, ts, &r.max_time);
+  aggregate(AGG_COUNT, 3, 4, &status, ts, &r.count);
+  return r;
+}
+
+static int same(REPORT a, REPORT b) {
+  return a.sum.count == b.sum.count && fabs(a.sum.value - b.sum.value) <= 1e-9 * fabs(b.sum.value)
+    && a.min_time.value == b.min_time.value && a.max_time.value == b.max_time.value
+    && a.count.value == b.count.value;
+}
+
+int main () {
+  const char* file_name = "data/readings.bin";
+  size_t col_types[5] = {
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int)) | KEY_FIELD,
+    MAKE_TYPE(TABLE_TYPE_VARCHAR, 32),
+    MAKE_TYPE(TABLE_TYPE_DATATIME, DATATIME_SIZE),
+    MAKE_TYPE(TABLE_TYPE_FLOAT, sizeof(float)),
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int))
+  };
+  const char* col_names[] = { "id", "station", "time", "temperature", "status" };
+  if (access(file_name, F_OK) == 0)
+    delete_table(file_name);
+  create_table(5, 32, col_types, col_names, file_name);
+  TABLE_STATE ts = { 0 };
+  open_table(file_name, &ts);
+  char station[32];
+  for (int i = 0; i < ROWS; i++) {
+    // every station reports once a minute, in turns
+    int minute = i / STATIONS;
+    size_t time = encode_datatime(2024, 3, 1 + minute / 1440, minute / 60 % 24, minute % 60, 0, 0);
+    snprintf(station, sizeof(station), "station %d", i % STATIONS);
+    float temperature = 10 + (i % STATIONS) / 4 + (minute / 120) * 0.5f;
+    create_entry(&ts, 5, i, station, &time, temperature, i / 5000 % 3);
+  }
+  commit_changes(&ts);
+  REPORT rows = report(&ts);
+
+  column_seal(&ts);
+  size_t nrows = row_count(&ts);
+  for (size_t col = 0; col < ts.ncols; col++)
+    printf("%-11s %-38s %7ld bytes, %ld raw\n", col_names[col], column_encoding(&ts, 1, col),
+      column_size(&ts, col), nrows * TYPE_SIZE(ts.col_types[col]));
+  REPORT sealed = report(&ts);
+  printf("sealed: temperature of station 7 %.1f over %ld readings, %.0f with status 2, %s\n",
+    sealed.sum.value, sealed.sum.count, sealed.count.value, same(sealed, rows) ? "same as the rows" : "different");
+
+  // a few readings are corrected, some removed and new ones come in
+  for (int i = 0; i < 20; i++) {
+    int id = i * 2477 % ROWS;
+    float corrected = -5;
+    PRED* where = pred_cmp(0, PRED_EQ, &id, &ts);
+    edit_where(where, 3, &corrected, &ts);
+    pred_free(where);
+  }
+  for (int i = 0; i < 10; i++) {
+    int id = i * 4099 % ROWS + 1;
+    delete_entry(0, &id, &ts);
+  }
+  for (int i = ROWS; i < ROWS + 100; i++) {
+    size_t time = encode_datatime(2024, 4, 1, 0, 0, 0, 0);
+    create_entry(&ts, 5, i, "station 7", &time, 20.0f, 2);
+  }
+  commit_changes(&ts);
+  close_table(&ts);
+  ts = (TABLE_STATE){ 0 };
+  open_table(file_name, &ts);
+  REPORT changed = report(&ts);
+  column_drop(&ts);
+  REPORT plain = report(&ts);
+  printf("changed: temperature of station 7 %.1f over %ld readings, %.0f with status 2, %s\n",
+    changed.sum.value, changed.sum.count, changed.count.value, same(changed, plain) ? "same as the rows" : "different");
+  close_table(&ts);
+  delete_table(file_name);
+  printf("\n");
+
+  return 0;
+}
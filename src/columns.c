@@ -0,0 +1,654 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include "file.h"
+
+// Sidecar view, <table>.cols
+// [0]   "TCOL"
+// [4]   [size_t] generation of the commit on the moment of saving
+// [12]  [size_t] block_rows
+// [20]  [size_t] ncols
+// [28]  [size_t] row count of the table on the moment of saving
+// [36]  [size_t] rows sealed
+// [44]  [size_t] nblocks
+// [56]  nblocks * [size_t] offset of a block
+// ...   (nblocks + 7) / 8 bytes, a bit per block changed since sealing
+// ...   blocks
+//
+// Block: [size_t] rows, live bits of block_rows rows, (ncols + 1) *
+// [size_t] offset of the segment of a column and the end of the last one,
+// then the segments. A segment starts with its encoding:
+// COL_FOR    [u64] base, [u8] bits, values - base packed in bits each
+// COL_DELTA  [u64] first, [u64] least delta, [u8] bits, deltas - least
+// COL_RLE    [u32] runs, per run [u64] value, [u32] length
+// COL_DICT   [u32] values, [u32] offset of each, [u32] bytes, the values
+//            sorted with their NUL, then the codes as a segment of the above
+// COL_XOR    FLOAT, the first value, then per value a 0 bit if it repeats
+//            the one before, 10 and the bits of the xor that fall into the
+//            window of the last one, or 11, 5 bits leading zeros, 5 bits
+//            length - 1 and the bits of the xor
+//
+// INT, DATATIME and codes are segmented as unsigned 64 bit values that
+// keep their order: an INT with its sign bit flipped, a DATATIME as its
+// datatime_key. Packed bits are read 8 bytes at a time, every segment is
+// followed by COL_PAD zero bytes
+
+#define COLS_MAGIC "TCOL"
+#define COLS_ROWS_OFFSET 28
+#define COLS_HEADER 56
+#define COL_LIVE_BYTES (ZMAP_BLOCK_ROWS / 8)
+#define COL_PAD 16
+
+#define COL_FOR   1
+#define COL_DELTA 2
+#define COL_RLE   3
+#define COL_DICT  4
+#define COL_XOR   5
+
+typedef struct {
+  unsigned char* p;
+  size_t len, cap;
+} COL_BUF;
+
+static void buf_put(COL_BUF* b, const void* data, size_t len) {
+  if (b->len + len > b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 4096;
+    while (b->cap < b->len + len) b->cap *= 2;
+    b->p = realloc(b->p, b->cap);
+  }
+  if (data)
+    memcpy(&b->p[b->len], data, len);
+  else
+    memset(&b->p[b->len], 0, len);
+  b->len += len;
+}
+
+static uint64_t get64(const unsigned char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t get32(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static void bits_put(unsigned char* buf, size_t pos, uint64_t v, size_t bits) {
+  for (size_t i = 0; i < bits; i++)
+    if ((v >> i) & 1)
+      buf[(pos + i) >> 3] |= 1 << ((pos + i) & 7);
+}
+
+static uint64_t bits_get(const unsigned char* buf, size_t pos, size_t bits) {
+  if (bits == 0)
+    return 0;
+  size_t shift = pos & 7;
+  uint64_t v = get64(&buf[pos >> 3]) >> shift;
+  if (shift + bits > 64)
+    v |= (uint64_t)buf[(pos >> 3) + 8] << (64 - shift);
+  return bits == 64 ? v : v & ((1ULL << bits) - 1);
+}
+
+static size_t bit_width(uint64_t v) {
+  return v ? 64 - __builtin_clzll(v) : 0;
+}
+
+static uint64_t int_key(int v) {
+  return (uint32_t)v ^ 0x80000000u;
+}
+
+static int key_int(uint64_t u) {
+  return (int)((uint32_t)u ^ 0x80000000u);
+}
+
+// Writes n values as the smallest of frame of reference, delta and run
+// length segments
+static void segment_ints(COL_BUF* b, const uint64_t* v, size_t n) {
+  uint64_t min = v[0], max = v[0], dmin = 0, dmax = 0;
+  size_t runs = 1;
+  for (size_t i = 1; i < n; i++) {
+    if (v[i] < min) min = v[i];
+    if (v[i] > max) max = v[i];
+    int64_t d = v[i] - v[i - 1];
+    if (i == 1 || d < (int64_t)dmin) dmin = d;
+    if (i == 1 || d > (int64_t)dmax) dmax = d;
+    runs += v[i] != v[i - 1];
+  }
+  size_t for_bits = bit_width(max - min), delta_bits = bit_width(dmax - dmin);
+  size_t for_size = 9 + (n * for_bits + 7) / 8;
+  size_t delta_size = 17 + ((n - 1) * delta_bits + 7) / 8;
+  size_t rle_size = 4 + runs * 12;
+  unsigned char enc = COL_FOR;
+  if (delta_size < for_size && delta_size <= rle_size)
+    enc = COL_DELTA;
+  else if (rle_size < for_size)
+    enc = COL_RLE;
+  buf_put(b, &enc, 1);
+  if (enc == COL_RLE) {
+    uint32_t count = runs;
+    buf_put(b, &count, 4);
+    for (size_t i = 0; i < n;) {
+      uint32_t len = 1;
+      while (i + len < n && v[i + len] == v[i]) len++;
+      buf_put(b, &v[i], 8);
+      buf_put(b, &len, 4);
+      i += len;
+    }
+  } else {
+    uint64_t head[2] = { enc == COL_FOR ? min : v[0], dmin };
+    unsigned char bits = enc == COL_FOR ? for_bits : delta_bits;
+    buf_put(b, head, enc == COL_FOR ? 8 : 16);
+    buf_put(b, &bits, 1);
+    size_t at = b->len, packed = enc == COL_FOR ? n : n - 1;
+    buf_put(b, NULL, (packed * bits + 7) / 8);
+    for (size_t i = 0; i < packed; i++)
+      bits_put(&b->p[at], i * bits, enc == COL_FOR ? v[i] - min : v[i + 1] - v[i] - dmin, bits);
+  }
+  buf_put(b, NULL, COL_PAD);
+}
+
+static void segment_floats(COL_BUF* b, const uint32_t* v, size_t n) {
+  unsigned char enc = COL_XOR;
+  buf_put(b, &enc, 1);
+  size_t at = b->len, pos = 32;
+  // the worst case, every value with its window
+  buf_put(b, NULL, (n * 44 + 7) / 8 + COL_PAD);
+  bits_put(&b->p[at], 0, v[0], 32);
+  size_t lead = 33, len = 0;
+  for (size_t i = 1; i < n; i++) {
+    uint32_t x = v[i] ^ v[i - 1];
+    if (x == 0) {
+      pos++;
+      continue;
+    }
+    size_t l = __builtin_clz(x), t = __builtin_ctz(x);
+    if (l > 31) l = 31;
+    if (lead <= 32 && l >= lead && t >= 32 - lead - len) {
+      bits_put(&b->p[at], pos, 1, 2);
+      pos += 2;
+      bits_put(&b->p[at], pos, x >> (32 - lead - len), len);
+      pos += len;
+      continue;
+    }
+    lead = l;
+    len = 32 - l - t;
+    bits_put(&b->p[at], pos, 3, 2);
+    bits_put(&b->p[at], pos + 2, lead, 5);
+    bits_put(&b->p[at], pos + 7, len - 1, 5);
+    pos += 12;
+    bits_put(&b->p[at], pos, x >> t, len);
+    pos += len;
+  }
+  b->len = at + (pos + 7) / 8 + COL_PAD;
+}
+
+static int str_cmp(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static void segment_strings(COL_BUF* b, char** v, size_t n) {
+  char** dict = malloc(n * sizeof(char*));
+  memcpy(dict, v, n * sizeof(char*));
+  qsort(dict, n, sizeof(char*), str_cmp);
+  uint32_t ndict = 0, bytes = 0;
+  for (size_t i = 0; i < n; i++)
+    if (ndict == 0 || strcmp(dict[ndict - 1], dict[i]) != 0)
+      dict[ndict++] = dict[i];
+  unsigned char enc = COL_DICT;
+  buf_put(b, &enc, 1);
+  buf_put(b, &ndict, 4);
+  for (uint32_t i = 0; i < ndict; i++) {
+    buf_put(b, &bytes, 4);
+    bytes += strlen(dict[i]) + 1;
+  }
+  buf_put(b, &bytes, 4);
+  for (uint32_t i = 0; i < ndict; i++)
+    buf_put(b, dict[i], strlen(dict[i]) + 1);
+  // the dictionary is sorted, codes keep the order of their values
+  uint64_t* codes = malloc(n * sizeof(uint64_t));
+  for (size_t i = 0; i < n; i++)
+    codes[i] = (char**)bsearch(&v[i], dict, ndict, sizeof(char*), str_cmp) - dict;
+  segment_ints(b, codes, n);
+  free(codes);
+  free(dict);
+}
+
+// Values of a segment in order, as runs of equal values
+typedef struct {
+  const unsigned char* p;
+  unsigned char enc;
+  size_t n, i;
+  uint64_t base, least, prev;
+  size_t bits, pos;
+  size_t lead, len;
+} RUNS;
+
+static void runs_init(RUNS* r, const unsigned char* segment, size_t n) {
+  memset(r, 0, sizeof(RUNS));
+  r->enc = segment[0];
+  r->p = &segment[1];
+  r->n = n;
+  if (r->enc == COL_FOR) {
+    r->base = get64(r->p);
+    r->bits = r->p[8];
+    r->p += 9;
+  }
+  if (r->enc == COL_DELTA) {
+    r->prev = get64(r->p);
+    r->least = get64(&r->p[8]);
+    r->bits = r->p[16];
+    r->p += 17;
+  }
+  if (r->enc == COL_RLE)
+    r->p += 4;
+  if (r->enc == COL_DICT) {
+    // runs of the codes
+    uint32_t ndict = get32(r->p);
+    uint32_t bytes = get32(&r->p[4 + ndict * 4]);
+    runs_init(r, &r->p[8 + ndict * 4 + bytes], n);
+  }
+}
+
+static int runs_next(RUNS* r, uint64_t* value, size_t* len) {
+  if (r->i >= r->n)
+    return 0;
+  *len = 1;
+  if (r->enc == COL_FOR) {
+    *value = r->base + bits_get(r->p, r->i * r->bits, r->bits);
+  } else if (r->enc == COL_DELTA) {
+    if (r->i)
+      r->prev += r->least + bits_get(r->p, (r->i - 1) * r->bits, r->bits);
+    *value = r->prev;
+  } else if (r->enc == COL_RLE) {
+    *value = get64(r->p);
+    *len = get32(&r->p[8]);
+    r->p += 12;
+  } else if (r->enc == COL_XOR) {
+    if (r->i == 0) {
+      r->prev = bits_get(r->p, 0, 32);
+      r->pos = 32;
+    } else if (bits_get(r->p, r->pos++, 1)) {
+      if (bits_get(r->p, r->pos++, 1)) {
+        r->lead = bits_get(r->p, r->pos, 5);
+        r->len = bits_get(r->p, r->pos + 5, 5) + 1;
+        r->pos += 10;
+      }
+      r->prev ^= bits_get(r->p, r->pos, r->len) << (32 - r->lead - r->len);
+      r->pos += r->len;
+    }
+    *value = r->prev;
+  }
+  r->i += *len;
+  return 1;
+}
+
+static const unsigned char* block_at(COLUMNS* cs, size_t block) {
+  return &cs->data[cs->blocks[block]];
+}
+
+static const unsigned char* segment_at(COLUMNS* cs, size_t block, size_t col) {
+  const unsigned char* b = block_at(cs, block);
+  return &cs->data[get64(&b[8 + COL_LIVE_BYTES + col * 8])];
+}
+
+static void block_build(COL_BUF* b, TABLE_STATE* ts, size_t first, size_t n, const char* rows) {
+  size_t size = ts->entry_raw_size;
+  unsigned char live[COL_LIVE_BYTES] = { 0 };
+  buf_put(b, &n, sizeof(size_t));
+  size_t live_at = b->len;
+  buf_put(b, live, COL_LIVE_BYTES);
+  size_t offsets_at = b->len;
+  buf_put(b, NULL, (ts->ncols + 1) * sizeof(size_t));
+  for (size_t i = 0; i < n; i++)
+    if (first + i != 0 && !ENTRY_DELETED(&rows[i * size]))
+      b->p[live_at + i / 8] |= 1 << (i % 8);
+  uint64_t* ints = malloc(n * sizeof(uint64_t));
+  char** strings = malloc(n * sizeof(char*));
+  for (size_t col = 0; col < ts->ncols; col++) {
+    size_t offset = b->len, type = ts->col_types[col], vsize = TYPE_SIZE(type);
+    memcpy(&b->p[offsets_at + col * sizeof(size_t)], &offset, sizeof(size_t));
+    // a free row takes the value of the row before, it is never read and
+    // does not break a run
+    size_t last = 0;
+    for (size_t i = 0; i < n; i++) {
+      size_t from = b->p[live_at + i / 8] & (1 << (i % 8)) ? (last = i) : last;
+      const char* value = &rows[from * size + ts->col_offsets[col]];
+      if (TYPE_NUMBER(type) == TABLE_TYPE_INT)
+        ints[i] = int_key(*(int*)value);
+      if (TYPE_NUMBER(type) == TABLE_TYPE_FLOAT)
+        ints[i] = *(uint32_t*)value;
+      if (TYPE_NUMBER(type) == TABLE_TYPE_DATATIME)
+        ints[i] = datatime_key((const unsigned char*)value);
+      if (TYPE_NUMBER(type) == TABLE_TYPE_VARCHAR)
+        strings[i] = strndup(value, vsize);
+    }
+    if (TYPE_NUMBER(type) == TABLE_TYPE_VARCHAR) {
+      segment_strings(b, strings, n);
+      for (size_t i = 0; i < n; i++)
+        free(strings[i]);
+    } else if (TYPE_NUMBER(type) == TABLE_TYPE_FLOAT) {
+      uint32_t* floats = malloc(n * sizeof(uint32_t));
+      for (size_t i = 0; i < n; i++)
+        floats[i] = ints[i];
+      segment_floats(b, floats, n);
+      free(floats);
+    } else {
+      segment_ints(b, ints, n);
+    }
+  }
+  size_t end = b->len;
+  memcpy(&b->p[offsets_at + ts->ncols * sizeof(size_t)], &end, sizeof(size_t));
+  free(ints);
+  free(strings);
+}
+
+static void columns_free(COLUMNS* cs) {
+  free(cs->data);
+  free(cs->blocks);
+  free(cs);
+}
+
+static void columns_load(TABLE_STATE* ts, COLUMNS* cs) {
+  size_t nblocks = get64(&cs->data[44]);
+  cs->rows = get64(&cs->data[36]);
+  cs->nblocks = nblocks;
+  cs->blocks = malloc((nblocks ? nblocks : 1) * sizeof(size_t));
+  memcpy(cs->blocks, &cs->data[COLS_HEADER], nblocks * sizeof(size_t));
+  cs->stale = &cs->data[COLS_HEADER + nblocks * sizeof(size_t)];
+  cs->saved_rows = row_count(ts);
+}
+
+// Encodes the rows of the table into column segments, sealed blocks stay
+// readable as columns until a commit changes one of their rows. Sealing
+// again replaces the segments.
+// Returns 1 if the table is an LSM table or a snapshot
+size_t column_seal(TABLE_STATE* ts) {
+  if (ts->lsm || ts->snapshot)
+    return 1;
+  size_t latched = table_latch(ts, TABLE_LOCK_WRITE);
+  // other processes read the new segments once they read the table again
+  TABLE_LOCK* lock = ts->lock;
+  size_t locked = lock && lock->mode == TABLE_LOCK_NONE;
+  if (locked)
+    table_lock(ts, TABLE_LOCK_WRITE);
+  size_t rows = row_count(ts), nblocks = (rows + ZMAP_BLOCK_ROWS - 1) / ZMAP_BLOCK_ROWS;
+  size_t header[6] = { table_generation(ts), ZMAP_BLOCK_ROWS, ts->ncols, rows, rows, nblocks };
+  COL_BUF b = { 0 };
+  buf_put(&b, NULL, COLS_HEADER);
+  memcpy(b.p, COLS_MAGIC, 4);
+  memcpy(&b.p[4], header, sizeof(header));
+  size_t offsets_at = b.len;
+  buf_put(&b, NULL, nblocks * sizeof(size_t) + (nblocks + 7) / 8);
+  char* buf = malloc(ZMAP_BLOCK_ROWS * ts->entry_raw_size);
+  for (size_t block = 0; block < nblocks; block++) {
+    size_t first = block * ZMAP_BLOCK_ROWS;
+    size_t n = rows - first < ZMAP_BLOCK_ROWS ? rows - first : ZMAP_BLOCK_ROWS;
+    size_t offset = b.len;
+    memcpy(&b.p[offsets_at + block * sizeof(size_t)], &offset, sizeof(size_t));
+    table_pread_some(ts, buf, n * ts->entry_raw_size, entry_offset(first, ts));
+    block_build(&b, ts, first, n, buf);
+  }
+  free(buf);
+  char* name = sidecar_name(ts->file_name, "cols");
+  FILE* file = fopen(name, "wb");
+  free(name);
+  size_t ret = file == NULL || fwrite(b.p, 1, b.len, file) != b.len;
+  if (file)
+    fclose(file);
+  if (ret == 0) {
+    if (ts->columns)
+      columns_free(ts->columns);
+    COLUMNS* cs = calloc(1, sizeof(COLUMNS));
+    cs->data = b.p;
+    cs->size = b.len;
+    columns_load(ts, cs);
+    ts->columns = cs;
+  } else {
+    free(b.p);
+  }
+  if (locked)
+    table_unlock(ts);
+  table_unlatch(ts, latched);
+  return ret;
+}
+
+// Removes the column segments, 1 if the table has none
+size_t column_drop(TABLE_STATE* ts) {
+  size_t latched = table_latch(ts, TABLE_LOCK_WRITE);
+  size_t ret = ts->columns == NULL;
+  char* name = sidecar_name(ts->file_name, "cols");
+  unlink(name);
+  free(name);
+  if (ts->columns)
+    columns_free(ts->columns);
+  ts->columns = NULL;
+  table_unlatch(ts, latched);
+  return ret;
+}
+
+void columns_open(TABLE_STATE* ts) {
+  char* name = sidecar_name(ts->file_name, "cols");
+  FILE* file = fopen(name, "rb");
+  free(name);
+  if (file == NULL)
+    return;
+  fseek(file, 0L, SEEK_END);
+  size_t size = ftell(file);
+  rewind(file);
+  unsigned char* data = malloc(size > COLS_HEADER ? size : COLS_HEADER);
+  size_t ok = fread(data, 1, size, file) == size && size >= COLS_HEADER && memcmp(data, COLS_MAGIC, 4) == 0;
+  fclose(file);
+  // written by another version or table was changed without the segments
+  ok = ok && get64(&data[SIDECAR_GENERATION_OFFSET]) == table_generation(ts)
+    && get64(&data[12]) == ZMAP_BLOCK_ROWS && get64(&data[20]) == ts->ncols
+    && get64(&data[COLS_ROWS_OFFSET]) == row_count(ts)
+    && COLS_HEADER + get64(&data[44]) * (sizeof(size_t) + 1) <= size;
+  if (!ok) {
+    free(data);
+    return;
+  }
+  COLUMNS* cs = calloc(1, sizeof(COLUMNS));
+  cs->data = data;
+  cs->size = size;
+  columns_load(ts, cs);
+  ts->columns = cs;
+}
+
+// Writes the blocks a commit made stale and the row count it left
+void columns_save(TABLE_STATE* ts) {
+  COLUMNS* cs = ts->columns;
+  if (cs == NULL)
+    return;
+  if (!cs->dirty && cs->saved_rows == row_count(ts)) {
+    sidecar_restamp(ts, "cols");
+    return;
+  }
+  char* name = sidecar_name(ts->file_name, "cols");
+  int fd = open(name, O_WRONLY);
+  free(name);
+  if (fd < 0)
+    return;
+  size_t gen = table_generation(ts), rows = row_count(ts);
+  pwrite(fd, cs->stale, (cs->nblocks + 7) / 8, cs->stale - cs->data);
+  pwrite(fd, &rows, sizeof(size_t), COLS_ROWS_OFFSET);
+  pwrite(fd, &gen, sizeof(size_t), SIDECAR_GENERATION_OFFSET);
+  close(fd);
+  cs->saved_rows = rows;
+  cs->dirty = 0;
+}
+
+void columns_close(TABLE_STATE* ts) {
+  if (ts->columns == NULL)
+    return;
+  columns_free(ts->columns);
+  ts->columns = NULL;
+}
+
+void column_row_changed(TABLE_STATE* ts, size_t row) {
+  COLUMNS* cs = ts->columns;
+  if (cs == NULL || row >= cs->rows)
+    return;
+  size_t block = row / ZMAP_BLOCK_ROWS;
+  cs->stale[block / 8] |= 1 << (block % 8);
+  cs->dirty = 1;
+}
+
+static int key_satisfies(uint64_t v, size_t op, uint64_t operand) {
+  if (op == PRED_EQ) return v == operand;
+  if (op == PRED_NE) return v != operand;
+  if (op == PRED_LT) return v < operand;
+  if (op == PRED_LE) return v <= operand;
+  if (op == PRED_GT) return v > operand;
+  if (op == PRED_GE) return v >= operand;
+  return 0;
+}
+
+static void sel_clear(uint64_t* sel, size_t first, size_t len) {
+  for (size_t i = first; i < first + len;) {
+    if (i % 64 == 0 && first + len - i >= 64) {
+      sel[i / 64] = 0;
+      i += 64;
+      continue;
+    }
+    sel[i / 64] &= ~(1ULL << (i % 64));
+    i++;
+  }
+}
+
+static size_t sel_count(const uint64_t* sel, size_t first, size_t len) {
+  if (len == 1)
+    return (sel[first / 64] >> (first % 64)) & 1;
+  size_t count = 0;
+  for (size_t i = first; i < first + len;) {
+    if (i % 64 == 0 && first + len - i >= 64) {
+      count += __builtin_popcountll(sel[i / 64]);
+      i += 64;
+      continue;
+    }
+    count += (sel[i / 64] >> (i % 64)) & 1;
+    i++;
+  }
+  return count;
+}
+
+// Clears the rows of sel whose value in the segment fails the predicate.
+// Each run and each distinct string is tested once, a value outside the
+// frame of a segment fails it without reading its rows
+static void segment_filter(const unsigned char* segment, size_t n, size_t type, size_t op, const void* value, uint64_t* sel) {
+  RUNS r;
+  runs_init(&r, segment, n);
+  unsigned char* pass = NULL;
+  uint64_t operand = 0;
+  if (TYPE_NUMBER(type) == TABLE_TYPE_VARCHAR) {
+    uint32_t ndict = get32(&segment[1]);
+    const char* strings = (const char*)&segment[9 + ndict * 4];
+    pass = malloc(ndict ? ndict : 1);
+    for (uint32_t i = 0; i < ndict; i++)
+      pass[i] = pred_match(type, op, &strings[get32(&segment[5 + i * 4])], value);
+  } else if (TYPE_NUMBER(type) == TABLE_TYPE_INT) {
+    operand = int_key(*(int*)value);
+  } else if (TYPE_NUMBER(type) == TABLE_TYPE_DATATIME) {
+    operand = datatime_key(value);
+  }
+  if (r.enc == COL_FOR && op == PRED_EQ && pass == NULL
+    && (operand < r.base || bit_width(operand - r.base) > r.bits)) {
+    sel_clear(sel, 0, n);
+    return;
+  }
+  uint64_t v;
+  size_t len, at = 0;
+  while (runs_next(&r, &v, &len)) {
+    int ok;
+    if (pass)
+      ok = pass[v];
+    else if (TYPE_NUMBER(type) == TABLE_TYPE_FLOAT) {
+      uint32_t bits = v;
+      float f;
+      memcpy(&f, &bits, sizeof(f));
+      ok = pred_match(type, op, &f, value);
+    } else
+      ok = key_satisfies(v, op, operand);
+    if (!ok)
+      sel_clear(sel, at, len);
+    at += len;
+  }
+  free(pass);
+}
+
+// Folds col of the live rows of a sealed block whose pred_col satisfies
+// op value, or of all its live rows if value is NULL, into fold. Runs of
+// equal values are folded at once.
+// Returns 1 if the block is not sealed or was changed since
+size_t column_fold(TABLE_STATE* ts, size_t block, size_t col, size_t pred_col, size_t op, const void* value, COLUMN_FOLD* fold) {
+  COLUMNS* cs = ts->columns;
+  if (cs == NULL || ts->snapshot || block >= cs->nblocks || (cs->stale[block / 8] & (1 << (block % 8))))
+    return 1;
+  const unsigned char* b = block_at(cs, block);
+  size_t n = get64(b);
+  uint64_t sel[ZMAP_BLOCK_ROWS / 64] = { 0 };
+  memcpy(sel, &b[8], (n + 7) / 8);
+  if (n % 64)
+    sel[n / 64] &= (1ULL << (n % 64)) - 1;
+  if (value)
+    segment_filter(segment_at(cs, block, pred_col), n, ts->col_types[pred_col], op, value, sel);
+  size_t type = ts->col_types[col];
+  RUNS r;
+  runs_init(&r, segment_at(cs, block, col), n);
+  uint64_t v;
+  size_t len, at = 0;
+  while (runs_next(&r, &v, &len)) {
+    size_t count = sel_count(sel, at, len);
+    at += len;
+    if (count == 0)
+      continue;
+    fold->count += count;
+    if (TYPE_NUMBER(type) == TABLE_TYPE_INT) {
+      int x = key_int(v);
+      fold->isum += (long long)x * count;
+      if (x < fold->imin) fold->imin = x;
+      if (x > fold->imax) fold->imax = x;
+    }
+    if (TYPE_NUMBER(type) == TABLE_TYPE_FLOAT) {
+      uint32_t bits = v;
+      float x;
+      memcpy(&x, &bits, sizeof(x));
+      fold->fsum += (double)x * count;
+      if (x < fold->fmin) fold->fmin = x;
+      if (x > fold->fmax) fold->fmax = x;
+    }
+    if (TYPE_NUMBER(type) == TABLE_TYPE_DATATIME) {
+      if (v < fold->tmin) fold->tmin = v;
+      if (v > fold->tmax) fold->tmax = v;
+    }
+  }
+  return 0;
+}
+
+// Bytes the segments of col take in all blocks
+size_t column_size(TABLE_STATE* ts, size_t col) {
+  COLUMNS* cs = ts->columns;
+  size_t size = 0;
+  for (size_t block = 0; cs && block < cs->nblocks; block++) {
+    const unsigned char* b = block_at(cs, block);
+    size += get64(&b[8 + COL_LIVE_BYTES + (col + 1) * 8]) - get64(&b[8 + COL_LIVE_BYTES + col * 8]);
+  }
+  return size;
+}
+
+// Name of the encoding of col in a block, NULL if it is not sealed
+const char* column_encoding(TABLE_STATE* ts, size_t block, size_t col) {
+  static const char* names[] = { NULL, "frame of reference", "delta", "run length", NULL, "xor" };
+  static const char* dict_names[] = { NULL, "dictionary, frame of reference codes", "dictionary, delta codes", "dictionary, run length codes" };
+  COLUMNS* cs = ts->columns;
+  if (cs == NULL || block >= cs->nblocks)
+    return NULL;
+  const unsigned char* segment = segment_at(cs, block, col);
+  if (segment[0] != COL_DICT)
+    return names[segment[0]];
+  RUNS r;
+  runs_init(&r, segment, 0);
+  return dict_names[r.enc];
+}
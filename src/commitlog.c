@@ -0,0 +1,292 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "file.h"
+
+// Sidecar view, <table>.log
+// [0]   "TLOG"
+// [4]   [size_t] last commit
+// [12]  [size_t] segment the next commit goes to
+//
+// Segment, <table>.log.<n>, a new one is started once LOG_SEGMENT_SIZE
+// is reached. Per commit
+// ...   [size_t] commit, [size_t] time in ms, [size_t] bytes of events
+//       then per event [size_t] type, [size_t] bytes, data
+// Rows are logged without their tree links
+//
+// Backup point, <backup>.logseq
+// [0]   [size_t] last commit in the backup
+
+#define LOG_MAGIC "TLOG"
+#define LOG_SEQ_OFFSET 4
+#define LOG_SEGMENT_OFFSET 12
+// events staged before a replay commits
+#define REPLAY_BATCH 4096
+
+static char* segment_name(const char* file_name, size_t segment) {
+  char* name = malloc(strlen(file_name) + 32);
+  sprintf(name, "%s.log.%ld", file_name, segment);
+  return name;
+}
+
+static size_t header_get(int fd, size_t offset) {
+  size_t value = 0;
+  pread(fd, &value, sizeof(size_t), offset);
+  return value;
+}
+
+static void header_set(int fd, size_t offset, size_t value) {
+  pwrite(fd, &value, sizeof(size_t), offset);
+}
+
+static size_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static size_t pred_length(const char* data) {
+  const char* it = data;
+  pred_free(pred_deserialize(&it));
+  return it - data;
+}
+
+// Bytes of the data of a stage event as it is logged
+static size_t event_size(TABLE_STATE* ts, const STAGE_EVENT* se) {
+  size_t col = *(size_t*)se->data;
+  switch (se->type) {
+  case SE_CREATE:
+    return ts->entry_size;
+  case SE_DELETE:
+    return sizeof(size_t) + TYPE_SIZE(ts->col_types[col]);
+  case SE_EDIT:
+    return sizeof(size_t) + 2 * TYPE_SIZE(ts->col_types[col]);
+  case SE_DELETE_WHERE:
+    return pred_length(se->data);
+  case SE_EDIT_WHERE:
+    return sizeof(size_t) + TYPE_SIZE(ts->col_types[col]) + pred_length(&se->data[sizeof(size_t) + TYPE_SIZE(ts->col_types[col])]);
+  }
+  return 0;
+}
+
+// 0 on success, 1 if the table is an LSM table or logged already. The log
+// starts at the table as it is now, a full backup is its base
+size_t log_enable(TABLE_STATE* ts) {
+  if (ts->lsm || ts->commit_log || ts->snapshot)
+    return 1;
+  log_remove(ts->file_name);
+  char* name = sidecar_name(ts->file_name, "log");
+  int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  free(name);
+  if (fd < 0)
+    return 1;
+  write(fd, LOG_MAGIC, 4);
+  header_set(fd, LOG_SEQ_OFFSET, 0);
+  header_set(fd, LOG_SEGMENT_OFFSET, 1);
+  close(fd);
+  log_open(ts);
+  return 0;
+}
+
+void log_open(TABLE_STATE* ts) {
+  char* name = sidecar_name(ts->file_name, "log");
+  int fd = open(name, O_RDWR);
+  free(name);
+  if (fd < 0)
+    return;
+  char magic[4];
+  if (pread(fd, magic, 4, 0) != 4 || memcmp(magic, LOG_MAGIC, 4) != 0) {
+    close(fd);
+    return;
+  }
+  ts->commit_log = calloc(1, sizeof(COMMIT_LOG));
+  ts->commit_log->fd = fd;
+}
+
+// Appends the events of a commit to the log before they are applied,
+// called with the table locked for writing
+void log_commit(TABLE_STATE* ts, const struct darray* stage) {
+  COMMIT_LOG* log = ts->commit_log;
+  if (log == NULL || stage->count == 0)
+    return;
+  size_t bytes = 0;
+  for (size_t i = 0; i < stage->count; i++)
+    bytes += 2 * sizeof(size_t) + event_size(ts, stage->items[i]);
+  size_t head[3] = { header_get(log->fd, LOG_SEQ_OFFSET) + 1, now_ms(), bytes };
+  char* record = malloc(sizeof(head) + bytes);
+  memcpy(record, head, sizeof(head));
+  char* it = &record[sizeof(head)];
+  for (size_t i = 0; i < stage->count; i++) {
+    STAGE_EVENT* se = stage->items[i];
+    size_t size = event_size(ts, se);
+    memcpy(it, &se->type, sizeof(size_t));
+    memcpy(&it[sizeof(size_t)], &size, sizeof(size_t));
+    if (se->type == SE_CREATE)
+      memcpy(&it[2 * sizeof(size_t)], &se->data[ts->entry_metadata_size], size);
+    else
+      memcpy(&it[2 * sizeof(size_t)], se->data, size);
+    it += 2 * sizeof(size_t) + size;
+  }
+  size_t segment = header_get(log->fd, LOG_SEGMENT_OFFSET);
+  char* name = segment_name(ts->file_name, segment);
+  struct stat st;
+  if (stat(name, &st) == 0 && st.st_size >= LOG_SEGMENT_SIZE) {
+    free(name);
+    header_set(log->fd, LOG_SEGMENT_OFFSET, ++segment);
+    name = segment_name(ts->file_name, segment);
+  }
+  int fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  free(name);
+  if (fd >= 0) {
+    write(fd, record, sizeof(head) + bytes);
+    close(fd);
+    header_set(log->fd, LOG_SEQ_OFFSET, head[0]);
+  }
+  free(record);
+}
+
+void log_close(TABLE_STATE* ts) {
+  COMMIT_LOG* log = ts->commit_log;
+  if (log == NULL)
+    return;
+  close(log->fd);
+  free(log);
+  ts->commit_log = NULL;
+}
+
+void log_remove(const char* file_name) {
+  char* name = sidecar_name(file_name, "log");
+  int fd = open(name, O_RDONLY);
+  if (fd >= 0) {
+    size_t last = header_get(fd, LOG_SEGMENT_OFFSET);
+    for (size_t s = 1; s <= last; s++) {
+      char* segment = segment_name(file_name, s);
+      unlink(segment);
+      free(segment);
+    }
+    close(fd);
+  }
+  unlink(name);
+  free(name);
+}
+
+// Last commit in the log of the table, 0 if it has none
+size_t log_seq(const char* file_name) {
+  char* name = sidecar_name(file_name, "log");
+  int fd = open(name, O_RDONLY);
+  free(name);
+  if (fd < 0)
+    return 0;
+  size_t seq = header_get(fd, LOG_SEQ_OFFSET);
+  close(fd);
+  return seq;
+}
+
+// Notes the last commit a full backup of the table holds next to it, or
+// forgets an older note if the table has no log. Called with the commit
+// byte shared for as long as the backup copies the table
+void log_backup_point(const char* file_name, const char* backup_name) {
+  char* name = sidecar_name(backup_name, "logseq");
+  char* log = sidecar_name(file_name, "log");
+  if (access(log, F_OK) == 0) {
+    size_t seq = log_seq(file_name);
+    FILE* file = fopen(name, "wb");
+    if (file) {
+      fwrite(&seq, sizeof(size_t), 1, file);
+      fclose(file);
+    }
+  } else {
+    unlink(name);
+  }
+  free(log);
+  free(name);
+}
+
+static STAGE_EVENT* event_read(TABLE_STATE* ts, const char* it, size_t* used) {
+  STAGE_EVENT* se = malloc(sizeof(STAGE_EVENT));
+  size_t size;
+  memcpy(&se->type, it, sizeof(size_t));
+  memcpy(&size, &it[sizeof(size_t)], sizeof(size_t));
+  if (se->type == SE_CREATE) {
+    se->data = calloc(1, ts->entry_raw_size);
+    memcpy(&se->data[ts->entry_metadata_size], &it[2 * sizeof(size_t)], size);
+  } else {
+    se->data = malloc(size);
+    memcpy(se->data, &it[2 * sizeof(size_t)], size);
+  }
+  *used = 2 * sizeof(size_t) + size;
+  return se;
+}
+
+// Restores the full backup backup_name of the table logged at log_name to
+// file_name and replays the commits of the log after it, up to commit seq
+// and commits made up to time in ms, (size_t)-1 for no limit. Commits are
+// staged REPLAY_BATCH events at a time and applied together.
+// Returns 1 if the backup has no backup point or the restore failed
+size_t restore_to_point(const char* file_name, const char* backup_name, const char* log_name, size_t seq, size_t time) {
+  char* name = sidecar_name(backup_name, "logseq");
+  FILE* point = fopen(name, "rb");
+  free(name);
+  size_t base;
+  if (point == NULL)
+    return 1;
+  size_t ok = fread(&base, sizeof(size_t), 1, point) == 1;
+  fclose(point);
+  if (!ok || archive(1, file_name, backup_name) != 0)
+    return 1;
+  // the sidecars of the table restored over are built again, its backup
+  // chain is no longer its chain
+  name = sidecar_name(file_name, "dirty");
+  unlink(name);
+  free(name);
+  table_replaced(file_name);
+  TABLE_STATE ts = { 0 };
+  if (open_table(file_name, &ts) != 0)
+    return 1;
+  // the replay is not logged again
+  log_close(&ts);
+  size_t staged = 0, done = 0;
+  for (size_t segment = 1; !done; segment++) {
+    name = segment_name(log_name, segment);
+    FILE* file = fopen(name, "rb");
+    free(name);
+    if (file == NULL)
+      break;
+    fseek(file, 0L, SEEK_END);
+    size_t size = ftell(file);
+    rewind(file);
+    char* buf = malloc(size);
+    size = fread(buf, 1, size, file);
+    fclose(file);
+    for (size_t at = 0; !done && at + 3 * sizeof(size_t) <= size;) {
+      size_t head[3];
+      memcpy(head, &buf[at], sizeof(head));
+      if (head[0] > seq || head[1] > time || at + sizeof(head) + head[2] > size) {
+        done = 1;
+        break;
+      }
+      at += sizeof(head);
+      if (head[0] > base) {
+        for (size_t used = 0; used < head[2];) {
+          size_t n;
+          stage_push(&ts, event_read(&ts, &buf[at + used], &n));
+          used += n;
+          staged++;
+        }
+      }
+      at += head[2];
+      // whole commits go into a batch
+      if (staged >= REPLAY_BATCH) {
+        commit_changes(&ts);
+        staged = 0;
+      }
+    }
+    free(buf);
+  }
+  commit_changes(&ts);
+  close_table(&ts);
+  return 0;
+}
@@ -0,0 +1,123 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+#include <sys/stat.h>
+
+// A table of mostly padding is compressed, then changed the same way as
+// a plain twin of it. Decompressed it is the twin byte for byte
+#define ROWS 20000
+#define COMMITS 100
+
+static size_t file_size(const char* name) {
+  struct stat st;
+  return stat(name, &st) == 0 ? st.st_size : 0;
+}
+
+static int same_file(const char* a, const char* b) {
+  FILE* fa = fopen(a, "rb");
+  FILE* fb = fopen(b, "rb");
+  int same = fa && fb;
+  char ba[4096], bb[4096];
+  while (same) {
+    size_t na = fread(ba, 1, sizeof(ba), fa);
+    size_t nb = fread(bb, 1, sizeof(bb), fb);
+    same = na == nb && memcmp(ba, bb, na) == 0;
+    if (na == 0)
+      break;
+  }
+  if (fa) fclose(fa);
+  if (fb) fclose(fb);
+  return same;
+}
+
+static void fill(const char* file_name) {
+  size_t col_types[3] = {
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int)) | KEY_FIELD,
+    MAKE_TYPE(TABLE_TYPE_VARCHAR, 64),
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int))
+  };
+  const char* col_names[] = { "id", "city", "visits" };
+  if (access(file_name, F_OK) == 0)
+    delete_table(file_name);
+  create_table(3, 32, col_types, col_names, file_name);
+  TABLE_STATE ts = { 0 };
+  open_table(file_name, &ts);
+  char city[64];
+  for (int i = 0; i < ROWS; i++) {
+    snprintf(city, sizeof(city), "city %d", i % 300);
+    create_entry(&ts, 3, i, city, i % 7);
+  }
+  commit_changes(&ts);
+  close_table(&ts);
+}
+
+// Edits, deletes and new rows, some of them in the slots the deletes free
+static double change(const char* file_name) {
+  TABLE_STATE ts = { 0 };
+  open_table(file_name, &ts);
+  for (int c = 0; c < 5; c++) {
+    for (int i = 0; i < 200; i++) {
+      int id = (c * 3001 + i * 97) % ROWS, visits = 1000 + c;
+      PRED* where = pred_cmp(0, PRED_EQ, &id, &ts);
+      edit_where(where, 2, &visits, &ts);
+      pred_free(where);
+    }
+    for (int i = 0; i < 50; i++) {
+      int id = c * 50 + i;
+      delete_entry(0, &id, &ts);
+    }
+    commit_changes(&ts);
+    for (int i = 0; i < 80; i++)
+      create_entry(&ts, 3, ROWS + c * 80 + i, "a new city", c);
+    commit_changes(&ts);
+  }
+  AGG_RESULT result;
+  aggregate(AGG_SUM, 2, 0, NULL, &ts, &result);
+  close_table(&ts);
+  return result.value;
+}
+
+// Many small commits, each a few edits
+static void churn(const char* file_name) {
+  TABLE_STATE ts = { 0 };
+  open_table(file_name, &ts);
+  for (int c = 0; c < COMMITS; c++) {
+    for (int i = 0; i < 20; i++) {
+      int id = (c * 3001 + i * 97) % ROWS, visits = 2000 + c;
+      PRED* where = pred_cmp(0, PRED_EQ, &id, &ts);
+      edit_where(where, 2, &visits, &ts);
+      pred_free(where);
+    }
+    commit_changes(&ts);
+  }
+  close_table(&ts);
+}
+
+int main () {
+  const char* file_name = "data/visits.bin";
+  const char* twin = "data/visits.twin";
+  fill(file_name);
+  fill(twin);
+  size_t raw = file_size(file_name);
+  table_compress(file_name);
+  printf("%ld bytes of table in a file of %ld bytes\n", raw, file_size(file_name));
+
+  double sum = change(file_name);
+  double twin_sum = change(twin);
+  printf("after the same changes: %ld bytes compressed, %ld plain, visits %s\n", file_size(file_name), file_size(twin),
+    sum == twin_sum ? "match" : "differ");
+  // the space of the slots pages leave is written again, the file does not
+  // grow with every commit
+  size_t before = file_size(file_name);
+  churn(file_name);
+  churn(twin);
+  printf("after %d more commits: %ld bytes compressed, %s\n", COMMITS, file_size(file_name),
+    file_size(file_name) <= before ? "no larger" : "larger");
+  table_decompress(file_name);
+  printf("decompressed %s the plain table\n", same_file(file_name, twin) ? "equals" : "differs from");
+
+  delete_table(file_name);
+  delete_table(twin);
+  printf("\n");
+
+  return 0;
+}
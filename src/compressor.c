@@ -1,6 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
 #include "zlib.h"
 
 #if defined(MSDOS) || defined(OS2) || defined(WIN32) || defined(__CYGWIN__)
@@ -13,6 +17,25 @@
 
 #define CHUNK 16384
 
+/* Backups are a framed container: the table is cut into BACKUP_BLOCK_SIZE
+   blocks that worker threads compress on their own, each into a zlib
+   stream of its own.
+   [BACKUP_MAGIC][size_t block size][size_t length of the table] then for
+   every block [size_t length][size_t compressed length][zlib stream]
+   then the block index, for every block [size_t offset of its frame],
+   and [size_t blocks][size_t offset of the index][BACKUP_INDEX_MAGIC]
+   A restore inflates the blocks a wave at a time, every worker writes its
+   block at its offset. backup_pread() finds the blocks of a range through
+   the index and inflates only those. BACKUP_MAGIC_V1 backups have neither
+   the length nor the index. Backups without a magic are one zlib stream
+   and are restored by inf() */
+#define BACKUP_MAGIC "TBK2"
+#define BACKUP_MAGIC_V1 "TBK1"
+#define BACKUP_INDEX_MAGIC "TBKX"
+#define DELTA_MAGIC "TBD1"
+#define BACKUP_BLOCK_SIZE (1 << 20)
+#define BACKUP_MAX_THREADS 16
+
 /* Compress from file source to file dest until EOF on source.
    def() returns Z_OK on success, Z_MEM_ERROR if memory could not be
    allocated for processing, Z_STREAM_ERROR if an invalid compression
@@ -133,6 +156,291 @@ int inf(FILE *source, FILE *dest)
     return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
 }
 
+/* Fills buf with len bytes of the table at offset, 0 on success */
+typedef int (*BACKUP_FILL)(void* cookie, void* buf, size_t len, size_t offset);
+
+typedef struct {
+  int fd;             /* of the table, -1 if raw is filled for the worker */
+  size_t offset;      /* of the block in the table */
+  size_t len;
+  size_t comp_len;
+  size_t comp_size;   /* of the comp buffer */
+  unsigned char* raw;
+  unsigned char* comp;
+  int level;
+  int ret;
+  int started;        /* thread is to be joined */
+  pthread_t thread;
+} BLOCK_WORKER;
+
+static size_t backup_threads(void) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cores < 1) return 1;
+  return cores < BACKUP_MAX_THREADS ? cores : BACKUP_MAX_THREADS;
+}
+
+static BLOCK_WORKER* workers_alloc(size_t threads, int fd, int level) {
+  BLOCK_WORKER* workers = calloc(threads, sizeof(BLOCK_WORKER));
+  for (size_t t = 0; t < threads; t++) {
+    workers[t].fd = fd;
+    workers[t].level = level;
+    workers[t].comp_size = compressBound(BACKUP_BLOCK_SIZE);
+    workers[t].raw = malloc(BACKUP_BLOCK_SIZE);
+    workers[t].comp = malloc(workers[t].comp_size);
+  }
+  return workers;
+}
+
+static void workers_free(BLOCK_WORKER* workers, size_t threads) {
+  for (size_t t = 0; t < threads; t++) {
+    free(workers[t].raw);
+    free(workers[t].comp);
+  }
+  free(workers);
+}
+
+static void* deflate_block(void* arg) {
+  BLOCK_WORKER* w = arg;
+  if (w->fd >= 0 && pread(w->fd, w->raw, w->len, w->offset) != (ssize_t)w->len) {
+    w->ret = Z_ERRNO;
+    return NULL;
+  }
+  uLongf comp_len = w->comp_size;
+  w->ret = compress2(w->comp, &comp_len, w->raw, w->len, w->level);
+  w->comp_len = comp_len;
+  return NULL;
+}
+
+static void* inflate_block(void* arg) {
+  BLOCK_WORKER* w = arg;
+  uLongf len = BACKUP_BLOCK_SIZE;
+  w->ret = uncompress(w->raw, &len, w->comp, w->comp_len);
+  if (w->ret == Z_OK && len != w->len)
+    w->ret = Z_DATA_ERROR;
+  if (w->ret == Z_OK && pwrite(w->fd, w->raw, len, w->offset) != (ssize_t)len)
+    w->ret = Z_ERRNO;
+  return NULL;
+}
+
+/* Runs the block on a thread of its own, or on the calling one if no
+   thread can be started */
+static void worker_start(BLOCK_WORKER* w, void* (*block)(void*))
+{
+  w->started = pthread_create(&w->thread, NULL, block, w) == 0;
+  if (!w->started)
+    block(w);
+}
+
+static void workers_join(BLOCK_WORKER* workers, size_t n)
+{
+  for (size_t t = 0; t < n; t++) {
+    if (workers[t].started)
+      pthread_join(workers[t].thread, NULL);
+    workers[t].started = 0;
+  }
+}
+
+/* Compress count ranges of the file behind source to dest in waves, the
+   ranges of a wave in parallel, their frames in order. offsets go in
+   front of the frames if framed_offsets. Where the frames start in dest
+   goes to frames unless it is NULL. With a fill the ranges are read
+   through it, one after the other, instead of from source.
+   Returns Z_OK or the first error of a range */
+static int def_ranges(int source, FILE *dest, const size_t *offsets, const size_t *lens, size_t count, int framed_offsets, size_t *frames,
+  BACKUP_FILL fill, void* cookie, int level)
+{
+  size_t threads = backup_threads();
+  BLOCK_WORKER* workers = workers_alloc(threads, fill ? -1 : source, level);
+  int ret = Z_OK;
+  for (size_t wave = 0; ret == Z_OK && wave < count; wave += threads) {
+    size_t n = count - wave < threads ? count - wave : threads;
+    for (size_t t = 0; t < n; t++) {
+      BLOCK_WORKER* w = &workers[t];
+      w->offset = offsets[wave + t];
+      w->len = lens[wave + t];
+      assert(w->len <= BACKUP_BLOCK_SIZE);
+      w->ret = Z_OK;
+      if (fill && fill(cookie, w->raw, w->len, w->offset) != 0)
+        w->ret = Z_ERRNO;
+      else
+        worker_start(w, deflate_block);
+    }
+    workers_join(workers, n);
+    for (size_t t = 0; ret == Z_OK && t < n; t++) {
+      BLOCK_WORKER* w = &workers[t];
+      ret = w->ret;
+      if (ret != Z_OK)
+        break;
+      if (frames)
+        frames[wave + t] = ftell(dest);
+      if (framed_offsets)
+        fwrite(&w->offset, sizeof(size_t), 1, dest);
+      fwrite(&w->len, sizeof(size_t), 1, dest);
+      fwrite(&w->comp_len, sizeof(size_t), 1, dest);
+      if (fwrite(w->comp, 1, w->comp_len, dest) != w->comp_len || ferror(dest))
+        ret = Z_ERRNO;
+    }
+  }
+  workers_free(workers, threads);
+  return ret;
+}
+
+/* Inflate up to limit frames of source, or up to its end, into the file
+   behind dest, a wave at a time. Without framed offsets the frames follow
+   each other from offset 0. *end is where the last frame ends */
+static int inf_ranges(FILE *source, int dest, int framed_offsets, size_t limit, size_t *end)
+{
+  size_t threads = backup_threads();
+  BLOCK_WORKER* workers = workers_alloc(threads, dest, 0);
+  size_t total = 0;
+  int ret = Z_OK, done = 0;
+  *end = 0;
+  while (ret == Z_OK && !done) {
+    size_t n = 0;
+    for (; ret == Z_OK && n < threads; n++) {
+      BLOCK_WORKER* w = &workers[n];
+      w->offset = total;
+      if (limit-- == 0) {
+        done = 1;
+        break;
+      }
+      if (framed_offsets ? fread(&w->offset, sizeof(size_t), 1, source) != 1
+                         : fread(&w->len, sizeof(size_t), 1, source) != 1) {
+        done = 1;
+        break;
+      }
+      if ((framed_offsets && fread(&w->len, sizeof(size_t), 1, source) != 1)
+        || fread(&w->comp_len, sizeof(size_t), 1, source) != 1
+        || w->len > BACKUP_BLOCK_SIZE || w->comp_len > w->comp_size
+        || fread(w->comp, 1, w->comp_len, source) != w->comp_len)
+        ret = Z_DATA_ERROR;
+      total = w->offset + w->len;
+      if (total > *end)
+        *end = total;
+    }
+    if (ret != Z_OK)
+      break;
+    for (size_t t = 0; t < n; t++)
+      worker_start(&workers[t], inflate_block);
+    workers_join(workers, n);
+    for (size_t t = 0; ret == Z_OK && t < n; t++)
+      ret = workers[t].ret;
+  }
+  workers_free(workers, threads);
+  return ret;
+}
+
+/* Compress size bytes of the file behind source, or of fill if it is not
+   NULL, to dest as a framed backup.
+   Returns Z_OK or the first error of a block */
+static int def_table(int source, size_t size, BACKUP_FILL fill, void* cookie, FILE *dest, int level)
+{
+  size_t block_size = BACKUP_BLOCK_SIZE;
+  size_t nblocks = (size + block_size - 1) / block_size;
+  size_t* offsets = malloc((nblocks + 1) * sizeof(size_t));
+  size_t* lens = malloc((nblocks + 1) * sizeof(size_t));
+  for (size_t b = 0; b < nblocks; b++) {
+    offsets[b] = b * block_size;
+    lens[b] = size - offsets[b] < block_size ? size - offsets[b] : block_size;
+  }
+  size_t* frames = malloc((nblocks + 1) * sizeof(size_t));
+  size_t table_size = size;
+  fwrite(BACKUP_MAGIC, 1, 4, dest);
+  fwrite(&block_size, sizeof(size_t), 1, dest);
+  fwrite(&table_size, sizeof(size_t), 1, dest);
+  int ret = def_ranges(source, dest, offsets, lens, nblocks, 0, frames, fill, cookie, level);
+  if (ret == Z_OK) {
+    size_t index = ftell(dest);
+    fwrite(frames, sizeof(size_t), nblocks, dest);
+    fwrite(&nblocks, sizeof(size_t), 1, dest);
+    fwrite(&index, sizeof(size_t), 1, dest);
+    if (fwrite(BACKUP_INDEX_MAGIC, 1, 4, dest) != 4 || ferror(dest))
+      ret = Z_ERRNO;
+  }
+  free(offsets);
+  free(lens);
+  free(frames);
+  return ret;
+}
+
+int def_blocks(int source, FILE *dest, int level)
+{
+  off_t size = lseek(source, 0, SEEK_END);
+  if (size < 0)
+    return Z_ERRNO;
+  return def_table(source, size, NULL, NULL, dest, level);
+}
+
+/* Restore a framed backup from source, read past its magic, into the file
+   behind dest, which is cut to the length of the table. A v1 backup has
+   no length, its frames go on to the end of source */
+int inf_blocks(FILE *source, int dest, int v1)
+{
+  size_t block_size, table_size = 0, total;
+  if (fread(&block_size, sizeof(size_t), 1, source) != 1 || block_size == 0 || block_size > BACKUP_BLOCK_SIZE
+    || (!v1 && fread(&table_size, sizeof(size_t), 1, source) != 1))
+    return Z_DATA_ERROR;
+  size_t limit = v1 ? (size_t)-1 : (table_size + block_size - 1) / block_size;
+  int ret = inf_ranges(source, dest, 0, limit, &total);
+  if (ret == Z_OK && !v1 && total != table_size)
+    ret = Z_DATA_ERROR;
+  if (ret == Z_OK && ftruncate(dest, total) != 0)
+    ret = Z_ERRNO;
+  return ret;
+}
+
+/* Reads size bytes at offset of the table in a backup, inflating only the
+   blocks that hold them. Returns the number of bytes read, less than size
+   at the end of the table, 0 on an error or a backup without an index */
+size_t backup_pread(const char* backup_name, void* buf, size_t size, size_t offset)
+{
+  FILE* backup = fopen(backup_name, "rb");
+  if (backup == NULL)
+    return 0;
+  char magic[4] = { 0 }, index_magic[4] = { 0 };
+  size_t block_size, table_size, nblocks, index, done = 0;
+  if (fread(magic, 1, 4, backup) != 4 || memcmp(magic, BACKUP_MAGIC, 4) != 0
+    || fread(&block_size, sizeof(size_t), 1, backup) != 1 || block_size == 0 || block_size > BACKUP_BLOCK_SIZE
+    || fread(&table_size, sizeof(size_t), 1, backup) != 1
+    || fseek(backup, -(long)(2 * sizeof(size_t) + 4), SEEK_END) != 0
+    || fread(&nblocks, sizeof(size_t), 1, backup) != 1
+    || fread(&index, sizeof(size_t), 1, backup) != 1
+    || fread(index_magic, 1, 4, backup) != 4 || memcmp(index_magic, BACKUP_INDEX_MAGIC, 4) != 0
+    || nblocks != (table_size + block_size - 1) / block_size) {
+    fclose(backup);
+    return 0;
+  }
+  if (offset >= table_size)
+    size = 0;
+  else if (size > table_size - offset)
+    size = table_size - offset;
+  unsigned char* raw = malloc(block_size);
+  unsigned char* comp = malloc(compressBound(block_size));
+  while (done < size) {
+    size_t at = offset + done, block = at / block_size, frame, len, comp_len;
+    uLongf raw_len = block_size;
+    if (fseek(backup, index + block * sizeof(size_t), SEEK_SET) != 0
+      || fread(&frame, sizeof(size_t), 1, backup) != 1
+      || fseek(backup, frame, SEEK_SET) != 0
+      || fread(&len, sizeof(size_t), 1, backup) != 1
+      || fread(&comp_len, sizeof(size_t), 1, backup) != 1
+      || len > block_size || comp_len > compressBound(block_size)
+      || fread(comp, 1, comp_len, backup) != comp_len
+      || uncompress(raw, &raw_len, comp, comp_len) != Z_OK || raw_len != len) {
+      done = 0;
+      break;
+    }
+    size_t from = at - block * block_size;
+    size_t n = len - from < size - done ? len - from : size - done;
+    memcpy((char*)buf + done, raw + from, n);
+    done += n;
+  }
+  free(raw);
+  free(comp);
+  fclose(backup);
+  return done;
+}
+
 /* report a zlib or i/o error */
 void zerr(int ret)
 {
@@ -174,7 +482,9 @@ int archive(int decompress, const char* table_name, const char* backup_name)
     FILE* backup = fopen(backup_name, "rb+");
 
     if (!decompress) {
-        ret = def(table, backup, Z_DEFAULT_COMPRESSION);
+        /* a framed backup is not followed by what an older one left */
+        ftruncate(fileno(backup), 0);
+        ret = def_blocks(fileno(table), backup, Z_DEFAULT_COMPRESSION);
         if (ret != Z_OK)
             zerr(ret);
         fflush(backup);
@@ -182,7 +492,16 @@ int archive(int decompress, const char* table_name, const char* backup_name)
 
     /* do decompression if -d specified */
     else if (decompress) {
-        ret = inf(backup, table);
+        char magic[4] = { 0 };
+        size_t got = fread(magic, 1, 4, backup);
+        if (got == 4 && memcmp(magic, BACKUP_MAGIC, 4) == 0) {
+            ret = inf_blocks(backup, fileno(table), 0);
+        } else if (got == 4 && memcmp(magic, BACKUP_MAGIC_V1, 4) == 0) {
+            ret = inf_blocks(backup, fileno(table), 1);
+        } else {
+            rewind(backup);
+            ret = inf(backup, table);
+        }
         if (ret != Z_OK)
             zerr(ret);
         fflush(table);
@@ -192,3 +511,66 @@ int archive(int decompress, const char* table_name, const char* backup_name)
     fclose(backup);
     return ret;
 }
+
+/* Incremental backups hold the changed ranges of the table only:
+   [DELTA_MAGIC][size_t length of the table] then for every range
+   [size_t offset][size_t length][size_t compressed length][zlib stream]
+   Ranges are at most BACKUP_BLOCK_SIZE long */
+int archive_ranges(const char* table_name, const char* delta_name, const size_t* offsets, const size_t* lens, size_t count)
+{
+  int source = open(table_name, O_RDONLY);
+  if (source < 0)
+    return Z_ERRNO;
+  FILE* delta = fopen(delta_name, "wb");
+  if (delta == NULL) {
+    close(source);
+    return Z_ERRNO;
+  }
+  size_t size = lseek(source, 0, SEEK_END);
+  fwrite(DELTA_MAGIC, 1, 4, delta);
+  fwrite(&size, sizeof(size_t), 1, delta);
+  int ret = def_ranges(source, delta, offsets, lens, count, 1, NULL, NULL, NULL, Z_DEFAULT_COMPRESSION);
+  if (ret != Z_OK)
+    zerr(ret);
+  fclose(delta);
+  close(source);
+  return ret;
+}
+
+/* Writes the ranges of an incremental backup over the table and gives the
+   table the length it had */
+int restore_ranges(const char* table_name, const char* delta_name)
+{
+  FILE* delta = fopen(delta_name, "rb");
+  if (delta == NULL)
+    return Z_ERRNO;
+  int dest = open(table_name, O_WRONLY | O_CREAT, 0644);
+  char magic[4] = { 0 };
+  size_t size, end;
+  int ret = Z_DATA_ERROR;
+  if (dest >= 0 && fread(magic, 1, 4, delta) == 4 && memcmp(magic, DELTA_MAGIC, 4) == 0
+    && fread(&size, sizeof(size_t), 1, delta) == 1)
+    ret = inf_ranges(delta, dest, 1, (size_t)-1, &end);
+  if (ret == Z_OK && ftruncate(dest, size) != 0)
+    ret = Z_ERRNO;
+  if (ret != Z_OK)
+    zerr(ret);
+  if (dest >= 0)
+    close(dest);
+  fclose(delta);
+  return ret;
+}
+
+/* Writes a full backup of a table of size bytes that fill reads, for
+   tables that are not to be read from their file as it is */
+int archive_fill(const char* backup_name, size_t size, BACKUP_FILL fill, void* cookie)
+{
+  FILE* backup = fopen(backup_name, "wb");
+  if (backup == NULL)
+    return Z_ERRNO;
+  int ret = def_table(-1, size, fill, cookie, backup, Z_DEFAULT_COMPRESSION);
+  if (ret != Z_OK)
+    zerr(ret);
+  fclose(backup);
+  return ret;
+}
@@ -0,0 +1,14 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+
+int main () {
+  TABLE_STATE table_state = { 0 };
+  open_table("data/table.bin", &table_state);
+  size_t ret = bitmap_index_create(2, &table_state);
+  if (ret == 2) {
+    fprintf(stderr, "Too many distinct values for a bitmap index\n");
+  }
+  close_table(&table_state);
+  
+  return 0;
+}
@@ -0,0 +1,124 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+
+// Daily backups of a table that changes a little every day go into one
+// chunk store, each keeps the chunks the days before did not have
+#define ROWS 20000
+#define DAYS 3
+
+static void copy_file(const char* from, const char* to) {
+  FILE* in = fopen(from, "rb");
+  FILE* out = fopen(to, "wb");
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    fwrite(buf, 1, n, out);
+  fclose(in);
+  fclose(out);
+}
+
+static int same_file(const char* a, const char* b) {
+  FILE* fa = fopen(a, "rb");
+  FILE* fb = fopen(b, "rb");
+  int same = fa && fb;
+  char ba[4096], bb[4096];
+  while (same) {
+    size_t na = fread(ba, 1, sizeof(ba), fa);
+    size_t nb = fread(bb, 1, sizeof(bb), fb);
+    same = na == nb && memcmp(ba, bb, na) == 0;
+    if (na == 0)
+      break;
+  }
+  if (fa) fclose(fa);
+  if (fb) fclose(fb);
+  return same;
+}
+
+int main () {
+  const char* file_name = "data/orders.bin";
+  const char* store = "data/orders.store";
+  size_t col_types[3] = {
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int)) | KEY_FIELD,
+    MAKE_TYPE(TABLE_TYPE_VARCHAR, 64),
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int))
+  };
+  const char* col_names[] = { "id", "item", "quantity" };
+  if (access(file_name, F_OK) == 0)
+    delete_table(file_name);
+  create_table(3, 32, col_types, col_names, file_name);
+  TABLE_STATE ts = { 0 };
+  open_table(file_name, &ts);
+  char item[64];
+  for (int i = 0; i < ROWS; i++) {
+    snprintf(item, sizeof(item), "item %d of catalog page %d", (i * 7919) % 5000, i % 97);
+    create_entry(&ts, 3, i, item, i % 10 + 1);
+  }
+  commit_changes(&ts);
+
+  char backup[32], copy[64];
+  for (int day = 1; day <= DAYS; day++) {
+    if (day > 1) {
+      // a few orders change, a few come in
+      for (int i = 0; i < 10; i++) {
+        int id = (day * 4099 + i * 1777) % ROWS, quantity = 100 + day;
+        PRED* where = pred_cmp(0, PRED_EQ, &id, &ts);
+        edit_where(where, 2, &quantity, &ts);
+        pred_free(where);
+      }
+      for (int i = 0; i < 50; i++)
+        create_entry(&ts, 3, ROWS + day * 50 + i, "new item", day);
+      commit_changes(&ts);
+    }
+    snprintf(backup, sizeof(backup), "day%d", day);
+    snprintf(copy, sizeof(copy), "data/orders.day%d", day);
+    copy_file(file_name, copy);
+    CHUNK_STATS stats;
+    chunk_backup(file_name, store, backup, &stats);
+    printf("%s: %ld of %ld chunks new, %ld of %ld bytes written\n", backup, stats.new_chunks, stats.chunks, stats.new_bytes, stats.bytes);
+  }
+  close_table(&ts);
+
+  for (int day = 1; day <= DAYS; day++) {
+    snprintf(backup, sizeof(backup), "day%d", day);
+    snprintf(copy, sizeof(copy), "data/orders.day%d", day);
+    chunk_restore("data/orders.restore", store, backup);
+    printf("%s restored %s\n", backup, same_file(copy, "data/orders.restore") ? "identical" : "different");
+    unlink(copy);
+    unlink("data/orders.restore");
+  }
+  for (int day = 1; day <= DAYS; day++) {
+    snprintf(backup, sizeof(backup), "day%d", day);
+    chunk_backup_delete(store, backup);
+  }
+  printf("store %s after the last backup is deleted\n", access(store, F_OK) == 0 ? "left" : "gone");
+  delete_table(file_name);
+
+  // orders brought back over themselves build their bitmap index again
+  create_table(3, 32, col_types, col_names, file_name);
+  ts = (TABLE_STATE){ 0 };
+  open_table(file_name, &ts);
+  bitmap_index_create(2, &ts);
+  for (int i = 0; i < ROWS; i++)
+    create_entry(&ts, 3, i, "item", 1);
+  commit_changes(&ts);
+  chunk_backup(file_name, store, "before", NULL);
+  int one = 1, two = 2;
+  PRED* where = pred_cmp(2, PRED_EQ, &one, &ts);
+  edit_where(where, 2, &two, &ts);
+  pred_free(where);
+  commit_changes(&ts);
+  close_table(&ts);
+  chunk_restore(file_name, store, "before");
+  ts = (TABLE_STATE){ 0 };
+  open_table(file_name, &ts);
+  where = pred_cmp(2, PRED_EQ, &one, &ts);
+  size_t found = find_where(where, &ts, NULL, NULL);
+  pred_free(where);
+  close_table(&ts);
+  printf("restored over orders with a bitmap index: %ld of %d orders of quantity 1\n", found, ROWS);
+  chunk_backup_delete(store, "before");
+  delete_table(file_name);
+  printf("\n");
+
+  return 0;
+}
@@ -7,7 +7,9 @@ int main () {
   open_table("data/table.bin", &table_state);
 
   size_t datatime = encode_datatime(2024, 12, 14, 11, 11, 11, 123);
-  delete_entry(2, &datatime, &table_state);
+  PRED* where = pred_cmp(2, PRED_EQ, &datatime, &table_state);
+  delete_where(where, &table_state);
+  pred_free(where);
   commit_changes(&table_state);
 
   close_table(&table_state);
@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "file.h"
+
+// Sidecar view, <table>.dirty, exists while the table has a backup chain
+// [0]   "DRTY"
+// [4]   [size_t] number of the next incremental backup
+// [12]  [size_t] 1 while a commit writes the table, until its pages are in
+// [20]  [size_t] length of the name of the full backup
+// [28]  name of the full backup
+// ...   [size_t] pages, then a bit per page changed since the last backup
+//
+// Commits OR their pages in under an exclusive flock of the sidecar. An
+// incremental backup shares the commit byte of the table and takes the
+// flock for as long as it reads the table. A commit that stopped before
+// its pages were in leaves the writing flag, the next incremental backup
+// then holds every page
+
+#define DIRTY_MAGIC "DRTY"
+#define DIRTY_WRITING_OFFSET 12
+// ranges of a delta are at most a backup block long
+#define DIRTY_RANGE_SIZE (1 << 20)
+
+typedef struct {
+  size_t next;
+  size_t writing;
+  char* backup_name;
+  size_t npages;
+  unsigned char* bits;
+} DIRTY_CHAIN;
+
+static char* delta_name(const char* backup_name, size_t seq) {
+  char* name = malloc(strlen(backup_name) + 32);
+  sprintf(name, "%s.%ld", backup_name, seq);
+  return name;
+}
+
+static void bits_grow(unsigned char** bits, size_t* npages, size_t pages) {
+  if (pages <= *npages)
+    return;
+  size_t old = (*npages + 7) / 8, new = (pages + 7) / 8;
+  *bits = realloc(*bits, new);
+  memset(*bits + old, 0, new - old);
+  *npages = pages;
+}
+
+static size_t chain_read(int fd, DIRTY_CHAIN* chain) {
+  char magic[4];
+  size_t len;
+  *chain = (DIRTY_CHAIN){ 0 };
+  if (pread(fd, magic, 4, 0) != 4 || memcmp(magic, DIRTY_MAGIC, 4) != 0
+    || pread(fd, &chain->next, sizeof(size_t), 4) != sizeof(size_t)
+    || pread(fd, &chain->writing, sizeof(size_t), DIRTY_WRITING_OFFSET) != sizeof(size_t)
+    || pread(fd, &len, sizeof(size_t), 20) != sizeof(size_t))
+    return 1;
+  chain->backup_name = calloc(len + 1, 1);
+  size_t npages = 0;
+  if (pread(fd, chain->backup_name, len, 28) != (ssize_t)len
+    || pread(fd, &npages, sizeof(size_t), 28 + len) != sizeof(size_t))
+    return 1;
+  bits_grow(&chain->bits, &chain->npages, npages);
+  if (npages && pread(fd, chain->bits, (npages + 7) / 8, 36 + len) != (ssize_t)((npages + 7) / 8))
+    return 1;
+  return 0;
+}
+
+static void chain_write(int fd, const DIRTY_CHAIN* chain) {
+  size_t len = strlen(chain->backup_name);
+  size_t size = 36 + len + (chain->npages + 7) / 8;
+  char* buf = malloc(size);
+  memcpy(buf, DIRTY_MAGIC, 4);
+  memcpy(&buf[4], &chain->next, sizeof(size_t));
+  memcpy(&buf[DIRTY_WRITING_OFFSET], &chain->writing, sizeof(size_t));
+  memcpy(&buf[20], &len, sizeof(size_t));
+  memcpy(&buf[28], chain->backup_name, len);
+  memcpy(&buf[28 + len], &chain->npages, sizeof(size_t));
+  memcpy(&buf[36 + len], chain->bits, (chain->npages + 7) / 8);
+  pwrite(fd, buf, size, 0);
+  ftruncate(fd, size);
+  free(buf);
+}
+
+static void chain_free(DIRTY_CHAIN* chain) {
+  free(chain->backup_name);
+  free(chain->bits);
+}
+
+static DIRTY_PAGES* dirty_pages(TABLE_STATE* ts) {
+  if (ts->dirty_pages == NULL)
+    ts->dirty_pages = calloc(1, sizeof(DIRTY_PAGES));
+  return ts->dirty_pages;
+}
+
+// Flags <table>.dirty before a commit writes the table, if the table has
+// a backup chain. The pages are not known before they are written,
+// dirty_save adds them and takes the flag down
+void dirty_begin(TABLE_STATE* ts) {
+  char* name = sidecar_name(ts->file_name, "dirty");
+  int fd = open(name, O_RDWR);
+  free(name);
+  if (fd < 0)
+    return;
+  flock(fd, LOCK_EX);
+  char magic[4];
+  size_t writing = 1;
+  if (pread(fd, magic, 4, 0) == 4 && memcmp(magic, DIRTY_MAGIC, 4) == 0) {
+    pwrite(fd, &writing, sizeof(size_t), DIRTY_WRITING_OFFSET);
+    dirty_pages(ts)->dirty = 1;
+  }
+  flock(fd, LOCK_UN);
+  close(fd);
+}
+
+// Notes a write to the table file, called by table_pwrite while the
+// commit holds the latch alone
+void dirty_mark(TABLE_STATE* ts, size_t offset, size_t size) {
+  if (size == 0)
+    return;
+  DIRTY_PAGES* dp = dirty_pages(ts);
+  size_t first = offset / DIRTY_PAGE_SIZE, last = (offset + size - 1) / DIRTY_PAGE_SIZE;
+  bits_grow(&dp->bits, &dp->npages, last + 1);
+  for (size_t page = first; page <= last; page++)
+    dp->bits[page / 8] |= 1 << (page % 8);
+  dp->dirty = 1;
+}
+
+// Adds the pages the commit wrote to <table>.dirty, if the table has a
+// backup chain, and forgets them
+void dirty_save(TABLE_STATE* ts) {
+  DIRTY_PAGES* dp = ts->dirty_pages;
+  if (dp == NULL || !dp->dirty)
+    return;
+  char* name = sidecar_name(ts->file_name, "dirty");
+  int fd = open(name, O_RDWR);
+  free(name);
+  if (fd >= 0) {
+    flock(fd, LOCK_EX);
+    DIRTY_CHAIN chain;
+    if (chain_read(fd, &chain) == 0) {
+      bits_grow(&chain.bits, &chain.npages, dp->npages);
+      for (size_t i = 0; i < (dp->npages + 7) / 8; i++)
+        chain.bits[i] |= dp->bits[i];
+      chain.writing = 0;
+      chain_write(fd, &chain);
+    }
+    chain_free(&chain);
+    flock(fd, LOCK_UN);
+    close(fd);
+  }
+  memset(dp->bits, 0, (dp->npages + 7) / 8);
+  dp->dirty = 0;
+}
+
+void dirty_close(TABLE_STATE* ts) {
+  DIRTY_PAGES* dp = ts->dirty_pages;
+  if (dp == NULL)
+    return;
+  free(dp->bits);
+  free(dp);
+  ts->dirty_pages = NULL;
+}
+
+// Starts a backup chain of the table at its full backup backup_name, the
+// incremental backups of an older chain at that name are dropped
+void dirty_chain_start(const char* file_name, const char* backup_name) {
+  for (size_t seq = 1;; seq++) {
+    char* delta = delta_name(backup_name, seq);
+    size_t gone = unlink(delta) != 0;
+    free(delta);
+    if (gone)
+      break;
+  }
+  char* name = sidecar_name(file_name, "dirty");
+  int fd = open(name, O_RDWR | O_CREAT, 0644);
+  free(name);
+  if (fd < 0)
+    return;
+  flock(fd, LOCK_EX);
+  DIRTY_CHAIN chain = { .next = 1, .backup_name = strdup(backup_name) };
+  chain_write(fd, &chain);
+  chain_free(&chain);
+  flock(fd, LOCK_UN);
+  close(fd);
+}
+
+// Writes the pages changed since the last backup of the chain that
+// starts at backup_name to <backup_name>.<n>. Page 0 always goes, it
+// holds the header and the head of the free list.
+// Returns 1 if the table has no chain starting at backup_name
+size_t create_incremental_backup(const char* file_name, const char* backup_name) {
+  char* name = sidecar_name(file_name, "dirty");
+  int fd = open(name, O_RDWR);
+  free(name);
+  if (fd < 0)
+    return 1;
+  // the commit byte, taken through a description of its own: no commit
+  // writes the table while it is read
+  TABLE_STATE pin = { 0 };
+  pin.file_name = strdup(file_name);
+  lock_open(&pin);
+  table_lock(&pin, TABLE_LOCK_READ);
+  flock(fd, LOCK_EX);
+  DIRTY_CHAIN chain;
+  size_t ret = 1;
+  if (chain_read(fd, &chain) == 0 && strcmp(chain.backup_name, backup_name) == 0) {
+    struct stat st;
+    stat(file_name, &st);
+    // a commit stopped halfway, its pages are not known
+    size_t pages = chain.writing ? (st.st_size + DIRTY_PAGE_SIZE - 1) / DIRTY_PAGE_SIZE : 1;
+    bits_grow(&chain.bits, &chain.npages, pages);
+    if (chain.writing)
+      memset(chain.bits, 0xff, (chain.npages + 7) / 8);
+    chain.bits[0] |= 1;
+    size_t* offsets = malloc(chain.npages * sizeof(size_t));
+    size_t* lens = malloc(chain.npages * sizeof(size_t));
+    size_t count = 0;
+    for (size_t page = 0; page < chain.npages; page++) {
+      if (!(chain.bits[page / 8] & (1 << (page % 8))))
+        continue;
+      size_t offset = page * DIRTY_PAGE_SIZE;
+      if (count && offsets[count - 1] + lens[count - 1] == offset && lens[count - 1] < DIRTY_RANGE_SIZE) {
+        lens[count - 1] += DIRTY_PAGE_SIZE;
+      } else {
+        offsets[count] = offset;
+        lens[count++] = DIRTY_PAGE_SIZE;
+      }
+    }
+    // the last page stops at the end of the file
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (offsets[i] >= (size_t)st.st_size)
+        continue;
+      offsets[kept] = offsets[i];
+      lens[kept++] = offsets[i] + lens[i] > (size_t)st.st_size ? st.st_size - offsets[i] : lens[i];
+    }
+    char* delta = delta_name(backup_name, chain.next);
+    if (archive_ranges(file_name, delta, offsets, lens, kept) == 0) {
+      memset(chain.bits, 0, (chain.npages + 7) / 8);
+      chain.next++;
+      chain.writing = 0;
+      chain_write(fd, &chain);
+      ret = 0;
+    }
+    free(delta);
+    free(offsets);
+    free(lens);
+  }
+  chain_free(&chain);
+  flock(fd, LOCK_UN);
+  close(fd);
+  table_unlock(&pin);
+  lock_close(&pin);
+  free(pin.file_name);
+  return ret;
+}
+
+// Restores the full backup backup_name and every incremental backup of
+// its chain after it, <backup_name>.1, .2, ... as long as they exist
+size_t restore_backup_chain(const char* file_name, const char* backup_name) {
+  size_t ret = archive(1, file_name, backup_name) != 0;
+  for (size_t seq = 1; ret == 0; seq++) {
+    char* delta = delta_name(backup_name, seq);
+    if (access(delta, F_OK) != 0) {
+      free(delta);
+      break;
+    }
+    ret = restore_ranges(file_name, delta) != 0;
+    free(delta);
+  }
+  // a chain of the table restored over is no longer its chain
+  char* name = sidecar_name(file_name, "dirty");
+  unlink(name);
+  free(name);
+  table_replaced(file_name);
+  return ret;
+}
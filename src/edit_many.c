@@ -8,7 +8,9 @@ int main () {
 
   const char* old_value = "76543210";
   const char* new_value = "12345678";
-  edit_entry(2, old_value, new_value, &table_state);
+  PRED* where = pred_cmp(2, PRED_EQ, old_value, &table_state);
+  edit_where(where, 2, new_value, &table_state);
+  pred_free(where);
   commit_changes(&table_state);
 
   close_table(&table_state);
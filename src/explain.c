@@ -0,0 +1,26 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+
+static void explain(const char* text, size_t col, size_t op, const void* value, TABLE_STATE* table_state) {
+  const char* access[] = { "index lookup", "range cursor", "zone map scan", "parallel scan" };
+  QUERY_PLAN plan;
+  plan_predicate(col, op, value, table_state, &plan);
+  printf("%s: %s, selectivity %f, rows %f, cost %f\n", text, access[plan.access], plan.selectivity, plan.rows, plan.cost);
+}
+
+int main () {
+  TABLE_STATE table_state = { 0 };
+  open_table("data/table.bin", &table_state);
+  printf("rows %ld, distinct birthday %ld\n", stats_rows(&table_state), stats_distinct(2, &table_state));
+  int id = 4;
+  explain("id = 4", 0, PRED_EQ, &id, &table_state);
+  explain("id > 4", 0, PRED_GT, &id, &table_state);
+  float height = 0.1;
+  explain("height < 0.1", 1, PRED_LT, &height, &table_state);
+  size_t datatime = encode_datatime(2024, 12, 14, 11, 11, 11, 123);
+  explain("birthday = Y2024 M12 D14 h11 m11 s11 ms123", 2, PRED_EQ, &datatime, &table_state);
+  printf("\n");
+  close_table(&table_state);
+  
+  return 0;
+}
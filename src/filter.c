@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "file.h"
+
+// Predicate trees are compiled into a flat program run on the raw row
+// buffer. The program has a single boolean register: comparisons set it,
+// AND/OR jump over their right side once the register decides them
+
+#define FILTER_CMP        0
+#define FILTER_PREFIX     1
+#define FILTER_JUMP_FALSE 2
+#define FILTER_JUMP_TRUE  3
+#define FILTER_NOT        4
+
+typedef struct {
+  size_t code;
+  size_t op;
+  size_t type;
+  size_t offset;  // of the column in a row
+  size_t jump;    // target instruction
+  size_t len;     // of a prefix
+  size_t key;     // datatime_key of a DATATIME operand
+  const unsigned char* value;
+} FILTER_OP;
+
+struct filter {
+  const PRED* where;
+  size_t count;
+  FILTER_OP* ops;
+};
+
+static PRED* pred_node(size_t op) {
+  PRED* p = malloc(sizeof(PRED));
+  memset(p, 0, sizeof(PRED));
+  p->op = op;
+  return p;
+}
+
+// col op value, value is a bare column value, a string for PRED_PREFIX
+PRED* pred_cmp(size_t col, size_t op, const void* value, TABLE_STATE* ts) {
+  assert(col < ts->ncols && op <= PRED_PREFIX);
+  assert(op != PRED_PREFIX || TYPE_NUMBER(ts->col_types[col]) == TABLE_TYPE_VARCHAR);
+  PRED* p = pred_node(op);
+  p->col = col;
+  p->size = TYPE_SIZE(ts->col_types[col]);
+  p->value = calloc(1, p->size);
+  if (TYPE_NUMBER(ts->col_types[col]) == TABLE_TYPE_VARCHAR)
+    strncpy((char*)p->value, value, p->size - 1);
+  else
+    memcpy(p->value, value, p->size);
+  return p;
+}
+
+PRED* pred_and(PRED* left, PRED* right) {
+  PRED* p = pred_node(PRED_AND);
+  p->left = left;
+  p->right = right;
+  return p;
+}
+
+PRED* pred_or(PRED* left, PRED* right) {
+  PRED* p = pred_node(PRED_OR);
+  p->left = left;
+  p->right = right;
+  return p;
+}
+
+PRED* pred_not(PRED* operand) {
+  PRED* p = pred_node(PRED_NOT);
+  p->left = operand;
+  return p;
+}
+
+void pred_free(PRED* p) {
+  if (p == NULL)
+    return;
+  pred_free(p->left);
+  pred_free(p->right);
+  free(p->value);
+  free(p);
+}
+
+// Prefix order, per node: [size_t] op, [size_t] col, [size_t] size, size bytes
+size_t pred_serialize(const PRED* p, char** buf) {
+  size_t node = 3 * sizeof(size_t) + p->size;
+  char* left = NULL, * right = NULL;
+  size_t nleft = p->left ? pred_serialize(p->left, &left) : 0;
+  size_t nright = p->right ? pred_serialize(p->right, &right) : 0;
+  *buf = malloc(node + nleft + nright);
+  memcpy(*buf, &p->op, sizeof(size_t));
+  memcpy(*buf + sizeof(size_t), &p->col, sizeof(size_t));
+  memcpy(*buf + 2 * sizeof(size_t), &p->size, sizeof(size_t));
+  if (p->size) memcpy(*buf + 3 * sizeof(size_t), p->value, p->size);
+  if (nleft) memcpy(*buf + node, left, nleft);
+  if (nright) memcpy(*buf + node + nleft, right, nright);
+  free(left);
+  free(right);
+  return node + nleft + nright;
+}
+
+PRED* pred_deserialize(const char** buf) {
+  PRED* p = pred_node(0);
+  memcpy(&p->op, *buf, sizeof(size_t));
+  memcpy(&p->col, *buf + sizeof(size_t), sizeof(size_t));
+  memcpy(&p->size, *buf + 2 * sizeof(size_t), sizeof(size_t));
+  *buf += 3 * sizeof(size_t);
+  if (p->size) {
+    p->value = malloc(p->size);
+    memcpy(p->value, *buf, p->size);
+    *buf += p->size;
+  }
+  if (p->op == PRED_AND || p->op == PRED_OR || p->op == PRED_NOT)
+    p->left = pred_deserialize(buf);
+  if (p->op == PRED_AND || p->op == PRED_OR)
+    p->right = pred_deserialize(buf);
+  return p;
+}
+
+static size_t program_size(const PRED* p) {
+  if (p->op == PRED_AND || p->op == PRED_OR)
+    return program_size(p->left) + 1 + program_size(p->right);
+  if (p->op == PRED_NOT)
+    return program_size(p->left) + 1;
+  return 1;
+}
+
+static size_t emit_program(FILTER* f, const PRED* p, TABLE_STATE* ts, size_t at) {
+  if (p->op == PRED_AND || p->op == PRED_OR) {
+    at = emit_program(f, p->left, ts, at);
+    FILTER_OP* jump = &f->ops[at++];
+    jump->code = p->op == PRED_AND ? FILTER_JUMP_FALSE : FILTER_JUMP_TRUE;
+    at = emit_program(f, p->right, ts, at);
+    jump->jump = at;
+    return at;
+  }
+  if (p->op == PRED_NOT) {
+    at = emit_program(f, p->left, ts, at);
+    f->ops[at].code = FILTER_NOT;
+    return at + 1;
+  }
+  FILTER_OP* op = &f->ops[at];
+  op->code = p->op == PRED_PREFIX ? FILTER_PREFIX : FILTER_CMP;
+  op->op = p->op;
+  op->type = ts->col_types[p->col];
+  op->offset = ts->col_offsets[p->col];
+  op->value = p->value;
+  if (p->op == PRED_PREFIX)
+    op->len = strlen((const char*)p->value);
+  if (TYPE_NUMBER(op->type) == TABLE_TYPE_DATATIME)
+    op->key = datatime_key(p->value);
+  return at + 1;
+}
+
+// where must outlive the filter
+FILTER* filter_compile(const PRED* where, TABLE_STATE* ts) {
+  FILTER* f = malloc(sizeof(FILTER));
+  f->where = where;
+  f->count = program_size(where);
+  f->ops = calloc(f->count, sizeof(FILTER_OP));
+  emit_program(f, where, ts, 0);
+  return f;
+}
+
+void filter_free(FILTER* f) {
+  if (f == NULL)
+    return;
+  free(f->ops);
+  free(f);
+}
+
+static int cmp_result(size_t op, int c) {
+  switch (op) {
+  case PRED_EQ: return c == 0;
+  case PRED_NE: return c != 0;
+  case PRED_LT: return c < 0;
+  case PRED_LE: return c <= 0;
+  case PRED_GT: return c > 0;
+  case PRED_GE: return c >= 0;
+  }
+  return 0;
+}
+
+// 1 if the raw row satisfies the filter
+int filter_match(const FILTER* f, const void* entry) {
+  const unsigned char* row = entry;
+  int r = 0;
+  for (size_t pc = 0; pc < f->count; ) {
+    const FILTER_OP* op = &f->ops[pc];
+    switch (op->code) {
+    case FILTER_CMP: {
+      const unsigned char* v = &row[op->offset];
+      int c;
+      switch (TYPE_NUMBER(op->type)) {
+      case TABLE_TYPE_INT: {
+        int l = *(const int*)v, o = *(const int*)op->value;
+        c = (l > o) - (l < o);
+        break;
+      }
+      case TABLE_TYPE_FLOAT: {
+        float l = *(const float*)v, o = *(const float*)op->value;
+        c = (l > o) - (l < o);
+        break;
+      }
+      case TABLE_TYPE_DATATIME: {
+        size_t l = datatime_key(v);
+        c = (l > op->key) - (l < op->key);
+        break;
+      }
+      default:
+        c = strcmp((const char*)v, (const char*)op->value);
+      }
+      r = cmp_result(op->op, c);
+      pc++;
+      break;
+    }
+    case FILTER_PREFIX:
+      r = strncmp((const char*)&row[op->offset], (const char*)op->value, op->len) == 0;
+      pc++;
+      break;
+    case FILTER_JUMP_FALSE:
+      pc = r ? pc + 1 : op->jump;
+      break;
+    case FILTER_JUMP_TRUE:
+      pc = r ? op->jump : pc + 1;
+      break;
+    case FILTER_NOT:
+      r = !r;
+      pc++;
+      break;
+    }
+  }
+  return r;
+}
+
+static size_t negate(size_t op) {
+  static const size_t negated[] = { PRED_NE, PRED_EQ, PRED_GE, PRED_GT, PRED_LE, PRED_LT };
+  return negated[op];
+}
+
+// Whether some row of the block may make p true and whether some may make it false
+static void block_outcomes(const PRED* p, TABLE_STATE* ts, size_t block, int* can_true, int* can_false) {
+  int lt, lf, rt, rf;
+  switch (p->op) {
+  case PRED_AND:
+    block_outcomes(p->left, ts, block, &lt, &lf);
+    block_outcomes(p->right, ts, block, &rt, &rf);
+    *can_true = lt && rt;
+    *can_false = lf || rf;
+    return;
+  case PRED_OR:
+    block_outcomes(p->left, ts, block, &lt, &lf);
+    block_outcomes(p->right, ts, block, &rt, &rf);
+    *can_true = lt || rt;
+    *can_false = lf && rf;
+    return;
+  case PRED_NOT:
+    block_outcomes(p->left, ts, block, can_false, can_true);
+    return;
+  case PRED_PREFIX:
+    *can_true = *can_false = 1;
+    return;
+  }
+  *can_true = zmap_block_may_satisfy(ts, block, p->col, p->op, p->value);
+  *can_false = zmap_block_may_satisfy(ts, block, p->col, negate(p->op), p->value);
+}
+
+// 0 if no row of the block can satisfy the filter
+int filter_block_may_match(const FILTER* f, TABLE_STATE* ts, size_t block) {
+  int can_true, can_false;
+  block_outcomes(f->where, ts, block, &can_true, &can_false);
+  return can_true;
+}
+
+// The conjunct with the cheapest access path drives the scan
+static void pick_driver(const PRED* p, TABLE_STATE* ts, const PRED** best, double* cost) {
+  if (p->op == PRED_AND) {
+    pick_driver(p->left, ts, best, cost);
+    pick_driver(p->right, ts, best, cost);
+    return;
+  }
+  if (p->op > PRED_PREFIX)
+    return;
+  QUERY_PLAN plan;
+  plan_predicate(p->col, p->op, p->value, ts, &plan);
+  if (*best == NULL || plan.cost < *cost) {
+    *best = p;
+    *cost = plan.cost;
+  }
+}
+
+// Rows that may satisfy where by the bitmap indexes alone: equalities on
+// columns with a bitmap index, intersected under AND and united under OR.
+// A conjunct without a bitmap leaves the rows of the other one to the
+// filter, a disjunct without one leaves all rows. 1 if *rows was set, to
+// be freed by the caller
+size_t filter_bitmap(const PRED* where, TABLE_STATE* ts, ROARING* rows) {
+  static const ROARING none = { 0 };
+  if (where->op == PRED_AND || where->op == PRED_OR) {
+    ROARING left, right;
+    size_t has_left = filter_bitmap(where->left, ts, &left);
+    size_t has_right = (has_left || where->op == PRED_AND) && filter_bitmap(where->right, ts, &right);
+    if (has_left && has_right) {
+      *rows = where->op == PRED_AND ? roaring_and(&left, &right) : roaring_or(&left, &right);
+      roaring_free(&left);
+      roaring_free(&right);
+      return 1;
+    }
+    if (where->op == PRED_AND && (has_left || has_right)) {
+      *rows = has_left ? left : right;
+      return 1;
+    }
+    if (has_left)
+      roaring_free(&left);
+    return 0;
+  }
+  if (where->op != PRED_EQ || bitmap_index_get(where->col, ts) == NULL)
+    return 0;
+  char* entry = calloc(1, ts->entry_raw_size);
+  memcpy(&entry[ts->col_offsets[where->col]], where->value, where->size);
+  // a copy, the index changes with the next commit
+  *rows = roaring_or(bitmap_index_lookup(where->col, entry, ts), &none);
+  free(entry);
+  return 1;
+}
+
+// Calls func(entry, row, cookie) for every live row satisfying where,
+// see table_select. Returns number of rows passed to func
+size_t table_filter(const PRED* where, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie) {
+  const PRED* driver = NULL;
+  double cost = 0;
+  // the driver is picked from statistics a commit changes
+  size_t latched = table_latch(ts, TABLE_LOCK_READ);
+  pick_driver(where, ts, &driver, &cost);
+  FILTER* f = filter_compile(where, ts);
+  size_t count;
+  // several bitmap indexed equalities combined can beat the best one alone,
+  // rows of a bitmap are fetched in row order as in plan_predicate
+  ROARING bitmap;
+  size_t has_bitmap = filter_bitmap(where, ts, &bitmap);
+  if (has_bitmap && (driver == NULL || roaring_count(&bitmap) * PLAN_RANDOM_COST / 2 < cost)) {
+    size_t* rows;
+    size_t n = roaring_to_array(&bitmap, &rows);
+    count = table_select_rows(rows, n, f, ts, func, cookie);
+    free(rows);
+  } else if (driver) {
+    count = table_select_where(driver->col, driver->op, driver->value, f, ts, func, cookie);
+  } else {
+    count = table_select_where(0, PRED_EQ, NULL, f, ts, func, cookie);
+  }
+  if (has_bitmap)
+    roaring_free(&bitmap);
+  table_unlatch(ts, latched);
+  filter_free(f);
+  return count;
+}
+
+typedef struct {
+  TABLE_STATE* ts;
+  struct darray entr, indx;
+  size_t result, indices;
+} FIND_WHERE;
+
+static int find_where_row(void* entry, size_t row, void* cookie) {
+  FIND_WHERE* found = cookie;
+  if (found->result) {
+    void* copy = malloc(found->ts->entry_raw_size);
+    memcpy(copy, entry, found->ts->entry_raw_size);
+    da_append(&found->entr, copy);
+  }
+  if (found->indices)
+    da_append(&found->indx, (void*)row);
+  return 0;
+}
+
+// find_entry for a predicate tree
+size_t find_where(const PRED* where, TABLE_STATE* ts, void** result, size_t** indices) {
+  FIND_WHERE found = { 0 };
+  found.ts = ts;
+  found.result = result != NULL;
+  found.indices = indices != NULL;
+  size_t count = table_filter(where, ts, find_where_row, &found);
+  if (result)
+    *result = found.entr.items;
+  if (indices)
+    *indices = (size_t*)found.indx.items;
+  return count;
+}
@@ -7,8 +7,10 @@ int main () {
   open_table("data/table.bin", &table_state);
 
   size_t datatime = encode_datatime(2024, 12, 14, 11, 11, 11, 123);
+  PRED* where = pred_cmp(2, PRED_EQ, &datatime, &table_state);
   void* entries;
-  size_t count = beautiful_find_entry(2, &datatime, &table_state, &entries, NULL);
+  size_t count = find_where(where, &table_state, &entries, NULL);
+  pred_free(where);
 
   printf("Found %ld entries\n", count);
   for (size_t i = 0; i < count; i++) {
@@ -0,0 +1,598 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "file.h"
+
+// Sidecar view
+// [0]   "FTSX"
+// [4]   [size_t] generation of the commit on the moment of saving
+// [..]  [size_t] row count of the table on the moment of saving
+// [..]  [size_t] number of indexes
+// ...   per index: [size_t] col, [size_t] number of terms, terms
+//
+// Term
+// [size_t] length, term, [size_t] rows, [size_t] last row,
+// [size_t] posting bytes, postings
+//
+// Postings, in row order
+// [varint] row - previous row, [varint] npos, npos * [varint] position - previous position
+
+#define FTS_MAGIC "FTSX"
+
+typedef struct {
+  char* word;
+  size_t pos;
+} FTS_TOKEN;
+
+typedef struct {
+  size_t count, capacity;
+  FTS_TOKEN* items;
+} FTS_TOKENS;
+
+typedef struct {
+  size_t count, capacity;
+  size_t* items;
+} FTS_ROWS;
+
+// Walks one posting list
+typedef struct {
+  const unsigned char* it;
+  const unsigned char* end;
+  size_t row;
+  size_t npos;
+  const unsigned char* pos; // npos position deltas of row
+} FTS_CURSOR;
+
+static void varint_write(FTS_POSTINGS* out, size_t v) {
+  while (v >= 0x80) {
+    da_append(out, (unsigned char)(v | 0x80));
+    v >>= 7;
+  }
+  da_append(out, (unsigned char)v);
+}
+
+static size_t varint_read(const unsigned char** it) {
+  size_t v = 0;
+  for (size_t shift = 0;; shift += 7) {
+    unsigned char b = *(*it)++;
+    v |= (size_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return v;
+  }
+}
+
+static void posting_write(FTS_POSTINGS* out, size_t delta, const size_t* pos, size_t npos) {
+  varint_write(out, delta);
+  varint_write(out, npos);
+  for (size_t i = 0; i < npos; i++)
+    varint_write(out, pos[i] - (i ? pos[i - 1] : 0));
+}
+
+// Lowercased runs of letters and digits, bytes above ASCII are kept
+// as they are so UTF-8 words stay whole
+static void tokenize(const char* text, size_t size, FTS_TOKENS* tokens) {
+  size_t n = strnlen(text, size);
+  size_t pos = 0;
+  for (size_t i = 0; i < n;) {
+    unsigned char c = text[i];
+    if (!isalnum(c) && c < 0x80) {
+      i++;
+      continue;
+    }
+    size_t start = i;
+    while (i < n && (isalnum((unsigned char)text[i]) || (unsigned char)text[i] >= 0x80))
+      i++;
+    FTS_TOKEN t = { malloc(i - start + 1), pos++ };
+    for (size_t j = start; j < i; j++)
+      t.word[j - start] = tolower((unsigned char)text[j]);
+    t.word[i - start] = 0;
+    da_append(tokens, t);
+  }
+}
+
+static void tokens_free(FTS_TOKENS* tokens) {
+  for (size_t i = 0; i < tokens->count; i++)
+    free(tokens->items[i].word);
+  free(tokens->items);
+}
+
+// by word, then by position
+static int token_cmp(const void* a, const void* b) {
+  const FTS_TOKEN* x = a;
+  const FTS_TOKEN* y = b;
+  int c = strcmp(x->word, y->word);
+  if (c) return c;
+  return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+// Slot of term, or where it would be inserted
+static size_t term_slot(const FTS_INDEX* fi, const char* word, size_t* found) {
+  size_t lo = 0, hi = fi->count;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    int c = strcmp(fi->terms[mid].term, word);
+    if (c == 0) {
+      *found = 1;
+      return mid;
+    }
+    if (c < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  *found = 0;
+  return lo;
+}
+
+static FTS_TERM* term_get(const FTS_INDEX* fi, const char* word) {
+  size_t found;
+  size_t i = term_slot(fi, word, &found);
+  return found ? &fi->terms[i] : NULL;
+}
+
+static FTS_TERM* term_add(FTS_INDEX* fi, const char* word) {
+  size_t found;
+  size_t i = term_slot(fi, word, &found);
+  if (found)
+    return &fi->terms[i];
+  if (fi->count == fi->capacity) {
+    fi->capacity = fi->capacity ? fi->capacity * 2 : 64;
+    fi->terms = realloc(fi->terms, fi->capacity * sizeof(FTS_TERM));
+  }
+  memmove(&fi->terms[i + 1], &fi->terms[i], (fi->count - i) * sizeof(FTS_TERM));
+  memset(&fi->terms[i], 0, sizeof(FTS_TERM));
+  fi->terms[i].term = strdup(word);
+  fi->count++;
+  return &fi->terms[i];
+}
+
+static void term_free(FTS_TERM* t) {
+  free(t->term);
+  free(t->postings.items);
+}
+
+// Sets the positions of row in the posting list of t, npos 0 removes
+// the row. Rows past the last one are appended, others rewrite the list
+static void term_put(FTS_TERM* t, size_t row, const size_t* pos, size_t npos) {
+  if (npos && (t->rows == 0 || row > t->last_row)) {
+    posting_write(&t->postings, row - t->last_row, pos, npos);
+    t->last_row = row;
+    t->rows++;
+    return;
+  }
+  FTS_POSTINGS out = { 0 };
+  const unsigned char* it = t->postings.items;
+  const unsigned char* end = it + t->postings.count;
+  size_t prev = 0, written = 0, rows = 0, done = 0;
+  while (it < end) {
+    size_t r = prev + varint_read(&it);
+    const unsigned char* body = it;
+    size_t n = varint_read(&it);
+    for (size_t i = 0; i < n; i++)
+      varint_read(&it);
+    prev = r;
+    if (!done && r >= row) {
+      done = 1;
+      if (npos) {
+        posting_write(&out, row - written, pos, npos);
+        written = row;
+        rows++;
+      }
+      if (r == row)
+        continue;
+    }
+    varint_write(&out, r - written);
+    for (const unsigned char* b = body; b < it; b++)
+      da_append(&out, *b);
+    written = r;
+    rows++;
+  }
+  if (!done && npos) {
+    posting_write(&out, row - written, pos, npos);
+    written = row;
+    rows++;
+  }
+  free(t->postings.items);
+  t->postings = out;
+  t->rows = rows;
+  t->last_row = written;
+}
+
+// Adds or removes the words of a value for row
+static void index_value(FTS_INDEX* fi, size_t row, const char* value, size_t size, size_t add) {
+  FTS_TOKENS tokens = { 0 };
+  tokenize(value, size, &tokens);
+  qsort(tokens.items, tokens.count, sizeof(FTS_TOKEN), token_cmp);
+  size_t* pos = malloc((tokens.count ? tokens.count : 1) * sizeof(size_t));
+  for (size_t i = 0, j; i < tokens.count; i = j) {
+    size_t npos = 0;
+    for (j = i; j < tokens.count && strcmp(tokens.items[i].word, tokens.items[j].word) == 0; j++)
+      pos[npos++] = tokens.items[j].pos;
+    if (add) {
+      term_put(term_add(fi, tokens.items[i].word), row, pos, npos);
+      continue;
+    }
+    size_t found;
+    size_t slot = term_slot(fi, tokens.items[i].word, &found);
+    if (!found)
+      continue;
+    term_put(&fi->terms[slot], row, NULL, 0);
+    if (fi->terms[slot].rows == 0) {
+      term_free(&fi->terms[slot]);
+      memmove(&fi->terms[slot], &fi->terms[slot + 1], (fi->count - slot - 1) * sizeof(FTS_TERM));
+      fi->count--;
+    }
+  }
+  free(pos);
+  tokens_free(&tokens);
+}
+
+static void index_free(FTS_INDEX* fi) {
+  for (size_t i = 0; i < fi->count; i++)
+    term_free(&fi->terms[i]);
+  free(fi->terms);
+  fi->terms = NULL;
+  fi->count = fi->capacity = 0;
+}
+
+static void index_build(FTS_INDEX* fi, TABLE_STATE* ts) {
+  size_t len = row_count(ts);
+  size_t offset = ts->col_offsets[fi->col];
+  size_t size = TYPE_SIZE(ts->col_types[fi->col]);
+  char* block = malloc(ZMAP_BLOCK_ROWS * ts->entry_raw_size);
+  for (size_t first = 1, last; first < len; first = last) {
+    last = first + ZMAP_BLOCK_ROWS;
+    if (last > len) last = len;
+    read_rows(first, last - first, block, ts);
+    for (size_t i = first; i < last; i++) {
+      char* entry = &block[(i - first) * ts->entry_raw_size];
+      if (!ENTRY_DELETED(entry))
+        index_value(fi, i, &entry[offset], size, 1);
+    }
+  }
+  free(block);
+}
+
+static void cursor_init(FTS_CURSOR* c, const FTS_TERM* t) {
+  c->it = t->postings.items;
+  c->end = c->it + t->postings.count;
+  c->row = 0;
+}
+
+// Moves to the next row of the list, 0 at the end
+static size_t cursor_next(FTS_CURSOR* c) {
+  if (c->it >= c->end)
+    return 0;
+  c->row += varint_read(&c->it);
+  c->npos = varint_read(&c->it);
+  c->pos = c->it;
+  for (size_t i = 0; i < c->npos; i++)
+    varint_read(&c->it);
+  return 1;
+}
+
+static size_t cursor_seek(FTS_CURSOR* c, size_t row) {
+  while (c->row < row) {
+    if (!cursor_next(c))
+      return 0;
+  }
+  return 1;
+}
+
+static size_t* cursor_positions(const FTS_CURSOR* c) {
+  size_t* pos = malloc(c->npos * sizeof(size_t));
+  const unsigned char* it = c->pos;
+  for (size_t i = 0, p = 0; i < c->npos; i++)
+    pos[i] = p += varint_read(&it);
+  return pos;
+}
+
+static size_t has_position(const size_t* pos, size_t npos, size_t p) {
+  size_t lo = 0, hi = npos;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (pos[mid] == p) return 1;
+    if (pos[mid] < p) lo = mid + 1;
+    else hi = mid;
+  }
+  return 0;
+}
+
+// All cursors stand on the same row, it matches if some position of
+// the first word is followed by the other words in order
+static size_t phrase_at(FTS_CURSOR* cursors, size_t n) {
+  if (n == 1)
+    return 1;
+  size_t** pos = malloc(n * sizeof(size_t*));
+  for (size_t i = 0; i < n; i++)
+    pos[i] = cursor_positions(&cursors[i]);
+  size_t match = 0;
+  for (size_t k = 0; !match && k < cursors[0].npos; k++) {
+    match = 1;
+    for (size_t i = 1; match && i < n; i++)
+      match = has_position(pos[i], cursors[i].npos, pos[0][k] + i);
+  }
+  for (size_t i = 0; i < n; i++)
+    free(pos[i]);
+  free(pos);
+  return match;
+}
+
+FTS_INDEX* fts_index_get(size_t col, TABLE_STATE* ts) {
+  FTS_INDEXES* fis = ts->fts_indexes;
+  if (fis == NULL)
+    return NULL;
+  for (size_t i = 0; i < fis->count; i++) {
+    if (fis->items[i].col == col)
+      return &fis->items[i];
+  }
+  return NULL;
+}
+
+static FTS_INDEXES* indexes(TABLE_STATE* ts) {
+  if (ts->fts_indexes == NULL) {
+    ts->fts_indexes = malloc(sizeof(FTS_INDEXES));
+    memset(ts->fts_indexes, 0, sizeof(FTS_INDEXES));
+  }
+  return ts->fts_indexes;
+}
+
+// 0 on success, 1 if col is not VARCHAR or already indexed
+size_t fts_index_create(size_t col, TABLE_STATE* ts) {
+  assert(col < ts->ncols);
+  if (TYPE_NUMBER(ts->col_types[col]) != TABLE_TYPE_VARCHAR || fts_index_get(col, ts))
+    return 1;
+  FTS_INDEX fi = { 0 };
+  fi.col = col;
+  index_build(&fi, ts);
+  size_t latched = table_latch(ts, TABLE_LOCK_WRITE);
+  FTS_INDEXES* fis = indexes(ts);
+  fis->items = realloc(fis->items, (fis->count + 1) * sizeof(FTS_INDEX));
+  fis->items[fis->count++] = fi;
+  fis->dirty = 1;
+  fts_indexes_save(ts);
+  table_unlatch(ts, latched);
+  return 0;
+}
+
+size_t fts_index_drop(size_t col, TABLE_STATE* ts) {
+  size_t latched = table_latch(ts, TABLE_LOCK_WRITE);
+  FTS_INDEX* fi = fts_index_get(col, ts);
+  if (fi == NULL) {
+    table_unlatch(ts, latched);
+    return 1;
+  }
+  FTS_INDEXES* fis = ts->fts_indexes;
+  index_free(fi);
+  size_t i = fi - fis->items;
+  memmove(&fis->items[i], &fis->items[i + 1], (fis->count - i - 1) * sizeof(FTS_INDEX));
+  fis->count--;
+  fis->dirty = 1;
+  fts_indexes_save(ts);
+  table_unlatch(ts, latched);
+  return 0;
+}
+
+// Number of rows holding the word, read off its posting list
+size_t fts_term_count(size_t col, const char* word, TABLE_STATE* ts) {
+  size_t latched = table_latch(ts, TABLE_LOCK_READ);
+  FTS_INDEX* fi = fts_index_get(col, ts);
+  assert(fi);
+  FTS_TOKENS tokens = { 0 };
+  tokenize(word, strlen(word), &tokens);
+  FTS_TERM* t = tokens.count == 1 ? term_get(fi, tokens.items[0].word) : NULL;
+  size_t rows = t ? t->rows : 0;
+  table_unlatch(ts, latched);
+  tokens_free(&tokens);
+  return rows;
+}
+
+// Rows whose col holds the words of query next to each other, a single
+// word is a term query. Rows are in row order, *rows has to be freed if
+// the count is not 0
+size_t fts_search(size_t col, const char* query, TABLE_STATE* ts, size_t** rows) {
+  size_t latched = table_latch(ts, TABLE_LOCK_READ);
+  FTS_INDEX* fi = fts_index_get(col, ts);
+  assert(fi);
+  FTS_ROWS found = { 0 };
+  FTS_TOKENS tokens = { 0 };
+  tokenize(query, strlen(query), &tokens);
+  size_t n = tokens.count;
+  FTS_CURSOR* cursors = calloc(n ? n : 1, sizeof(FTS_CURSOR));
+  size_t ok = n != 0;
+  for (size_t i = 0; ok && i < n; i++) {
+    FTS_TERM* t = term_get(fi, tokens.items[i].word);
+    ok = t != NULL;
+    if (ok) {
+      cursor_init(&cursors[i], t);
+      ok = cursor_next(&cursors[i]);
+    }
+  }
+  // leapfrog: every list is moved up to the highest row among them
+  while (ok) {
+    size_t target = 0;
+    for (size_t i = 0; i < n; i++)
+      if (cursors[i].row > target) target = cursors[i].row;
+    size_t same = 1;
+    for (size_t i = 0; ok && i < n; i++) {
+      ok = cursor_seek(&cursors[i], target);
+      same = same && cursors[i].row == target;
+    }
+    if (!ok || !same)
+      continue;
+    if (phrase_at(cursors, n))
+      da_append(&found, target);
+    ok = cursor_next(&cursors[0]);
+  }
+  table_unlatch(ts, latched);
+  free(cursors);
+  tokens_free(&tokens);
+  *rows = found.items;
+  return found.count;
+}
+
+// Calls func on the rows matching query, in row order, until it returns
+// non zero. Returns the number of rows passed to func
+size_t fts_select(size_t col, const char* query, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie) {
+  size_t* rows;
+  size_t latched = table_latch(ts, TABLE_LOCK_READ);
+  size_t n = fts_search(col, query, ts, &rows);
+  char* entry = malloc(ts->entry_raw_size);
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) {
+    read_rows(rows[i], 1, entry, ts);
+    count++;
+    if (func(entry, rows[i], cookie))
+      break;
+  }
+  table_unlatch(ts, latched);
+  free(entry);
+  if (n) free(rows);
+  return count;
+}
+
+static size_t term_read(FTS_TERM* t, FILE* file) {
+  size_t len;
+  if (!fread(&len, sizeof(size_t), 1, file) || len == 0 || len > 4096)
+    return 0;
+  t->term = malloc(len + 1);
+  t->term[len] = 0;
+  size_t ok = fread(t->term, 1, len, file) == len;
+  ok = ok && fread(&t->rows, sizeof(size_t), 1, file);
+  ok = ok && fread(&t->last_row, sizeof(size_t), 1, file);
+  ok = ok && fread(&t->postings.count, sizeof(size_t), 1, file);
+  if (ok) {
+    t->postings.capacity = t->postings.count;
+    t->postings.items = malloc(t->postings.count ? t->postings.count : 1);
+    ok = fread(t->postings.items, 1, t->postings.count, file) == t->postings.count;
+  }
+  return ok;
+}
+
+void fts_indexes_open(TABLE_STATE* ts) {
+  char* name = sidecar_name(ts->file_name, "fts");
+  FILE* file = fopen(name, "rb");
+  free(name);
+  if (file == NULL)
+    return;
+  FTS_INDEXES* fis = indexes(ts);
+  char magic[4];
+  size_t gen, nrows, count;
+  size_t ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, FTS_MAGIC, 4) == 0;
+  ok = ok && fread(&gen, sizeof(size_t), 1, file);
+  ok = ok && fread(&nrows, sizeof(size_t), 1, file);
+  ok = ok && fread(&count, sizeof(size_t), 1, file);
+  size_t stale = ok && (gen != table_generation(ts) || nrows != row_count(ts));
+  if (ok) {
+    fis->items = calloc(count ? count : 1, sizeof(FTS_INDEX));
+    for (size_t i = 0; ok && i < count; i++) {
+      FTS_INDEX* fi = &fis->items[fis->count++];
+      size_t nterms;
+      ok = ok && fread(&fi->col, sizeof(size_t), 1, file) && fi->col < ts->ncols;
+      ok = ok && fread(&nterms, sizeof(size_t), 1, file);
+      if (!ok || stale)
+        continue;
+      fi->terms = calloc(nterms ? nterms : 1, sizeof(FTS_TERM));
+      fi->capacity = nterms ? nterms : 1;
+      for (size_t j = 0; ok && j < nterms; j++, fi->count++)
+        ok = term_read(&fi->terms[j], file);
+    }
+  }
+  fclose(file);
+  // table was changed without the indexes, build them again
+  if (!ok || stale) {
+    for (size_t i = 0; i < fis->count; i++) {
+      index_free(&fis->items[i]);
+      if (ok) index_build(&fis->items[i], ts);
+    }
+    if (!ok) fis->count = 0;
+    fis->dirty = 1;
+  }
+}
+
+void fts_indexes_save(TABLE_STATE* ts) {
+  FTS_INDEXES* fis = ts->fts_indexes;
+  if (fis == NULL)
+    return;
+  if (!fis->dirty) {
+    sidecar_restamp(ts, "fts");
+    return;
+  }
+  char* name = sidecar_name(ts->file_name, "fts");
+  if (fis->count == 0) {
+    unlink(name);
+    free(name);
+    fis->dirty = 0;
+    return;
+  }
+  FILE* file = fopen(name, "wb");
+  free(name);
+  if (file == NULL)
+    return;
+  size_t gen = table_generation(ts), nrows = row_count(ts);
+  fwrite(FTS_MAGIC, 1, 4, file);
+  fwrite(&gen, sizeof(size_t), 1, file);
+  fwrite(&nrows, sizeof(size_t), 1, file);
+  fwrite(&fis->count, sizeof(size_t), 1, file);
+  for (size_t i = 0; i < fis->count; i++) {
+    FTS_INDEX* fi = &fis->items[i];
+    fwrite(&fi->col, sizeof(size_t), 1, file);
+    fwrite(&fi->count, sizeof(size_t), 1, file);
+    for (size_t j = 0; j < fi->count; j++) {
+      FTS_TERM* t = &fi->terms[j];
+      size_t len = strlen(t->term);
+      fwrite(&len, sizeof(size_t), 1, file);
+      fwrite(t->term, 1, len, file);
+      fwrite(&t->rows, sizeof(size_t), 1, file);
+      fwrite(&t->last_row, sizeof(size_t), 1, file);
+      fwrite(&t->postings.count, sizeof(size_t), 1, file);
+      fwrite(t->postings.items, 1, t->postings.count, file);
+    }
+  }
+  fclose(file);
+  fis->dirty = 0;
+}
+
+void fts_indexes_close(TABLE_STATE* ts) {
+  FTS_INDEXES* fis = ts->fts_indexes;
+  if (fis == NULL)
+    return;
+  for (size_t i = 0; i < fis->count; i++)
+    index_free(&fis->items[i]);
+  free(fis->items);
+  free(fis);
+  ts->fts_indexes = NULL;
+}
+
+void fts_row_written(TABLE_STATE* ts, size_t row, const void* entry) {
+  FTS_INDEXES* fis = ts->fts_indexes;
+  if (fis == NULL)
+    return;
+  for (size_t i = 0; i < fis->count; i++) {
+    FTS_INDEX* fi = &fis->items[i];
+    index_value(fi, row, &((const char*)entry)[ts->col_offsets[fi->col]], TYPE_SIZE(ts->col_types[fi->col]), 1);
+    fis->dirty = 1;
+  }
+}
+
+// old_value is the bare value col had before
+void fts_value_written(TABLE_STATE* ts, size_t row, size_t col, const void* old_value, const void* entry) {
+  FTS_INDEX* fi = fts_index_get(col, ts);
+  if (fi == NULL)
+    return;
+  size_t size = TYPE_SIZE(ts->col_types[col]);
+  index_value(fi, row, old_value, size, 0);
+  index_value(fi, row, &((const char*)entry)[ts->col_offsets[col]], size, 1);
+  ts->fts_indexes->dirty = 1;
+}
+
+void fts_row_deleted(TABLE_STATE* ts, size_t row) {
+  FTS_INDEXES* fis = ts->fts_indexes;
+  if (fis == NULL || fis->count == 0)
+    return;
+  char* entry = get_by_tindex(row, ts);
+  for (size_t i = 0; i < fis->count; i++) {
+    FTS_INDEX* fi = &fis->items[i];
+    index_value(fi, row, &entry[ts->col_offsets[fi->col]], TYPE_SIZE(ts->col_types[fi->col]), 0);
+    fis->dirty = 1;
+  }
+  free(entry);
+}
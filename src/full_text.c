@@ -0,0 +1,63 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+
+#define ROWS 3000
+
+static int print_person(void* entry, size_t row, void* cookie) {
+  TABLE_STATE* table_state = cookie;
+  printf("  [%ld]: %d %s\n", row, *(int*)&((char*)entry)[table_state->col_offsets[0]], &((char*)entry)[table_state->col_offsets[1]]);
+  return 0;
+}
+
+int main () {
+  const char* file_name = "data/people.bin";
+  size_t col_types[2] = {
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int)) | KEY_FIELD,
+    MAKE_TYPE(TABLE_TYPE_VARCHAR, 64)
+  };
+  const char* col_names[] = { "id", "name" };
+  if (access(file_name, F_OK) == 0)
+    delete_table(file_name);
+  create_table(2, 32, col_types, col_names, file_name);
+
+  TABLE_STATE table_state = { 0 };
+  open_table(file_name, &table_state);
+  const char* firsts[] = { "Anna", "John", "Maria", "Paul", "Lena", "Oskar", "Ida" };
+  const char* seconds[] = { "Maria", "Paul", "Jones", "Lee", "Rose" };
+  const char* surnames[] = { "Smith", "Jones", "Lee", "Brown", "Stone", "Paul", "Moore", "Young", "King", "Hill", "Surname" };
+  char name[64];
+  for (int i = 0; i < ROWS; i++) {
+    snprintf(name, sizeof(name), "%s %s %s", firsts[i % 7], seconds[(i / 7) % 5], surnames[(i * 31) % 11]);
+    create_entry(&table_state, 2, i, name);
+  }
+  commit_changes(&table_state);
+  fts_index_create(1, &table_state);
+  close_table(&table_state);
+
+  table_state = (TABLE_STATE){ 0 };
+  open_table(file_name, &table_state);
+  printf("name MATCH 'surname': %ld rows\n", fts_term_count(1, "surname", &table_state));
+  size_t* rows;
+  size_t n = fts_search(1, "maria jones", &table_state, &rows);
+  printf("name MATCH \"maria jones\": %ld rows\n", n);
+  if (n) free(rows);
+  n = fts_search(1, "jones maria", &table_state, &rows);
+  printf("name MATCH \"jones maria\": %ld rows\n", n);
+  if (n) free(rows);
+  printf("name MATCH \"ida rose surname\"\n");
+  fts_select(1, "ida rose surname", &table_state, print_person, &table_state);
+
+  char old_name[64] = "Ida Rose Hill";
+  char new_name[64] = "Ida Rose Surname";
+  edit_entry(1, old_name, new_name, &table_state);
+  int id = 314;
+  delete_entry(0, &id, &table_state);
+  commit_changes(&table_state);
+  printf("after renaming \"Ida Rose Hill\" and deleting id 314\n");
+  fts_select(1, "ida rose surname", &table_state, print_person, &table_state);
+  close_table(&table_state);
+  delete_table(file_name);
+  printf("\n");
+
+  return 0;
+}
@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "file.h"
+
+// Rows are turned into records: key columns followed by the values of the
+// aggregated columns. Records of groups that do not fit into memory are
+// written to partition files as is and grouped again with another seed.
+
+typedef struct {
+  size_t count;
+  double sum;
+  unsigned char min[ZMAP_VALUE_SIZE];
+  unsigned char max[ZMAP_VALUE_SIZE];
+} GROUP_STATE;
+
+typedef struct {
+  size_t hash;
+  unsigned char* group; // key followed by naggs GROUP_STATE
+} GROUP_SLOT;
+
+typedef struct {
+  GROUP_BY* query;
+  TABLE_STATE* ts;
+  size_t key_size;
+  size_t rec_size;
+  size_t* agg_offsets; // of the aggregated values in a record
+  size_t seed;
+  size_t depth;
+
+  GROUP_SLOT* slots;
+  size_t nslots, count;
+  ARENA arena;
+
+  size_t spilling;
+  FILE* partitions[GROUP_PARTITIONS];
+
+  unsigned char* record; // scratch record for table rows
+  GROUP_RESULT* result;
+  size_t result_capacity;
+} GROUP_CTX;
+
+static size_t group_hash(const unsigned char* key, size_t size, size_t seed) {
+  size_t h = 14695981039346656037UL ^ (seed * 0x9E3779B97F4A7C15UL);
+  for (size_t i = 0; i < size; i++) {
+    h ^= key[i];
+    h *= 1099511628211UL;
+  }
+  return h ^ (h >> 29);
+}
+
+static double as_number(size_t type, const unsigned char* value) {
+  if (TYPE_NUMBER(type) == TABLE_TYPE_INT) return *(int*)value;
+  if (TYPE_NUMBER(type) == TABLE_TYPE_FLOAT) return *(float*)value;
+  return 0;
+}
+
+static size_t agg_type(GROUP_CTX* ctx, size_t a) {
+  return ctx->ts->col_types[ctx->query->agg_cols[a]];
+}
+
+static GROUP_STATE* group_states(GROUP_CTX* ctx, unsigned char* group) {
+  return (GROUP_STATE*)&group[(ctx->key_size + 7) & ~(size_t)7];
+}
+
+static size_t group_size(GROUP_CTX* ctx) {
+  return ((ctx->key_size + 7) & ~(size_t)7) + ctx->query->naggs * sizeof(GROUP_STATE);
+}
+
+static void group_update(GROUP_CTX* ctx, unsigned char* group, const unsigned char* rec) {
+  GROUP_STATE* states = group_states(ctx, group);
+  for (size_t a = 0; a < ctx->query->naggs; a++) {
+    GROUP_STATE* st = &states[a];
+    size_t op = ctx->query->agg_ops[a];
+    size_t type = agg_type(ctx, a);
+    const unsigned char* value = &rec[ctx->agg_offsets[a]];
+    if (op == AGG_SUM || op == AGG_AVG)
+      st->sum += as_number(type, value);
+    if (op == AGG_MIN && (st->count == 0 || value_cmp(type, value, st->min) < 0))
+      memcpy(st->min, value, TYPE_SIZE(type));
+    if (op == AGG_MAX && (st->count == 0 || value_cmp(type, value, st->max) > 0))
+      memcpy(st->max, value, TYPE_SIZE(type));
+    st->count++;
+  }
+}
+
+static void table_grow(GROUP_CTX* ctx) {
+  size_t nslots = ctx->nslots ? ctx->nslots * 2 : 1024;
+  GROUP_SLOT* slots = calloc(nslots, sizeof(GROUP_SLOT));
+  for (size_t i = 0; i < ctx->nslots; i++) {
+    if (ctx->slots[i].group == NULL)
+      continue;
+    size_t j = ctx->slots[i].hash & (nslots - 1);
+    while (slots[j].group) j = (j + 1) & (nslots - 1);
+    slots[j] = ctx->slots[i];
+  }
+  free(ctx->slots);
+  ctx->slots = slots;
+  ctx->nslots = nslots;
+}
+
+static int over_budget(GROUP_CTX* ctx) {
+  size_t limit = ctx->query->memory_limit ? ctx->query->memory_limit : GROUP_MEMORY_LIMIT;
+  return ctx->depth < GROUP_MAX_DEPTH && ctx->arena.allocated + ctx->nslots * sizeof(GROUP_SLOT) > limit;
+}
+
+static void spill(GROUP_CTX* ctx, const unsigned char* rec, size_t hash) {
+  size_t p = (hash >> 32) % GROUP_PARTITIONS;
+  if (ctx->partitions[p] == NULL)
+    ctx->partitions[p] = tmpfile();
+  fwrite(rec, ctx->rec_size, 1, ctx->partitions[p]);
+}
+
+static void group_consume(GROUP_CTX* ctx, const unsigned char* rec) {
+  size_t hash = group_hash(rec, ctx->key_size, ctx->seed);
+  if (ctx->nslots) {
+    for (size_t j = hash & (ctx->nslots - 1); ctx->slots[j].group; j = (j + 1) & (ctx->nslots - 1)) {
+      if (ctx->slots[j].hash == hash && memcmp(ctx->slots[j].group, rec, ctx->key_size) == 0) {
+        group_update(ctx, ctx->slots[j].group, rec);
+        return;
+      }
+    }
+  }
+  if (ctx->spilling || (ctx->spilling = over_budget(ctx))) {
+    spill(ctx, rec, hash);
+    return;
+  }
+  if ((ctx->count + 1) * 10 > ctx->nslots * 7)
+    table_grow(ctx);
+  size_t j = hash & (ctx->nslots - 1);
+  while (ctx->slots[j].group) j = (j + 1) & (ctx->nslots - 1);
+  unsigned char* group = arena_alloc(&ctx->arena, group_size(ctx));
+  memset(group, 0, group_size(ctx));
+  memcpy(group, rec, ctx->key_size);
+  ctx->slots[j].hash = hash;
+  ctx->slots[j].group = group;
+  ctx->count++;
+  group_update(ctx, group, rec);
+}
+
+static void group_emit(GROUP_CTX* ctx) {
+  GROUP_RESULT* result = ctx->result;
+  for (size_t i = 0; i < ctx->nslots; i++) {
+    unsigned char* group = ctx->slots[i].group;
+    if (group == NULL)
+      continue;
+    if (result->count >= ctx->result_capacity) {
+      ctx->result_capacity = ctx->result_capacity ? ctx->result_capacity * 2 : 256;
+      result->rows = realloc(result->rows, ctx->result_capacity * result->row_size);
+    }
+    unsigned char* row = &result->rows[result->count++ * result->row_size];
+    memcpy(row, group, ctx->key_size);
+    GROUP_STATE* states = group_states(ctx, group);
+    for (size_t a = 0; a < ctx->query->naggs; a++) {
+      AGG_RESULT* r = group_agg(result, result->count - 1, a);
+      GROUP_STATE* st = &states[a];
+      size_t op = ctx->query->agg_ops[a];
+      size_t type = agg_type(ctx, a);
+      memset(r, 0, sizeof(AGG_RESULT));
+      r->count = st->count;
+      if (op == AGG_COUNT) r->value = st->count;
+      if (op == AGG_SUM)   r->value = st->sum;
+      if (op == AGG_AVG)   r->value = st->count ? st->sum / st->count : 0;
+      if (op == AGG_MIN || op == AGG_MAX) {
+        memcpy(r->raw, op == AGG_MIN ? st->min : st->max, TYPE_SIZE(type));
+        r->value = TYPE_NUMBER(type) == TABLE_TYPE_DATATIME ? datatime_key(r->raw) : as_number(type, r->raw);
+      }
+    }
+  }
+}
+
+static void group_reset(GROUP_CTX* ctx) {
+  free(ctx->slots);
+  ctx->slots = NULL;
+  ctx->nslots = ctx->count = 0;
+  arena_free(&ctx->arena);
+}
+
+static void group_partitions(GROUP_CTX* ctx) {
+  FILE* partitions[GROUP_PARTITIONS];
+  memcpy(partitions, ctx->partitions, sizeof(partitions));
+  unsigned char* rec = malloc(ctx->rec_size);
+  for (size_t p = 0; p < GROUP_PARTITIONS; p++) {
+    if (partitions[p] == NULL)
+      continue;
+    GROUP_CTX sub = *ctx;
+    sub.slots = NULL;
+    sub.nslots = sub.count = 0;
+    sub.arena = (ARENA){ 0 };
+    sub.spilling = 0;
+    memset(sub.partitions, 0, sizeof(sub.partitions));
+    sub.seed = ctx->seed + 1;
+    sub.depth = ctx->depth + 1;
+    rewind(partitions[p]);
+    while (fread(rec, ctx->rec_size, 1, partitions[p]) == 1)
+      group_consume(&sub, rec);
+    fclose(partitions[p]);
+    group_emit(&sub);
+    group_reset(&sub);
+    if (sub.spilling)
+      group_partitions(&sub);
+    ctx->result_capacity = sub.result_capacity;
+  }
+  free(rec);
+}
+
+static void put_value(unsigned char* dst, size_t type, const unsigned char* value) {
+  size_t size = TYPE_SIZE(type);
+  if (TYPE_NUMBER(type) == TABLE_TYPE_VARCHAR) {
+    memset(dst, 0, size);
+    strncpy((char*)dst, (const char*)value, size - 1);
+  } else if (TYPE_NUMBER(type) == TABLE_TYPE_FLOAT && *(float*)value == 0) {
+    float zero = 0; // -0.0 and 0.0 are one group
+    memcpy(dst, &zero, sizeof(float));
+  } else {
+    memcpy(dst, value, size);
+  }
+}
+
+static int group_row(void* entry, size_t row, void* cookie) {
+  GROUP_CTX* ctx = cookie;
+  TABLE_STATE* ts = ctx->ts;
+  unsigned char* e = entry;
+  unsigned char* rec = ctx->record;
+  size_t offset = 0;
+  for (size_t k = 0; k < ctx->query->nkeys; k++) {
+    size_t col = ctx->query->key_cols[k];
+    put_value(&rec[offset], ts->col_types[col], &e[ts->col_offsets[col]]);
+    offset += TYPE_SIZE(ts->col_types[col]);
+  }
+  for (size_t a = 0; a < ctx->query->naggs; a++) {
+    if (ctx->query->agg_ops[a] == AGG_COUNT)
+      continue;
+    size_t col = ctx->query->agg_cols[a];
+    memcpy(&rec[ctx->agg_offsets[a]], &e[ts->col_offsets[col]], TYPE_SIZE(ts->col_types[col]));
+  }
+  group_consume(ctx, rec);
+  return 0;
+}
+
+static size_t group_table(GROUP_BY* query, TABLE_STATE* ts, GROUP_RESULT* result) {
+  memset(result, 0, sizeof(GROUP_RESULT));
+  GROUP_CTX ctx = { 0 };
+  ctx.query = query;
+  ctx.ts = ts;
+  ctx.result = result;
+  for (size_t k = 0; k < query->nkeys; k++)
+    ctx.key_size += TYPE_SIZE(ts->col_types[query->key_cols[k]]);
+  ctx.agg_offsets = malloc((query->naggs + 1) * sizeof(size_t));
+  ctx.rec_size = ctx.key_size;
+  for (size_t a = 0; a < query->naggs; a++) {
+    size_t op = query->agg_ops[a];
+    size_t type = ts->col_types[query->agg_cols[a]];
+    if (op != AGG_COUNT && TYPE_NUMBER(type) == TABLE_TYPE_VARCHAR) {
+      free(ctx.agg_offsets);
+      return 1;
+    }
+    if ((op == AGG_SUM || op == AGG_AVG) && TYPE_NUMBER(type) == TABLE_TYPE_DATATIME) {
+      free(ctx.agg_offsets);
+      return 1;
+    }
+    ctx.agg_offsets[a] = ctx.rec_size;
+    if (op != AGG_COUNT)
+      ctx.rec_size += TYPE_SIZE(type);
+  }
+  result->key_size = ctx.key_size;
+  result->row_size = ((ctx.key_size + 7) & ~(size_t)7) + query->naggs * sizeof(AGG_RESULT);
+  ctx.record = calloc(1, ctx.rec_size ? ctx.rec_size : 1);
+
+  char* pred = NULL;
+  if (query->pred_value) {
+    pred = get_by_tindex(0, ts);
+    memcpy(&pred[ts->col_offsets[query->pred_col]], query->pred_value, TYPE_SIZE(ts->col_types[query->pred_col]));
+  }
+  table_scan(query->pred_col, pred, ts, group_row, &ctx);
+  group_emit(&ctx);
+  group_reset(&ctx);
+  if (ctx.spilling)
+    group_partitions(&ctx);
+
+  if (pred) free(pred);
+  free(ctx.record);
+  free(ctx.agg_offsets);
+  return 0;
+}
+
+// Groups rows by query->key_cols and computes query->agg_ops over
+// query->agg_cols for every group. Returns 1 if an aggregate is not defined
+// for its column type. result must be freed with group_result_free
+size_t group_by(GROUP_BY* query, TABLE_STATE* ts, GROUP_RESULT* result) {
+  size_t latched = table_latch(ts, TABLE_LOCK_READ);
+  size_t ret = group_table(query, ts, result);
+  table_unlatch(ts, latched);
+  return ret;
+}
+
+unsigned char* group_key(GROUP_RESULT* result, size_t group) {
+  return &result->rows[group * result->row_size];
+}
+
+AGG_RESULT* group_agg(GROUP_RESULT* result, size_t group, size_t agg) {
+  unsigned char* row = group_key(result, group);
+  return &((AGG_RESULT*)&row[(result->key_size + 7) & ~(size_t)7])[agg];
+}
+
+void group_result_free(GROUP_RESULT* result) {
+  free(result->rows);
+  memset(result, 0, sizeof(GROUP_RESULT));
+}
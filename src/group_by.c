@@ -0,0 +1,30 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+
+int main () {
+  TABLE_STATE table_state = { 0 };
+  open_table("data/table.bin", &table_state);
+  size_t key_cols[] = { 2 };
+  size_t agg_ops[]  = { AGG_COUNT, AGG_AVG };
+  size_t agg_cols[] = { 1, 1 };
+  GROUP_BY query = { 0 };
+  query.nkeys = 1;
+  query.key_cols = key_cols;
+  query.naggs = 2;
+  query.agg_ops = agg_ops;
+  query.agg_cols = agg_cols;
+  GROUP_RESULT result;
+  group_by(&query, &table_state, &result);
+  for (size_t g = 0; g < result.count; g++) {
+    size_t key = datatime_key(group_key(&result, g));
+    printf("Y%ld M%ld D%ld h%ld m%ld s%ld ms%ld: ",
+           key >> 52, (key >> 44) & 0xff, (key >> 36) & 0xff, (key >> 28) & 0xff,
+           (key >> 20) & 0xff, (key >> 12) & 0xff, key & 0xfff);
+    printf("COUNT(height) = %f, AVG(height) = %f\n", group_agg(&result, g, 0)->value, group_agg(&result, g, 1)->value);
+  }
+  printf("\n");
+  group_result_free(&result);
+  close_table(&table_state);
+  
+  return 0;
+}
@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "file.h"
+
+// Online backups of versioned tables. The backup pins a snapshot while
+// it holds the commit byte for a moment, so the header it keeps, the rows
+// the snapshot reads and the backup point in the log are of one commit.
+// Rows are then read through the snapshot and compressed while writers
+// go on committing, at most rate bytes a second
+
+typedef struct {
+  TABLE_STATE* ts;
+  char* head;            // header of the table at the snapshot
+  size_t rate;
+  size_t done;
+  struct timespec start;
+} HOT_BACKUP;
+
+static double elapsed(const struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int hot_fill(void* cookie, void* buf, size_t len, size_t offset) {
+  HOT_BACKUP* hb = cookie;
+  TABLE_STATE* ts = hb->ts;
+  size_t size = ts->entry_raw_size;
+  char* out = buf;
+  size_t end = offset + len;
+  if (offset < ts->header_offset) {
+    size_t n = end < ts->header_offset ? len : ts->header_offset - offset;
+    memcpy(out, &hb->head[offset], n);
+    out += n;
+    offset += n;
+  }
+  // blocks start and end in the middle of rows
+  while (offset < end) {
+    size_t row = (offset - ts->header_offset) / size;
+    size_t from = (offset - ts->header_offset) % size;
+    size_t whole = from == 0 ? (end - offset) / size : 0;
+    if (whole) {
+      if (snapshot_rows(ts, row, whole, out) != whole)
+        return 1;
+      out += whole * size;
+      offset += whole * size;
+      continue;
+    }
+    size_t n = size - from < end - offset ? size - from : end - offset;
+    memcpy(out, (const char*)snapshot_row(ts, row) + from, n);
+    out += n;
+    offset += n;
+  }
+  if (hb->rate) {
+    hb->done += len;
+    double ahead = (double)hb->done / hb->rate - elapsed(&hb->start);
+    if (ahead > 0) {
+      struct timespec pause = { (time_t)ahead, (long)((ahead - (time_t)ahead) * 1e9) };
+      nanosleep(&pause, NULL);
+    }
+  }
+  return 0;
+}
+
+// Writes a full backup of the table as of its last commit while writers
+// go on, reading at most rate bytes a second, 0 for no limit. The commit
+// the backup holds goes to seq if it is not NULL, the backup starts a
+// chain of incremental backups from there.
+// Returns 1 if the table is not versioned or the backup failed
+size_t create_online_backup(const char* file_name, const char* backup_name, size_t rate, size_t* seq) {
+  if (access(file_name, F_OK) != 0)
+    return 1;
+  // the commit byte, taken through a description of its own
+  TABLE_STATE pin = { 0 };
+  pin.file_name = strdup(file_name);
+  lock_open(&pin);
+  table_lock(&pin, TABLE_LOCK_READ);
+  TABLE_STATE ts = { 0 };
+  size_t ret = snapshot_open(file_name, &ts);
+  HOT_BACKUP hb = { .ts = &ts, .rate = rate };
+  if (ret == 0) {
+    hb.head = malloc(ts.header_offset);
+    ret = table_pread(&ts, hb.head, ts.header_offset, 0) == 0;
+    // commits after the snapshot go to the next incremental backup and
+    // are replayed from the log. The backup holds the rows of a compressed
+    // table, not its pages, so no chain of its pages starts from it
+    if (ret == 0) {
+      if (ts.page_store == NULL)
+        dirty_chain_start(file_name, backup_name);
+      log_backup_point(file_name, backup_name);
+    }
+  }
+  table_unlock(&pin);
+  lock_close(&pin);
+  free(pin.file_name);
+  if (ret != 0) {
+    if (ts.snapshot)
+      close_table(&ts);
+    free(hb.head);
+    return 1;
+  }
+  if (seq)
+    *seq = snapshot_seq(&ts);
+  clock_gettime(CLOCK_MONOTONIC, &hb.start);
+  ret = archive_fill(backup_name, ts.append_offset, hot_fill, &hb) != 0;
+  free(hb.head);
+  close_table(&ts);
+  return ret;
+}
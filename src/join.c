@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "file.h"
+
+// Join record: [size_t] row, then the raw entry of its table
+
+typedef struct join_entry {
+  struct join_entry* next;
+  size_t hash;
+  size_t row;
+  unsigned char entry[];
+} JOIN_ENTRY;
+
+typedef struct {
+  JOIN* query;
+  TABLE_STATE* side[2];  // build, probe
+  size_t col[2];
+  size_t build_is_left;
+  size_t type;
+  size_t rec_size[2];
+  size_t memory_limit;
+  int (*func)(void*, size_t, void*, size_t, void*);
+  void* cookie;
+  size_t count;
+  int stop;
+
+  // in memory build side
+  JOIN_ENTRY** buckets;
+  size_t nbuckets;
+  ARENA arena;
+  size_t seed;
+
+  // partitioning scan of one side
+  FILE** partitions;
+  size_t partition_side;
+} JOIN_CTX;
+
+static size_t join_hash(JOIN_CTX* ctx, const unsigned char* value, size_t seed) {
+  size_t h = 14695981039346656037UL ^ (seed * 0x9E3779B97F4A7C15UL);
+  size_t size = TYPE_SIZE(ctx->type);
+  size_t key;
+  if (TYPE_NUMBER(ctx->type) == TABLE_TYPE_VARCHAR) {
+    size = strlen((const char*)value);
+  } else if (TYPE_NUMBER(ctx->type) == TABLE_TYPE_DATATIME) {
+    key = datatime_key(value);
+    value = (const unsigned char*)&key;
+    size = sizeof(size_t);
+  } else if (TYPE_NUMBER(ctx->type) == TABLE_TYPE_FLOAT && *(float*)value == 0) {
+    key = 0; // -0.0 is equal to 0.0
+    value = (const unsigned char*)&key;
+  }
+  for (size_t i = 0; i < size; i++) {
+    h ^= value[i];
+    h *= 1099511628211UL;
+  }
+  return h ^ (h >> 29);
+}
+
+static const unsigned char* join_value(JOIN_CTX* ctx, size_t side, const unsigned char* entry) {
+  return &entry[ctx->side[side]->col_offsets[ctx->col[side]]];
+}
+
+static int join_emit(JOIN_CTX* ctx, void* build_entry, size_t build_row, void* probe_entry, size_t probe_row) {
+  ctx->count++;
+  if (ctx->build_is_left)
+    ctx->stop = ctx->func(build_entry, build_row, probe_entry, probe_row, ctx->cookie);
+  else
+    ctx->stop = ctx->func(probe_entry, probe_row, build_entry, build_row, ctx->cookie);
+  return ctx->stop;
+}
+
+static void table_add(JOIN_CTX* ctx, const unsigned char* entry, size_t row) {
+  size_t size = ctx->side[0]->entry_raw_size;
+  JOIN_ENTRY* e = arena_alloc(&ctx->arena, sizeof(JOIN_ENTRY) + size);
+  e->hash = join_hash(ctx, join_value(ctx, 0, entry), ctx->seed);
+  e->row = row;
+  memcpy(e->entry, entry, size);
+  size_t b = e->hash & (ctx->nbuckets - 1);
+  e->next = ctx->buckets[b];
+  ctx->buckets[b] = e;
+}
+
+static void table_reset(JOIN_CTX* ctx, size_t nrows) {
+  free(ctx->buckets);
+  arena_free(&ctx->arena);
+  ctx->nbuckets = 1024;
+  while (ctx->nbuckets < nrows) ctx->nbuckets *= 2;
+  ctx->buckets = calloc(ctx->nbuckets, sizeof(JOIN_ENTRY*));
+}
+
+static int table_probe(JOIN_CTX* ctx, void* entry, size_t row) {
+  const unsigned char* value = join_value(ctx, 1, entry);
+  size_t hash = join_hash(ctx, value, ctx->seed);
+  for (JOIN_ENTRY* e = ctx->buckets[hash & (ctx->nbuckets - 1)]; e; e = e->next) {
+    if (e->hash == hash && value_cmp(ctx->type, join_value(ctx, 0, e->entry), value) == 0 &&
+        join_emit(ctx, e->entry, e->row, entry, row))
+      return 1;
+  }
+  return 0;
+}
+
+static int build_row(void* entry, size_t row, void* cookie) {
+  table_add(cookie, entry, row);
+  return 0;
+}
+
+static int probe_row(void* entry, size_t row, void* cookie) {
+  return table_probe(cookie, entry, row);
+}
+
+static int partition_row(void* entry, size_t row, void* cookie) {
+  JOIN_CTX* ctx = cookie;
+  size_t side = ctx->partition_side;
+  size_t p = (join_hash(ctx, join_value(ctx, side, entry), ctx->seed) >> 32) % JOIN_PARTITIONS;
+  if (ctx->partitions[p] == NULL)
+    ctx->partitions[p] = tmpfile();
+  fwrite(&row, sizeof(size_t), 1, ctx->partitions[p]);
+  fwrite(entry, ctx->side[side]->entry_raw_size, 1, ctx->partitions[p]);
+  return 0;
+}
+
+// Reads the records of a partition file, calls func for every one
+static void partition_read(JOIN_CTX* ctx, FILE* file, size_t side, int (*func)(void*, size_t, void*), void* cookie) {
+  unsigned char* rec = malloc(ctx->rec_size[side]);
+  rewind(file);
+  while (fread(rec, ctx->rec_size[side], 1, file) == 1 && !func(&rec[sizeof(size_t)], *(size_t*)rec, cookie));
+  free(rec);
+}
+
+static void join_partitions(JOIN_CTX* ctx, FILE** build, FILE** probe, size_t depth);
+
+// Joins one pair of partitions, splitting them again with another seed
+// while the build side does not fit into memory
+static void join_pair(JOIN_CTX* ctx, FILE* build, FILE* probe, size_t depth) {
+  fseek(build, 0, SEEK_END);
+  size_t nrows = ftell(build) / ctx->rec_size[0];
+  if (nrows * (sizeof(JOIN_ENTRY) + ctx->side[0]->entry_raw_size) > ctx->memory_limit && depth < JOIN_MAX_DEPTH) {
+    FILE* sub[2][JOIN_PARTITIONS] = { 0 };
+    ctx->seed++;
+    for (size_t side = 0; side < 2; side++) {
+      ctx->partitions = sub[side];
+      ctx->partition_side = side;
+      partition_read(ctx, side ? probe : build, side, partition_row, ctx);
+    }
+    join_partitions(ctx, sub[0], sub[1], depth + 1);
+    ctx->seed--;
+    return;
+  }
+  table_reset(ctx, nrows);
+  partition_read(ctx, build, 0, build_row, ctx);
+  partition_read(ctx, probe, 1, probe_row, ctx);
+}
+
+static void join_partitions(JOIN_CTX* ctx, FILE** build, FILE** probe, size_t depth) {
+  for (size_t p = 0; p < JOIN_PARTITIONS; p++) {
+    // a partition without rows on either side has no matches
+    if (!ctx->stop && build[p] && probe[p])
+      join_pair(ctx, build[p], probe[p], depth);
+    if (build[p]) fclose(build[p]);
+    if (probe[p]) fclose(probe[p]);
+  }
+}
+
+typedef struct {
+  JOIN_CTX* ctx;
+  unsigned char* query; // row 0 of the probe table
+} JOIN_LOOKUP;
+
+static int lookup_row(void* entry, size_t row, void* cookie) {
+  JOIN_LOOKUP* lookup = cookie;
+  JOIN_CTX* ctx = lookup->ctx;
+  TABLE_STATE* ts = ctx->side[1];
+  size_t col = ctx->col[1];
+  unsigned char* dst = &lookup->query[ts->col_offsets[col]];
+  const unsigned char* value = join_value(ctx, 0, entry);
+  if (TYPE_NUMBER(ctx->type) == TABLE_TYPE_VARCHAR) {
+    memset(dst, 0, TYPE_SIZE(ts->col_types[col]));
+    strncpy((char*)dst, (const char*)value, TYPE_SIZE(ts->col_types[col]) - 1);
+  } else {
+    memcpy(dst, value, TYPE_SIZE(ctx->type));
+  }
+  size_t found = key_find(col, lookup->query, ts);
+  if (found == 0)
+    return 0;
+  void* match = get_by_tindex(found, ts);
+  int stop = join_emit(ctx, entry, row, match, found);
+  free(match);
+  return stop;
+}
+
+static size_t live_rows(TABLE_STATE* ts) {
+  ZONE_MAP* zm = ts->zone_map;
+  if (zm == NULL)
+    return row_count(ts);
+  size_t count = 0;
+  for (size_t b = 0; b < zm->nblocks; b++)
+    count += zm->live[b];
+  return count;
+}
+
+static size_t join_tables(JOIN* query, TABLE_STATE* left, TABLE_STATE* right, int (*func)(void*, size_t, void*, size_t, void*), void* cookie) {
+  assert(query->left_col < left->ncols && query->right_col < right->ncols);
+  assert(TYPE_NUMBER(left->col_types[query->left_col]) == TYPE_NUMBER(right->col_types[query->right_col]));
+  JOIN_CTX ctx = { 0 };
+  ctx.query = query;
+  ctx.func = func;
+  ctx.cookie = cookie;
+  ctx.memory_limit = query->memory_limit ? query->memory_limit : JOIN_MEMORY_LIMIT;
+  ctx.type = left->col_types[query->left_col];
+
+  // index nested loop when one side can be looked up by key,
+  // otherwise the hash table is built on the smaller side
+  size_t left_key = IS_KEY(left->col_types[query->left_col]);
+  size_t right_key = IS_KEY(right->col_types[query->right_col]);
+  size_t nleft = live_rows(left), nright = live_rows(right);
+  if (right_key || left_key)
+    ctx.build_is_left = right_key;
+  else
+    ctx.build_is_left = nleft <= nright;
+  ctx.side[0] = ctx.build_is_left ? left : right;
+  ctx.side[1] = ctx.build_is_left ? right : left;
+  ctx.col[0] = ctx.build_is_left ? query->left_col : query->right_col;
+  ctx.col[1] = ctx.build_is_left ? query->right_col : query->left_col;
+  ctx.rec_size[0] = sizeof(size_t) + ctx.side[0]->entry_raw_size;
+  ctx.rec_size[1] = sizeof(size_t) + ctx.side[1]->entry_raw_size;
+  size_t nbuild = ctx.build_is_left ? nleft : nright;
+
+  if (right_key || left_key) {
+    // the scanned side plays build, the key side is probed through its tree
+    JOIN_LOOKUP lookup = { &ctx, get_by_tindex(0, ctx.side[1]) };
+    table_scan(ctx.col[0], NULL, ctx.side[0], lookup_row, &lookup);
+    free(lookup.query);
+    return ctx.count;
+  }
+
+  if (nbuild * (sizeof(JOIN_ENTRY) + ctx.side[0]->entry_raw_size) <= ctx.memory_limit) {
+    table_reset(&ctx, nbuild);
+    table_scan(ctx.col[0], NULL, ctx.side[0], build_row, &ctx);
+    table_scan(ctx.col[1], NULL, ctx.side[1], probe_row, &ctx);
+  } else {
+    FILE* partitions[2][JOIN_PARTITIONS] = { 0 };
+    for (size_t side = 0; side < 2; side++) {
+      ctx.partitions = partitions[side];
+      ctx.partition_side = side;
+      table_scan(ctx.col[side], NULL, ctx.side[side], partition_row, &ctx);
+    }
+    join_partitions(&ctx, partitions[0], partitions[1], 0);
+  }
+  free(ctx.buckets);
+  arena_free(&ctx.arena);
+  return ctx.count;
+}
+
+// Calls func(left_entry, left_row, right_entry, right_row, cookie) for every
+// pair of rows with equal query->left_col and query->right_col. Entries are
+// only valid during the call. Stops when func returns non-zero.
+// Returns number of pairs passed to func
+size_t hash_join(JOIN* query, TABLE_STATE* left, TABLE_STATE* right, int (*func)(void*, size_t, void*, size_t, void*), void* cookie) {
+  // in address order, so two joins of the same tables cannot wait on
+  // each other
+  TABLE_STATE* first = left < right ? left : right;
+  TABLE_STATE* second = left < right ? right : left;
+  size_t first_latched = table_latch(first, TABLE_LOCK_READ);
+  size_t second_latched = table_latch(second, TABLE_LOCK_READ);
+  size_t count = join_tables(query, left, right, func, cookie);
+  table_unlatch(second, second_latched);
+  table_unlatch(first, first_latched);
+  return count;
+}
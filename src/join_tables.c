@@ -0,0 +1,27 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+
+static int print_pair(void* left, size_t left_row, void* right, size_t right_row, void* cookie) {
+  printf("[%ld] x [%ld]\n", left_row, right_row);
+  return 0;
+}
+
+int main () {
+  TABLE_STATE left = { 0 }, right = { 0 };
+  open_table("data/table.bin", &left);
+  open_table("data/table.bin", &right);
+  JOIN query = { 0 };
+  query.left_col = 0;
+  query.right_col = 0;
+  printf("JOIN ON id\n");
+  printf("Found %ld pairs\n", hash_join(&query, &left, &right, print_pair, NULL));
+  query.left_col = 2;
+  query.right_col = 2;
+  printf("JOIN ON birthday\n");
+  printf("Found %ld pairs\n", hash_join(&query, &left, &right, print_pair, NULL));
+  printf("\n");
+  close_table(&right);
+  close_table(&left);
+  
+  return 0;
+}
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "file.h"
+
+// Sidecar view
+// [0]   "KBFL"
+// [4]   [size_t] generation of the commit on the moment of saving
+// [..]  [size_t] nkeys
+// [..]  [size_t] row count of the table on the moment of saving
+// [..]  [size_t] capacity
+// [..]  [size_t] count
+// ...   per key column: [size_t] ncounters, [size_t] nhashes, ncounters / 2 bytes
+
+#define KEYFILTER_MAGIC "KBFL"
+
+static KEY_FILTERS* keyfilter_create(TABLE_STATE* ts, size_t capacity) {
+  KEY_FILTERS* kf = malloc(sizeof(KEY_FILTERS));
+  memset(kf, 0, sizeof(KEY_FILTERS));
+  kf->nkeys = ts->nkey_cols;
+  kf->capacity = capacity < KEYFILTER_MIN_KEYS ? KEYFILTER_MIN_KEYS : capacity;
+  kf->filters = calloc(kf->nkeys, sizeof(COUNTING_BLOOM));
+  for (size_t k = 0; k < kf->nkeys; k++)
+    cbloom_init(&kf->filters[k], kf->capacity, KEYFILTER_BITS);
+  return kf;
+}
+
+static void keyfilter_free(KEY_FILTERS* kf) {
+  for (size_t k = 0; k < kf->nkeys; k++)
+    cbloom_free(&kf->filters[k]);
+  free(kf->filters);
+  free(kf);
+}
+
+static size_t keyfilter_load(TABLE_STATE* ts) {
+  char* name = sidecar_name(ts->file_name, "kbf");
+  FILE* file = fopen(name, "rb");
+  free(name);
+  if (file == NULL)
+    return 1;
+  char magic[4];
+  size_t gen, nkeys, nrows, capacity, count;
+  size_t ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, KEYFILTER_MAGIC, 4) == 0;
+  ok = ok && fread(&gen, sizeof(size_t), 1, file);
+  ok = ok && fread(&nkeys, sizeof(size_t), 1, file);
+  ok = ok && fread(&nrows, sizeof(size_t), 1, file);
+  ok = ok && fread(&capacity, sizeof(size_t), 1, file);
+  ok = ok && fread(&count, sizeof(size_t), 1, file);
+  // a stale filter could miss keys, it is rebuilt instead
+  ok = ok && gen == table_generation(ts) && nkeys == ts->nkey_cols && nrows == row_count(ts);
+  if (ok) {
+    KEY_FILTERS* kf = ts->key_filters = keyfilter_create(ts, capacity);
+    kf->count = count;
+    for (size_t k = 0; ok && k < nkeys; k++) {
+      COUNTING_BLOOM* f = &kf->filters[k];
+      size_t ncounters, nhashes;
+      ok = fread(&ncounters, sizeof(size_t), 1, file) && fread(&nhashes, sizeof(size_t), 1, file);
+      ok = ok && ncounters == f->ncounters && nhashes == f->nhashes;
+      ok = ok && fread(f->counters, 1, ncounters / 2, file) == ncounters / 2;
+    }
+    if (!ok) {
+      keyfilter_free(kf);
+      ts->key_filters = NULL;
+    }
+  }
+  fclose(file);
+  return !ok;
+}
+
+static int rebuild_row(void* entry, size_t row, void* cookie) {
+  TABLE_STATE* ts = cookie;
+  keyfilter_row_written(ts, row, entry);
+  return 0;
+}
+
+// Refills the filters from the live rows, sized for twice the row slots
+void keyfilter_rebuild(TABLE_STATE* ts) {
+  if (ts->key_filters)
+    keyfilter_free(ts->key_filters);
+  ts->key_filters = NULL;
+  ts->key_filters = keyfilter_create(ts, 2 * row_count(ts));
+  table_scan(0, NULL, ts, rebuild_row, ts);
+  ts->key_filters->dirty = 1;
+}
+
+void keyfilter_open(TABLE_STATE* ts) {
+  if (ts->nkey_cols == 0)
+    return;
+  if (keyfilter_load(ts) != 0)
+    keyfilter_rebuild(ts);
+}
+
+void keyfilter_save(TABLE_STATE* ts) {
+  KEY_FILTERS* kf = ts->key_filters;
+  if (kf == NULL)
+    return;
+  if (!kf->dirty) {
+    sidecar_restamp(ts, "kbf");
+    return;
+  }
+  // past capacity the false positive rate climbs
+  if (kf->count > kf->capacity)
+    keyfilter_rebuild(ts);
+  kf = ts->key_filters;
+  char* name = sidecar_name(ts->file_name, "kbf");
+  FILE* file = fopen(name, "wb");
+  free(name);
+  if (file == NULL)
+    return;
+  size_t gen = table_generation(ts), nrows = row_count(ts);
+  fwrite(KEYFILTER_MAGIC, 1, 4, file);
+  fwrite(&gen, sizeof(size_t), 1, file);
+  fwrite(&kf->nkeys, sizeof(size_t), 1, file);
+  fwrite(&nrows, sizeof(size_t), 1, file);
+  fwrite(&kf->capacity, sizeof(size_t), 1, file);
+  fwrite(&kf->count, sizeof(size_t), 1, file);
+  for (size_t k = 0; k < kf->nkeys; k++) {
+    fwrite(&kf->filters[k].ncounters, sizeof(size_t), 1, file);
+    fwrite(&kf->filters[k].nhashes, sizeof(size_t), 1, file);
+    fwrite(kf->filters[k].counters, 1, kf->filters[k].ncounters / 2, file);
+  }
+  fclose(file);
+  kf->dirty = 0;
+}
+
+void keyfilter_close(TABLE_STATE* ts) {
+  if (ts->key_filters == NULL)
+    return;
+  keyfilter_free(ts->key_filters);
+  ts->key_filters = NULL;
+}
+
+void keyfilter_row_written(TABLE_STATE* ts, size_t row, const void* entry) {
+  KEY_FILTERS* kf = ts->key_filters;
+  if (kf == NULL)
+    return;
+  for (size_t c = 0; c < ts->ncols; c++) {
+    if (IS_KEY(ts->col_types[c]))
+      cbloom_add(&kf->filters[ts->key_col_relpos[c]], value_hash(ts->col_types[c], &((const unsigned char*)entry)[ts->col_offsets[c]]));
+  }
+  kf->count++;
+  kf->dirty = 1;
+}
+
+// old_value is the bare value col had before
+void keyfilter_value_written(TABLE_STATE* ts, size_t row, size_t col, const void* old_value, const void* entry) {
+  KEY_FILTERS* kf = ts->key_filters;
+  if (kf == NULL || !IS_KEY(ts->col_types[col]))
+    return;
+  COUNTING_BLOOM* f = &kf->filters[ts->key_col_relpos[col]];
+  cbloom_remove(f, value_hash(ts->col_types[col], old_value));
+  cbloom_add(f, value_hash(ts->col_types[col], &((const unsigned char*)entry)[ts->col_offsets[col]]));
+  kf->dirty = 1;
+}
+
+void keyfilter_row_deleted(TABLE_STATE* ts, size_t row) {
+  KEY_FILTERS* kf = ts->key_filters;
+  if (kf == NULL)
+    return;
+  unsigned char* entry = get_by_tindex(row, ts);
+  for (size_t c = 0; c < ts->ncols; c++) {
+    if (IS_KEY(ts->col_types[c]))
+      cbloom_remove(&kf->filters[ts->key_col_relpos[c]], value_hash(ts->col_types[c], &entry[ts->col_offsets[c]]));
+  }
+  free(entry);
+  if (kf->count) kf->count--;
+  kf->dirty = 1;
+}
+
+// 0 if no row holds the bare value in key column col
+int keyfilter_may_contain(size_t col, const void* value, TABLE_STATE* ts) {
+  KEY_FILTERS* kf = ts->key_filters;
+  if (kf == NULL)
+    return 1;
+  return cbloom_may_contain(&kf->filters[ts->key_col_relpos[col]], value_hash(ts->col_types[col], value));
+}
@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "file.h"
+
+// Address of a thread local, tells the threads apart
+static __thread char self;
+
+#define LATCH_SHARED 2 // the commit byte was shared along with the latch
+
+void latch_open(TABLE_STATE* ts) {
+  ts->latch = calloc(1, sizeof(TABLE_LATCH));
+  // readers may nest (a select reads rows through the trees), a waiting
+  // commit must not stop them halfway
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_READER_NP);
+  pthread_rwlock_init(&ts->latch->latch, &attr);
+  pthread_rwlockattr_destroy(&attr);
+  pthread_mutex_init(&ts->latch->stage, NULL);
+}
+
+void latch_close(TABLE_STATE* ts) {
+  TABLE_LATCH* latch = ts->latch;
+  if (latch == NULL)
+    return;
+  pthread_rwlock_destroy(&latch->latch);
+  pthread_mutex_destroy(&latch->stage);
+  free(latch);
+  ts->latch = NULL;
+}
+
+// Latches the table for the calling thread, shared for TABLE_LOCK_READ
+// and alone for TABLE_LOCK_WRITE. The thread holding it alone passes
+// without taking it again. A thread sharing it must not ask for it alone,
+// so callbacks of a select do not commit. Sharing the latch shares the
+// commit byte of the table with the other processes as well. Returns 1 if
+// nothing was taken, to be handed to table_unlatch
+size_t table_latch(TABLE_STATE* ts, size_t mode) {
+  TABLE_LATCH* latch = ts->latch;
+  if (latch == NULL || __atomic_load_n(&latch->owner, __ATOMIC_RELAXED) == &self)
+    return 1;
+  if (mode == TABLE_LOCK_READ && ts->lsm == NULL && ts->snapshot == NULL) {
+    pthread_rwlock_rdlock(&latch->latch);
+    return table_lock_shared(ts) ? 0 : LATCH_SHARED;
+  }
+  pthread_rwlock_wrlock(&latch->latch);
+  __atomic_store_n(&latch->owner, &self, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void table_unlatch(TABLE_STATE* ts, size_t held) {
+  TABLE_LATCH* latch = ts->latch;
+  if (held == 1 || latch == NULL)
+    return;
+  if (held == LATCH_SHARED)
+    table_unlock(ts);
+  if (__atomic_load_n(&latch->owner, __ATOMIC_RELAXED) == &self)
+    __atomic_store_n(&latch->owner, NULL, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&latch->latch);
+}
+
+void stage_push(TABLE_STATE* ts, STAGE_EVENT* se) {
+  if (ts->latch)
+    pthread_mutex_lock(&ts->latch->stage);
+  da_append(&ts->stage, se);
+  if (ts->latch)
+    pthread_mutex_unlock(&ts->latch->stage);
+}
+
+// Hands the staged events to a commit and starts an empty stage
+struct darray stage_take(TABLE_STATE* ts) {
+  if (ts->latch)
+    pthread_mutex_lock(&ts->latch->stage);
+  struct darray stage = ts->stage;
+  ts->stage = (struct darray){ 0 };
+  if (ts->latch)
+    pthread_mutex_unlock(&ts->latch->stage);
+  return stage;
+}
@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include "file.h"
+
+// Lock file view, <table>.lock
+// [0]   commit byte: shared by readers, exclusive for the writer applying
+//       a commit
+// [8]   [size_t] generation, counts the commits of all processes
+// [LOCK_KEYS_OFFSET + relpos << 33 + key] one byte per lock key of a key
+//       column, ranges of keys are ranges of bytes
+//
+// Locks are open file description locks: they belong to the TABLE_STATE
+// that took them and go away with its process
+
+#define LOCK_GENERATION_OFFSET 8
+#define LOCK_KEYS_OFFSET ((off_t)1 << 32)
+
+static int range_lock(int fd, short type, off_t start, off_t len, int wait) {
+  struct flock lock = { 0 };
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = start;
+  lock.l_len = len;
+  return fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock);
+}
+
+static size_t generation(int fd) {
+  size_t gen = 0;
+  pread(fd, &gen, sizeof(size_t), LOCK_GENERATION_OFFSET);
+  return gen;
+}
+
+// Order preserving 32 bit image of a key value, keys that share it
+// share the lock
+static unsigned int lock_key(size_t type, const void* value) {
+  const unsigned char* v = value;
+  unsigned int bits;
+  switch (TYPE_NUMBER(type)) {
+  case TABLE_TYPE_INT:
+    return (unsigned int)*(const int*)value ^ 0x80000000u;
+  case TABLE_TYPE_FLOAT:
+    memcpy(&bits, value, sizeof(bits));
+    return bits & 0x80000000u ? ~bits : bits ^ 0x80000000u;
+  case TABLE_TYPE_DATATIME:
+    return datatime_key(v) >> 32;
+  }
+  size_t n = strnlen(value, TYPE_SIZE(type));
+  bits = 0;
+  for (size_t i = 0; i < 4; i++)
+    bits = bits << 8 | (i < n ? v[i] : 0);
+  return bits;
+}
+
+static off_t key_offset(size_t col, const void* value, TABLE_STATE* ts) {
+  return LOCK_KEYS_OFFSET + ((off_t)ts->key_col_relpos[col] << 33) + lock_key(ts->col_types[col], value);
+}
+
+void lock_open(TABLE_STATE* ts) {
+  char* name = sidecar_name(ts->file_name, "lock");
+  int fd = open(name, O_RDWR | O_CREAT, 0644);
+  free(name);
+  if (fd < 0)
+    return;
+  ts->lock = calloc(1, sizeof(TABLE_LOCK));
+  ts->lock->fd = fd;
+  pthread_mutex_init(&ts->lock->mutex, NULL);
+  ts->lock->generation = generation(fd);
+}
+
+void lock_close(TABLE_STATE* ts) {
+  TABLE_LOCK* lock = ts->lock;
+  if (lock == NULL)
+    return;
+  // closing the descriptor drops every lock taken through it
+  close(lock->fd);
+  pthread_mutex_destroy(&lock->mutex);
+  free(lock);
+  ts->lock = NULL;
+}
+
+// The lock of the table this thread is reading again, its reads pass
+static __thread TABLE_LOCK* reloading;
+
+static void reload(TABLE_STATE* ts, TABLE_LOCK* lock) {
+  size_t gen = generation(lock->fd);
+  if (gen == lock->generation)
+    return;
+  // sidecars are read again with the generation they were stamped with
+  lock->generation = gen;
+  // open_table locks before anything is read
+  if (ts->init) {
+    reloading = lock;
+    table_reload(ts);
+    reloading = NULL;
+  }
+}
+
+// One more reader of this process shares the commit byte, the first one
+// waits for it and reads the table again if another process committed
+// since this one last looked. Readers coming in meanwhile wait for the
+// mutex, none of them reads before the table is read again
+static void lock_share(TABLE_STATE* ts) {
+  TABLE_LOCK* lock = ts->lock;
+  size_t readers = __atomic_load_n(&lock->readers, __ATOMIC_ACQUIRE);
+  while (readers && !__atomic_compare_exchange_n(&lock->readers, &readers, readers + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+  if (readers)
+    return;
+  pthread_mutex_lock(&lock->mutex);
+  assert(lock->mode != TABLE_LOCK_WRITE);
+  if (lock->readers == 0) {
+    while (range_lock(lock->fd, F_RDLCK, 0, 1, 1) != 0)
+      assert(errno == EINTR);
+    lock->mode = TABLE_LOCK_READ;
+    reload(ts, lock);
+  }
+  __atomic_add_fetch(&lock->readers, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&lock->mutex);
+}
+
+// Waits for the commit byte, shared for TABLE_LOCK_READ and exclusive for
+// TABLE_LOCK_WRITE. The table is read again if another process committed
+// since this one last looked. Not to be asked for by a thread latching
+// the table shared, table_latch shares the byte for it. 1 if the table
+// has no lock file
+size_t table_lock(TABLE_STATE* ts, size_t mode) {
+  TABLE_LOCK* lock = ts->lock;
+  if (lock == NULL)
+    return 1;
+  // threads of this process do not read while the table is read again
+  size_t latched = table_latch(ts, TABLE_LOCK_WRITE);
+  if (mode == TABLE_LOCK_READ) {
+    lock_share(ts);
+  } else {
+    assert(lock->mode == TABLE_LOCK_NONE);
+    while (range_lock(lock->fd, F_WRLCK, 0, 1, 1) != 0)
+      assert(errno == EINTR);
+    lock->mode = mode;
+    reload(ts, lock);
+  }
+  table_unlatch(ts, latched);
+  return 0;
+}
+
+// Shares the commit byte for a thread that latched the table shared,
+// nested reads and the reads of the table being read again pass. 1 if
+// nothing was taken, else table_unlock lets it go
+size_t table_lock_shared(TABLE_STATE* ts) {
+  TABLE_LOCK* lock = ts->lock;
+  if (lock == NULL || reloading == lock)
+    return 1;
+  lock_share(ts);
+  return 0;
+}
+
+// The last reader of the process lets the commit byte go
+void table_unlock(TABLE_STATE* ts) {
+  TABLE_LOCK* lock = ts->lock;
+  if (lock == NULL || lock->mode == TABLE_LOCK_NONE)
+    return;
+  size_t readers = __atomic_load_n(&lock->readers, __ATOMIC_ACQUIRE);
+  while (readers > 1 && !__atomic_compare_exchange_n(&lock->readers, &readers, readers - 1, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+  if (readers > 1)
+    return;
+  pthread_mutex_lock(&lock->mutex);
+  if (lock->mode == TABLE_LOCK_WRITE || __atomic_sub_fetch(&lock->readers, 1, __ATOMIC_ACQ_REL) == 0) {
+    range_lock(lock->fd, F_UNLCK, 0, 1, 0);
+    lock->mode = TABLE_LOCK_NONE;
+  }
+  pthread_mutex_unlock(&lock->mutex);
+}
+
+// Generation of the table as this process last read or committed it, 0
+// if the table has no lock file
+size_t table_generation(TABLE_STATE* ts) {
+  return ts->lock ? ts->lock->generation : 0;
+}
+
+// Moves the generation on before a commit writes the table, which tells
+// the other processes to read it again. The sidecars the commit saves are
+// stamped with the new generation, a commit that stops before saving them
+// leaves them with an older one
+void table_generation_next(TABLE_STATE* ts) {
+  TABLE_LOCK* lock = ts->lock;
+  if (lock == NULL)
+    return;
+  lock->generation = generation(lock->fd) + 1;
+  pwrite(lock->fd, &lock->generation, sizeof(size_t), LOCK_GENERATION_OFFSET);
+}
+
+// Stamps a sidecar the commit left alone with its generation, what the
+// sidecar holds is still true of the table
+void sidecar_restamp(TABLE_STATE* ts, const char* ext) {
+  if (ts->lock == NULL)
+    return;
+  char* name = sidecar_name(ts->file_name, ext);
+  int fd = open(name, O_WRONLY);
+  free(name);
+  if (fd < 0)
+    return;
+  pwrite(fd, &ts->lock->generation, sizeof(size_t), SIDECAR_GENERATION_OFFSET);
+  close(fd);
+}
+
+// Moves the generation of a table on after its file was replaced, the
+// sidecars stamped before are built again on the next open
+void table_replaced(const char* file_name) {
+  char* name = sidecar_name(file_name, "lock");
+  int fd = open(name, O_RDWR | O_CREAT, 0644);
+  free(name);
+  if (fd < 0)
+    return;
+  size_t gen = generation(fd) + 1;
+  pwrite(fd, &gen, sizeof(size_t), LOCK_GENERATION_OFFSET);
+  close(fd);
+}
+
+// Takes the keys lo..hi of a key column for this TABLE_STATE until its
+// next commit, waiting for writers holding keys of the range. Writers of
+// other ranges stage their changes meanwhile and only queue up for the
+// short commit itself. hi NULL locks the single key lo
+size_t key_range_lock(TABLE_STATE* ts, size_t col, const void* lo, const void* hi) {
+  TABLE_LOCK* lock = ts->lock;
+  assert(col < ts->ncols && IS_KEY(ts->col_types[col]));
+  if (lock == NULL)
+    return 1;
+  off_t first = key_offset(col, lo, ts);
+  off_t last = key_offset(col, hi ? hi : lo, ts);
+  if (last < first)
+    return 1;
+  while (range_lock(lock->fd, F_WRLCK, first, last - first + 1, 1) != 0)
+    assert(errno == EINTR);
+  lock->keys = 1;
+  return 0;
+}
+
+void key_range_unlock(TABLE_STATE* ts) {
+  TABLE_LOCK* lock = ts->lock;
+  if (lock == NULL || !lock->keys)
+    return;
+  range_lock(lock->fd, F_UNLCK, LOCK_KEYS_OFFSET, 0, 0);
+  lock->keys = 0;
+}
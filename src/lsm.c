@@ -0,0 +1,775 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "file.h"
+
+// Sidecar view, <table>.lsm
+// [0]   "LSMT"
+// [4]   [size_t] generation of the commit on the moment of saving, kept
+//       older while keys wait in the memtables
+// [..]  [size_t] nkey_cols
+// [..]  [size_t] row count of the table on the moment of saving
+// [..]  [size_t] next run id
+// ...   per key column: [size_t] nruns, nruns * ([size_t] id, [size_t] level), newest first
+//
+// Run view, <table>.lsm.<key>.<id>
+// [0]   "LSMR"
+// [4]   [size_t] key_size
+// [..]  [size_t] count
+// [..]  [size_t] nblocks
+// [..]  [size_t] bloom nbits
+// [..]  [size_t] bloom nhashes
+// ...   count records sorted by key: key_size bytes of key, [size_t] row
+// ...   nblocks fence keys, the first key of every block
+// ...   nbits / 8 bytes of bloom filter
+//
+// The table itself is marked by LSM_MARK in the parent slot of the first
+// tree of row 0, so a table restored without its sidecars rebuilds them
+// instead of trusting trees that were not kept up to date. A commit does
+// not flush the memtables, a table left without lsm_close finds the
+// manifest stamped with an older generation and rebuilds the runs
+
+#define LSM_MAGIC "LSMT"
+#define LSM_RUN_MAGIC "LSMR"
+#define LSM_RUN_HEADER (4 + 5 * sizeof(size_t))
+#define LSM_MARK ((size_t)-2)
+#define LSM_TOMBSTONE ((size_t)-1) // row of a deleted key
+
+typedef struct lsm_node {
+  unsigned char* rec;
+  struct lsm_node* next[];
+} LSM_NODE;
+
+typedef struct {
+  size_t id, level;
+  size_t count, nblocks;
+  FILE* file;
+  unsigned char* fences;
+  BLOOM bloom;
+} LSM_RUN;
+
+typedef struct lsm_tree LSM_TREE;
+
+typedef struct {
+  LSM_TREE* tree;
+  LSM_RUN** inputs;  // contiguous in the run list
+  size_t ninputs;
+  size_t id, level;
+  int bottom;        // no older runs, tombstones can go
+  LSM_RUN* out;
+  int done;
+  pthread_t thread;
+} LSM_MERGE;
+
+struct lsm_tree {
+  LSM* lsm;
+  size_t relpos, col, type;
+  size_t key_size, rec_size;
+
+  // memtable
+  ARENA arena;
+  LSM_NODE* head;
+  size_t levels;
+  size_t count;
+  size_t random;
+
+  LSM_RUN** runs; // newest first, levels do not decrease
+  size_t nruns;
+  LSM_MERGE* merge;
+  unsigned char* block;
+};
+
+struct lsm {
+  char* file_name;
+  size_t ntrees;
+  LSM_TREE* trees;
+  size_t next_id;
+  struct darray garbage; // run files to unlink once the manifest is written
+  size_t dirty;
+};
+
+static size_t rec_row(LSM_TREE* tree, const unsigned char* rec) {
+  size_t row;
+  memcpy(&row, &rec[tree->key_size], sizeof(size_t));
+  return row;
+}
+
+static void key_copy(LSM_TREE* tree, unsigned char* dst, const unsigned char* key) {
+  if (TYPE_NUMBER(tree->type) == TABLE_TYPE_VARCHAR) {
+    memset(dst, 0, tree->key_size);
+    strncpy((char*)dst, (const char*)key, tree->key_size - 1);
+  } else {
+    memcpy(dst, key, tree->key_size);
+  }
+}
+
+static char* run_name(const char* file_name, size_t relpos, size_t id) {
+  char ext[64];
+  sprintf(ext, "lsm.%ld.%ld", relpos, id);
+  return sidecar_name(file_name, ext);
+}
+
+// Memtable
+
+static void mem_reset(LSM_TREE* tree) {
+  arena_free(&tree->arena);
+  tree->head = arena_alloc(&tree->arena, sizeof(LSM_NODE) + LSM_SKIP_LEVELS * sizeof(LSM_NODE*));
+  memset(tree->head, 0, sizeof(LSM_NODE) + LSM_SKIP_LEVELS * sizeof(LSM_NODE*));
+  tree->levels = 1;
+  tree->count = 0;
+}
+
+// Last node of every level before key
+static LSM_NODE* mem_seek(LSM_TREE* tree, const unsigned char* key, LSM_NODE** update) {
+  LSM_NODE* x = tree->head;
+  for (size_t l = tree->levels; l-- > 0; ) {
+    while (x->next[l] && value_cmp(tree->type, x->next[l]->rec, key) < 0)
+      x = x->next[l];
+    if (update) update[l] = x;
+  }
+  x = x->next[0];
+  return x && value_cmp(tree->type, x->rec, key) == 0 ? x : NULL;
+}
+
+static void mem_put(LSM_TREE* tree, const unsigned char* key, size_t row) {
+  LSM_NODE* update[LSM_SKIP_LEVELS];
+  LSM_NODE* x = mem_seek(tree, key, update);
+  if (x) {
+    memcpy(&x->rec[tree->key_size], &row, sizeof(size_t));
+    return;
+  }
+  // a level more with probability 1/4
+  size_t levels = 1;
+  tree->random ^= tree->random << 13;
+  tree->random ^= tree->random >> 7;
+  tree->random ^= tree->random << 17;
+  for (size_t r = tree->random; levels < LSM_SKIP_LEVELS && (r & 3) == 0; r >>= 2)
+    levels++;
+  for (; tree->levels < levels; tree->levels++)
+    update[tree->levels] = tree->head;
+  x = arena_alloc(&tree->arena, sizeof(LSM_NODE) + levels * sizeof(LSM_NODE*) + tree->rec_size);
+  x->rec = (unsigned char*)&x->next[levels];
+  key_copy(tree, x->rec, key);
+  memcpy(&x->rec[tree->key_size], &row, sizeof(size_t));
+  for (size_t l = 0; l < levels; l++) {
+    x->next[l] = update[l]->next[l];
+    update[l]->next[l] = x;
+  }
+  tree->count++;
+}
+
+// Runs
+
+static void run_free(LSM_RUN* run) {
+  if (run->file) fclose(run->file);
+  free(run->fences);
+  bloom_free(&run->bloom);
+  free(run);
+}
+
+typedef struct {
+  LSM_TREE* tree;
+  LSM_RUN* run;
+  size_t capacity; // of fences, in keys
+} RUN_WRITER;
+
+static void run_begin(RUN_WRITER* w, LSM_TREE* tree, size_t id, size_t level, size_t expected) {
+  w->tree = tree;
+  w->run = malloc(sizeof(LSM_RUN));
+  memset(w->run, 0, sizeof(LSM_RUN));
+  w->run->id = id;
+  w->run->level = level;
+  char* name = run_name(tree->lsm->file_name, tree->relpos, id);
+  w->run->file = fopen(name, "wb+");
+  free(name);
+  bloom_init(&w->run->bloom, expected, LSM_BLOOM_BITS);
+  w->capacity = 0;
+  fseek(w->run->file, LSM_RUN_HEADER, SEEK_SET);
+}
+
+static void run_add(RUN_WRITER* w, const unsigned char* rec) {
+  LSM_RUN* run = w->run;
+  size_t key_size = w->tree->key_size;
+  if (run->count % LSM_BLOCK_RECORDS == 0) {
+    if (run->nblocks == w->capacity) {
+      w->capacity = w->capacity ? 2 * w->capacity : 16;
+      run->fences = realloc(run->fences, w->capacity * key_size);
+    }
+    memcpy(&run->fences[run->nblocks++ * key_size], rec, key_size);
+  }
+  bloom_add(&run->bloom, value_hash(w->tree->type, rec));
+  fwrite(rec, w->tree->rec_size, 1, run->file);
+  run->count++;
+}
+
+static LSM_RUN* run_end(RUN_WRITER* w) {
+  LSM_RUN* run = w->run;
+  fwrite(run->fences, w->tree->key_size, run->nblocks, run->file);
+  fwrite(run->bloom.bits, 1, run->bloom.nbits / 8, run->file);
+  rewind(run->file);
+  fwrite(LSM_RUN_MAGIC, 1, 4, run->file);
+  fwrite(&w->tree->key_size, sizeof(size_t), 1, run->file);
+  fwrite(&run->count, sizeof(size_t), 1, run->file);
+  fwrite(&run->nblocks, sizeof(size_t), 1, run->file);
+  fwrite(&run->bloom.nbits, sizeof(size_t), 1, run->file);
+  fwrite(&run->bloom.nhashes, sizeof(size_t), 1, run->file);
+  fflush(run->file);
+  return run;
+}
+
+static LSM_RUN* run_open(LSM_TREE* tree, size_t id, size_t level) {
+  char* name = run_name(tree->lsm->file_name, tree->relpos, id);
+  FILE* file = fopen(name, "rb");
+  free(name);
+  if (file == NULL)
+    return NULL;
+  LSM_RUN* run = malloc(sizeof(LSM_RUN));
+  memset(run, 0, sizeof(LSM_RUN));
+  run->id = id;
+  run->level = level;
+  run->file = file;
+  char magic[4];
+  size_t key_size;
+  size_t ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, LSM_RUN_MAGIC, 4) == 0;
+  ok = ok && fread(&key_size, sizeof(size_t), 1, file) && key_size == tree->key_size;
+  ok = ok && fread(&run->count, sizeof(size_t), 1, file);
+  ok = ok && fread(&run->nblocks, sizeof(size_t), 1, file);
+  ok = ok && fread(&run->bloom.nbits, sizeof(size_t), 1, file);
+  ok = ok && fread(&run->bloom.nhashes, sizeof(size_t), 1, file);
+  if (ok) {
+    run->fences = malloc(run->nblocks * key_size + 1);
+    run->bloom.bits = malloc(run->bloom.nbits / 8);
+    fseek(file, LSM_RUN_HEADER + run->count * tree->rec_size, SEEK_SET);
+    ok = fread(run->fences, key_size, run->nblocks, file) == run->nblocks;
+    ok = ok && fread(run->bloom.bits, 1, run->bloom.nbits / 8, file) == run->bloom.nbits / 8;
+  }
+  if (!ok) {
+    run_free(run);
+    return NULL;
+  }
+  return run;
+}
+
+// 1 if the run has key, its row is put into row
+static int run_get(LSM_TREE* tree, LSM_RUN* run, const unsigned char* key, size_t hash, size_t* row) {
+  if (run->count == 0 || !bloom_may_contain(&run->bloom, hash))
+    return 0;
+  // last block whose fence is not above key
+  size_t lo = 0, hi = run->nblocks;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (value_cmp(tree->type, &run->fences[mid * tree->key_size], key) <= 0) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo == 0)
+    return 0;
+  size_t block = lo - 1;
+  size_t first = block * LSM_BLOCK_RECORDS;
+  size_t n = run->count - first < LSM_BLOCK_RECORDS ? run->count - first : LSM_BLOCK_RECORDS;
+  fseek(run->file, LSM_RUN_HEADER + first * tree->rec_size, SEEK_SET);
+  if (fread(tree->block, tree->rec_size, n, run->file) != n)
+    return 0;
+  lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    int c = value_cmp(tree->type, &tree->block[mid * tree->rec_size], key);
+    if (c == 0) {
+      *row = rec_row(tree, &tree->block[mid * tree->rec_size]);
+      return 1;
+    }
+    if (c < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return 0;
+}
+
+static size_t tree_lookup(LSM_TREE* tree, const unsigned char* key) {
+  LSM_NODE* x = mem_seek(tree, key, NULL);
+  size_t row = LSM_TOMBSTONE;
+  if (x) {
+    row = rec_row(tree, x->rec);
+  } else {
+    size_t hash = value_hash(tree->type, key);
+    for (size_t i = 0; i < tree->nruns; i++)
+      if (run_get(tree, tree->runs[i], key, hash, &row))
+        break;
+  }
+  return row == LSM_TOMBSTONE ? 0 : row;
+}
+
+// Merges
+
+static void* merge_thread(void* arg) {
+  LSM_MERGE* m = arg;
+  LSM_TREE* tree = m->tree;
+  size_t n = m->ninputs, expected = 0;
+  // own handles, the foreground keeps reading through the run files
+  FILE** files = malloc(n * sizeof(FILE*));
+  size_t* left = malloc(n * sizeof(size_t));
+  unsigned char* heads = malloc(n * tree->rec_size);
+  unsigned char* rec = malloc(tree->rec_size);
+  for (size_t i = 0; i < n; i++) {
+    char* name = run_name(tree->lsm->file_name, tree->relpos, m->inputs[i]->id);
+    files[i] = fopen(name, "rb");
+    free(name);
+    fseek(files[i], LSM_RUN_HEADER, SEEK_SET);
+    left[i] = m->inputs[i]->count;
+    if (left[i] && fread(&heads[i * tree->rec_size], tree->rec_size, 1, files[i]) != 1)
+      left[i] = 0;
+    expected += m->inputs[i]->count;
+  }
+  RUN_WRITER w;
+  run_begin(&w, tree, m->id, m->level, expected);
+  for (;;) {
+    // the smallest key, of the newest run on ties
+    size_t min = n;
+    for (size_t i = 0; i < n; i++)
+      if (left[i] && (min == n || value_cmp(tree->type, &heads[i * tree->rec_size], &heads[min * tree->rec_size]) < 0))
+        min = i;
+    if (min == n)
+      break;
+    memcpy(rec, &heads[min * tree->rec_size], tree->rec_size);
+    for (size_t i = 0; i < n; i++) {
+      if (left[i] && value_cmp(tree->type, &heads[i * tree->rec_size], rec) == 0) {
+        if (--left[i] && fread(&heads[i * tree->rec_size], tree->rec_size, 1, files[i]) != 1)
+          left[i] = 0;
+      }
+    }
+    if (!(m->bottom && rec_row(tree, rec) == LSM_TOMBSTONE))
+      run_add(&w, rec);
+  }
+  m->out = run_end(&w);
+  for (size_t i = 0; i < n; i++)
+    fclose(files[i]);
+  free(files);
+  free(left);
+  free(heads);
+  free(rec);
+  __atomic_store_n(&m->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void garbage_add(LSM* lsm, size_t relpos, size_t id) {
+  da_append(&lsm->garbage, run_name(lsm->file_name, relpos, id));
+}
+
+// Puts a finished merge into the run list, waits for it if wait is set
+static void merge_reap(LSM_TREE* tree, int wait) {
+  LSM_MERGE* m = tree->merge;
+  if (m == NULL || (!wait && !__atomic_load_n(&m->done, __ATOMIC_ACQUIRE)))
+    return;
+  pthread_join(m->thread, NULL);
+  size_t first = 0;
+  while (tree->runs[first] != m->inputs[0]) first++;
+  for (size_t i = 0; i < m->ninputs; i++) {
+    garbage_add(tree->lsm, tree->relpos, m->inputs[i]->id);
+    run_free(m->inputs[i]);
+  }
+  size_t keep = m->out->count != 0;
+  if (keep) {
+    tree->runs[first] = m->out;
+  } else {
+    garbage_add(tree->lsm, tree->relpos, m->out->id);
+    run_free(m->out);
+  }
+  memmove(&tree->runs[first + keep], &tree->runs[first + m->ninputs],
+          (tree->nruns - first - m->ninputs) * sizeof(LSM_RUN*));
+  tree->nruns -= m->ninputs - keep;
+  free(m->inputs);
+  free(m);
+  tree->merge = NULL;
+  tree->lsm->dirty = 1;
+}
+
+// Starts merging the lowest level holding LSM_FANOUT runs.
+// Returns 1 if a merge was started
+static int merge_start(LSM_TREE* tree) {
+  if (tree->merge)
+    return 0;
+  for (size_t first = 0; first < tree->nruns; ) {
+    size_t last = first;
+    while (last < tree->nruns && tree->runs[last]->level == tree->runs[first]->level) last++;
+    if (last - first >= LSM_FANOUT) {
+      LSM_MERGE* m = malloc(sizeof(LSM_MERGE));
+      memset(m, 0, sizeof(LSM_MERGE));
+      m->tree = tree;
+      m->ninputs = last - first;
+      m->inputs = malloc(m->ninputs * sizeof(LSM_RUN*));
+      memcpy(m->inputs, &tree->runs[first], m->ninputs * sizeof(LSM_RUN*));
+      m->id = tree->lsm->next_id++;
+      m->level = tree->runs[first]->level + 1;
+      m->bottom = last == tree->nruns;
+      tree->merge = m;
+      pthread_create(&m->thread, NULL, merge_thread, m);
+      return 1;
+    }
+    first = last;
+  }
+  return 0;
+}
+
+static void runs_push(LSM_TREE* tree, LSM_RUN* run) {
+  tree->runs = realloc(tree->runs, (tree->nruns + 1) * sizeof(LSM_RUN*));
+  size_t at = 0;
+  while (at < tree->nruns && tree->runs[at]->level < run->level) at++;
+  memmove(&tree->runs[at + 1], &tree->runs[at], (tree->nruns - at) * sizeof(LSM_RUN*));
+  tree->runs[at] = run;
+  tree->nruns++;
+}
+
+static void mem_flush(LSM_TREE* tree) {
+  if (tree->count == 0)
+    return;
+  merge_reap(tree, 0);
+  // flushes outrunning the merges wait for them, so the run count stays bounded
+  size_t level0 = 0;
+  while (level0 < tree->nruns && tree->runs[level0]->level == 0) level0++;
+  if (level0 >= 2 * LSM_FANOUT)
+    merge_reap(tree, 1);
+  RUN_WRITER w;
+  run_begin(&w, tree, tree->lsm->next_id++, 0, tree->count);
+  for (LSM_NODE* x = tree->head->next[0]; x; x = x->next[0])
+    run_add(&w, x->rec);
+  runs_push(tree, run_end(&w));
+  mem_reset(tree);
+  merge_start(tree);
+  tree->lsm->dirty = 1;
+}
+
+static void tree_put(LSM_TREE* tree, const unsigned char* key, size_t row) {
+  mem_put(tree, key, row);
+  if (tree->count >= LSM_MEMTABLE_RECORDS)
+    mem_flush(tree);
+}
+
+static void tree_clear(LSM_TREE* tree) {
+  merge_reap(tree, 1);
+  for (size_t i = 0; i < tree->nruns; i++) {
+    garbage_add(tree->lsm, tree->relpos, tree->runs[i]->id);
+    run_free(tree->runs[i]);
+  }
+  tree->nruns = 0;
+  mem_reset(tree);
+}
+
+// Manifest
+
+static LSM* lsm_alloc(TABLE_STATE* ts) {
+  LSM* lsm = malloc(sizeof(LSM));
+  memset(lsm, 0, sizeof(LSM));
+  lsm->file_name = strdup(ts->file_name);
+  lsm->ntrees = ts->nkey_cols;
+  lsm->trees = calloc(lsm->ntrees, sizeof(LSM_TREE));
+  for (size_t c = 0; c < ts->ncols; c++) {
+    if (!IS_KEY(ts->col_types[c]))
+      continue;
+    LSM_TREE* tree = &lsm->trees[ts->key_col_relpos[c]];
+    tree->lsm = lsm;
+    tree->relpos = ts->key_col_relpos[c];
+    tree->col = c;
+    tree->type = ts->col_types[c];
+    tree->key_size = TYPE_SIZE(tree->type);
+    tree->rec_size = tree->key_size + sizeof(size_t);
+    tree->random = 0x9E3779B97F4A7C15UL ^ c;
+    tree->block = malloc(LSM_BLOCK_RECORDS * tree->rec_size);
+    mem_reset(tree);
+  }
+  return lsm;
+}
+
+// 1 if keys of the table are only in the memtables
+static size_t mem_pending(LSM* lsm) {
+  for (size_t t = 0; t < lsm->ntrees; t++) {
+    if (lsm->trees[t].count)
+      return 1;
+  }
+  return 0;
+}
+
+static void lsm_write(TABLE_STATE* ts) {
+  LSM* lsm = ts->lsm;
+  char* name = sidecar_name(lsm->file_name, "lsm");
+  FILE* file = fopen(name, "wb");
+  free(name);
+  if (file == NULL)
+    return;
+  size_t gen = mem_pending(lsm) ? (size_t)-1 : table_generation(ts), nrows = row_count(ts);
+  fwrite(LSM_MAGIC, 1, 4, file);
+  fwrite(&gen, sizeof(size_t), 1, file);
+  fwrite(&lsm->ntrees, sizeof(size_t), 1, file);
+  fwrite(&nrows, sizeof(size_t), 1, file);
+  fwrite(&lsm->next_id, sizeof(size_t), 1, file);
+  for (size_t t = 0; t < lsm->ntrees; t++) {
+    LSM_TREE* tree = &lsm->trees[t];
+    fwrite(&tree->nruns, sizeof(size_t), 1, file);
+    for (size_t i = 0; i < tree->nruns; i++) {
+      fwrite(&tree->runs[i]->id, sizeof(size_t), 1, file);
+      fwrite(&tree->runs[i]->level, sizeof(size_t), 1, file);
+    }
+  }
+  fclose(file);
+  // replaced runs are not referenced anymore
+  for (size_t i = 0; i < lsm->garbage.count; i++) {
+    unlink(lsm->garbage.items[i]);
+    free(lsm->garbage.items[i]);
+  }
+  lsm->garbage.count = 0;
+  lsm->dirty = 0;
+}
+
+static size_t lsm_load(TABLE_STATE* ts) {
+  LSM* lsm = ts->lsm;
+  char* name = sidecar_name(lsm->file_name, "lsm");
+  FILE* file = fopen(name, "rb");
+  free(name);
+  if (file == NULL)
+    return 1;
+  char magic[4];
+  size_t gen = 0, ntrees, nrows = 0;
+  size_t ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, LSM_MAGIC, 4) == 0;
+  ok = ok && fread(&gen, sizeof(size_t), 1, file);
+  ok = ok && fread(&ntrees, sizeof(size_t), 1, file) && ntrees == lsm->ntrees;
+  ok = ok && fread(&nrows, sizeof(size_t), 1, file);
+  // runs of a stale manifest are still loaded, the rebuild unlinks them
+  size_t stale = gen != table_generation(ts) || nrows != row_count(ts);
+  ok = ok && fread(&lsm->next_id, sizeof(size_t), 1, file);
+  for (size_t t = 0; ok && t < ntrees; t++) {
+    LSM_TREE* tree = &lsm->trees[t];
+    size_t nruns;
+    ok = fread(&nruns, sizeof(size_t), 1, file);
+    for (size_t i = 0; ok && i < nruns; i++) {
+      size_t id, level;
+      ok = fread(&id, sizeof(size_t), 1, file) && fread(&level, sizeof(size_t), 1, file);
+      LSM_RUN* run = ok ? run_open(tree, id, level) : NULL;
+      ok = run != NULL;
+      if (ok) {
+        tree->runs = realloc(tree->runs, (tree->nruns + 1) * sizeof(LSM_RUN*));
+        tree->runs[tree->nruns++] = run;
+      }
+    }
+  }
+  fclose(file);
+  return !ok || stale;
+}
+
+typedef struct {
+  LSM* lsm;
+  TABLE_STATE* ts;
+  unsigned char** recs; // per tree
+  size_t count, capacity;
+} LSM_REBUILD;
+
+static int rebuild_row(void* entry, size_t row, void* cookie) {
+  LSM_REBUILD* rb = cookie;
+  if (rb->count == rb->capacity) {
+    rb->capacity = rb->capacity ? 2 * rb->capacity : 1024;
+    for (size_t t = 0; t < rb->lsm->ntrees; t++)
+      rb->recs[t] = realloc(rb->recs[t], rb->capacity * rb->lsm->trees[t].rec_size);
+  }
+  for (size_t t = 0; t < rb->lsm->ntrees; t++) {
+    LSM_TREE* tree = &rb->lsm->trees[t];
+    unsigned char* rec = &rb->recs[t][rb->count * tree->rec_size];
+    key_copy(tree, rec, &((unsigned char*)entry)[rb->ts->col_offsets[tree->col]]);
+    memcpy(&rec[tree->key_size], &row, sizeof(size_t));
+  }
+  rb->count++;
+  return 0;
+}
+
+static int rec_cmp(const void* a, const void* b, void* tree) {
+  return value_cmp(((LSM_TREE*)tree)->type, a, b);
+}
+
+// Replaces the runs by one run per key made of the live rows
+static void lsm_rebuild(TABLE_STATE* ts) {
+  LSM* lsm = ts->lsm;
+  LSM_REBUILD rb = { lsm, ts };
+  rb.recs = calloc(lsm->ntrees, sizeof(unsigned char*));
+  table_scan(0, NULL, ts, rebuild_row, &rb);
+  // a level as deep as flushes of this many records would have reached
+  size_t level = 0;
+  for (size_t n = LSM_MEMTABLE_RECORDS; n < rb.count; n *= LSM_FANOUT) level++;
+  for (size_t t = 0; t < lsm->ntrees; t++) {
+    LSM_TREE* tree = &lsm->trees[t];
+    tree_clear(tree);
+    if (rb.count == 0)
+      continue;
+    qsort_r(rb.recs[t], rb.count, tree->rec_size, rec_cmp, tree);
+    RUN_WRITER w;
+    run_begin(&w, tree, lsm->next_id++, level, rb.count);
+    for (size_t i = 0; i < rb.count; i++)
+      run_add(&w, &rb.recs[t][i * tree->rec_size]);
+    runs_push(tree, run_end(&w));
+    free(rb.recs[t]);
+  }
+  free(rb.recs);
+  lsm->dirty = 1;
+}
+
+static size_t mark_offset(TABLE_STATE* ts) {
+  return entry_offset(0, ts) + RB_INDEX_PARENT * sizeof(size_t);
+}
+
+// Public
+
+// Moves the keys of the table from its row trees into LSM runs.
+// Returns 1 if the table has no key column, already uses LSM or is versioned
+size_t lsm_create(TABLE_STATE* ts) {
+  if (ts->nkey_cols == 0 || ts->lsm || ts->mvcc)
+    return 1;
+  size_t latched = table_latch(ts, TABLE_LOCK_WRITE);
+  size_t mark = LSM_MARK;
+  table_pwrite(ts, &mark, sizeof(size_t), mark_offset(ts));
+  ts->lsm = lsm_alloc(ts);
+  lsm_rebuild(ts);
+  lsm_write(ts);
+  table_unlatch(ts, latched);
+  return 0;
+}
+
+void lsm_open(TABLE_STATE* ts) {
+  if (ts->nkey_cols == 0)
+    return;
+  size_t mark = 0;
+  table_pread(ts, &mark, sizeof(size_t), mark_offset(ts));
+  if (mark != LSM_MARK)
+    return;
+  ts->lsm = lsm_alloc(ts);
+  if (lsm_load(ts) != 0) {
+    lsm_rebuild(ts);
+    lsm_write(ts);
+  }
+}
+
+// Writes the run list if flushes or merges changed it, called on commit.
+// Memtables are flushed when full and on lsm_close only
+void lsm_save(TABLE_STATE* ts) {
+  LSM* lsm = ts->lsm;
+  if (lsm == NULL)
+    return;
+  for (size_t t = 0; t < lsm->ntrees; t++)
+    merge_reap(&lsm->trees[t], 0);
+  if (lsm->dirty)
+    lsm_write(ts);
+  else if (!mem_pending(lsm))
+    sidecar_restamp(ts, "lsm");
+}
+
+void lsm_close(TABLE_STATE* ts) {
+  LSM* lsm = ts->lsm;
+  if (lsm == NULL)
+    return;
+  for (size_t t = 0; t < lsm->ntrees; t++) {
+    LSM_TREE* tree = &lsm->trees[t];
+    mem_flush(tree);
+    // levels are left with less than LSM_FANOUT runs
+    do merge_reap(tree, 1); while (merge_start(tree));
+  }
+  if (lsm->dirty)
+    lsm_write(ts);
+  for (size_t t = 0; t < lsm->ntrees; t++) {
+    LSM_TREE* tree = &lsm->trees[t];
+    for (size_t i = 0; i < tree->nruns; i++)
+      run_free(tree->runs[i]);
+    free(tree->runs);
+    free(tree->block);
+    arena_free(&tree->arena);
+  }
+  for (size_t i = 0; i < lsm->garbage.count; i++)
+    free(lsm->garbage.items[i]);
+  free(lsm->garbage.items);
+  free(lsm->trees);
+  free(lsm->file_name);
+  free(lsm);
+  ts->lsm = NULL;
+}
+
+// Unlinks the manifest and the runs it lists
+void lsm_remove(const char* file_name) {
+  char* name = sidecar_name(file_name, "lsm");
+  FILE* file = fopen(name, "rb");
+  if (file) {
+    size_t ntrees, nrows, next_id;
+    fseek(file, 4 + sizeof(size_t), SEEK_SET);
+    if (fread(&ntrees, sizeof(size_t), 1, file) && fread(&nrows, sizeof(size_t), 1, file) &&
+        fread(&next_id, sizeof(size_t), 1, file)) {
+      size_t nruns, rec[2];
+      for (size_t t = 0; t < ntrees && fread(&nruns, sizeof(size_t), 1, file); t++) {
+        for (size_t i = 0; i < nruns && fread(rec, sizeof(size_t), 2, file) == 2; i++) {
+          char* run = run_name(file_name, t, rec[0]);
+          unlink(run);
+          free(run);
+        }
+      }
+    }
+    fclose(file);
+  }
+  unlink(name);
+  free(name);
+}
+
+// Row holding the bare key value in col, 0 if there is none
+size_t lsm_find(size_t col, const void* value, TABLE_STATE* ts) {
+  assert(ts->lsm && IS_KEY(ts->col_types[col]));
+  return tree_lookup(&ts->lsm->trees[ts->key_col_relpos[col]], value);
+}
+
+// 1 if a key column of entry holds a value some row already has
+int lsm_key_exists(TABLE_STATE* ts, const void* entry) {
+  for (size_t t = 0; t < ts->lsm->ntrees; t++) {
+    LSM_TREE* tree = &ts->lsm->trees[t];
+    const unsigned char* key = &((const unsigned char*)entry)[ts->col_offsets[tree->col]];
+    if (keyfilter_may_contain(tree->col, key, ts) && tree_lookup(tree, key))
+      return 1;
+  }
+  return 0;
+}
+
+void lsm_row_written(TABLE_STATE* ts, size_t row, const void* entry) {
+  LSM* lsm = ts->lsm;
+  if (lsm == NULL)
+    return;
+  // the metadata is not maintained by any tree, it has to tell the row is live
+  size_t* metadata = malloc(ts->entry_metadata_size);
+  for (size_t t = 0; t < lsm->ntrees; t++) {
+    metadata[t * RB_DATA_LEN + RB_INDEX_PARENT] = RB_NIL_PTR;
+    metadata[t * RB_DATA_LEN + RB_INDEX_LEFT]   = RB_NIL_PTR;
+    metadata[t * RB_DATA_LEN + RB_INDEX_RIGHT]  = RB_NIL_PTR;
+    metadata[t * RB_DATA_LEN + RB_INDEX_COLOR]  = BLACK;
+    metadata[t * RB_DATA_LEN + RB_INDEX_SIZE]   = 1;
+  }
+  table_pwrite(ts, metadata, ts->entry_metadata_size, entry_offset(row, ts));
+  free(metadata);
+  for (size_t t = 0; t < lsm->ntrees; t++) {
+    LSM_TREE* tree = &lsm->trees[t];
+    tree_put(tree, &((const unsigned char*)entry)[ts->col_offsets[tree->col]], row);
+  }
+}
+
+void lsm_value_written(TABLE_STATE* ts, size_t row, size_t col, const void* old_value, const void* entry) {
+  if (ts->lsm == NULL || !IS_KEY(ts->col_types[col]))
+    return;
+  LSM_TREE* tree = &ts->lsm->trees[ts->key_col_relpos[col]];
+  tree_put(tree, old_value, LSM_TOMBSTONE);
+  tree_put(tree, &((const unsigned char*)entry)[ts->col_offsets[col]], row);
+}
+
+void lsm_row_deleted(TABLE_STATE* ts, size_t row) {
+  LSM* lsm = ts->lsm;
+  if (lsm == NULL)
+    return;
+  unsigned char* entry = get_by_tindex(row, ts);
+  for (size_t t = 0; t < lsm->ntrees; t++) {
+    LSM_TREE* tree = &lsm->trees[t];
+    tree_put(tree, &entry[ts->col_offsets[tree->col]], LSM_TOMBSTONE);
+  }
+  free(entry);
+}
+
+// Number of runs holding the keys of col
+size_t lsm_run_count(size_t col, TABLE_STATE* ts) {
+  if (ts->lsm == NULL || !IS_KEY(ts->col_types[col]))
+    return 0;
+  return ts->lsm->trees[ts->key_col_relpos[col]].nruns;
+}
@@ -0,0 +1,63 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+#include <sys/wait.h>
+
+#define ROWS 20000
+
+int main () {
+  const char* file_name = "data/lsm.bin";
+  size_t col_types[2] = {
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int)) | KEY_FIELD,
+    MAKE_TYPE(TABLE_TYPE_FLOAT, sizeof(float))
+  };
+  const char* col_names[] = { "id", "height" };
+  if (access(file_name, F_OK) == 0)
+    delete_table(file_name);
+  create_table(2, 32, col_types, col_names, file_name);
+
+  TABLE_STATE table_state = { 0 };
+  open_table(file_name, &table_state);
+  lsm_create(&table_state);
+  // ids in scattered order, one commit per 1000 rows
+  for (int i = 0; i < ROWS; i++) {
+    create_entry(&table_state, 2, (int)((i * 7919L) % ROWS), (double)i);
+    if (i % 1000 == 999)
+      commit_changes(&table_state);
+  }
+  close_table(&table_state);
+
+  // commits leave their keys in the memtable, a process ending without
+  // close_table leaves the runs to be rebuilt from the table
+  if (fork() == 0) {
+    table_state = (TABLE_STATE){ 0 };
+    open_table(file_name, &table_state);
+    create_entry(&table_state, 2, 42, 0.0);
+    commit_changes(&table_state);
+    int id = 13;
+    delete_entry(0, &id, &table_state);
+    commit_changes(&table_state);
+    _exit(0);
+  }
+  wait(NULL);
+
+  table_state = (TABLE_STATE){ 0 };
+  open_table(file_name, &table_state);
+  printf("rows %ld, runs %ld\n", row_count(&table_state) - 1, lsm_run_count(0, &table_state));
+  int ids[] = { 0, 13, 42, ROWS - 1, ROWS };
+  for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) {
+    void* entries;
+    size_t count = beautiful_find_entry(0, &ids[i], &table_state, &entries, NULL);
+    if (count) {
+      printf("id %d: height %f\n", ids[i], *(float*)&((char*)((void**)entries)[0])[table_state.col_offsets[1]]);
+      free(((void**)entries)[0]);
+      free(entries);
+    } else {
+      printf("id %d: not found\n", ids[i]);
+    }
+  }
+  close_table(&table_state);
+  delete_table(file_name);
+  printf("\n");
+
+  return 0;
+}
@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "file.h"
+
+// Sidecar view, <table>.mvcc
+// [0]   "MVCC"
+// [4]   [size_t] last commit
+// [12]  2 * [size_t] row count of a commit, by commit % 2
+// [28]  [size_t] oldest version file that may still exist
+// [36]  MVCC_SNAPSHOTS * [size_t] commit read by a snapshot, 0 if free
+//
+// A slot is taken by the write lock on its bytes, which is held while
+// the snapshot is open
+//
+// Version file, <table>.mvcc.<commit>
+// ...   per row changed by the commit: [size_t] row, the row before it
+
+#define MVCC_MAGIC "MVCC"
+#define MVCC_SEQ_OFFSET 4
+#define MVCC_ROWS_OFFSET 12
+#define MVCC_OLDEST_OFFSET 28
+#define MVCC_SLOTS_OFFSET 36
+
+static char* version_name(const char* file_name, size_t seq) {
+  char* name = malloc(strlen(file_name) + 32);
+  sprintf(name, "%s.mvcc.%ld", file_name, seq);
+  return name;
+}
+
+static size_t header_get(int fd, size_t offset) {
+  size_t value = 0;
+  pread(fd, &value, sizeof(size_t), offset);
+  return value;
+}
+
+static void header_set(int fd, size_t offset, size_t value) {
+  pwrite(fd, &value, sizeof(size_t), offset);
+}
+
+// Last commit and its row count, read again if a commit ends in between
+static size_t committed(int fd, size_t* rows) {
+  for (;;) {
+    size_t seq = header_get(fd, MVCC_SEQ_OFFSET);
+    size_t n = header_get(fd, MVCC_ROWS_OFFSET + (seq % 2) * sizeof(size_t));
+    if (header_get(fd, MVCC_SEQ_OFFSET) != seq)
+      continue;
+    if (rows) *rows = n;
+    return seq;
+  }
+}
+
+static int slot_lock(int fd, size_t slot, short type, int cmd) {
+  struct flock lock = { 0 };
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = MVCC_SLOTS_OFFSET + slot * sizeof(size_t);
+  lock.l_len = sizeof(size_t);
+  if (fcntl(fd, cmd, &lock) != 0)
+    return -1;
+  return lock.l_type;
+}
+
+// Oldest commit an open snapshot reads, seq if there is none. Slots of
+// snapshots whose process is gone are not locked and do not count
+static size_t oldest_snapshot(int fd, size_t seq) {
+  size_t oldest = seq;
+  for (size_t i = 0; i < MVCC_SNAPSHOTS; i++) {
+    size_t s = header_get(fd, MVCC_SLOTS_OFFSET + i * sizeof(size_t));
+    if (s && s < oldest && slot_lock(fd, i, F_WRLCK, F_OFD_GETLK) != F_UNLCK)
+      oldest = s;
+  }
+  return oldest;
+}
+
+// Drops the version files of commits up to the oldest one a snapshot
+// reads, they are not needed to see it or anything after. The file of a
+// commit in progress is newer than all of them
+static void collect(int fd, const char* file_name) {
+  size_t oldest = oldest_snapshot(fd, committed(fd, NULL));
+  size_t first = header_get(fd, MVCC_OLDEST_OFFSET);
+  for (size_t s = first; s <= oldest; s++) {
+    char* name = version_name(file_name, s);
+    unlink(name);
+    free(name);
+  }
+  if (oldest + 1 > first)
+    header_set(fd, MVCC_OLDEST_OFFSET, oldest + 1);
+}
+
+// 0 on success, 1 if the table is an LSM table or versioned already
+size_t mvcc_enable(TABLE_STATE* ts) {
+  if (ts->lsm || ts->mvcc || ts->snapshot)
+    return 1;
+  fflush(ts->file);
+  char* name = sidecar_name(ts->file_name, "mvcc");
+  int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  free(name);
+  if (fd < 0)
+    return 1;
+  size_t header[MVCC_SLOTS_OFFSET / sizeof(size_t) + MVCC_SNAPSHOTS + 1] = { 0 };
+  write(fd, header, MVCC_SLOTS_OFFSET + MVCC_SNAPSHOTS * sizeof(size_t));
+  pwrite(fd, MVCC_MAGIC, 4, 0);
+  header_set(fd, MVCC_ROWS_OFFSET + sizeof(size_t), row_count(ts));
+  header_set(fd, MVCC_OLDEST_OFFSET, 2);
+  header_set(fd, MVCC_SEQ_OFFSET, 1);
+  close(fd);
+  mvcc_open(ts);
+  return 0;
+}
+
+void mvcc_open(TABLE_STATE* ts) {
+  char* name = sidecar_name(ts->file_name, "mvcc");
+  int fd = open(name, O_RDWR);
+  free(name);
+  if (fd < 0)
+    return;
+  char magic[4];
+  if (pread(fd, magic, 4, 0) != 4 || memcmp(magic, MVCC_MAGIC, 4) != 0) {
+    close(fd);
+    return;
+  }
+  MVCC* m = calloc(1, sizeof(MVCC));
+  m->fd = fd;
+  m->version_fd = -1;
+  m->seq = committed(fd, &m->rows);
+  ts->mvcc = m;
+}
+
+// Saves the committed image of a row before its first change in this
+// commit. Rows appended since are not seen by any snapshot
+void mvcc_before_write(TABLE_STATE* ts, size_t row) {
+  MVCC* m = ts->mvcc;
+  if (m == NULL || row >= m->rows)
+    return;
+  if (m->version_fd < 0) {
+    char* name = version_name(ts->file_name, m->seq + 1);
+    m->version_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    free(name);
+    m->saved = calloc((m->rows + 7) / 8, 1);
+  }
+  if (m->saved[row / 8] & (1 << (row % 8)))
+    return;
+  m->saved[row / 8] |= 1 << (row % 8);
+  char* record = malloc(sizeof(size_t) + ts->entry_raw_size);
+  memcpy(record, &row, sizeof(size_t));
+  table_pread(ts, &record[sizeof(size_t)], ts->entry_raw_size, entry_offset(row, ts));
+  // one write, the image is in the file before the row changes
+  write(m->version_fd, record, sizeof(size_t) + ts->entry_raw_size);
+  free(record);
+}
+
+// Publishes the commit after the table file is flushed
+void mvcc_commit(TABLE_STATE* ts) {
+  MVCC* m = ts->mvcc;
+  if (m == NULL || (m->version_fd < 0 && row_count(ts) == m->rows))
+    return;
+  if (ts->file)
+    fflush(ts->file);
+  if (m->version_fd >= 0) {
+    close(m->version_fd);
+    m->version_fd = -1;
+    free(m->saved);
+    m->saved = NULL;
+  }
+  m->rows = row_count(ts);
+  header_set(m->fd, MVCC_ROWS_OFFSET + ((m->seq + 1) % 2) * sizeof(size_t), m->rows);
+  header_set(m->fd, MVCC_SEQ_OFFSET, ++m->seq);
+  collect(m->fd, ts->file_name);
+}
+
+void mvcc_close(TABLE_STATE* ts) {
+  MVCC* m = ts->mvcc;
+  if (m == NULL)
+    return;
+  // rows changed outside commit_changes are in the file by now
+  if (m->version_fd >= 0 || (ts->file && row_count(ts) != m->rows))
+    mvcc_commit(ts);
+  close(m->fd);
+  free(m);
+  ts->mvcc = NULL;
+}
+
+void mvcc_remove(const char* file_name) {
+  char* name = sidecar_name(file_name, "mvcc");
+  int fd = open(name, O_RDONLY);
+  free(name);
+  if (fd < 0)
+    return;
+  size_t seq = header_get(fd, MVCC_SEQ_OFFSET);
+  for (size_t s = header_get(fd, MVCC_OLDEST_OFFSET); s <= seq + 1; s++) {
+    char* version = version_name(file_name, s);
+    unlink(version);
+    free(version);
+  }
+  close(fd);
+}
+
+static void version_put(MVCC_VERSION* v, size_t row, size_t offset) {
+  if (2 * (v->count + 1) > v->capacity) {
+    MVCC_VERSION grown = *v;
+    grown.capacity = v->capacity ? v->capacity * 2 : 64;
+    grown.count = 0;
+    grown.rows = calloc(grown.capacity, sizeof(size_t));
+    grown.offsets = malloc(grown.capacity * sizeof(size_t));
+    for (size_t i = 0; i < v->capacity; i++)
+      if (v->rows[i]) version_put(&grown, v->rows[i] - 1, v->offsets[i]);
+    free(v->rows);
+    free(v->offsets);
+    *v = grown;
+  }
+  size_t i = (row * 0x9e3779b97f4a7c15ULL) & (v->capacity - 1);
+  while (v->rows[i] && v->rows[i] != row + 1)
+    i = (i + 1) & (v->capacity - 1);
+  if (!v->rows[i]) v->count++;
+  v->rows[i] = row + 1;
+  v->offsets[i] = offset;
+}
+
+// Offset of the image of row in the version file, -1 if it has none
+static size_t version_get(const MVCC_VERSION* v, size_t row) {
+  if (v->capacity == 0)
+    return -1;
+  size_t i = (row * 0x9e3779b97f4a7c15ULL) & (v->capacity - 1);
+  while (v->rows[i]) {
+    if (v->rows[i] == row + 1)
+      return v->offsets[i];
+    i = (i + 1) & (v->capacity - 1);
+  }
+  return -1;
+}
+
+// Reads the records written to a version file since the last call
+static void version_parse(MVCC_VERSION* v, size_t record) {
+  struct stat st;
+  if (fstat(v->fd, &st) != 0)
+    return;
+  size_t end = st.st_size - st.st_size % record;
+  for (; v->parsed < end; v->parsed += record) {
+    size_t row;
+    if (pread(v->fd, &row, sizeof(size_t), v->parsed) != sizeof(size_t))
+      break;
+    version_put(v, row, v->parsed + sizeof(size_t));
+  }
+}
+
+// Opens the version files of commits after the snapshot. The file of a
+// commit in progress may grow, it is parsed again until the commit ends
+static void versions_refresh(SNAPSHOT* snap, TABLE_STATE* ts) {
+  size_t seq = committed(snap->fd, NULL);
+  size_t record = sizeof(size_t) + ts->entry_raw_size;
+  for (size_t s = snap->seq + 1; s <= seq + 1; s++) {
+    size_t i = s - snap->seq - 1;
+    if (i == snap->count) {
+      char* name = version_name(ts->file_name, s);
+      int fd = open(name, O_RDONLY);
+      free(name);
+      // a finished commit without a file changed no row of the snapshot
+      if (fd < 0 && s > seq)
+        break;
+      snap->versions = realloc(snap->versions, (snap->count + 1) * sizeof(MVCC_VERSION));
+      memset(&snap->versions[i], 0, sizeof(MVCC_VERSION));
+      snap->versions[i].seq = s;
+      snap->versions[i].fd = fd;
+      snap->count++;
+    }
+    MVCC_VERSION* v = &snap->versions[i];
+    if (v->fd < 0 || v->done)
+      continue;
+    v->done = s <= seq;
+    version_parse(v, record);
+  }
+}
+
+// 0 on success, 1 if the table does not exist, is not versioned, is of
+// another format or all snapshot slots are taken
+size_t snapshot_open(const char* file_name, TABLE_STATE* ts) {
+  if (access(file_name, F_OK) != 0)
+    return 1;
+  char* name = sidecar_name(file_name, "mvcc");
+  int fd = open(name, O_RDWR);
+  free(name);
+  if (fd < 0)
+    return 1;
+  size_t slot = 0;
+  while (slot < MVCC_SNAPSHOTS && slot_lock(fd, slot, F_WRLCK, F_OFD_SETLK) < 0)
+    slot++;
+  if (slot == MVCC_SNAPSHOTS) {
+    close(fd);
+    return 1;
+  }
+  // the slot is published before the commit is read again, a commit that
+  // ends in between moves the snapshot forward
+  size_t rows, seq = committed(fd, &rows);
+  for (;;) {
+    header_set(fd, MVCC_SLOTS_OFFSET + slot * sizeof(size_t), seq);
+    size_t again = committed(fd, &rows);
+    if (again == seq)
+      break;
+    seq = again;
+  }
+  SNAPSHOT* snap = calloc(1, sizeof(SNAPSHOT));
+  snap->fd = fd;
+  snap->slot = slot;
+  snap->seq = seq;
+  snap->rows = rows;
+  snap->cached = -1;
+  ts->snapshot = snap;
+  FILE* file = table_fopen(file_name, "rb", ts);
+  ts->file_name = strdup(file_name);
+  latch_open(ts);
+  if (header_read(file, ts) != 0) {
+    close_table(ts);
+    return 1;
+  }
+  ts->stage_append_offset = ts->append_offset = entry_offset(rows, ts);
+  return 0;
+}
+
+// Reads count rows starting from first as the snapshot sees them
+size_t snapshot_rows(TABLE_STATE* ts, size_t first, size_t count, void* buf) {
+  SNAPSHOT* snap = ts->snapshot;
+  if (first >= snap->rows)
+    return 0;
+  if (first + count > snap->rows)
+    count = snap->rows - first;
+  size_t size = ts->entry_raw_size;
+  table_pread_some(ts, buf, count * size, entry_offset(first, ts));
+  // any row the read saw changed has its image saved by now
+  versions_refresh(snap, ts);
+  for (size_t r = first; r < first + count; r++) {
+    for (size_t i = 0; i < snap->count; i++) {
+      size_t offset = snap->versions[i].fd < 0 ? (size_t)-1 : version_get(&snap->versions[i], r);
+      if (offset == (size_t)-1)
+        continue;
+      pread(snap->versions[i].fd, &((char*)buf)[(r - first) * size], size, offset);
+      break;
+    }
+  }
+  return count;
+}
+
+// One row as the snapshot sees it, valid until the next call
+const void* snapshot_row(TABLE_STATE* ts, size_t row) {
+  SNAPSHOT* snap = ts->snapshot;
+  if (snap->cache == NULL)
+    snap->cache = malloc(ts->entry_raw_size);
+  // the rows of a snapshot do not change, the last one read is kept
+  if (snap->cached != row) {
+    snap->cached = -1;
+    if (snapshot_rows(ts, row, 1, snap->cache))
+      snap->cached = row;
+    else
+      memset(snap->cache, 0xff, ts->entry_raw_size);
+  }
+  return snap->cache;
+}
+
+size_t snapshot_seq(TABLE_STATE* ts) {
+  return ts->snapshot ? ts->snapshot->seq : 0;
+}
+
+void snapshot_close(TABLE_STATE* ts) {
+  SNAPSHOT* snap = ts->snapshot;
+  if (snap == NULL)
+    return;
+  header_set(snap->fd, MVCC_SLOTS_OFFSET + snap->slot * sizeof(size_t), 0);
+  slot_lock(snap->fd, snap->slot, F_UNLCK, F_OFD_SETLK);
+  // the last snapshot of old commits does not wait for the next commit
+  collect(snap->fd, ts->file_name);
+  close(snap->fd);
+  for (size_t i = 0; i < snap->count; i++) {
+    if (snap->versions[i].fd >= 0)
+      close(snap->versions[i].fd);
+    free(snap->versions[i].rows);
+    free(snap->versions[i].offsets);
+  }
+  free(snap->versions);
+  free(snap->cache);
+  free(snap);
+  ts->snapshot = NULL;
+}
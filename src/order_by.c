@@ -0,0 +1,47 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+
+static int print_row(void* entry, size_t row, void* cookie) {
+  TABLE_STATE* table_state = cookie;
+  printf("[%ld]: id: %d\n", row, *(int*)&((char*)entry)[table_state->col_offsets[0]]);
+  return 0;
+}
+
+int main () {
+  TABLE_STATE table_state = { 0 };
+  open_table("data/table.bin", &table_state);
+  ORDER_BY query = { 0 };
+  query.col = 0;
+  query.desc = 1;
+  query.limit = 3;
+  printf("ORDER BY id DESC LIMIT 3\n");
+  order_by(&query, &table_state, print_row, &table_state);
+  query.col = 2;
+  query.desc = 0;
+  query.limit = 0;
+  printf("ORDER BY birthday\n");
+  order_by(&query, &table_state, print_row, &table_state);
+  query.col = 0;
+  query.limit = 2;
+  query.offset = 2;
+  printf("ORDER BY id LIMIT 2 OFFSET 2\n");
+  order_by(&query, &table_state, print_row, &table_state);
+  int lo = 2, hi = 4;
+  printf("COUNT id BETWEEN 2 AND 4: %ld\n",
+    key_count(0, PRED_GE, &lo, &table_state) - key_count(0, PRED_GT, &hi, &table_state));
+  close_table(&table_state);
+
+  // a table of the format before nodes kept subtree sizes is not opened
+  size_t col_types[1] = { MAKE_TYPE(TABLE_TYPE_INT, sizeof(int)) | KEY_FIELD };
+  const char* col_names[] = { "id" };
+  create_table(1, 32, col_types, col_names, "data/old.bin");
+  FILE* file = fopen("data/old.bin", "rb+");
+  fputc(sizeof(size_t), file);
+  fclose(file);
+  TABLE_STATE old = { 0 };
+  printf("table of the older format: %s\n", open_table("data/old.bin", &old) ? "not opened" : "opened");
+  delete_table("data/old.bin");
+  printf("\n");
+  
+  return 0;
+}
@@ -0,0 +1,515 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "zlib.h"
+#include "file.h"
+
+// Container view, a compressed table file
+// [0]   "TPZ1"
+// [4]   [size_t] page size
+// [12]  [size_t] length of the table
+// [20]  [size_t] offset of the page map
+// [28]  [size_t] pages the map has room for
+// [36]  [size_t] end of the container, new slots go there
+// [64]  slots and maps
+//
+// Page map, per page [size_t] offset of its slot, [size_t] compressed
+// length, 0 for a page of zeros, [size_t] size of the slot
+//
+// A flushed page is compressed into a new slot, never into one the map
+// committed last holds. The slots are written before the map, so the map
+// write publishes them and the table a commit stops in the middle of is
+// the one committed before. One that reads a torn map entry reads it
+// again. Space no slot of the map holds is found again by the next commit
+// and written over
+
+#define PSTORE_MAGIC "TPZ1"
+#define PSTORE_PAGE_OFFSET 4
+#define PSTORE_LENGTH_OFFSET 12
+#define PSTORE_MAP_OFFSET 20
+#define PSTORE_CAPACITY_OFFSET 28
+#define PSTORE_END_OFFSET 36
+#define PSTORE_HEADER 64
+#define PSTORE_ENTRY (3 * sizeof(size_t))
+#define PSTORE_SLOT_ALIGN 256
+#define PSTORE_RETRIES 8
+
+static size_t header_get(int fd, size_t offset) {
+  size_t value = 0;
+  pread(fd, &value, sizeof(size_t), offset);
+  return value;
+}
+
+static void header_set(int fd, size_t offset, size_t value) {
+  pwrite(fd, &value, sizeof(size_t), offset);
+}
+
+static void map_load(PAGE_STORE* ps) {
+  ps->length = header_get(ps->fd, PSTORE_LENGTH_OFFSET);
+  ps->map_offset = header_get(ps->fd, PSTORE_MAP_OFFSET);
+  ps->capacity = header_get(ps->fd, PSTORE_CAPACITY_OFFSET);
+  size_t npages = (ps->length + PAGE_STORE_PAGE - 1) / PAGE_STORE_PAGE;
+  size_t old = ps->npages;
+  if (npages > old) {
+    ps->map = realloc(ps->map, npages * PSTORE_ENTRY);
+    ps->cache = realloc(ps->cache, npages * sizeof(unsigned char*));
+    ps->dirty = realloc(ps->dirty, npages);
+    ps->used = realloc(ps->used, npages);
+    memset(&ps->cache[old], 0, (npages - old) * sizeof(unsigned char*));
+    memset(&ps->dirty[old], 0, npages - old);
+    memset(&ps->used[old], 0, npages - old);
+    ps->npages = npages;
+  }
+  memset(ps->map, 0, ps->npages * PSTORE_ENTRY);
+  size_t stored = npages < ps->capacity ? npages : ps->capacity;
+  pread(ps->fd, ps->map, stored * PSTORE_ENTRY, ps->map_offset);
+}
+
+static void pages_grow(PAGE_STORE* ps, size_t npages) {
+  if (npages <= ps->npages)
+    return;
+  size_t old = ps->npages;
+  ps->map = realloc(ps->map, npages * PSTORE_ENTRY);
+  ps->cache = realloc(ps->cache, npages * sizeof(unsigned char*));
+  ps->dirty = realloc(ps->dirty, npages);
+  ps->used = realloc(ps->used, npages);
+  memset(&ps->map[old * 3], 0, (npages - old) * PSTORE_ENTRY);
+  memset(&ps->cache[old], 0, (npages - old) * sizeof(unsigned char*));
+  memset(&ps->dirty[old], 0, npages - old);
+  memset(&ps->used[old], 0, npages - old);
+  ps->npages = npages;
+}
+
+// Drops clean pages, the ones not used since the hand last passed first
+static void cache_evict(PAGE_STORE* ps) {
+  for (size_t steps = 0; ps->cached > PAGE_CACHE_PAGES && steps < 2 * ps->npages; steps++) {
+    size_t page = ps->hand++ % ps->npages;
+    if (ps->cache[page] == NULL || ps->dirty[page])
+      continue;
+    if (ps->used[page]) {
+      ps->used[page] = 0;
+      continue;
+    }
+    free(ps->cache[page]);
+    ps->cache[page] = NULL;
+    ps->cached--;
+  }
+}
+
+// The page decompressed, read into the cache if it is not there. A slot
+// that does not inflate to a page after the retries is a damaged table
+static unsigned char* page_get(PAGE_STORE* ps, size_t page) {
+  ps->used[page] = 1;
+  if (ps->cache[page])
+    return ps->cache[page];
+  unsigned char* raw = calloc(1, PAGE_STORE_PAGE);
+  size_t* entry = &ps->map[page * 3];
+  size_t bound = compressBound(PAGE_STORE_PAGE);
+  unsigned char* comp = malloc(bound);
+  int ok = entry[1] == 0;
+  for (size_t retry = 0; !ok && retry < PSTORE_RETRIES; retry++) {
+    uLongf len = PAGE_STORE_PAGE;
+    ok = entry[1] <= bound && pread(ps->fd, comp, entry[1], entry[0]) == (ssize_t)entry[1]
+      && uncompress(raw, &len, comp, entry[1]) == Z_OK && len == PAGE_STORE_PAGE;
+    if (!ok && page < ps->capacity)
+      pread(ps->fd, entry, PSTORE_ENTRY, ps->map_offset + page * PSTORE_ENTRY);
+  }
+  free(comp);
+  assert(ok);
+  ps->cache[page] = raw;
+  ps->cached++;
+  cache_evict(ps);
+  return raw;
+}
+
+PAGE_STORE* page_store_open(int fd) {
+  char magic[4];
+  if (pread(fd, magic, 4, 0) != 4 || memcmp(magic, PSTORE_MAGIC, 4) != 0
+    || header_get(fd, PSTORE_PAGE_OFFSET) != PAGE_STORE_PAGE)
+    return NULL;
+  PAGE_STORE* ps = calloc(1, sizeof(PAGE_STORE));
+  ps->fd = fd;
+  pthread_mutex_init(&ps->mutex, NULL);
+  map_load(ps);
+  return ps;
+}
+
+// Bytes of the table read at offset, less than size at its end
+size_t page_store_read(PAGE_STORE* ps, void* buf, size_t size, size_t offset) {
+  pthread_mutex_lock(&ps->mutex);
+  if (offset >= ps->length)
+    size = 0;
+  else if (size > ps->length - offset)
+    size = ps->length - offset;
+  for (size_t done = 0; done < size;) {
+    size_t at = offset + done, from = at % PAGE_STORE_PAGE;
+    size_t n = PAGE_STORE_PAGE - from < size - done ? PAGE_STORE_PAGE - from : size - done;
+    memcpy((char*)buf + done, page_get(ps, at / PAGE_STORE_PAGE) + from, n);
+    done += n;
+  }
+  pthread_mutex_unlock(&ps->mutex);
+  return size;
+}
+
+size_t page_store_write(PAGE_STORE* ps, const void* buf, size_t size, size_t offset) {
+  pthread_mutex_lock(&ps->mutex);
+  pages_grow(ps, (offset + size + PAGE_STORE_PAGE - 1) / PAGE_STORE_PAGE);
+  for (size_t done = 0; done < size;) {
+    size_t at = offset + done, page = at / PAGE_STORE_PAGE, from = at % PAGE_STORE_PAGE;
+    size_t n = PAGE_STORE_PAGE - from < size - done ? PAGE_STORE_PAGE - from : size - done;
+    memcpy(page_get(ps, page) + from, (const char*)buf + done, n);
+    ps->dirty[page] = 1;
+    done += n;
+  }
+  if (offset + size > ps->length)
+    ps->length = offset + size;
+  pthread_mutex_unlock(&ps->mutex);
+  return size;
+}
+
+// Cuts the table to length, what lies after reads as zeros if it grows
+void page_store_truncate(PAGE_STORE* ps, size_t length) {
+  pthread_mutex_lock(&ps->mutex);
+  if (length < ps->length) {
+    size_t last = (ps->length - 1) / PAGE_STORE_PAGE;
+    for (size_t page = length / PAGE_STORE_PAGE; page <= last; page++) {
+      size_t from = page == length / PAGE_STORE_PAGE ? length % PAGE_STORE_PAGE : 0;
+      memset(page_get(ps, page) + from, 0, PAGE_STORE_PAGE - from);
+      ps->dirty[page] = 1;
+    }
+    ps->length = length;
+  }
+  pthread_mutex_unlock(&ps->mutex);
+}
+
+static size_t page_is_zero(const unsigned char* page) {
+  for (size_t i = 0; i < PAGE_STORE_PAGE; i++)
+    if (page[i])
+      return 0;
+  return 1;
+}
+
+static int extent_cmp(const void* a, const void* b) {
+  size_t x = *(const size_t*)a, y = *(const size_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Extents, [offset, size] pairs, of the container no slot of the map or
+// the map itself lies in. end is moved back over free space at its end
+static size_t* free_extents(PAGE_STORE* ps, size_t* nfree, size_t* end) {
+  size_t* used = malloc((ps->npages + 1) * 2 * sizeof(size_t));
+  size_t nused = 0;
+  for (size_t page = 0; page < ps->npages; page++) {
+    if (ps->map[page * 3 + 1] == 0)
+      continue;
+    used[nused * 2] = ps->map[page * 3];
+    used[nused++ * 2 + 1] = ps->map[page * 3 + 2];
+  }
+  used[nused * 2] = ps->map_offset;
+  used[nused++ * 2 + 1] = ps->capacity * PSTORE_ENTRY;
+  qsort(used, nused, 2 * sizeof(size_t), extent_cmp);
+  size_t* extents = malloc((nused + 1) * 2 * sizeof(size_t));
+  size_t at = PSTORE_HEADER;
+  *nfree = 0;
+  for (size_t i = 0; i < nused; i++) {
+    if (used[i * 2] > at) {
+      extents[*nfree * 2] = at;
+      extents[*nfree * 2 + 1] = used[i * 2] - at;
+      (*nfree)++;
+    }
+    if (used[i * 2] + used[i * 2 + 1] > at)
+      at = used[i * 2] + used[i * 2 + 1];
+  }
+  if (at < *end)
+    *end = at;
+  free(used);
+  return extents;
+}
+
+// Offset of size bytes, in the first free extent they fit in or at end
+static size_t slot_alloc(size_t* extents, size_t nfree, size_t size, size_t* end) {
+  for (size_t i = 0; i < nfree; i++) {
+    if (extents[i * 2 + 1] < size)
+      continue;
+    size_t offset = extents[i * 2];
+    extents[i * 2] += size;
+    extents[i * 2 + 1] -= size;
+    return offset;
+  }
+  size_t offset = *end;
+  *end += size;
+  return offset;
+}
+
+// Compresses the pages written since the last flush into the container,
+// called by commit_changes with the table locked for writing. The space
+// the map committed last does not hold is written again: no other process
+// reads while the commit byte is held and each reads the map again when
+// the generation has moved on. The slots this flush gives up are free
+// once its map is written. Without the lock, as on close, slots go to the
+// end only
+void page_store_flush(TABLE_STATE* ts) {
+  PAGE_STORE* ps = ts->page_store;
+  if (ps == NULL)
+    return;
+  pthread_mutex_lock(&ps->mutex);
+  size_t changed = 0;
+  for (size_t page = 0; page < ps->npages && !changed; page++)
+    changed = ps->dirty[page];
+  if (!changed) {
+    pthread_mutex_unlock(&ps->mutex);
+    return;
+  }
+  // another process may have added slots since the map was read
+  size_t end = header_get(ps->fd, PSTORE_END_OFFSET), nfree = 0;
+  size_t* extents = NULL;
+  if (ts->lock && ts->lock->mode == TABLE_LOCK_WRITE)
+    extents = free_extents(ps, &nfree, &end);
+  size_t bound = compressBound(PAGE_STORE_PAGE);
+  unsigned char* comp = malloc(bound);
+  for (size_t page = 0; page < ps->npages; page++) {
+    if (!ps->dirty[page])
+      continue;
+    size_t* entry = &ps->map[page * 3];
+    uLongf comp_len = 0;
+    if (!page_is_zero(ps->cache[page])) {
+      comp_len = bound;
+      compress2(comp, &comp_len, ps->cache[page], PAGE_STORE_PAGE, Z_BEST_SPEED);
+      entry[2] = (comp_len + PSTORE_SLOT_ALIGN - 1) / PSTORE_SLOT_ALIGN * PSTORE_SLOT_ALIGN;
+      entry[0] = slot_alloc(extents, nfree, entry[2], &end);
+      pwrite(ps->fd, comp, comp_len, entry[0]);
+      dirty_mark(ts, entry[0], comp_len);
+    }
+    entry[1] = comp_len;
+    ps->dirty[page] = 0;
+  }
+  free(comp);
+  if (ps->npages > ps->capacity) {
+    // the map moves, with room to grow
+    ps->capacity = ps->npages * 2;
+    ps->map_offset = slot_alloc(extents, nfree, ps->capacity * PSTORE_ENTRY, &end);
+    char* map = calloc(ps->capacity, PSTORE_ENTRY);
+    memcpy(map, ps->map, ps->npages * PSTORE_ENTRY);
+    pwrite(ps->fd, map, ps->capacity * PSTORE_ENTRY, ps->map_offset);
+    free(map);
+    header_set(ps->fd, PSTORE_CAPACITY_OFFSET, ps->capacity);
+    header_set(ps->fd, PSTORE_MAP_OFFSET, ps->map_offset);
+  } else {
+    pwrite(ps->fd, ps->map, ps->npages * PSTORE_ENTRY, ps->map_offset);
+  }
+  free(extents);
+  dirty_mark(ts, ps->map_offset, ps->npages * PSTORE_ENTRY);
+  header_set(ps->fd, PSTORE_LENGTH_OFFSET, ps->length);
+  header_set(ps->fd, PSTORE_END_OFFSET, end);
+  dirty_mark(ts, 0, PSTORE_HEADER);
+  pthread_mutex_unlock(&ps->mutex);
+}
+
+// Forgets the cached pages and reads the map again, after another process
+// committed to the table
+void page_store_reload(TABLE_STATE* ts) {
+  PAGE_STORE* ps = ts->page_store;
+  if (ps == NULL)
+    return;
+  pthread_mutex_lock(&ps->mutex);
+  for (size_t page = 0; page < ps->npages; page++) {
+    free(ps->cache[page]);
+    ps->cache[page] = NULL;
+    ps->dirty[page] = 0;
+  }
+  ps->cached = 0;
+  map_load(ps);
+  pthread_mutex_unlock(&ps->mutex);
+}
+
+void page_store_close(TABLE_STATE* ts) {
+  PAGE_STORE* ps = ts->page_store;
+  if (ps == NULL)
+    return;
+  page_store_flush(ts);
+  for (size_t page = 0; page < ps->npages; page++)
+    free(ps->cache[page]);
+  free(ps->cache);
+  free(ps->dirty);
+  free(ps->used);
+  free(ps->map);
+  pthread_mutex_destroy(&ps->mutex);
+  close(ps->fd);
+  free(ps);
+  ts->page_store = NULL;
+}
+
+// The FILE of a compressed table reads and writes through its pages
+static ssize_t cookie_read(void* cookie, char* buf, size_t size) {
+  TABLE_STATE* ts = cookie;
+  size_t n = page_store_read(ts->page_store, buf, size, ts->page_store->pos);
+  ts->page_store->pos += n;
+  return n;
+}
+
+static ssize_t cookie_write(void* cookie, const char* buf, size_t size) {
+  TABLE_STATE* ts = cookie;
+  size_t n = page_store_write(ts->page_store, buf, size, ts->page_store->pos);
+  ts->page_store->pos += n;
+  return n;
+}
+
+static int cookie_seek(void* cookie, off64_t* offset, int whence) {
+  PAGE_STORE* ps = ((TABLE_STATE*)cookie)->page_store;
+  off64_t base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? (off64_t)ps->pos : (off64_t)ps->length;
+  if (base + *offset < 0)
+    return -1;
+  ps->pos = *offset = base + *offset;
+  return 0;
+}
+
+static int cookie_close(void* cookie) {
+  page_store_close(cookie);
+  return 0;
+}
+
+// Opens the table file for header_read, through its pages if the table is
+// compressed
+FILE* table_fopen(const char* file_name, const char* mode, TABLE_STATE* ts) {
+  int fd = open(file_name, strchr(mode, '+') ? O_RDWR : O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  PAGE_STORE* ps = page_store_open(fd);
+  if (ps == NULL) {
+    close(fd);
+    return fopen(file_name, mode);
+  }
+  ts->page_store = ps;
+  cookie_io_functions_t io = { cookie_read, cookie_write, cookie_seek, cookie_close };
+  FILE* file = fopencookie(ts, mode, io);
+  // rows are read and written through the pages, never through the FILE
+  setvbuf(file, NULL, _IONBF, 0);
+  return file;
+}
+
+// Rewrites a table that is not open anywhere as a container of compressed
+// pages. Its incremental backup chain ends, the file is another one.
+// Returns 1 if the table is missing or compressed already
+size_t table_compress(const char* file_name) {
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0)
+    return 1;
+  char magic[4] = { 0 };
+  pread(fd, magic, 4, 0);
+  if (memcmp(magic, PSTORE_MAGIC, 4) == 0) {
+    close(fd);
+    return 1;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  size_t length = st.st_size, npages = (length + PAGE_STORE_PAGE - 1) / PAGE_STORE_PAGE;
+  char* tmp = sidecar_name(file_name, "tpz");
+  int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  size_t capacity = npages ? npages * 2 : 16, end = PSTORE_HEADER;
+  size_t* map = calloc(capacity, PSTORE_ENTRY);
+  unsigned char* raw = malloc(PAGE_STORE_PAGE);
+  size_t bound = compressBound(PAGE_STORE_PAGE);
+  unsigned char* comp = malloc(bound);
+  for (size_t page = 0; page < npages; page++) {
+    memset(raw, 0, PAGE_STORE_PAGE);
+    pread(fd, raw, PAGE_STORE_PAGE, page * PAGE_STORE_PAGE);
+    if (page_is_zero(raw))
+      continue;
+    uLongf comp_len = bound;
+    compress2(comp, &comp_len, raw, PAGE_STORE_PAGE, Z_BEST_SPEED);
+    map[page * 3] = end;
+    map[page * 3 + 1] = comp_len;
+    map[page * 3 + 2] = (comp_len + PSTORE_SLOT_ALIGN - 1) / PSTORE_SLOT_ALIGN * PSTORE_SLOT_ALIGN;
+    pwrite(out, comp, comp_len, end);
+    end += map[page * 3 + 2];
+  }
+  pwrite(out, map, capacity * PSTORE_ENTRY, end);
+  char header[PSTORE_HEADER] = { 0 };
+  size_t fields[5] = { PAGE_STORE_PAGE, length, end, capacity, end + capacity * PSTORE_ENTRY };
+  memcpy(header, PSTORE_MAGIC, 4);
+  memcpy(&header[PSTORE_PAGE_OFFSET], fields, sizeof(fields));
+  pwrite(out, header, PSTORE_HEADER, 0);
+  close(out);
+  close(fd);
+  free(map);
+  free(raw);
+  free(comp);
+  size_t ret = rename(tmp, file_name) != 0;
+  free(tmp);
+  char* dirty = sidecar_name(file_name, "dirty");
+  unlink(dirty);
+  free(dirty);
+  return ret;
+}
+
+// Rewrites a compressed table that is not open anywhere as a plain table
+// file. Returns 1 if the table is missing or not compressed
+size_t table_decompress(const char* file_name) {
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0)
+    return 1;
+  PAGE_STORE* ps = page_store_open(fd);
+  if (ps == NULL) {
+    close(fd);
+    return 1;
+  }
+  TABLE_STATE ts = { 0 };
+  ts.page_store = ps;
+  char* tmp = sidecar_name(file_name, "tpz");
+  int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  unsigned char* buf = malloc(PAGE_STORE_PAGE);
+  for (size_t at = 0; at < ps->length; at += PAGE_STORE_PAGE) {
+    size_t n = page_store_read(ps, buf, PAGE_STORE_PAGE, at);
+    pwrite(out, buf, n, at);
+  }
+  close(out);
+  free(buf);
+  page_store_close(&ts);
+  size_t ret = rename(tmp, file_name) != 0;
+  free(tmp);
+  char* dirty = sidecar_name(file_name, "dirty");
+  unlink(dirty);
+  free(dirty);
+  return ret;
+}
+
+// Reads bytes of the table a full backup holds, through the pages of the
+// container if the table was compressed
+size_t backup_table_pread(const char* backup_name, void* buf, size_t size, size_t offset) {
+  char magic[4] = { 0 };
+  size_t header[5];
+  if (backup_pread(backup_name, magic, 4, 0) != 4 || memcmp(magic, PSTORE_MAGIC, 4) != 0
+    || backup_pread(backup_name, header, sizeof(header), PSTORE_PAGE_OFFSET) != sizeof(header)
+    || header[0] != PAGE_STORE_PAGE)
+    return backup_pread(backup_name, buf, size, offset);
+  size_t length = header[1], map_offset = header[2], capacity = header[3];
+  if (offset >= length)
+    size = 0;
+  else if (size > length - offset)
+    size = length - offset;
+  unsigned char* raw = malloc(PAGE_STORE_PAGE);
+  unsigned char* comp = malloc(compressBound(PAGE_STORE_PAGE));
+  size_t done = 0;
+  while (done < size) {
+    size_t at = offset + done, page = at / PAGE_STORE_PAGE, from = at % PAGE_STORE_PAGE;
+    size_t n = PAGE_STORE_PAGE - from < size - done ? PAGE_STORE_PAGE - from : size - done;
+    size_t entry[3] = { 0 };
+    uLongf len = PAGE_STORE_PAGE;
+    memset(raw, 0, PAGE_STORE_PAGE);
+    if (page < capacity
+      && backup_pread(backup_name, entry, PSTORE_ENTRY, map_offset + page * PSTORE_ENTRY) != PSTORE_ENTRY)
+      break;
+    if (entry[1] && (entry[1] > compressBound(PAGE_STORE_PAGE)
+      || backup_pread(backup_name, comp, entry[1], entry[0]) != entry[1]
+      || uncompress(raw, &len, comp, entry[1]) != Z_OK))
+      break;
+    memcpy((char*)buf + done, raw + from, n);
+    done += n;
+  }
+  free(raw);
+  free(comp);
+  return done;
+}
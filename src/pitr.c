@@ -0,0 +1,134 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+#include <time.h>
+
+// A ledger is backed up, changed by many commits and then emptied by
+// mistake. The backup and the log bring it back to any commit before
+#define ACCOUNTS 1000
+#define COMMITS 60
+
+typedef struct {
+  size_t rows;
+  double balance;
+} LEDGER;
+
+static LEDGER ledger(TABLE_STATE* ts) {
+  AGG_RESULT result;
+  aggregate(AGG_SUM, 1, 0, NULL, ts, &result);
+  return (LEDGER){ result.count, result.value };
+}
+
+static LEDGER restored(const char* file_name, size_t seq, size_t time) {
+  restore_to_point(file_name, "data/ledger.backup", "data/ledger.bin", seq, time);
+  TABLE_STATE ts = { 0 };
+  open_table(file_name, &ts);
+  LEDGER l = ledger(&ts);
+  close_table(&ts);
+  delete_table(file_name);
+  return l;
+}
+
+static size_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int main () {
+  const char* file_name = "data/ledger.bin";
+  size_t col_types[2] = {
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int)) | KEY_FIELD,
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int))
+  };
+  const char* col_names[] = { "id", "balance" };
+  if (access(file_name, F_OK) == 0)
+    delete_table(file_name);
+  create_table(2, 32, col_types, col_names, file_name);
+  TABLE_STATE ts = { 0 };
+  open_table(file_name, &ts);
+  log_enable(&ts);
+  for (int i = 0; i < ACCOUNTS; i++)
+    create_entry(&ts, 2, i, 100);
+  commit_changes(&ts);
+  create_backup(file_name, "data/ledger.backup");
+
+  // transfers, new accounts and closed ones
+  LEDGER half;
+  size_t half_seq = 0;
+  for (int c = 0; c < COMMITS; c++) {
+    for (int i = 0; i < 20; i++) {
+      int id = (c * 37 + i * 101) % ACCOUNTS, balance = c + i;
+      PRED* where = pred_cmp(0, PRED_EQ, &id, &ts);
+      edit_where(where, 1, &balance, &ts);
+      pred_free(where);
+    }
+    create_entry(&ts, 2, ACCOUNTS + c, c);
+    int closed = ACCOUNTS + c - 1;
+    if (c % 3 == 0)
+      delete_entry(0, &closed, &ts);
+    commit_changes(&ts);
+    if (c == COMMITS / 2) {
+      half = ledger(&ts);
+      half_seq = log_seq(file_name);
+    }
+  }
+  LEDGER before = ledger(&ts);
+  size_t before_seq = log_seq(file_name);
+  usleep(5000);
+  size_t before_time = now_ms();
+  usleep(5000);
+  int mid = ACCOUNTS / 2;
+  PRED* where = pred_cmp(0, PRED_LT, &mid, &ts);
+  delete_where(where, &ts);
+  pred_free(where);
+  commit_changes(&ts);
+  LEDGER after = ledger(&ts);
+  close_table(&ts);
+
+  LEDGER l = restored("data/ledger.restore", half_seq, -1);
+  printf("commit %ld: %ld accounts, %.0f in total, restored %s\n", half_seq, half.rows, half.balance,
+    l.rows == half.rows && l.balance == half.balance ? "same" : "different");
+  l = restored("data/ledger.restore", before_seq, -1);
+  printf("commit %ld: %ld accounts, %.0f in total, restored %s\n", before_seq, before.rows, before.balance,
+    l.rows == before.rows && l.balance == before.balance ? "same" : "different");
+  printf("commit %ld: %ld accounts, %.0f in total\n", before_seq + 1, after.rows, after.balance);
+  l = restored("data/ledger.restore", -1, before_time);
+  printf("restored to the time before commit %ld: %s\n", before_seq + 1,
+    l.rows == before.rows && l.balance == before.balance ? "same" : "different");
+
+  delete_table(file_name);
+  unlink("data/ledger.backup");
+  unlink("data/ledger.backup.logseq");
+
+  // a ledger brought back over itself builds its bitmap index again
+  create_table(2, 32, col_types, col_names, file_name);
+  ts = (TABLE_STATE){ 0 };
+  open_table(file_name, &ts);
+  log_enable(&ts);
+  bitmap_index_create(1, &ts);
+  for (int i = 0; i < ACCOUNTS; i++)
+    create_entry(&ts, 2, i, 100);
+  commit_changes(&ts);
+  create_backup(file_name, "data/ledger.backup");
+  size_t backup_seq = log_seq(file_name);
+  int hundred = 100, zero = 0;
+  where = pred_cmp(1, PRED_EQ, &hundred, &ts);
+  edit_where(where, 1, &zero, &ts);
+  pred_free(where);
+  commit_changes(&ts);
+  close_table(&ts);
+  restore_to_point(file_name, "data/ledger.backup", "data/ledger.bin", backup_seq, -1);
+  ts = (TABLE_STATE){ 0 };
+  open_table(file_name, &ts);
+  where = pred_cmp(1, PRED_EQ, &hundred, &ts);
+  size_t found = find_where(where, &ts, NULL, NULL);
+  pred_free(where);
+  close_table(&ts);
+  printf("restored over the ledger with a bitmap index: %ld of %d accounts at 100\n", found, ACCOUNTS);
+  delete_table(file_name);
+  unlink("data/ledger.backup");
+  unlink("data/ledger.backup.logseq");
+  printf("\n");
+
+  return 0;
+}
@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include "file.h"
+
+// 1 if value of a row satisfies op with operand
+int pred_match(size_t type, size_t op, const void* value, const void* operand) {
+  if (op == PRED_PREFIX)
+    return strncmp(value, operand, strlen(operand)) == 0;
+  int c = value_cmp(type, value, operand);
+  if (op == PRED_EQ) return c == 0;
+  if (op == PRED_NE) return c != 0;
+  if (op == PRED_LT) return c < 0;
+  if (op == PRED_LE) return c <= 0;
+  if (op == PRED_GT) return c > 0;
+  if (op == PRED_GE) return c >= 0;
+  return 0;
+}
+
+static size_t scan_threads(size_t nblocks) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t threads = n > 0 ? n : 1;
+  if (threads > SCAN_MAX_THREADS) threads = SCAN_MAX_THREADS;
+  if (threads > nblocks) threads = nblocks;
+  return threads ? threads : 1;
+}
+
+// Picks the cheapest access path for rows whose col satisfies op with
+// value, value is a bare column value, NULL for all rows
+void plan_predicate(size_t col, size_t op, const void* value, TABLE_STATE* ts, QUERY_PLAN* plan) {
+  size_t type = ts->col_types[col];
+  double n = stats_rows(ts);
+  size_t len = row_count(ts);
+  size_t nblocks = (len + ZMAP_BLOCK_ROWS - 1) / ZMAP_BLOCK_ROWS;
+  memset(plan, 0, sizeof(QUERY_PLAN));
+  plan->selectivity = stats_selectivity(col, op, value, ts);
+  plan->rows = plan->selectivity * n;
+  // a key tree counts a range exactly in two descents
+  if (value && op >= PRED_LT && op <= PRED_GE && key_tree(col, ts)) {
+    plan->rows = key_count(col, op, value, ts);
+    plan->selectivity = n ? plan->rows / n : 0;
+  }
+
+  size_t candidates = 0;
+  for (size_t b = 0; b < nblocks; b++) {
+    if (zmap_block_may_satisfy(ts, b, col, op, value)) {
+      size_t last = (b + 1) * ZMAP_BLOCK_ROWS;
+      candidates += (last < len ? last : len) - b * ZMAP_BLOCK_ROWS;
+    }
+  }
+  plan->access = ACCESS_ZONE_MAP_SCAN;
+  plan->cost = candidates;
+  plan->threads = 1;
+
+  // workers read the file on their own, a snapshot has to be read through
+  size_t threads = ts->snapshot ? 1 : scan_threads(nblocks);
+  double parallel = (double)candidates / threads + threads * PLAN_THREAD_COST;
+  if (threads > 1 && parallel < plan->cost) {
+    plan->access = ACCESS_PARALLEL_SCAN;
+    plan->cost = parallel;
+    plan->threads = threads;
+  }
+  if (value == NULL)
+    return;
+
+  double depth = log2(n + 1) * PLAN_RANDOM_COST;
+  if (op == PRED_EQ && IS_KEY(type) && depth < plan->cost) {
+    plan->access = ACCESS_INDEX_LOOKUP;
+    plan->cost = depth;
+    plan->threads = 1;
+  }
+  // rows of a bitmap are fetched in row order, cheaper than random reads
+  double bitmap = plan->rows * PLAN_RANDOM_COST / 2;
+  if (op == PRED_EQ && bitmap_index_get(col, ts) && bitmap < plan->cost) {
+    plan->access = ACCESS_INDEX_LOOKUP;
+    plan->cost = bitmap;
+    plan->threads = 1;
+  }
+  double range = depth + plan->rows * PLAN_RANDOM_COST;
+  if (op >= PRED_LT && op <= PRED_GE && key_tree(col, ts) && range < plan->cost) {
+    plan->access = ACCESS_RANGE_CURSOR;
+    plan->cost = range;
+    plan->threads = 1;
+  }
+  // the subtree of a prefix knows its rows, only they are fetched
+  if (op == PRED_PREFIX && art_index_get(col, ts)) {
+    plan->rows = art_prefix_count(col, value, ts);
+    plan->selectivity = n ? plan->rows / n : 0;
+    double prefix = plan->rows * PLAN_RANDOM_COST;
+    if (prefix < plan->cost) {
+      plan->access = ACCESS_RANGE_CURSOR;
+      plan->cost = prefix;
+      plan->threads = 1;
+    }
+  }
+}
+
+// Row 0 with value put into col, the form trees and bitmaps are searched by
+static char* query_entry(size_t col, const void* value, TABLE_STATE* ts) {
+  char* query = get_by_tindex(0, ts);
+  size_t size = TYPE_SIZE(ts->col_types[col]);
+  if (TYPE_NUMBER(ts->col_types[col]) == TABLE_TYPE_VARCHAR) {
+    memset(&query[ts->col_offsets[col]], 0, size);
+    strncpy(&query[ts->col_offsets[col]], value, size - 1);
+  } else {
+    memcpy(&query[ts->col_offsets[col]], value, size);
+  }
+  return query;
+}
+
+// Number of rows whose key col satisfies op with the bare value, all rows
+// if value is NULL. Rows between lo and hi are key_count(PRED_GE, lo)
+// minus key_count(PRED_GT, hi). col has to be a key_tree column
+size_t key_count(size_t col, size_t op, const void* value, TABLE_STATE* ts) {
+  assert(key_tree(col, ts));
+  rbtree* rbt = ts->rb_trees[ts->key_col_relpos[col]];
+  size_t latched = table_latch(ts, TABLE_LOCK_READ);
+  size_t total = rb_count(rbt);
+  size_t less = 0, equal = 0;
+  if (value) {
+    char* query = query_entry(col, value, ts);
+    less = op == PRED_EQ || op == PRED_NE ? 0 : rb_rank(rbt, query);
+    equal = key_find(col, query, ts) != 0;
+    free(query);
+  }
+  table_unlatch(ts, latched);
+  if (value == NULL)
+    return total;
+  if (op == PRED_EQ) return equal;
+  if (op == PRED_NE) return total - equal;
+  if (op == PRED_LT) return less;
+  if (op == PRED_LE) return less + equal;
+  if (op == PRED_GT) return total - less - equal;
+  if (op == PRED_GE) return total - less;
+  return 0;
+}
+
+// Row with n rows before it in the key order of col, descending if desc,
+// 0 if there are not that many rows. col has to be a key_tree column
+size_t key_nth(size_t col, size_t n, size_t desc, TABLE_STATE* ts) {
+  assert(key_tree(col, ts));
+  rbtree* rbt = ts->rb_trees[ts->key_col_relpos[col]];
+  size_t latched = table_latch(ts, TABLE_LOCK_READ);
+  size_t total = rb_count(rbt);
+  size_t row = n < total ? rb_select(rbt, desc ? total - 1 - n : n) : 0;
+  table_unlatch(ts, latched);
+  return row;
+}
+
+// Calls func for the rows an index yielded that pass filter, filter may be
+// NULL. Returns number of rows passed to func
+size_t table_select_rows(const size_t* rows, size_t n, const FILTER* filter, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie) {
+  char* entry = malloc(ts->entry_raw_size);
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) {
+    read_rows(rows[i], 1, entry, ts);
+    if (filter && !filter_match(filter, entry))
+      continue;
+    count++;
+    if (func(entry, rows[i], cookie))
+      break;
+  }
+  free(entry);
+  return count;
+}
+
+static size_t select_index(size_t col, const void* value, const FILTER* filter, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie) {
+  char* query = query_entry(col, value, ts);
+  size_t count = 0;
+  if (IS_KEY(ts->col_types[col])) {
+    size_t row = key_find(col, query, ts);
+    void* entry = row ? get_by_tindex(row, ts) : NULL;
+    if (row && (!filter || filter_match(filter, entry))) {
+      func(entry, row, cookie);
+      count++;
+    }
+    free(entry);
+  } else {
+    size_t* rows;
+    size_t n = roaring_to_array(bitmap_index_lookup(col, query, ts), &rows);
+    count = table_select_rows(rows, n, filter, ts, func, cookie);
+    if (n) free(rows);
+  }
+  free(query);
+  return count;
+}
+
+// Walks the tree from the first row that can match, rows come in key order
+static size_t select_range(size_t col, size_t op, const void* value, const FILTER* filter, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie) {
+  rbtree* rbt = ts->rb_trees[ts->key_col_relpos[col]];
+  char* query = query_entry(col, value, ts);
+  size_t type = ts->col_types[col];
+  size_t node_ptr = op == PRED_GT || op == PRED_GE ? rb_lower_bound(rbt, query) : rb_min(rbt);
+  char* entry = malloc(ts->entry_raw_size);
+  size_t count = 0;
+  for (; node_ptr != RB_NIL_PTR; node_ptr = rb_successor(rbt, node_ptr)) {
+    read_rows(node_ptr, 1, entry, ts);
+    if (!pred_match(type, op, &entry[ts->col_offsets[col]], value)) {
+      if (op == PRED_GT) continue; // rows equal to value
+      break;
+    }
+    if (filter && !filter_match(filter, entry))
+      continue;
+    count++;
+    if (func(entry, node_ptr, cookie))
+      break;
+  }
+  free(entry);
+  free(query);
+  return count;
+}
+
+// Rows of a prefix from the ART index, in key order
+static size_t select_prefix(size_t col, const char* prefix, const FILTER* filter, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie) {
+  size_t* rows;
+  size_t n = art_prefix_rows(col, prefix, ts, &rows);
+  size_t count = table_select_rows(rows, n, filter, ts, func, cookie);
+  if (n) free(rows);
+  return count;
+}
+
+static size_t select_zone_map(size_t col, size_t op, const void* value, const FILTER* filter, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie) {
+  size_t type = ts->col_types[col];
+  size_t len = row_count(ts);
+  char* block = malloc(ZMAP_BLOCK_ROWS * ts->entry_raw_size);
+  size_t count = 0;
+  int stop = 0;
+  for (size_t first = 1, last; !stop && first < len; first = last) {
+    size_t b = first / ZMAP_BLOCK_ROWS;
+    last = (b + 1) * ZMAP_BLOCK_ROWS;
+    if (last > len) last = len;
+    if (!zmap_block_may_satisfy(ts, b, col, op, value) || (filter && !filter_block_may_match(filter, ts, b)))
+      continue;
+    read_rows(first, last - first, block, ts);
+    for (size_t i = first; !stop && i < last; i++) {
+      char* entry = &block[(i - first) * ts->entry_raw_size];
+      if (ENTRY_DELETED(entry) || (value && !pred_match(type, op, &entry[ts->col_offsets[col]], value)))
+        continue;
+      if (filter && !filter_match(filter, entry))
+        continue;
+      stop = func(entry, i, cookie);
+      count++;
+    }
+  }
+  free(block);
+  return count;
+}
+
+typedef struct {
+  TABLE_STATE* ts;
+  size_t col, op;
+  const void* value;
+  const FILTER* filter;
+  size_t block;
+  char* rows;
+  size_t* matches;
+  size_t nmatches;
+  pthread_t thread;
+} SCAN_WORKER;
+
+static void* scan_worker(void* arg) {
+  SCAN_WORKER* w = arg;
+  TABLE_STATE* ts = w->ts;
+  size_t type = ts->col_types[w->col];
+  size_t len = row_count(ts);
+  size_t first = w->block * ZMAP_BLOCK_ROWS, last = first + ZMAP_BLOCK_ROWS;
+  if (first == 0) first = 1;
+  if (last > len) last = len;
+  w->nmatches = 0;
+  if (first >= last || !zmap_block_may_satisfy(ts, w->block, w->col, w->op, w->value))
+    return NULL;
+  if (w->filter && !filter_block_may_match(w->filter, ts, w->block))
+    return NULL;
+  size_t n = table_pread_some(ts, w->rows, (last - first) * ts->entry_raw_size, entry_offset(first, ts)) / ts->entry_raw_size;
+  for (size_t i = 0; i < n; i++) {
+    char* entry = &w->rows[i * ts->entry_raw_size];
+    if (ENTRY_DELETED(entry) || (w->value && !pred_match(type, w->op, &entry[ts->col_offsets[w->col]], w->value)))
+      continue;
+    if (w->filter && !filter_match(w->filter, entry))
+      continue;
+    w->matches[w->nmatches++] = first + i;
+  }
+  return NULL;
+}
+
+// Blocks are filtered by the workers a wave at a time, each reading its
+// block at its offset, matches are handed to func in row order by the caller
+static size_t select_parallel(size_t col, size_t op, const void* value, const FILTER* filter, size_t threads, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie) {
+  size_t nblocks = (row_count(ts) + ZMAP_BLOCK_ROWS - 1) / ZMAP_BLOCK_ROWS;
+  SCAN_WORKER* workers = calloc(threads, sizeof(SCAN_WORKER));
+  for (size_t t = 0; t < threads; t++) {
+    SCAN_WORKER* w = &workers[t];
+    w->ts = ts;
+    w->col = col;
+    w->op = op;
+    w->value = value;
+    w->filter = filter;
+    w->rows = malloc(ZMAP_BLOCK_ROWS * ts->entry_raw_size);
+    w->matches = malloc(ZMAP_BLOCK_ROWS * sizeof(size_t));
+  }
+  size_t count = 0;
+  int stop = 0;
+  for (size_t wave = 0; !stop && wave < nblocks; wave += threads) {
+    size_t n = nblocks - wave < threads ? nblocks - wave : threads;
+    for (size_t t = 0; t < n; t++) {
+      workers[t].block = wave + t;
+      pthread_create(&workers[t].thread, NULL, scan_worker, &workers[t]);
+    }
+    for (size_t t = 0; t < n; t++)
+      pthread_join(workers[t].thread, NULL);
+    for (size_t t = 0; !stop && t < n; t++) {
+      SCAN_WORKER* w = &workers[t];
+      size_t first = w->block ? w->block * ZMAP_BLOCK_ROWS : 1;
+      for (size_t i = 0; !stop && i < w->nmatches; i++) {
+        stop = func(&w->rows[(w->matches[i] - first) * ts->entry_raw_size], w->matches[i], cookie);
+        count++;
+      }
+    }
+  }
+  for (size_t t = 0; t < threads; t++) {
+    free(workers[t].rows);
+    free(workers[t].matches);
+  }
+  free(workers);
+  return count;
+}
+
+// Calls func(entry, row, cookie) for every live row whose col satisfies
+// op with value (a bare column value, NULL for all rows) through the
+// access path chosen by plan_predicate. Rows come in row order, except for
+// a range cursor that yields them in key order. entry is only valid during
+// the call. Stops when func returns non-zero.
+// Returns number of rows passed to func
+size_t table_select(size_t col, size_t op, const void* value, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie) {
+  return table_select_where(col, op, value, NULL, ts, func, cookie);
+}
+
+// table_select with a residual filter checked on every row the access path
+// yields and on the zone map of every block it reads, filter may be NULL.
+// The table stays latched for reading while func is called, func must not
+// commit it
+size_t table_select_where(size_t col, size_t op, const void* value, const FILTER* filter, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie) {
+  assert(col < ts->ncols);
+  size_t latched = table_latch(ts, TABLE_LOCK_READ);
+  QUERY_PLAN plan;
+  size_t count;
+  plan_predicate(col, op, value, ts, &plan);
+  if (plan.access == ACCESS_INDEX_LOOKUP)
+    count = select_index(col, value, filter, ts, func, cookie);
+  else if (plan.access == ACCESS_RANGE_CURSOR && op == PRED_PREFIX)
+    count = select_prefix(col, value, filter, ts, func, cookie);
+  else if (plan.access == ACCESS_RANGE_CURSOR)
+    count = select_range(col, op, value, filter, ts, func, cookie);
+  else if (plan.access == ACCESS_PARALLEL_SCAN)
+    count = select_parallel(col, op, value, filter, plan.threads, ts, func, cookie);
+  else
+    count = select_zone_map(col, op, value, filter, ts, func, cookie);
+  table_unlatch(ts, latched);
+  return count;
+}
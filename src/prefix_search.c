@@ -0,0 +1,48 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+
+#define ROWS 5000
+
+static int print_name(void* entry, size_t row, void* cookie) {
+  TABLE_STATE* table_state = cookie;
+  printf("  %s: %d\n", &((char*)entry)[table_state->col_offsets[0]], *(int*)&((char*)entry)[table_state->col_offsets[1]]);
+  return 0;
+}
+
+int main () {
+  const char* file_name = "data/names.bin";
+  size_t col_types[2] = {
+    MAKE_TYPE(TABLE_TYPE_VARCHAR, 32) | KEY_FIELD,
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int))
+  };
+  const char* col_names[] = { "name", "n" };
+  if (access(file_name, F_OK) == 0)
+    delete_table(file_name);
+  create_table(2, 32, col_types, col_names, file_name);
+
+  TABLE_STATE table_state = { 0 };
+  open_table(file_name, &table_state);
+  const char* stems[] = { "alice", "alfred", "bob", "bobby", "carol" };
+  char name[32];
+  for (int i = 0; i < ROWS; i++) {
+    snprintf(name, sizeof(name), "%s%d", stems[i % 5], (int)((i * 7919L) % ROWS));
+    create_entry(&table_state, 2, name, i);
+  }
+  commit_changes(&table_state);
+  art_index_create(0, &table_state);
+  close_table(&table_state);
+
+  table_state = (TABLE_STATE){ 0 };
+  open_table(file_name, &table_state);
+  printf("name LIKE 'alf%%': %ld rows\n", art_prefix_count(0, "alf", &table_state));
+  printf("name LIKE 'bobby112%%'\n");
+  table_select(0, PRED_PREFIX, "bobby112", &table_state, print_name, &table_state);
+  char query[32] = "alfred4";
+  size_t row = beautiful_find_entry(0, query, &table_state, NULL, NULL);
+  printf("name = 'alfred4': %s\n", row ? "found" : "not found");
+  close_table(&table_state);
+  delete_table(file_name);
+  printf("\n");
+
+  return 0;
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "file.h"
+
+// Tuple: the projected columns one after another, each TYPE_SIZE bytes
+
+typedef struct {
+  size_t row;
+  size_t pos;  // of the tuple in the result
+} PROJECT_ROW;
+
+size_t projection_size(const PROJECTION* proj, TABLE_STATE* ts) {
+  size_t size = 0;
+  for (size_t i = 0; i < proj->ncols; i++)
+    size += TYPE_SIZE(ts->col_types[proj->cols[i]]);
+  return size;
+}
+
+// Value of the i-th projected column of a tuple
+void* projection_value(void* tuple, const PROJECTION* proj, size_t i, TABLE_STATE* ts) {
+  assert(i < proj->ncols);
+  size_t offset = 0;
+  for (size_t j = 0; j < i; j++)
+    offset += TYPE_SIZE(ts->col_types[proj->cols[j]]);
+  return &((unsigned char*)tuple)[offset];
+}
+
+static int row_cmp(const void* a, const void* b) {
+  size_t l = ((const PROJECT_ROW*)a)->row, r = ((const PROJECT_ROW*)b)->row;
+  return (l > r) - (l < r);
+}
+
+// Copies the projected columns of rows[i] into the i-th tuple of result,
+// which has to hold count * projection_size bytes. Returns number of tuples
+size_t project_rows(const size_t* rows, size_t count, const PROJECTION* proj, TABLE_STATE* ts, void* result) {
+  if (count == 0)
+    return 0;
+  for (size_t i = 0; i < proj->ncols; i++)
+    assert(proj->cols[i] < ts->ncols);
+  size_t tuple_size = projection_size(proj, ts);
+
+  // rows are read in file order no matter the order they are delivered in
+  PROJECT_ROW* order = malloc(count * sizeof(PROJECT_ROW));
+  int sorted = 1;
+  for (size_t i = 0; i < count; i++) {
+    order[i].row = rows[i];
+    order[i].pos = i;
+    sorted = sorted && (i == 0 || rows[i - 1] <= rows[i]);
+  }
+  if (!sorted)
+    qsort(order, count, sizeof(PROJECT_ROW), row_cmp);
+
+  unsigned char* buf = malloc(PROJECT_BATCH_ROWS * ts->entry_raw_size);
+  for (size_t i = 0; i < count; ) {
+    size_t first = order[i].row, j = i + 1;
+    while (j < count && order[j].row - first < PROJECT_BATCH_ROWS &&
+           order[j].row - order[j - 1].row <= PROJECT_MAX_GAP)
+      j++;
+    read_rows(first, order[j - 1].row - first + 1, buf, ts);
+    for (; i < j; i++) {
+      const unsigned char* entry = &buf[(order[i].row - first) * ts->entry_raw_size];
+      unsigned char* tuple = &((unsigned char*)result)[order[i].pos * tuple_size];
+      for (size_t c = 0; c < proj->ncols; c++) {
+        size_t col = proj->cols[c];
+        size_t size = TYPE_SIZE(ts->col_types[col]);
+        const unsigned char* value = &entry[ts->col_offsets[col]];
+        if (TYPE_NUMBER(ts->col_types[col]) == TABLE_TYPE_VARCHAR) {
+          // only the string, the rest of the field stays zero
+          size_t len = strnlen((const char*)value, size);
+          memcpy(tuple, value, len);
+          memset(tuple + len, 0, size - len);
+        } else {
+          memcpy(tuple, value, size);
+        }
+        tuple += size;
+      }
+    }
+  }
+  free(buf);
+  free(order);
+  return count;
+}
+
+typedef struct {
+  size_t count, capacity;
+  size_t* items;
+} PROJECT_MATCHES;
+
+static int project_match(void* entry, size_t row, void* cookie) {
+  da_append((PROJECT_MATCHES*)cookie, row);
+  return 0;
+}
+
+// find_where delivering only the projected columns: result is one buffer
+// of count tuples, see projection_size. where may be NULL for all rows
+size_t find_project(const PRED* where, const PROJECTION* proj, TABLE_STATE* ts, void** result, size_t** indices) {
+  PROJECT_MATCHES matches = { 0 };
+  size_t count;
+  // no commit between collecting the rows and reading them
+  size_t latched = table_latch(ts, TABLE_LOCK_READ);
+  if (where)
+    count = table_filter(where, ts, project_match, &matches);
+  else
+    count = table_select(0, PRED_EQ, NULL, ts, project_match, &matches);
+  if (result) {
+    *result = malloc(count * projection_size(proj, ts) + 1);
+    project_rows(matches.items, count, proj, ts, *result);
+  }
+  table_unlatch(ts, latched);
+  if (indices)
+    *indices = matches.items;
+  else
+    free(matches.items);
+  return count;
+}
@@ -5,6 +5,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include "rb.h"
 #include "file.h"
 
@@ -23,9 +24,10 @@ static size_t read_rb_data_by_index(rbtree *rbt, size_t node_ptr, size_t rb_inde
   }
   size_t rb_data;
   TABLE_STATE* ts = rbt->table_state;
+  if (ts->snapshot)
+    return ((const size_t*)snapshot_row(ts, node_ptr))[rbt->col * RB_DATA_LEN + rb_index];
   size_t offset = entry_offset(node_ptr, ts) + rbt->col * RB_DATA_SIZE + sizeof(size_t) * rb_index;
-  fseek(ts->file, offset, SEEK_SET);
-  fread(&rb_data, sizeof(size_t), 1, ts->file);
+  table_pread(ts, &rb_data, sizeof(size_t), offset);
   return rb_data;
 }
 
@@ -41,13 +43,18 @@ static size_t get_parent(rbtree *rbt, size_t node_ptr) {
 static size_t get_color (rbtree *rbt, size_t node_ptr) {
   return read_rb_data_by_index(rbt, node_ptr, RB_INDEX_COLOR);
 }
+static size_t get_size  (rbtree *rbt, size_t node_ptr) {
+  if (node_ptr == RB_NIL_PTR)
+    return 0;
+  return read_rb_data_by_index(rbt, node_ptr, RB_INDEX_SIZE);
+}
 
 static size_t write_rb_data_by_index(rbtree *rbt, size_t node_ptr, size_t value, size_t rb_index) {
   assert(node_ptr+1);
   TABLE_STATE* ts = rbt->table_state;
   size_t offset = entry_offset(node_ptr, ts) + rbt->col * RB_DATA_SIZE + sizeof(size_t) * rb_index;
-  fseek(ts->file, offset, SEEK_SET);
-  return fwrite(&value, sizeof(size_t), 1, ts->file);
+  mvcc_before_write(ts, node_ptr);
+  return table_pwrite(ts, &value, sizeof(size_t), offset);
 }
 
 
@@ -66,11 +73,21 @@ static size_t set_parent (rbtree *rbt, size_t node_ptr, size_t value) {
 static size_t set_color (rbtree *rbt, size_t node_ptr, size_t value) {
   return write_rb_data_by_index(rbt, node_ptr, value, RB_INDEX_COLOR);
 }
+static size_t set_size (rbtree *rbt, size_t node_ptr, size_t value) {
+  return write_rb_data_by_index(rbt, node_ptr, value, RB_INDEX_SIZE);
+}
+
+/*
+ * subtree size of a node from its children
+ */
+static void update_size(rbtree *rbt, size_t node_ptr) {
+  set_size(rbt, node_ptr, get_size(rbt, get_left(rbt, node_ptr)) + get_size(rbt, get_right(rbt, node_ptr)) + 1);
+}
 
 static size_t set_free  (rbtree *rbt, size_t node_ptr) {
   TABLE_STATE* ts = rbt->table_state;
-  size_t next_empty = next_empty_read(ts->file);
-  next_empty_write(ts->file, node_ptr);
+  size_t next_empty = next_empty_read(ts);
+  next_empty_write(ts, node_ptr);
   set_parent(rbt, node_ptr, next_empty);
   set_color(rbt, node_ptr, -1);
 }
@@ -80,24 +97,43 @@ static size_t set_rb_data(rbtree *rbt, void *data, void *rb_data) {
   return 0;
 }
 
+/*
+ * rows handed to the comparators, one buffer per thread so threads
+ * walking the same tree do not overwrite each other's
+ */
+static pthread_key_t copy_key;
+static pthread_once_t copy_once = PTHREAD_ONCE_INIT;
+static __thread void* copy_data;
+static __thread size_t copy_size;
+
+static void copy_key_create(void) {
+  pthread_key_create(&copy_key, free);
+}
+
 static void* get_data(rbtree *rbt, size_t node_ptr) {
   TABLE_STATE* ts = rbt->table_state;
-  size_t offset = entry_offset(node_ptr, ts);
-  fseek(ts->file, offset, SEEK_SET);
-  fread(rbt->copy_data, ts->entry_raw_size, 1, ts->file);
-  return rbt->copy_data;
+  if (copy_size < ts->entry_raw_size) {
+    pthread_once(&copy_once, copy_key_create);
+    copy_data = realloc(copy_data, ts->entry_raw_size);
+    copy_size = ts->entry_raw_size;
+    // freed when the thread exits
+    pthread_setspecific(copy_key, copy_data);
+  }
+  if (ts->snapshot) {
+    memcpy(copy_data, snapshot_row(ts, node_ptr), ts->entry_raw_size);
+    return copy_data;
+  }
+  table_pread(ts, copy_data, ts->entry_raw_size, entry_offset(node_ptr, ts));
+  return copy_data;
 }
 
 static size_t set_data(rbtree *rbt, size_t node_ptr, void* data) {
   TABLE_STATE* ts = rbt->table_state;
   size_t offset = entry_offset(node_ptr, ts);
-  fseek(ts->file, offset + ts->col_offsets[rbt->col], SEEK_SET);
-  return fwrite(&((char*)data)[ts->col_offsets[rbt->col]], TYPE_SIZE(ts->col_types[rbt->col]), 1, ts->file);
+  mvcc_before_write(ts, node_ptr);
+  return table_pwrite(ts, &((char*)data)[ts->col_offsets[rbt->col]], TYPE_SIZE(ts->col_types[rbt->col]), offset + ts->col_offsets[rbt->col]);
 }
 
-#define RB_ROOT_PTR 0
-#define RB_NIL_PTR (-1)
-
 static size_t RB_FIRST_PTR(rbtree* rbt) {
   return get_left(rbt, 0);
 }
@@ -106,8 +142,11 @@ rbtree* rb_restore_from_table(size_t col, TABLE_STATE* table_state, int (*cmp)(c
   rbtree* rbt = rb_create(cmp, _destroy);
   rbt->table_state = table_state;
   rbt->col = col;
-  rbt->copy_data = malloc(table_state->entry_raw_size);
-  set_color(rbt, 0, BLACK);
+  if (table_state->snapshot == NULL)
+    set_color(rbt, 0, BLACK);
+	#ifdef RB_MIN
+  rbt->min_ptr = rb_min(rbt);
+	#endif
   return rbt;
 }
 
@@ -151,8 +190,6 @@ rbtree *rb_create(int (*compare)(const void*, const void *, const void *), void
 void rb_destroy(rbtree *rbt)
 {
 	// destroy(rbt, RB_FIRST(rbt));
-  if (rbt->copy_data)
-    free(rbt->copy_data);
 	free(rbt);
 }
 
@@ -164,6 +201,7 @@ size_t rb_find(rbtree *rbt, void *data)
 {
 	//rbnode *p;
   size_t p_ptr;
+  size_t latched = table_latch(rbt->table_state, TABLE_LOCK_READ);
 
 	//p = RB_FIRST(rbt);
   p_ptr = RB_FIRST_PTR(rbt);
@@ -173,12 +211,114 @@ size_t rb_find(rbtree *rbt, void *data)
     void* d = get_data(rbt, p_ptr);
 		cmp = rbt->compare(rbt, data, d);
 		if (cmp == 0)
-			return p_ptr; /* found */
+			break; /* found */
 		// p = cmp < 0 ? p->left : p->right;
     p_ptr = cmp < 0 ? get_left(rbt, p_ptr) : get_right(rbt, p_ptr);
 	}
 
-	return 0; /* not found */
+  table_unlatch(rbt->table_state, latched);
+	return p_ptr == RB_NIL_PTR ? 0 : p_ptr; /* 0 if not found */
+}
+
+/*
+ * first node not less than data
+ * return RB_NIL_PTR if there is none
+ */
+size_t rb_lower_bound(rbtree *rbt, void *data)
+{
+  size_t found = RB_NIL_PTR;
+  size_t latched = table_latch(rbt->table_state, TABLE_LOCK_READ);
+  size_t p_ptr = RB_FIRST_PTR(rbt);
+  while (p_ptr != RB_NIL_PTR) {
+    if (rbt->compare(rbt, data, get_data(rbt, p_ptr)) <= 0) {
+      found = p_ptr;
+      p_ptr = get_left(rbt, p_ptr);
+    } else {
+      p_ptr = get_right(rbt, p_ptr);
+    }
+  }
+  table_unlatch(rbt->table_state, latched);
+  return found;
+}
+
+/*
+ * smallest and largest nodes, walk down from the first node
+ * return RB_NIL_PTR if the tree is empty
+ */
+size_t rb_min(rbtree *rbt)
+{
+  size_t latched = table_latch(rbt->table_state, TABLE_LOCK_READ);
+  size_t p_ptr = RB_FIRST_PTR(rbt);
+  if (p_ptr != RB_NIL_PTR)
+    for (size_t left = get_left(rbt, p_ptr); left != RB_NIL_PTR; left = get_left(rbt, p_ptr))
+      p_ptr = left;
+  table_unlatch(rbt->table_state, latched);
+  return p_ptr;
+}
+
+size_t rb_max(rbtree *rbt)
+{
+  size_t latched = table_latch(rbt->table_state, TABLE_LOCK_READ);
+  size_t p_ptr = RB_FIRST_PTR(rbt);
+  if (p_ptr != RB_NIL_PTR)
+    for (size_t right = get_right(rbt, p_ptr); right != RB_NIL_PTR; right = get_right(rbt, p_ptr))
+      p_ptr = right;
+  table_unlatch(rbt->table_state, latched);
+  return p_ptr;
+}
+
+/*
+ * number of nodes, the size of the first node's subtree
+ */
+size_t rb_count(rbtree *rbt)
+{
+  size_t latched = table_latch(rbt->table_state, TABLE_LOCK_READ);
+  size_t count = get_size(rbt, RB_FIRST_PTR(rbt));
+  table_unlatch(rbt->table_state, latched);
+  return count;
+}
+
+/*
+ * number of nodes less than data
+ */
+size_t rb_rank(rbtree *rbt, void *data)
+{
+  size_t rank = 0;
+  size_t latched = table_latch(rbt->table_state, TABLE_LOCK_READ);
+  size_t p_ptr = RB_FIRST_PTR(rbt);
+  while (p_ptr != RB_NIL_PTR) {
+    if (rbt->compare(rbt, data, get_data(rbt, p_ptr)) <= 0) {
+      p_ptr = get_left(rbt, p_ptr);
+    } else {
+      rank += get_size(rbt, get_left(rbt, p_ptr)) + 1;
+      p_ptr = get_right(rbt, p_ptr);
+    }
+  }
+  table_unlatch(rbt->table_state, latched);
+  return rank;
+}
+
+/*
+ * node with rank nodes before it in order
+ * return RB_NIL_PTR if the tree is not that large
+ */
+size_t rb_select(rbtree *rbt, size_t rank)
+{
+  size_t latched = table_latch(rbt->table_state, TABLE_LOCK_READ);
+  size_t p_ptr = RB_FIRST_PTR(rbt);
+  while (p_ptr != RB_NIL_PTR) {
+    size_t left = get_size(rbt, get_left(rbt, p_ptr));
+    if (rank == left)
+      break;
+    if (rank < left) {
+      p_ptr = get_left(rbt, p_ptr);
+    } else {
+      rank -= left + 1;
+      p_ptr = get_right(rbt, p_ptr);
+    }
+  }
+  table_unlatch(rbt->table_state, latched);
+  return p_ptr;
 }
 
 /*
@@ -189,6 +329,7 @@ size_t rb_successor(rbtree *rbt, size_t node_ptr)
 {
 	// rbnode *p;
   size_t p_ptr;
+  size_t latched = table_latch(rbt->table_state, TABLE_LOCK_READ);
 
 	// p = node->right;
   p_ptr = get_right(rbt, node_ptr);
@@ -210,9 +351,35 @@ size_t rb_successor(rbtree *rbt, size_t node_ptr)
 			p_ptr = RB_NIL_PTR; /* not found */
 	}
 
+  table_unlatch(rbt->table_state, latched);
 	return p_ptr;
 }
 
+/*
+ * next smaller
+ * return RB_NIL_PTR if not found
+ */
+size_t rb_predecessor(rbtree *rbt, size_t node_ptr)
+{
+  size_t latched = table_latch(rbt->table_state, TABLE_LOCK_READ);
+  size_t p_ptr = get_left(rbt, node_ptr);
+
+  if (p_ptr != RB_NIL_PTR) {
+    /* move down until we find it */
+    for (size_t pright = get_right(rbt, p_ptr); pright != RB_NIL_PTR; pright = get_right(rbt, p_ptr))
+      p_ptr = pright;
+  } else {
+    /* move up until we find it or hit the root */
+    for (p_ptr = get_parent(rbt, node_ptr); p_ptr != RB_ROOT_PTR && node_ptr == get_left(rbt, p_ptr); node_ptr = p_ptr, p_ptr = get_parent(rbt, p_ptr));
+
+    if (p_ptr == RB_ROOT_PTR)
+      p_ptr = RB_NIL_PTR; /* not found */
+  }
+
+  table_unlatch(rbt->table_state, latched);
+  return p_ptr;
+}
+
 /*
  * apply func
  * return non-zero if error
@@ -280,6 +447,10 @@ void rotate_left(rbtree *rbt, size_t x_ptr)
 	// x->parent = y;
   set_parent(rbt, x_ptr, y_ptr);
   //rb_table_update(rbt, x);
+
+  /* y now holds the nodes of x, x lost y and the other subtree of y */
+  set_size(rbt, y_ptr, get_size(rbt, x_ptr));
+  update_size(rbt, x_ptr);
 }
 
 /*
@@ -321,6 +492,10 @@ void rotate_right(rbtree *rbt, size_t x_ptr)
 	// x->parent = y;
   set_parent(rbt, x_ptr, y_ptr);
   //rb_table_update(rbt, x);
+
+  /* y now holds the nodes of x, x lost y and the other subtree of y */
+  set_size(rbt, y_ptr, get_size(rbt, x_ptr));
+  update_size(rbt, x_ptr);
 }
 
 
@@ -382,6 +557,7 @@ size_t rb_insert(rbtree *rbt, void *data)
   set_left(rbt, current_ptr, RB_NIL_PTR);
   set_right(rbt, current_ptr, RB_NIL_PTR);
   set_color(rbt, current_ptr, RED);
+  set_size(rbt, current_ptr, 1);
 
   
 	if (parent_ptr == RB_ROOT_PTR || rbt->compare(rbt, data, get_data(rbt, parent_ptr)) < 0)
@@ -392,8 +568,12 @@ size_t rb_insert(rbtree *rbt, void *data)
     set_right(rbt, parent_ptr, current_ptr);
   //rb_table_update(rbt, parent);
 
+	/* one more node in every subtree on the search path */
+  for (size_t p_ptr = parent_ptr; p_ptr != RB_ROOT_PTR; p_ptr = get_parent(rbt, p_ptr))
+    set_size(rbt, p_ptr, get_size(rbt, p_ptr) + 1);
+
 	#ifdef RB_MIN
-	if (rbt->min_ptr == RB_NIL_PTR || rbt->compare(rbt, get_data(rbt, current_ptr), get_data(rbt, rbt->min_ptr)) < 0)
+	if (rbt->min_ptr == RB_NIL_PTR || rbt->compare(rbt, data, get_data(rbt, rbt->min_ptr)) < 0)
 		rbt->min_ptr = current_ptr;
 	#endif
 	
@@ -562,7 +742,7 @@ void rb_delete(rbtree *rbt, size_t node_ptr, int keep)
 		// node->data = target->data; /* data swapped */
 
 		#ifdef RB_MIN
-		/* if min == node, then min = successor = node (swapped), thus idle */
+		/* node has a left child, thus it is not the minimal */
 		/* if min == target, then min = successor, which is not the minimal, thus impossible */
 		#endif
 	}
@@ -570,6 +750,14 @@ void rb_delete(rbtree *rbt, size_t node_ptr, int keep)
 	// child = (target->left == RB_NIL_PTR(rbt)) ? target->right : target->left; /* child may be NIL */
   child_ptr = (get_left(rbt, target_ptr) == RB_NIL_PTR ? get_right(rbt, target_ptr) : get_left(rbt, target_ptr));
 
+	/*
+	 * the target leaves the tree, it no longer counts in the subtrees above it;
+	 * while delete_repair rotates, the target is a leaf and counts as 0
+	 */
+  set_size(rbt, target_ptr, 0);
+  for (size_t p_ptr = get_parent(rbt, target_ptr); p_ptr != RB_ROOT_PTR; p_ptr = get_parent(rbt, p_ptr))
+    set_size(rbt, p_ptr, get_size(rbt, p_ptr) - 1);
+
 	/*
 	 * deletion from red-black tree
 	 *   4-children cluster (RED target node) becomes 3-children cluster
@@ -626,11 +814,33 @@ void rb_delete(rbtree *rbt, size_t node_ptr, int keep)
     set_right(rbt, get_parent(rbt, target_ptr), child_ptr);
   //rb_table_update(rbt, target->parent);
 
+	/*
+	 * rows stay where they are in the file, so instead of swapping the data
+	 * the successor takes over the place of node in the tree
+	 */
+  if (target_ptr != node_ptr) {
+    size_t parent_ptr = get_parent(rbt, node_ptr);
+    size_t left_ptr = get_left(rbt, node_ptr), right_ptr = get_right(rbt, node_ptr);
+    set_parent(rbt, target_ptr, parent_ptr);
+    set_left(rbt, target_ptr, left_ptr);
+    set_right(rbt, target_ptr, right_ptr);
+    set_color(rbt, target_ptr, get_color(rbt, node_ptr));
+    set_size(rbt, target_ptr, get_size(rbt, node_ptr));
+    if (node_ptr == get_left(rbt, parent_ptr))
+      set_left(rbt, parent_ptr, target_ptr);
+    else
+      set_right(rbt, parent_ptr, target_ptr);
+    if (left_ptr != RB_NIL_PTR)
+      set_parent(rbt, left_ptr, target_ptr);
+    if (right_ptr != RB_NIL_PTR)
+      set_parent(rbt, right_ptr, target_ptr);
+  }
+
 	/* keep or discard data */
 	if (keep == 0) {
 		// rbt->destroy(data);
 		// data = NULL;
-	  set_free(rbt, target_ptr);
+	  set_free(rbt, node_ptr);
 	}
 
 	// return data;
@@ -820,11 +1030,12 @@ int check_order(rbtree *rbt, size_t n_ptr, void *min, void *max)
 
 int rb_check_black_height(rbtree *rbt)
 {
-	if (RB_ROOT(rbt)->color == RED || get_color(rbt, RB_FIRST_PTR(rbt)) == RED || RB_NIL(rbt)->color == RED)
-
-		return 0;
-
-	return check_black_height(rbt, RB_FIRST_PTR(rbt));
+  size_t latched = table_latch(rbt->table_state, TABLE_LOCK_READ);
+  int ok = 0;
+	if (!(RB_ROOT(rbt)->color == RED || get_color(rbt, RB_FIRST_PTR(rbt)) == RED || RB_NIL(rbt)->color == RED))
+		ok = check_black_height(rbt, RB_FIRST_PTR(rbt));
+  table_unlatch(rbt->table_state, latched);
+	return ok;
 }
 
 /*
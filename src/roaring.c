@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "file.h"
+
+#define LOW(x)  ((unsigned short)((x) & 0xffff))
+#define HIGH(x) ((unsigned int)((x) >> 16))
+
+static size_t container_index(const ROARING* r, unsigned int key, size_t* found) {
+  size_t lo = 0, hi = r->count;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (r->items[mid].key < key) lo = mid + 1;
+    else hi = mid;
+  }
+  *found = lo < r->count && r->items[lo].key == key;
+  return lo;
+}
+
+static RCONTAINER* container_insert(ROARING* r, size_t pos, unsigned int key) {
+  if (r->count >= r->capacity) {
+    r->capacity = r->capacity ? r->capacity * 2 : 4;
+    r->items = realloc(r->items, r->capacity * sizeof(RCONTAINER));
+  }
+  memmove(&r->items[pos + 1], &r->items[pos], (r->count - pos) * sizeof(RCONTAINER));
+  r->count++;
+  RCONTAINER* c = &r->items[pos];
+  memset(c, 0, sizeof(RCONTAINER));
+  c->key = key;
+  return c;
+}
+
+static void container_free(RCONTAINER* c) {
+  free(c->array);
+  free(c->bits);
+  c->array = NULL;
+  c->bits = NULL;
+}
+
+static size_t array_index(const RCONTAINER* c, unsigned short low, size_t* found) {
+  size_t lo = 0, hi = c->card;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (c->array[mid] < low) lo = mid + 1;
+    else hi = mid;
+  }
+  *found = lo < c->card && c->array[lo] == low;
+  return lo;
+}
+
+static void container_to_bitmap(RCONTAINER* c) {
+  if (c->bits)
+    return;
+  c->bits = calloc(ROARING_BITMAP_WORDS, sizeof(unsigned long long));
+  for (size_t i = 0; i < c->card; i++)
+    c->bits[c->array[i] >> 6] |= 1ULL << (c->array[i] & 63);
+  free(c->array);
+  c->array = NULL;
+}
+
+static void container_to_array(RCONTAINER* c) {
+  if (!c->bits)
+    return;
+  c->array = malloc((c->card ? c->card : 1) * sizeof(unsigned short));
+  size_t n = 0;
+  for (size_t w = 0; w < ROARING_BITMAP_WORDS; w++) {
+    unsigned long long word = c->bits[w];
+    while (word) {
+      c->array[n++] = (unsigned short)(w * 64 + __builtin_ctzll(word));
+      word &= word - 1;
+    }
+  }
+  free(c->bits);
+  c->bits = NULL;
+}
+
+// keeps the smaller representation
+static void container_normalize(RCONTAINER* c) {
+  if (c->bits && c->card <= ROARING_ARRAY_MAX)
+    container_to_array(c);
+  else if (!c->bits && c->card > ROARING_ARRAY_MAX)
+    container_to_bitmap(c);
+}
+
+void roaring_add(ROARING* r, size_t x) {
+  size_t found;
+  size_t pos = container_index(r, HIGH(x), &found);
+  RCONTAINER* c = found ? &r->items[pos] : container_insert(r, pos, HIGH(x));
+  unsigned short low = LOW(x);
+  if (c->bits) {
+    if (!(c->bits[low >> 6] & (1ULL << (low & 63)))) {
+      c->bits[low >> 6] |= 1ULL << (low & 63);
+      c->card++;
+    }
+    return;
+  }
+  size_t i = array_index(c, low, &found);
+  if (found)
+    return;
+  c->array = realloc(c->array, (c->card + 1) * sizeof(unsigned short));
+  memmove(&c->array[i + 1], &c->array[i], (c->card - i) * sizeof(unsigned short));
+  c->array[i] = low;
+  c->card++;
+  container_normalize(c);
+}
+
+void roaring_remove(ROARING* r, size_t x) {
+  size_t found;
+  size_t pos = container_index(r, HIGH(x), &found);
+  if (!found)
+    return;
+  RCONTAINER* c = &r->items[pos];
+  unsigned short low = LOW(x);
+  if (c->bits) {
+    if (c->bits[low >> 6] & (1ULL << (low & 63))) {
+      c->bits[low >> 6] &= ~(1ULL << (low & 63));
+      c->card--;
+    }
+  } else {
+    size_t i = array_index(c, low, &found);
+    if (!found)
+      return;
+    memmove(&c->array[i], &c->array[i + 1], (c->card - i - 1) * sizeof(unsigned short));
+    c->card--;
+  }
+  if (c->card == 0) {
+    container_free(c);
+    memmove(&r->items[pos], &r->items[pos + 1], (r->count - pos - 1) * sizeof(RCONTAINER));
+    r->count--;
+    return;
+  }
+  container_normalize(c);
+}
+
+int roaring_contains(const ROARING* r, size_t x) {
+  size_t found;
+  size_t pos = container_index(r, HIGH(x), &found);
+  if (!found)
+    return 0;
+  const RCONTAINER* c = &r->items[pos];
+  unsigned short low = LOW(x);
+  if (c->bits)
+    return (c->bits[low >> 6] >> (low & 63)) & 1;
+  array_index(c, low, &found);
+  return found;
+}
+
+size_t roaring_count(const ROARING* r) {
+  size_t count = 0;
+  for (size_t i = 0; i < r->count; i++)
+    count += r->items[i].card;
+  return count;
+}
+
+static void container_and(const RCONTAINER* a, const RCONTAINER* b, RCONTAINER* out) {
+  out->key = a->key;
+  out->card = 0;
+  if (a->bits && b->bits) {
+    out->bits = malloc(ROARING_BITMAP_WORDS * sizeof(unsigned long long));
+    for (size_t w = 0; w < ROARING_BITMAP_WORDS; w++) {
+      out->bits[w] = a->bits[w] & b->bits[w];
+      out->card += __builtin_popcountll(out->bits[w]);
+    }
+    container_normalize(out);
+    return;
+  }
+  if (a->bits) {
+    const RCONTAINER* t = a; a = b; b = t;
+  }
+  // a is an array here
+  out->array = malloc((a->card ? a->card : 1) * sizeof(unsigned short));
+  if (b->bits) {
+    for (size_t i = 0; i < a->card; i++) {
+      unsigned short low = a->array[i];
+      if ((b->bits[low >> 6] >> (low & 63)) & 1)
+        out->array[out->card++] = low;
+    }
+    return;
+  }
+  for (size_t i = 0, j = 0; i < a->card && j < b->card; ) {
+    if (a->array[i] < b->array[j]) i++;
+    else if (a->array[i] > b->array[j]) j++;
+    else { out->array[out->card++] = a->array[i]; i++; j++; }
+  }
+}
+
+static void container_or(const RCONTAINER* a, const RCONTAINER* b, RCONTAINER* out) {
+  out->key = a->key;
+  out->card = 0;
+  if (!a->bits && !b->bits && a->card + b->card <= ROARING_ARRAY_MAX) {
+    out->array = malloc((a->card + b->card + 1) * sizeof(unsigned short));
+    size_t i = 0, j = 0;
+    while (i < a->card || j < b->card) {
+      if (j == b->card || (i < a->card && a->array[i] < b->array[j]))
+        out->array[out->card++] = a->array[i++];
+      else if (i == a->card || b->array[j] < a->array[i])
+        out->array[out->card++] = b->array[j++];
+      else {
+        out->array[out->card++] = a->array[i++];
+        j++;
+      }
+    }
+    return;
+  }
+  out->bits = calloc(ROARING_BITMAP_WORDS, sizeof(unsigned long long));
+  const RCONTAINER* src[2] = { a, b };
+  for (size_t s = 0; s < 2; s++) {
+    if (src[s]->bits) {
+      for (size_t w = 0; w < ROARING_BITMAP_WORDS; w++)
+        out->bits[w] |= src[s]->bits[w];
+    } else {
+      for (size_t i = 0; i < src[s]->card; i++)
+        out->bits[src[s]->array[i] >> 6] |= 1ULL << (src[s]->array[i] & 63);
+    }
+  }
+  for (size_t w = 0; w < ROARING_BITMAP_WORDS; w++)
+    out->card += __builtin_popcountll(out->bits[w]);
+  container_normalize(out);
+}
+
+static void container_copy(const RCONTAINER* c, RCONTAINER* out) {
+  *out = *c;
+  if (c->bits) {
+    out->bits = malloc(ROARING_BITMAP_WORDS * sizeof(unsigned long long));
+    memcpy(out->bits, c->bits, ROARING_BITMAP_WORDS * sizeof(unsigned long long));
+  } else {
+    out->array = malloc((c->card ? c->card : 1) * sizeof(unsigned short));
+    memcpy(out->array, c->array, c->card * sizeof(unsigned short));
+  }
+}
+
+static void roaring_push(ROARING* r, RCONTAINER* c) {
+  if (c->card == 0) {
+    container_free(c);
+    return;
+  }
+  *container_insert(r, r->count, c->key) = *c;
+}
+
+ROARING roaring_and(const ROARING* a, const ROARING* b) {
+  ROARING r = { 0 };
+  for (size_t i = 0, j = 0; i < a->count && j < b->count; ) {
+    if (a->items[i].key < b->items[j].key) i++;
+    else if (a->items[i].key > b->items[j].key) j++;
+    else {
+      RCONTAINER c = { 0 };
+      container_and(&a->items[i++], &b->items[j++], &c);
+      roaring_push(&r, &c);
+    }
+  }
+  return r;
+}
+
+ROARING roaring_or(const ROARING* a, const ROARING* b) {
+  ROARING r = { 0 };
+  size_t i = 0, j = 0;
+  while (i < a->count || j < b->count) {
+    RCONTAINER c = { 0 };
+    if (j == b->count || (i < a->count && a->items[i].key < b->items[j].key))
+      container_copy(&a->items[i++], &c);
+    else if (i == a->count || b->items[j].key < a->items[i].key)
+      container_copy(&b->items[j++], &c);
+    else
+      container_or(&a->items[i++], &b->items[j++], &c);
+    roaring_push(&r, &c);
+  }
+  return r;
+}
+
+// Ascending row ids, *result must be freed
+size_t roaring_to_array(const ROARING* r, size_t** result) {
+  size_t count = roaring_count(r);
+  size_t* ids = malloc((count ? count : 1) * sizeof(size_t));
+  size_t n = 0;
+  for (size_t i = 0; i < r->count; i++) {
+    const RCONTAINER* c = &r->items[i];
+    size_t high = (size_t)c->key << 16;
+    if (c->bits) {
+      for (size_t w = 0; w < ROARING_BITMAP_WORDS; w++) {
+        unsigned long long word = c->bits[w];
+        while (word) {
+          ids[n++] = high | (w * 64 + __builtin_ctzll(word));
+          word &= word - 1;
+        }
+      }
+    } else {
+      for (size_t j = 0; j < c->card; j++)
+        ids[n++] = high | c->array[j];
+    }
+  }
+  *result = ids;
+  return n;
+}
+
+void roaring_free(ROARING* r) {
+  for (size_t i = 0; i < r->count; i++)
+    container_free(&r->items[i]);
+  free(r->items);
+  *r = (ROARING){ 0 };
+}
+
+// [size_t] count, per container: [uint] key, [uint] card, array or bitmap
+size_t roaring_write(const ROARING* r, FILE* file) {
+  size_t ok = fwrite(&r->count, sizeof(size_t), 1, file);
+  for (size_t i = 0; ok && i < r->count; i++) {
+    const RCONTAINER* c = &r->items[i];
+    ok = ok && fwrite(&c->key, sizeof(unsigned int), 1, file);
+    ok = ok && fwrite(&c->card, sizeof(unsigned int), 1, file);
+    if (c->bits)
+      ok = ok && fwrite(c->bits, sizeof(unsigned long long), ROARING_BITMAP_WORDS, file) == ROARING_BITMAP_WORDS;
+    else
+      ok = ok && fwrite(c->array, sizeof(unsigned short), c->card, file) == c->card;
+  }
+  return ok;
+}
+
+size_t roaring_read(ROARING* r, FILE* file) {
+  size_t count;
+  *r = (ROARING){ 0 };
+  if (!fread(&count, sizeof(size_t), 1, file))
+    return 0;
+  for (size_t i = 0; i < count; i++) {
+    unsigned int key, card;
+    if (!fread(&key, sizeof(unsigned int), 1, file) || !fread(&card, sizeof(unsigned int), 1, file))
+      return 0;
+    RCONTAINER* c = container_insert(r, r->count, key);
+    c->card = card;
+    size_t ok;
+    if (card > ROARING_ARRAY_MAX) {
+      c->bits = malloc(ROARING_BITMAP_WORDS * sizeof(unsigned long long));
+      ok = fread(c->bits, sizeof(unsigned long long), ROARING_BITMAP_WORDS, file) == ROARING_BITMAP_WORDS;
+    } else {
+      c->array = malloc((card ? card : 1) * sizeof(unsigned short));
+      ok = fread(c->array, sizeof(unsigned short), card, file) == card;
+    }
+    if (!ok)
+      return 0;
+  }
+  return 1;
+}
@@ -0,0 +1,29 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+
+int main () {
+  TABLE_STATE table_state = { 0 };
+  open_table("data/table.bin", &table_state);
+
+  size_t cols[] = { 0, 3 };
+  PROJECTION proj = { 2, cols };
+  int id = 3;
+  PRED* where = pred_cmp(0, PRED_GE, &id, &table_state);
+  void* tuples;
+  size_t count = find_project(where, &proj, &table_state, &tuples, NULL);
+  pred_free(where);
+
+  printf("Found %ld entries\n", count);
+  size_t size = projection_size(&proj, &table_state);
+  for (size_t i = 0; i < count; i++) {
+    unsigned char* tuple = &((unsigned char*)tuples)[i * size];
+    printf("id: %d, name: `%s'\n", *(int*)projection_value(tuple, &proj, 0, &table_state),
+           (char*)projection_value(tuple, &proj, 1, &table_state));
+  }
+  free(tuples);
+  printf("\n");
+
+  close_table(&table_state);
+  
+  return 0;
+}
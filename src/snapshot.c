@@ -0,0 +1,67 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+
+#define ROWS 1000
+
+typedef struct {
+  TABLE_STATE* ts;
+  long rows, sum;
+} TOTAL;
+
+static int add_balance(void* entry, size_t row, void* cookie) {
+  TOTAL* total = cookie;
+  total->rows++;
+  total->sum += *(int*)&((char*)entry)[total->ts->col_offsets[1]];
+  return 0;
+}
+
+static void print_total(const char* name, TABLE_STATE* ts) {
+  TOTAL total = { ts, 0, 0 };
+  table_select(1, PRED_GE, NULL, ts, add_balance, &total);
+  int id = 7;
+  size_t found = beautiful_find_entry(0, &id, ts, NULL, NULL);
+  printf("%s (commit %ld): %ld accounts, balance %ld, id 7 %s\n", name, snapshot_seq(ts), total.rows, total.sum, found ? "found" : "not found");
+}
+
+int main () {
+  const char* file_name = "data/accounts.bin";
+  size_t col_types[2] = {
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int)) | KEY_FIELD,
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int))
+  };
+  const char* col_names[] = { "id", "balance" };
+  if (access(file_name, F_OK) == 0)
+    delete_table(file_name);
+  create_table(2, 32, col_types, col_names, file_name);
+
+  TABLE_STATE writer = { 0 };
+  open_table(file_name, &writer);
+  mvcc_enable(&writer);
+  for (int i = 0; i < ROWS; i++)
+    create_entry(&writer, 2, i, 100);
+  commit_changes(&writer);
+
+  TABLE_STATE before = { 0 };
+  snapshot_open(file_name, &before);
+  // charges a fee on every account, closes account 7 and opens new ones,
+  // the snapshot taken before keeps its view
+  int from = 100, to = 90;
+  edit_entry(1, &from, &to, &writer);
+  int id = 7;
+  delete_entry(0, &id, &writer);
+  for (int i = ROWS; i < ROWS + 10; i++)
+    create_entry(&writer, 2, i, 10);
+  commit_changes(&writer);
+
+  TABLE_STATE after = { 0 };
+  snapshot_open(file_name, &after);
+  print_total("before", &before);
+  print_total("after", &after);
+  close_table(&before);
+  close_table(&after);
+  close_table(&writer);
+  delete_table(file_name);
+  printf("\n");
+
+  return 0;
+}
@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "file.h"
+
+// Sort record: [size_t] row, then the raw entry
+
+typedef struct {
+  ORDER_BY* query;
+  TABLE_STATE* ts;
+  size_t type, offset;
+  size_t rec_size;
+  int (*func)(void*, size_t, void*);
+  void* cookie;
+  size_t emitted;
+  size_t skipped;
+
+  // top-K heap or the current run
+  unsigned char* slab;
+  unsigned char** recs;
+  size_t count, capacity;
+  size_t topk;
+
+  FILE** runs;
+  size_t nruns;
+} SORT_CTX;
+
+typedef struct {
+  FILE* file;
+  unsigned char* rec;
+} SORT_RUN;
+
+static int rec_cmp(SORT_CTX* ctx, const unsigned char* a, const unsigned char* b) {
+  int c = value_cmp(ctx->type, &a[sizeof(size_t) + ctx->offset], &b[sizeof(size_t) + ctx->offset]);
+  if (ctx->query->desc) c = -c;
+  if (c == 0) {
+    // equal values keep row order
+    size_t l = *(size_t*)a, r = *(size_t*)b;
+    c = (l > r) - (l < r);
+  }
+  return c;
+}
+
+// Stable bottom-up merge sort of record pointers
+static void sort_recs(SORT_CTX* ctx, unsigned char** recs, size_t n) {
+  unsigned char** tmp = malloc((n ? n : 1) * sizeof(unsigned char*));
+  unsigned char** src = recs, ** dst = tmp;
+  for (size_t width = 1; width < n; width *= 2) {
+    for (size_t lo = 0; lo < n; lo += 2 * width) {
+      size_t mid = lo + width < n ? lo + width : n;
+      size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+      size_t i = lo, j = mid, k = lo;
+      while (i < mid && j < hi) dst[k++] = rec_cmp(ctx, src[j], src[i]) < 0 ? src[j++] : src[i++];
+      while (i < mid) dst[k++] = src[i++];
+      while (j < hi)  dst[k++] = src[j++];
+    }
+    unsigned char** t = src; src = dst; dst = t;
+  }
+  if (src != recs)
+    memcpy(recs, src, n * sizeof(unsigned char*));
+  free(tmp);
+}
+
+// non-zero when no more rows are wanted
+static int emit(SORT_CTX* ctx, unsigned char* rec) {
+  if (ctx->skipped < ctx->query->offset) {
+    ctx->skipped++;
+    return 0;
+  }
+  int stop = ctx->func(&rec[sizeof(size_t)], *(size_t*)rec, ctx->cookie);
+  ctx->emitted++;
+  return stop || (ctx->query->limit && ctx->emitted >= ctx->query->limit);
+}
+
+// Max-heap on rec_cmp, the root is the worst of the best K records
+static void heap_sift_down(SORT_CTX* ctx, size_t i) {
+  for (;;) {
+    size_t l = 2 * i + 1, r = l + 1, m = i;
+    if (l < ctx->count && rec_cmp(ctx, ctx->recs[l], ctx->recs[m]) > 0) m = l;
+    if (r < ctx->count && rec_cmp(ctx, ctx->recs[r], ctx->recs[m]) > 0) m = r;
+    if (m == i) return;
+    unsigned char* t = ctx->recs[i]; ctx->recs[i] = ctx->recs[m]; ctx->recs[m] = t;
+    i = m;
+  }
+}
+
+static void heap_push(SORT_CTX* ctx, const unsigned char* rec) {
+  if (ctx->count == ctx->capacity) {
+    if (rec_cmp(ctx, rec, ctx->recs[0]) >= 0)
+      return;
+    memcpy(ctx->recs[0], rec, ctx->rec_size);
+    heap_sift_down(ctx, 0);
+    return;
+  }
+  size_t i = ctx->count++;
+  memcpy(ctx->recs[i], rec, ctx->rec_size);
+  while (i > 0) {
+    size_t p = (i - 1) / 2;
+    if (rec_cmp(ctx, ctx->recs[i], ctx->recs[p]) <= 0) break;
+    unsigned char* t = ctx->recs[i]; ctx->recs[i] = ctx->recs[p]; ctx->recs[p] = t;
+    i = p;
+  }
+}
+
+static void run_spill(SORT_CTX* ctx) {
+  sort_recs(ctx, ctx->recs, ctx->count);
+  FILE* file = tmpfile();
+  for (size_t i = 0; i < ctx->count; i++)
+    fwrite(ctx->recs[i], ctx->rec_size, 1, file);
+  ctx->runs = realloc(ctx->runs, (ctx->nruns + 1) * sizeof(FILE*));
+  ctx->runs[ctx->nruns++] = file;
+  ctx->count = 0;
+}
+
+static int sort_row(void* entry, size_t row, void* cookie) {
+  SORT_CTX* ctx = cookie;
+  unsigned char* rec = ctx->recs[ctx->count];
+  if (ctx->topk) {
+    // scratch record past the heap
+    rec = &ctx->slab[ctx->capacity * ctx->rec_size];
+    memcpy(rec, &row, sizeof(size_t));
+    memcpy(&rec[sizeof(size_t)], entry, ctx->ts->entry_raw_size);
+    heap_push(ctx, rec);
+    return 0;
+  }
+  memcpy(rec, &row, sizeof(size_t));
+  memcpy(&rec[sizeof(size_t)], entry, ctx->ts->entry_raw_size);
+  if (++ctx->count == ctx->capacity)
+    run_spill(ctx);
+  return 0;
+}
+
+static void run_heap_down(SORT_CTX* ctx, SORT_RUN* runs, size_t* heap, size_t n, size_t i) {
+  for (;;) {
+    size_t l = 2 * i + 1, r = l + 1, m = i;
+    if (l < n && rec_cmp(ctx, runs[heap[l]].rec, runs[heap[m]].rec) < 0) m = l;
+    if (r < n && rec_cmp(ctx, runs[heap[r]].rec, runs[heap[m]].rec) < 0) m = r;
+    if (m == i) return;
+    size_t t = heap[i]; heap[i] = heap[m]; heap[m] = t;
+    i = m;
+  }
+}
+
+// Merges files into out, or emits the records if out is NULL.
+// Closes the merged files. Returns non-zero if emitting was stopped
+static int merge_runs(SORT_CTX* ctx, FILE** files, size_t n, FILE* out) {
+  SORT_RUN* runs = malloc(n * sizeof(SORT_RUN));
+  size_t* heap = malloc(n * sizeof(size_t));
+  size_t nheap = 0;
+  for (size_t i = 0; i < n; i++) {
+    runs[i].file = files[i];
+    runs[i].rec = malloc(ctx->rec_size);
+    rewind(files[i]);
+    if (fread(runs[i].rec, ctx->rec_size, 1, files[i]) == 1)
+      heap[nheap++] = i;
+  }
+  for (size_t i = nheap; i-- > 0; )
+    run_heap_down(ctx, runs, heap, nheap, i);
+  int stop = 0;
+  while (nheap && !stop) {
+    SORT_RUN* run = &runs[heap[0]];
+    if (out)
+      fwrite(run->rec, ctx->rec_size, 1, out);
+    else
+      stop = emit(ctx, run->rec);
+    if (fread(run->rec, ctx->rec_size, 1, run->file) != 1)
+      heap[0] = heap[--nheap];
+    run_heap_down(ctx, runs, heap, nheap, 0);
+  }
+  for (size_t i = 0; i < n; i++) {
+    fclose(runs[i].file);
+    free(runs[i].rec);
+  }
+  free(runs);
+  free(heap);
+  return stop;
+}
+
+static void sort_external(SORT_CTX* ctx) {
+  if (ctx->nruns == 0) {
+    sort_recs(ctx, ctx->recs, ctx->count);
+    for (size_t i = 0; i < ctx->count && !emit(ctx, ctx->recs[i]); i++);
+    return;
+  }
+  if (ctx->count)
+    run_spill(ctx);
+  // runs are merged into fewer, longer runs until one pass is enough
+  while (ctx->nruns > SORT_MERGE_FANIN) {
+    size_t nruns = 0;
+    for (size_t first = 0; first < ctx->nruns; first += SORT_MERGE_FANIN) {
+      size_t n = ctx->nruns - first < SORT_MERGE_FANIN ? ctx->nruns - first : SORT_MERGE_FANIN;
+      FILE* out = tmpfile();
+      merge_runs(ctx, &ctx->runs[first], n, out);
+      ctx->runs[nruns++] = out;
+    }
+    ctx->nruns = nruns;
+  }
+  merge_runs(ctx, ctx->runs, ctx->nruns, NULL);
+  ctx->nruns = 0;
+}
+
+// Rows come out of the tree in order, so nothing has to be sorted
+static void sort_from_index(SORT_CTX* ctx) {
+  TABLE_STATE* ts = ctx->ts;
+  ORDER_BY* query = ctx->query;
+  rbtree* rbt = ts->rb_trees[ts->key_col_relpos[query->col]];
+  size_t node_ptr = query->desc ? rb_max(rbt) : rb_min(rbt);
+  if (query->pred_value == NULL && query->offset) {
+    // subtree sizes lead straight to the first row after the offset
+    node_ptr = key_nth(query->col, query->offset, query->desc, ts);
+    if (node_ptr == 0) node_ptr = RB_NIL_PTR;
+    ctx->skipped = query->offset;
+  }
+  unsigned char* rec = malloc(ctx->rec_size);
+  int stop = 0;
+  while (!stop && node_ptr != RB_NIL_PTR) {
+    read_rows(node_ptr, 1, &rec[sizeof(size_t)], ts);
+    memcpy(rec, &node_ptr, sizeof(size_t));
+    unsigned char* entry = &rec[sizeof(size_t)];
+    if (query->pred_value == NULL ||
+        value_cmp(ts->col_types[query->pred_col], &entry[ts->col_offsets[query->pred_col]], query->pred_value) == 0)
+      stop = emit(ctx, rec);
+    node_ptr = query->desc ? rb_predecessor(rbt, node_ptr) : rb_successor(rbt, node_ptr);
+  }
+  free(rec);
+}
+
+static size_t sort_table(ORDER_BY* query, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie) {
+  assert(query->col < ts->ncols);
+  SORT_CTX ctx = { 0 };
+  ctx.query = query;
+  ctx.ts = ts;
+  ctx.type = ts->col_types[query->col];
+  ctx.offset = ts->col_offsets[query->col];
+  ctx.rec_size = (sizeof(size_t) + ts->entry_raw_size + 7) & ~(size_t)7;
+  ctx.func = func;
+  ctx.cookie = cookie;
+
+  // a selective indexed predicate is cheaper to fetch and sort than walking the whole tree
+  size_t pred_indexed = query->pred_value &&
+    (IS_KEY(ts->col_types[query->pred_col]) || bitmap_index_get(query->pred_col, ts));
+  if (key_tree(query->col, ts) && !pred_indexed) {
+    sort_from_index(&ctx);
+    return ctx.emitted;
+  }
+
+  size_t memory_limit = query->memory_limit ? query->memory_limit : SORT_MEMORY_LIMIT;
+  ctx.capacity = memory_limit / ctx.rec_size;
+  if (ctx.capacity < 2) ctx.capacity = 2;
+  ctx.topk = query->limit && query->offset + query->limit <= ctx.capacity;
+  if (ctx.topk) ctx.capacity = query->offset + query->limit;
+  ctx.slab = malloc((ctx.capacity + 1) * ctx.rec_size);
+  ctx.recs = malloc(ctx.capacity * sizeof(unsigned char*));
+  for (size_t i = 0; i < ctx.capacity; i++)
+    ctx.recs[i] = &ctx.slab[i * ctx.rec_size];
+
+  char* pred = NULL;
+  if (query->pred_value) {
+    pred = get_by_tindex(0, ts);
+    memcpy(&pred[ts->col_offsets[query->pred_col]], query->pred_value, TYPE_SIZE(ts->col_types[query->pred_col]));
+  }
+  table_scan(query->pred_col, pred, ts, sort_row, &ctx);
+
+  if (ctx.topk) {
+    sort_recs(&ctx, ctx.recs, ctx.count);
+    for (size_t i = 0; i < ctx.count && !emit(&ctx, ctx.recs[i]); i++);
+  } else {
+    sort_external(&ctx);
+  }
+
+  if (pred) free(pred);
+  free(ctx.runs);
+  free(ctx.recs);
+  free(ctx.slab);
+  return ctx.emitted;
+}
+
+// Calls func(entry, row, cookie) for the rows ordered by query->col, at
+// most query->limit of them after skipping query->offset. Rows with equal
+// values keep row order. Stops when func returns non-zero. Returns number
+// of rows passed to func
+size_t order_by(ORDER_BY* query, TABLE_STATE* ts, int (*func)(void*, size_t, void*), void* cookie) {
+  size_t latched = table_latch(ts, TABLE_LOCK_READ);
+  size_t count = sort_table(query, ts, func, cookie);
+  table_unlatch(ts, latched);
+  return count;
+}
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "file.h"
+
+// Sidecar view
+// [0]   "STAT"
+// [4]   [size_t] generation of the commit on the moment of saving
+// [..]  [size_t] ncols
+// [..]  [size_t] row count of the table on the moment of saving
+// [..]  [size_t] nrows
+// [..]  [size_t] changes
+// ...   ncols * COL_STATS
+
+#define STATS_MAGIC "STAT"
+
+static size_t stats_hash(size_t type, const unsigned char* value) {
+  size_t size = TYPE_SIZE(type);
+  size_t key;
+  if (TYPE_NUMBER(type) == TABLE_TYPE_VARCHAR) {
+    size = strlen((const char*)value);
+  } else if (TYPE_NUMBER(type) == TABLE_TYPE_DATATIME) {
+    key = datatime_key(value);
+    value = (const unsigned char*)&key;
+    size = sizeof(size_t);
+  }
+  size_t h = 14695981039346656037UL;
+  for (size_t i = 0; i < size; i++) {
+    h ^= value[i];
+    h *= 1099511628211UL;
+  }
+  // FNV leaves the high bits poorly mixed, HyperLogLog needs all of them
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdUL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53UL;
+  h ^= h >> 33;
+  return h;
+}
+
+static void hll_add(COL_STATS* cs, size_t type, const unsigned char* value) {
+  size_t h = stats_hash(type, value);
+  size_t reg = h >> (64 - STATS_HLL_BITS);
+  size_t rest = (h << STATS_HLL_BITS) | ((size_t)1 << (STATS_HLL_BITS - 1));
+  unsigned char rank = __builtin_clzl(rest) + 1;
+  if (rank > cs->hll[reg])
+    cs->hll[reg] = rank;
+}
+
+static double hll_estimate(const COL_STATS* cs) {
+  double m = STATS_HLL_REGISTERS, sum = 0;
+  size_t zeros = 0;
+  for (size_t i = 0; i < STATS_HLL_REGISTERS; i++) {
+    sum += ldexp(1.0, -cs->hll[i]);
+    zeros += cs->hll[i] == 0;
+  }
+  double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+  // linear counting is more precise while many registers are empty
+  if (estimate <= 2.5 * m && zeros)
+    estimate = m * log(m / zeros);
+  return estimate;
+}
+
+// Position of a value on the number line, histograms are built on it
+static double stats_number(size_t type, const unsigned char* value) {
+  if (TYPE_NUMBER(type) == TABLE_TYPE_INT) return *(int*)value;
+  if (TYPE_NUMBER(type) == TABLE_TYPE_FLOAT) return *(float*)value;
+  if (TYPE_NUMBER(type) == TABLE_TYPE_DATATIME) return (double)datatime_key(value);
+  return 0;
+}
+
+static void col_widen(COL_STATS* cs, size_t type, const unsigned char* value) {
+  hll_add(cs, type, value);
+  if (!ZMAP_TRACKED(type))
+    return;
+  size_t size = TYPE_SIZE(type);
+  if (!cs->init) {
+    memcpy(cs->min, value, size);
+    memcpy(cs->max, value, size);
+    cs->init = 1;
+    return;
+  }
+  if (value_cmp(type, value, cs->min) < 0) memcpy(cs->min, value, size);
+  if (value_cmp(type, value, cs->max) > 0) memcpy(cs->max, value, size);
+}
+
+static TABLE_STATS* stats_create(TABLE_STATE* ts) {
+  TABLE_STATS* st = malloc(sizeof(TABLE_STATS));
+  memset(st, 0, sizeof(TABLE_STATS));
+  st->ncols = ts->ncols;
+  st->cols = calloc(ts->ncols, sizeof(COL_STATS));
+  return st;
+}
+
+static int cmp_double(const void* a, const void* b) {
+  double l = *(double*)a, r = *(double*)b;
+  return l == r ? 0 : (l < r ? -1 : 1);
+}
+
+// Full pass over the table, histograms come from a reservoir sample
+void stats_rebuild(TABLE_STATE* ts) {
+  TABLE_STATS* st = ts->stats;
+  memset(st->cols, 0, st->ncols * sizeof(COL_STATS));
+  st->nrows = 0;
+  double* sample = malloc(STATS_SAMPLE * ts->ncols * sizeof(double));
+  size_t nsample = 0;
+  size_t seed = 0x2545F4914F6CDD1DUL;
+  size_t len = row_count(ts);
+  unsigned char* block = malloc(ZMAP_BLOCK_ROWS * ts->entry_raw_size);
+  for (size_t first = 1, last; first < len; first = last) {
+    last = first + ZMAP_BLOCK_ROWS;
+    if (last > len) last = len;
+    read_rows(first, last - first, block, ts);
+    for (size_t i = first; i < last; i++) {
+      unsigned char* entry = &block[(i - first) * ts->entry_raw_size];
+      if (ENTRY_DELETED(entry))
+        continue;
+      st->nrows++;
+      size_t slot = nsample;
+      if (nsample == STATS_SAMPLE) {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        slot = seed % st->nrows;
+      } else {
+        nsample++;
+      }
+      for (size_t c = 0; c < ts->ncols; c++) {
+        col_widen(&st->cols[c], ts->col_types[c], &entry[ts->col_offsets[c]]);
+        if (slot < STATS_SAMPLE)
+          sample[c * STATS_SAMPLE + slot] = stats_number(ts->col_types[c], &entry[ts->col_offsets[c]]);
+      }
+    }
+  }
+  free(block);
+  for (size_t c = 0; nsample && c < ts->ncols; c++) {
+    if (!ZMAP_TRACKED(ts->col_types[c]))
+      continue;
+    double* values = &sample[c * STATS_SAMPLE];
+    qsort(values, nsample, sizeof(double), cmp_double);
+    COL_STATS* cs = &st->cols[c];
+    // small tables keep every value
+    if (nsample <= STATS_BUCKETS) {
+      cs->nbounds = nsample;
+      memcpy(cs->bounds, values, nsample * sizeof(double));
+      continue;
+    }
+    cs->nbounds = STATS_BUCKETS + 1;
+    for (size_t b = 0; b <= STATS_BUCKETS; b++)
+      cs->bounds[b] = values[b * (nsample - 1) / STATS_BUCKETS];
+  }
+  free(sample);
+  st->changes = 0;
+  st->dirty = 1;
+}
+
+static size_t stats_load(TABLE_STATE* ts) {
+  char* name = sidecar_name(ts->file_name, "stats");
+  FILE* file = fopen(name, "rb");
+  free(name);
+  if (file == NULL)
+    return 1;
+  TABLE_STATS* st = ts->stats;
+  char magic[4];
+  size_t gen, ncols, nrows;
+  size_t ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, STATS_MAGIC, 4) == 0;
+  ok = ok && fread(&gen, sizeof(size_t), 1, file);
+  ok = ok && fread(&ncols, sizeof(size_t), 1, file);
+  ok = ok && fread(&nrows, sizeof(size_t), 1, file);
+  // table was changed without the statistics
+  ok = ok && gen == table_generation(ts) && ncols == ts->ncols && nrows == row_count(ts);
+  ok = ok && fread(&st->nrows, sizeof(size_t), 1, file);
+  ok = ok && fread(&st->changes, sizeof(size_t), 1, file);
+  ok = ok && fread(st->cols, sizeof(COL_STATS), ncols, file) == ncols;
+  fclose(file);
+  return !ok;
+}
+
+void stats_open(TABLE_STATE* ts) {
+  ts->stats = stats_create(ts);
+  if (stats_load(ts) != 0)
+    stats_rebuild(ts);
+}
+
+void stats_save(TABLE_STATE* ts) {
+  TABLE_STATS* st = ts->stats;
+  if (st == NULL)
+    return;
+  if (!st->dirty) {
+    sidecar_restamp(ts, "stats");
+    return;
+  }
+  if (st->changes * STATS_REBUILD_RATIO >= st->nrows)
+    stats_rebuild(ts);
+  char* name = sidecar_name(ts->file_name, "stats");
+  FILE* file = fopen(name, "wb");
+  free(name);
+  if (file == NULL)
+    return;
+  size_t gen = table_generation(ts), nrows = row_count(ts);
+  fwrite(STATS_MAGIC, 1, 4, file);
+  fwrite(&gen, sizeof(size_t), 1, file);
+  fwrite(&st->ncols, sizeof(size_t), 1, file);
+  fwrite(&nrows, sizeof(size_t), 1, file);
+  fwrite(&st->nrows, sizeof(size_t), 1, file);
+  fwrite(&st->changes, sizeof(size_t), 1, file);
+  fwrite(st->cols, sizeof(COL_STATS), st->ncols, file);
+  fclose(file);
+  st->dirty = 0;
+}
+
+void stats_close(TABLE_STATE* ts) {
+  TABLE_STATS* st = ts->stats;
+  if (st == NULL)
+    return;
+  free(st->cols);
+  free(st);
+  ts->stats = NULL;
+}
+
+void stats_row_written(TABLE_STATE* ts, size_t row, const void* entry) {
+  TABLE_STATS* st = ts->stats;
+  if (st == NULL)
+    return;
+  for (size_t c = 0; c < ts->ncols; c++)
+    col_widen(&st->cols[c], ts->col_types[c], &((unsigned char*)entry)[ts->col_offsets[c]]);
+  st->nrows++;
+  st->changes++;
+  st->dirty = 1;
+}
+
+void stats_value_written(TABLE_STATE* ts, size_t row, size_t col, const void* entry) {
+  TABLE_STATS* st = ts->stats;
+  if (st == NULL)
+    return;
+  col_widen(&st->cols[col], ts->col_types[col], &((unsigned char*)entry)[ts->col_offsets[col]]);
+  st->changes++;
+  st->dirty = 1;
+}
+
+// distinct counts and min/max stay as they are until the next rebuild
+void stats_row_deleted(TABLE_STATE* ts, size_t row) {
+  TABLE_STATS* st = ts->stats;
+  if (st == NULL)
+    return;
+  if (st->nrows)
+    st->nrows--;
+  st->changes++;
+  st->dirty = 1;
+}
+
+size_t stats_rows(TABLE_STATE* ts) {
+  return ts->stats ? ts->stats->nrows : row_count(ts);
+}
+
+size_t stats_distinct(size_t col, TABLE_STATE* ts) {
+  if (ts->stats == NULL || ts->stats->nrows == 0)
+    return 0;
+  if (IS_KEY(ts->col_types[col]))
+    return ts->stats->nrows;
+  size_t distinct = (size_t)(hll_estimate(&ts->stats->cols[col]) + 0.5);
+  if (distinct > ts->stats->nrows) distinct = ts->stats->nrows;
+  return distinct ? distinct : 1;
+}
+
+// Fraction of values below x by the histogram
+static double histogram_below(const COL_STATS* cs, double x, size_t or_equal) {
+  const double* b = cs->bounds;
+  if (cs->nbounds <= STATS_BUCKETS) {
+    size_t count = 0;
+    for (size_t i = 0; i < cs->nbounds; i++)
+      count += b[i] < x || (or_equal && b[i] == x);
+    return (double)count / cs->nbounds;
+  }
+  if (x <= b[0]) return 0;
+  if (x > b[STATS_BUCKETS]) return 1;
+  for (size_t i = 0; i < STATS_BUCKETS; i++) {
+    if (x <= b[i + 1]) {
+      double part = b[i + 1] > b[i] ? (x - b[i]) / (b[i + 1] - b[i]) : 0;
+      return (i + part) / STATS_BUCKETS;
+    }
+  }
+  return 1;
+}
+
+// Estimated fraction of rows whose col satisfies op with value
+double stats_selectivity(size_t col, size_t op, const void* value, TABLE_STATE* ts) {
+  TABLE_STATS* st = ts->stats;
+  if (value == NULL)
+    return 1;
+  if (st == NULL || st->nrows == 0)
+    return op == PRED_EQ ? 0.1 : (op == PRED_NE ? 0.9 : 1.0 / 3);
+  COL_STATS* cs = &st->cols[col];
+  size_t type = ts->col_types[col];
+  double eq = 1.0 / stats_distinct(col, ts);
+  if (cs->init && (value_cmp(type, value, cs->min) < 0 || value_cmp(type, value, cs->max) > 0))
+    eq = 0;
+  if (op == PRED_EQ) return eq;
+  if (op == PRED_NE) return 1 - eq;
+  double below = 1.0 / 3, below_eq = 1.0 / 3;
+  if (cs->nbounds > STATS_BUCKETS) {
+    below = histogram_below(cs, stats_number(type, value), 0);
+    below_eq = below + eq > 1 ? 1 : below + eq;
+  } else if (cs->nbounds) {
+    below = histogram_below(cs, stats_number(type, value), 0);
+    below_eq = histogram_below(cs, stats_number(type, value), 1);
+  }
+  if (op == PRED_LT) return below;
+  if (op == PRED_LE) return below_eq;
+  if (op == PRED_GT) return 1 - below_eq;
+  if (op == PRED_GE) return 1 - below;
+  return 1;
+}
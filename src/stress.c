@@ -0,0 +1,139 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+#include <stdlib.h>
+#include <sys/wait.h>
+
+// Writers insert and delete keys of their own range and all bump one
+// shared counter row, readers check the key tree while they run
+#define WRITERS 4
+#define READERS 2
+#define ROUNDS 25
+#define PER_ROUND 8
+#define RANGE 100000
+#define COUNTER -1
+
+typedef struct {
+  TABLE_STATE* ts;
+  long rows;
+  int prev, unordered;
+  size_t count;
+  int balanced;
+} CHECK;
+
+static int check_row(void* entry, size_t row, void* cookie) {
+  CHECK* check = cookie;
+  int id = *(int*)&((char*)entry)[check->ts->col_offsets[0]];
+  // reads nested in the scan see the same commit as the scan
+  if (check->rows == 0) {
+    check->count = rb_count(check->ts->rb_trees[0]);
+    check->balanced = rb_check_black_height(check->ts->rb_trees[0]);
+  }
+  if (check->rows && id <= check->prev)
+    check->unordered++;
+  check->prev = id;
+  check->rows++;
+  return 0;
+}
+
+// 0 if the key tree is ordered, balanced and counts all of its rows. The
+// scan shares the commit byte, no commit of another process comes between
+// its reads
+static int check_table(TABLE_STATE* ts) {
+  CHECK check = { ts, 0, 0, 0, 0, 1 };
+  ORDER_BY query = { 0 };
+  order_by(&query, ts, check_row, &check);
+  return check.unordered || (size_t)check.rows != check.count || !check.balanced;
+}
+
+static int counter_value(TABLE_STATE* ts) {
+  int id = COUNTER;
+  void* entries;
+  if (!beautiful_find_entry(0, &id, ts, &entries, NULL))
+    return -1;
+  int value = *(int*)&((char*)((void**)entries)[0])[ts->col_offsets[1]];
+  free(((void**)entries)[0]);
+  free(entries);
+  return value;
+}
+
+static int writer(const char* file_name, int w) {
+  TABLE_STATE ts = { 0 };
+  open_table(file_name, &ts);
+  int lo = w * RANGE, hi = lo + RANGE - 1, counter = COUNTER;
+  for (int r = 0; r < ROUNDS; r++) {
+    // the own range never waits on the other writers, the counter does
+    key_range_lock(&ts, 0, &lo, &hi);
+    key_range_lock(&ts, 0, &counter, NULL);
+    int value = counter_value(&ts);
+    for (int i = 0; i < PER_ROUND; i++)
+      create_entry(&ts, 2, lo + r * PER_ROUND + i, w);
+    int id = lo + r * PER_ROUND;
+    delete_entry(0, &id, &ts);
+    value++;
+    PRED* where = pred_cmp(0, PRED_EQ, &counter, &ts);
+    edit_where(where, 1, &value, &ts);
+    pred_free(where);
+    commit_changes(&ts);
+  }
+  close_table(&ts);
+  return 0;
+}
+
+static int reader(const char* file_name) {
+  TABLE_STATE ts = { 0 };
+  open_table(file_name, &ts);
+  int bad = 0;
+  for (int i = 0; i < ROUNDS * 2; i++)
+    bad += check_table(&ts);
+  close_table(&ts);
+  return bad != 0;
+}
+
+int main () {
+  const char* file_name = "data/stress.bin";
+  size_t col_types[2] = {
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int)) | KEY_FIELD,
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int))
+  };
+  const char* col_names[] = { "id", "n" };
+  if (access(file_name, F_OK) == 0)
+    delete_table(file_name);
+  create_table(2, 32, col_types, col_names, file_name);
+  TABLE_STATE ts = { 0 };
+  open_table(file_name, &ts);
+  create_entry(&ts, 2, COUNTER, 0);
+  commit_changes(&ts);
+  close_table(&ts);
+
+  pid_t pids[WRITERS + READERS];
+  for (int p = 0; p < WRITERS + READERS; p++) {
+    pids[p] = fork();
+    if (pids[p] == 0)
+      _exit(p < WRITERS ? writer(file_name, p) : reader(file_name));
+  }
+  int failed = 0;
+  for (int p = 0; p < WRITERS + READERS; p++) {
+    int status;
+    waitpid(pids[p], &status, 0);
+    failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  }
+
+  ts = (TABLE_STATE){ 0 };
+  open_table(file_name, &ts);
+  size_t missing = 0;
+  for (int w = 0; w < WRITERS; w++) {
+    for (int i = 0; i < ROUNDS * PER_ROUND; i++) {
+      int id = w * RANGE + i;
+      size_t found = beautiful_find_entry(0, &id, &ts, NULL, NULL) != 0;
+      missing += found != (i % PER_ROUND != 0);
+    }
+  }
+  printf("%d writers, %d readers: %ld rows, %ld misplaced, counter %d of %d, %s\n",
+    WRITERS, READERS, rb_count(ts.rb_trees[0]), missing, counter_value(&ts), WRITERS * ROUNDS,
+    failed || check_table(&ts) ? "tree broken" : "tree ok");
+  close_table(&ts);
+  delete_table(file_name);
+  printf("\n");
+
+  return 0;
+}
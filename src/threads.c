@@ -0,0 +1,104 @@
+#define TABLE_FILE_H_IMPLEMENTATION
+#include "file.h"
+#include <pthread.h>
+
+// Threads of one process share an open table: readers look rows up by key
+// while writers stage and commit inserts and deletes of keys of their own
+#define ROWS 10000
+#define READERS 8
+#define LOOKUPS 4000
+#define WRITERS 2
+#define ROUNDS 20
+#define PER_ROUND 16
+
+typedef struct {
+  TABLE_STATE* ts;
+  size_t id;
+  unsigned int seed;
+  size_t wrong;
+  pthread_t thread;
+} WORKER;
+
+static void* reader(void* arg) {
+  WORKER* w = arg;
+  TABLE_STATE* ts = w->ts;
+  int below = ROWS;
+  for (int i = 0; i < LOOKUPS; i++) {
+    int id = rand_r(&w->seed) % ROWS;
+    void* entries;
+    if (!beautiful_find_entry(0, &id, ts, &entries, NULL)) {
+      w->wrong++;
+      continue;
+    }
+    char* entry = ((void**)entries)[0];
+    w->wrong += *(int*)&entry[ts->col_offsets[2]] != id * 10;
+    free(entry);
+    free(entries);
+    // the keys the writers add and remove are all above ROWS
+    if (i % 100 == 0)
+      w->wrong += key_count(0, PRED_LT, &below, ts) != ROWS;
+  }
+  return NULL;
+}
+
+static void* writer(void* arg) {
+  WORKER* w = arg;
+  TABLE_STATE* ts = w->ts;
+  int base = ROWS + w->id * ROUNDS * PER_ROUND;
+  for (int r = 0; r < ROUNDS; r++) {
+    for (int i = 0; i < PER_ROUND; i++) {
+      int id = base + r * PER_ROUND + i;
+      create_entry(ts, 3, id, "new", id * 10);
+    }
+    // the rows of the last round stay
+    for (int i = 0; r > 0 && i < PER_ROUND; i++) {
+      int id = base + (r - 1) * PER_ROUND + i;
+      delete_entry(0, &id, ts);
+    }
+    commit_changes(ts);
+  }
+  return NULL;
+}
+
+int main () {
+  const char* file_name = "data/threads.bin";
+  size_t col_types[3] = {
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int)) | KEY_FIELD,
+    MAKE_TYPE(TABLE_TYPE_VARCHAR, 16),
+    MAKE_TYPE(TABLE_TYPE_INT, sizeof(int))
+  };
+  const char* col_names[] = { "id", "name", "balance" };
+  if (access(file_name, F_OK) == 0)
+    delete_table(file_name);
+  create_table(3, 32, col_types, col_names, file_name);
+
+  TABLE_STATE ts = { 0 };
+  open_table(file_name, &ts);
+  for (int i = 0; i < ROWS; i++)
+    create_entry(&ts, 3, (int)((i * 7919L) % ROWS), "old", (int)((i * 7919L) % ROWS) * 10);
+  commit_changes(&ts);
+
+  WORKER workers[READERS + WRITERS] = { 0 };
+  for (size_t t = 0; t < READERS + WRITERS; t++) {
+    workers[t].ts = &ts;
+    workers[t].id = t < READERS ? t : t - READERS;
+    workers[t].seed = t + 1;
+    pthread_create(&workers[t].thread, NULL, t < READERS ? reader : writer, &workers[t]);
+  }
+  size_t wrong = 0;
+  for (size_t t = 0; t < READERS + WRITERS; t++) {
+    pthread_join(workers[t].thread, NULL);
+    wrong += workers[t].wrong;
+  }
+
+  rbtree* rbt = ts.rb_trees[0];
+  size_t rows = rb_count(rbt);
+  printf("%d readers, %d writers: %d lookups, %ld wrong, %ld rows of %d, %s\n",
+    READERS, WRITERS, READERS * LOOKUPS, wrong, rows, ROWS + WRITERS * PER_ROUND,
+    rb_check_black_height(rbt) ? "tree ok" : "tree broken");
+  close_table(&ts);
+  delete_table(file_name);
+  printf("\n");
+
+  return 0;
+}
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "file.h"
+
+// Sidecar view
+// [0]   "ZMAP"
+// [4]   [size_t] generation of the commit on the moment of saving
+// [..]  [size_t] block_rows
+// [..]  [size_t] ncols
+// [..]  [size_t] row count of the table on the moment of saving
+// [..]  [size_t] nblocks
+// ...   per block: [size_t] live, [size_t] deleted, ncols * ZONE
+
+#define ZMAP_MAGIC "ZMAP"
+
+static ZONE* zone_at(ZONE_MAP* zm, size_t block, size_t col) {
+  return &zm->zones[block * zm->ncols + col];
+}
+
+static void zmap_reserve(ZONE_MAP* zm, size_t nblocks) {
+  if (nblocks <= zm->nblocks)
+    return;
+  if (nblocks > zm->capacity) {
+    size_t capacity = zm->capacity ? zm->capacity : 16;
+    while (capacity < nblocks) capacity *= 2;
+    zm->live    = realloc(zm->live, capacity * sizeof(size_t));
+    zm->deleted = realloc(zm->deleted, capacity * sizeof(size_t));
+    zm->zones   = realloc(zm->zones, capacity * zm->ncols * sizeof(ZONE));
+    zm->capacity = capacity;
+  }
+  memset(&zm->live[zm->nblocks], 0, (nblocks - zm->nblocks) * sizeof(size_t));
+  memset(&zm->deleted[zm->nblocks], 0, (nblocks - zm->nblocks) * sizeof(size_t));
+  memset(&zm->zones[zm->nblocks * zm->ncols], 0, (nblocks - zm->nblocks) * zm->ncols * sizeof(ZONE));
+  zm->nblocks = nblocks;
+}
+
+static void zone_widen(ZONE* z, size_t type, const unsigned char* value) {
+  size_t size = TYPE_SIZE(type);
+  if (!z->init) {
+    memcpy(z->min, value, size);
+    memcpy(z->max, value, size);
+    z->init = 1;
+    return;
+  }
+  if (value_cmp(type, value, z->min) < 0) memcpy(z->min, value, size);
+  if (value_cmp(type, value, z->max) > 0) memcpy(z->max, value, size);
+}
+
+static ZONE_MAP* zmap_create(TABLE_STATE* ts) {
+  ZONE_MAP* zm = malloc(sizeof(ZONE_MAP));
+  memset(zm, 0, sizeof(ZONE_MAP));
+  zm->block_rows = ZMAP_BLOCK_ROWS;
+  zm->ncols = ts->ncols;
+  return zm;
+}
+
+static size_t zmap_load(TABLE_STATE* ts) {
+  char* name = sidecar_name(ts->file_name, "zmap");
+  FILE* file = fopen(name, "rb");
+  free(name);
+  if (file == NULL)
+    return 1;
+  char magic[4];
+  size_t gen, block_rows, ncols, nrows, nblocks;
+  size_t ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, ZMAP_MAGIC, 4) == 0;
+  ok = ok && fread(&gen, sizeof(size_t), 1, file);
+  ok = ok && fread(&block_rows, sizeof(size_t), 1, file);
+  ok = ok && fread(&ncols, sizeof(size_t), 1, file);
+  ok = ok && fread(&nrows, sizeof(size_t), 1, file);
+  ok = ok && fread(&nblocks, sizeof(size_t), 1, file);
+  // written by another version or table was changed without the zone map
+  ok = ok && gen == table_generation(ts) && block_rows == ZMAP_BLOCK_ROWS && ncols == ts->ncols && nrows == row_count(ts);
+  if (ok) {
+    ZONE_MAP* zm = ts->zone_map;
+    zmap_reserve(zm, nblocks);
+    for (size_t b = 0; ok && b < nblocks; b++) {
+      ok = ok && fread(&zm->live[b], sizeof(size_t), 1, file);
+      ok = ok && fread(&zm->deleted[b], sizeof(size_t), 1, file);
+      ok = ok && fread(zone_at(zm, b, 0), sizeof(ZONE), ncols, file) == ncols;
+    }
+  }
+  fclose(file);
+  return !ok;
+}
+
+void zmap_open(TABLE_STATE* ts) {
+  ts->zone_map = zmap_create(ts);
+  if (zmap_load(ts) != 0)
+    zmap_rebuild(ts);
+}
+
+void zmap_rebuild(TABLE_STATE* ts) {
+  ZONE_MAP* zm = ts->zone_map;
+  zm->nblocks = 0;
+  size_t len = row_count(ts);
+  zmap_reserve(zm, (len + zm->block_rows - 1) / zm->block_rows);
+  unsigned char* block = malloc(zm->block_rows * ts->entry_raw_size);
+  for (size_t first = 1, last; first < len; first = last) {
+    size_t b = first / zm->block_rows;
+    last = (b + 1) * zm->block_rows;
+    if (last > len) last = len;
+    read_rows(first, last - first, block, ts);
+    for (size_t i = first; i < last; i++) {
+      unsigned char* entry = &block[(i - first) * ts->entry_raw_size];
+      if (ENTRY_DELETED(entry)) {
+        zm->deleted[b]++;
+        continue;
+      }
+      zm->live[b]++;
+      for (size_t c = 0; c < ts->ncols; c++) {
+        if (ZMAP_TRACKED(ts->col_types[c]))
+          zone_widen(zone_at(zm, b, c), ts->col_types[c], &entry[ts->col_offsets[c]]);
+      }
+    }
+  }
+  free(block);
+  zm->dirty = 1;
+}
+
+void zmap_save(TABLE_STATE* ts) {
+  ZONE_MAP* zm = ts->zone_map;
+  if (zm == NULL)
+    return;
+  if (!zm->dirty) {
+    sidecar_restamp(ts, "zmap");
+    return;
+  }
+  char* name = sidecar_name(ts->file_name, "zmap");
+  FILE* file = fopen(name, "wb");
+  free(name);
+  if (file == NULL)
+    return;
+  size_t gen = table_generation(ts), nrows = row_count(ts);
+  fwrite(ZMAP_MAGIC, 1, 4, file);
+  fwrite(&gen, sizeof(size_t), 1, file);
+  fwrite(&zm->block_rows, sizeof(size_t), 1, file);
+  fwrite(&zm->ncols, sizeof(size_t), 1, file);
+  fwrite(&nrows, sizeof(size_t), 1, file);
+  fwrite(&zm->nblocks, sizeof(size_t), 1, file);
+  for (size_t b = 0; b < zm->nblocks; b++) {
+    fwrite(&zm->live[b], sizeof(size_t), 1, file);
+    fwrite(&zm->deleted[b], sizeof(size_t), 1, file);
+    fwrite(zone_at(zm, b, 0), sizeof(ZONE), zm->ncols, file);
+  }
+  fclose(file);
+  zm->dirty = 0;
+}
+
+void zmap_close(TABLE_STATE* ts) {
+  ZONE_MAP* zm = ts->zone_map;
+  if (zm == NULL)
+    return;
+  free(zm->live);
+  free(zm->deleted);
+  free(zm->zones);
+  free(zm);
+  ts->zone_map = NULL;
+}
+
+void zmap_row_written(TABLE_STATE* ts, size_t row, const void* entry, size_t reused) {
+  ZONE_MAP* zm = ts->zone_map;
+  if (zm == NULL)
+    return;
+  size_t b = row / zm->block_rows;
+  zmap_reserve(zm, b + 1);
+  if (reused && zm->deleted[b])
+    zm->deleted[b]--;
+  zm->live[b]++;
+  for (size_t c = 0; c < ts->ncols; c++) {
+    if (ZMAP_TRACKED(ts->col_types[c]))
+      zone_widen(zone_at(zm, b, c), ts->col_types[c], &((unsigned char*)entry)[ts->col_offsets[c]]);
+  }
+  zm->dirty = 1;
+}
+
+void zmap_value_written(TABLE_STATE* ts, size_t row, size_t col, const void* entry) {
+  ZONE_MAP* zm = ts->zone_map;
+  if (zm == NULL || !ZMAP_TRACKED(ts->col_types[col]))
+    return;
+  size_t b = row / zm->block_rows;
+  zmap_reserve(zm, b + 1);
+  zone_widen(zone_at(zm, b, col), ts->col_types[col], &((unsigned char*)entry)[ts->col_offsets[col]]);
+  zm->dirty = 1;
+}
+
+// min/max are not narrowed on delete, zone stays conservative
+void zmap_row_deleted(TABLE_STATE* ts, size_t row) {
+  ZONE_MAP* zm = ts->zone_map;
+  if (zm == NULL)
+    return;
+  size_t b = row / zm->block_rows;
+  zmap_reserve(zm, b + 1);
+  if (zm->live[b])
+    zm->live[b]--;
+  zm->deleted[b]++;
+  zm->dirty = 1;
+}
+
+// 0 if no row of the block can be equal to entry by col,
+// with entry NULL only tells if the block has live rows
+int zmap_block_may_match(TABLE_STATE* ts, size_t block, size_t col, const void* entry) {
+  ZONE_MAP* zm = ts->zone_map;
+  if (zm == NULL || block >= zm->nblocks)
+    return 1;
+  if (zm->live[block] == 0)
+    return 0;
+  if (entry == NULL || !ZMAP_TRACKED(ts->col_types[col]))
+    return 1;
+  ZONE* z = zone_at(zm, block, col);
+  if (!z->init)
+    return 1;
+  const unsigned char* value = &((unsigned char*)entry)[ts->col_offsets[col]];
+  size_t type = ts->col_types[col];
+  return value_cmp(type, value, z->min) >= 0 && value_cmp(type, value, z->max) <= 0;
+}
+
+// 0 if no row of the block can satisfy op with value by col, value is a
+// bare column value, NULL only tells if the block has live rows
+int zmap_block_may_satisfy(TABLE_STATE* ts, size_t block, size_t col, size_t op, const void* value) {
+  ZONE_MAP* zm = ts->zone_map;
+  if (zm == NULL || block >= zm->nblocks)
+    return 1;
+  if (zm->live[block] == 0)
+    return 0;
+  if (value == NULL || !ZMAP_TRACKED(ts->col_types[col]))
+    return 1;
+  ZONE* z = zone_at(zm, block, col);
+  if (!z->init)
+    return 1;
+  size_t type = ts->col_types[col];
+  int lo = value_cmp(type, value, z->min), hi = value_cmp(type, value, z->max);
+  if (op == PRED_EQ) return lo >= 0 && hi <= 0;
+  if (op == PRED_NE) return !(lo == 0 && hi == 0);
+  if (op == PRED_LT) return lo > 0;
+  if (op == PRED_LE) return lo >= 0;
+  if (op == PRED_GT) return hi < 0;
+  if (op == PRED_GE) return hi <= 0;
+  return 1;
+}
@@ -10,6 +10,8 @@ echo "INSERT ID=2"
    ./build/insert <<< 2
 echo "INSERT ID=-1"
    ./build/insert <<< -1
+echo "CREATE BITMAP INDEX birthday"
+   ./build/create_bitmap
 echo "DELETE ID=2"
    ./build/delete <<< 2
 echo "DELETE birth=\"Y2024 M12 D14 h11 m11 s11 ms123\""
@@ -26,11 +28,45 @@ echo "INSERT ID=5"
    ./build/insert <<< 5
 echo "FIND birth=\"Y2024 M12 D14 h11 m11 s11 ms123\""
    ./build/find_many
+echo "AGGREGATE height, id"
+   ./build/aggregate
+echo "GROUP BY birthday"
+   ./build/group_by
+echo "ORDER BY id, birthday"
+   ./build/order_by
+echo "JOIN table, table"
+   ./build/join_tables
+echo "EXPLAIN"
+   ./build/explain
+echo "SELECT id, name WHERE id >= 3"
+   ./build/select
+echo "LSM TABLE"
+   ./build/lsm_table
+echo "BITMAP AND/OR"
+   ./build/bitmap_filter
+echo "PREFIX SEARCH"
+   ./build/prefix_search
+echo "FULL TEXT SEARCH"
+   ./build/full_text
+echo "SNAPSHOT READS"
+   ./build/snapshot
+echo "CONCURRENT WRITERS AND READERS"
+   ./build/stress
+echo "THREADS SHARING A TABLE"
+   ./build/threads
 echo "FIND id = 0"
    ./build/find <<< 0
 echo "FIND id = 4"
    ./build/find <<< 4
 echo "BACKUP"
    ./build/backup
+echo "POINT IN TIME RECOVERY"
+   ./build/pitr
+echo "DEDUPLICATING BACKUPS"
+   ./build/dedup
+echo "COMPRESSED TABLE"
+   ./build/compressed
+echo "COLUMNAR SEGMENTS"
+   ./build/columnar
 echo "ERASE TABLE"
    ./build/erase_table